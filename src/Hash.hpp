@@ -5,6 +5,7 @@
 #include <sha1.hpp>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 namespace SHA256 {
 
@@ -31,6 +32,53 @@ namespace SHA256 {
 		final(ctx, digest);
 	}
 
+	// size of a context saved by save_state(), the words are stored little endian
+	constexpr uint64_t STATE_SIZE = 2 * 4 + 8 * 4 + 64;
+
+	/***
+	 * serialize the context of a hash in progress, independent of the width of uint32
+	 * @param ctx
+	 * @param state receives STATE_SIZE bytes
+	 */
+	inline void save_state(const context &ctx, void *state) {
+		uint32_t words[10];
+		for (int i = 0; i < 2; ++i) {
+			words[i] = (uint32_t) ctx.total[i];
+		}
+		for (int i = 0; i < 8; ++i) {
+			words[2 + i] = (uint32_t) ctx.state[i];
+		}
+		uint8_t *p = (uint8_t *) state;
+		for (int i = 0; i < 10; ++i) {
+			for (int j = 0; j < 4; ++j) {
+				*p++ = (uint8_t) (words[i] >> (8 * j));
+			}
+		}
+		memcpy(p, ctx.buffer, 64);
+	}
+
+	/***
+	 * restore a context saved by save_state(), the hash continues where it has been saved
+	 * @param ctx
+	 * @param state STATE_SIZE bytes
+	 */
+	inline void load_state(context &ctx, const void *state) {
+		uint32_t words[10] = { 0 };
+		const uint8_t *p = (const uint8_t *) state;
+		for (int i = 0; i < 10; ++i) {
+			for (int j = 0; j < 4; ++j) {
+				words[i] |= (uint32_t) *p++ << (8 * j);
+			}
+		}
+		for (int i = 0; i < 2; ++i) {
+			ctx.total[i] = words[i];
+		}
+		for (int i = 0; i < 8; ++i) {
+			ctx.state[i] = words[2 + i];
+		}
+		memcpy(ctx.buffer, p, 64);
+	}
+
 } // namespace SHA256
 
 namespace SHA1 {
@@ -58,8 +106,98 @@ namespace SHA1 {
     final(ctx, digest);
   }
 
+  // size of a context saved by save_state(), the words are stored little endian
+  constexpr uint64_t STATE_SIZE = 5 * 4 + 2 * 4 + 64;
+
+  /***
+   * serialize the context of a hash in progress
+   * @param ctx
+   * @param state receives STATE_SIZE bytes
+   */
+  inline void save_state(const context &ctx, void *state) {
+    uint32_t words[7];
+    memcpy(words, ctx.state, sizeof(ctx.state));
+    memcpy(words + 5, ctx.count, sizeof(ctx.count));
+    uint8_t *p = (uint8_t *) state;
+    for (int i = 0; i < 7; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        *p++ = (uint8_t) (words[i] >> (8 * j));
+      }
+    }
+    memcpy(p, ctx.buffer, 64);
+  }
+
+  /***
+   * restore a context saved by save_state(), the hash continues where it has been saved
+   * @param ctx
+   * @param state STATE_SIZE bytes
+   */
+  inline void load_state(context &ctx, const void *state) {
+    uint32_t words[7] = { 0 };
+    const uint8_t *p = (const uint8_t *) state;
+    for (int i = 0; i < 7; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        words[i] |= (uint32_t) *p++ << (8 * j);
+      }
+    }
+    memcpy(ctx.state, words, sizeof(ctx.state));
+    memcpy(ctx.count, words + 5, sizeof(ctx.count));
+    memcpy(ctx.buffer, p, 64);
+  }
+
 } // namespace SHA1
 
+namespace HMAC_SHA256 {
+
+	constexpr uint64_t HASH_SIZE = SHA256::HASH_SIZE;
+
+	constexpr uint64_t BLOCK_SIZE = 64;
+
+	// inner and outer hash, after init() the context can be copied to reuse the key
+	struct context {
+		SHA256::context inner;
+		SHA256::context outer;
+	};
+
+	inline void init(context &ctx, const void *key, size_t len) {
+		uint8_t block[BLOCK_SIZE] = { 0 };
+		if (len > BLOCK_SIZE) {
+			SHA256::hash(key, len, block);
+		} else {
+			memcpy(block, key, len);
+		}
+		for (uint64_t i = 0; i < BLOCK_SIZE; ++i) {
+			block[i] ^= 0x36;
+		}
+		SHA256::init(ctx.inner);
+		SHA256::update(ctx.inner, block, BLOCK_SIZE);
+		for (uint64_t i = 0; i < BLOCK_SIZE; ++i) {
+			block[i] ^= 0x36 ^ 0x5c;
+		}
+		SHA256::init(ctx.outer);
+		SHA256::update(ctx.outer, block, BLOCK_SIZE);
+	}
+
+	inline void update(context &ctx, const void *data, size_t len) {
+		SHA256::update(ctx.inner, data, len);
+	}
+
+	inline void final(context &ctx, void *digest) {
+		uint8_t inner[SHA256::HASH_SIZE];
+		SHA256::final(ctx.inner, inner);
+		SHA256::update(ctx.outer, inner, SHA256::HASH_SIZE);
+		SHA256::final(ctx.outer, digest);
+	}
+
+	inline void hash(const void *key, size_t key_len, const void *data, size_t len, void *digest) {
+		context ctx;
+		init(ctx, key, key_len);
+		update(ctx, data, len);
+		final(ctx, digest);
+	}
+
+} // namespace HMAC_SHA256
+
 /***
  * Wrapper class that can dynamically compute hashes from different digests
  */
@@ -0,0 +1,453 @@
+#include <acrypt.hpp>
+#include <crypt.hpp>
+#include <cpu.hpp>
+#include <provider.hpp>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+static_assert(ACRYPT_HEADER_SIZE == HEADER_SIZE, "header size of the C interface is out of date");
+static_assert(ACRYPT_TRAILER_SIZE == CHECKSUM::HASH_SIZE, "trailer size of the C interface is out of date");
+static_assert(ACRYPT_KEY_SIZE == KEY_BUFFER_SIZE, "key size of the C interface is out of date");
+
+/***
+ * CTR key stream that can be applied in parts of any size, the rest of a block
+ * that was started is used up first
+ */
+struct KeyStream {
+
+    void init(const uint8_t *key, const uint8_t *iv, const CipherProvider &provider) {
+        aes_ctr_expand_key(key, (uint32_t *) exp_key, provider);
+        memcpy(counter, iv, AES_BLOCK_SIZE);
+        used = AES_BLOCK_SIZE;
+    }
+
+    void apply(const uint8_t *in, uint8_t *out, size_t len) {
+        while (len > 0 && used < AES_BLOCK_SIZE) {
+            *out++ = *in++ ^ block[used++];
+            --len;
+        }
+        const size_t num_blocks = len / AES_BLOCK_SIZE;
+        if (num_blocks > 0) {
+            aes_ctr_enc(in, out, (const uint32_t *) exp_key, counter, num_blocks);
+            in += num_blocks * AES_BLOCK_SIZE;
+            out += num_blocks * AES_BLOCK_SIZE;
+            len -= num_blocks * AES_BLOCK_SIZE;
+        }
+        if (len > 0) {
+            memset(block, 0, AES_BLOCK_SIZE);
+            aes_ctr_enc(block, block, (const uint32_t *) exp_key, counter, 1);
+            for (used = 0; used < len; ++used) {
+                out[used] = in[used] ^ block[used];
+            }
+        }
+    }
+
+    alignas(16) uint8_t exp_key[AES_EXP_KEY_BUFFER_SIZE];
+    uint8_t counter[AES_BLOCK_SIZE];
+    uint8_t block[AES_BLOCK_SIZE];
+    size_t used = AES_BLOCK_SIZE;
+
+};
+
+struct Encryptor::State {
+    const CipherProvider *provider;
+    KeyStream stream;
+    CHECKSUM::context ctx;
+    bool ready = false;
+};
+
+Encryptor::Encryptor(const std::string &provider) : _state(new State) {
+    _state->provider = &cipher_provider(provider);
+}
+
+Encryptor::~Encryptor() = default;
+
+size_t Encryptor::init(const std::string &password, uint8_t *header) {
+    uint8_t key[KEY_BUFFER_SIZE];
+    aes_generate_iv(header);
+    derive_key(password, header, key);
+    _state->stream.init(key, header, *_state->provider);
+
+    // the hash of the key is covered by the checksum as well
+    uint8_t *key_hash = header + AES_BLOCK_SIZE;
+    hash_key(key, key_hash);
+    CHECKSUM::init(_state->ctx);
+    CHECKSUM::update(_state->ctx, key_hash, SHA256::HASH_SIZE);
+    _state->stream.apply(key_hash, key_hash, SHA256::HASH_SIZE);
+    memset(key, 0, KEY_BUFFER_SIZE);
+    _state->ready = true;
+    return HEADER_SIZE;
+}
+
+size_t Encryptor::update(const uint8_t *in, size_t len, uint8_t *out) {
+    if (!_state->ready) {
+        throw std::runtime_error("encryptor is not initialized");
+    }
+    // tile by tile, so the cipher finds the tile still in cache after the hash
+    const size_t tile = cpu_tile_size();
+    for (size_t pos = 0; pos < len; pos += tile) {
+        const size_t n = std::min(tile, len - pos);
+        CHECKSUM::update(_state->ctx, in + pos, n);
+        _state->stream.apply(in + pos, out + pos, n);
+    }
+    return len;
+}
+
+size_t Encryptor::finish(uint8_t *out) {
+    if (!_state->ready) {
+        throw std::runtime_error("encryptor is not initialized");
+    }
+    uint8_t digest[CHECKSUM::HASH_SIZE];
+    CHECKSUM::final(_state->ctx, digest);
+    _state->stream.apply(digest, out, CHECKSUM::HASH_SIZE);
+    _state->ready = false;
+    return CHECKSUM::HASH_SIZE;
+}
+
+const char *Encryptor::provider() const {
+    return _state->provider->name;
+}
+
+struct Decryptor::State {
+    const CipherProvider *provider;
+    KeyStream stream;
+    CHECKSUM::context ctx;
+    bool ready = false;
+    std::string password;
+    bool have_key = false;
+    uint8_t key[KEY_BUFFER_SIZE];
+    uint8_t header[HEADER_SIZE];
+    size_t header_size = 0;
+    // the last bytes seen, they might be the checksum
+    uint8_t held[CHECKSUM::HASH_SIZE];
+    size_t num_held = 0;
+
+    // decrypt and hash
+    void process(const uint8_t *in, size_t len, uint8_t *out) {
+        const size_t tile = cpu_tile_size();
+        for (size_t pos = 0; pos < len; pos += tile) {
+            const size_t n = std::min(tile, len - pos);
+            stream.apply(in + pos, out + pos, n);
+            CHECKSUM::update(ctx, out + pos, n);
+        }
+    }
+
+    void open() {
+        if (!have_key) {
+            derive_key(password, header, key);
+            password.clear();
+            have_key = true;
+        }
+        stream.init(key, header, *provider);
+
+        // check if the key hashes match
+        uint8_t hash_of_key[SHA256::HASH_SIZE];
+        uint8_t key_hash[SHA256::HASH_SIZE];
+        hash_key(key, hash_of_key);
+        stream.apply(header + AES_BLOCK_SIZE, key_hash, SHA256::HASH_SIZE);
+        if (memcmp(key_hash, hash_of_key, SHA256::HASH_SIZE) != 0) {
+            ready = false;
+            have_key = false;
+            throw std::runtime_error("invalid password or compromised iv");
+        }
+        CHECKSUM::init(ctx);
+        CHECKSUM::update(ctx, key_hash, SHA256::HASH_SIZE);
+    }
+};
+
+Decryptor::Decryptor(const std::string &provider) : _state(new State) {
+    _state->provider = &cipher_provider(provider);
+}
+
+Decryptor::~Decryptor() = default;
+
+void Decryptor::init(const std::string &password) {
+    _state->password = password;
+    _state->have_key = false;
+    _state->header_size = 0;
+    _state->num_held = 0;
+    _state->ready = true;
+}
+
+void Decryptor::init_key(const uint8_t *key) {
+    memcpy(_state->key, key, KEY_BUFFER_SIZE);
+    _state->password.clear();
+    _state->have_key = true;
+    _state->header_size = 0;
+    _state->num_held = 0;
+    _state->ready = true;
+}
+
+size_t Decryptor::update(const uint8_t *in, size_t len, uint8_t *out) {
+    State &s = *_state;
+    if (!s.ready) {
+        throw std::runtime_error("decryptor is not initialized");
+    }
+
+    if (s.header_size < HEADER_SIZE) {
+        const size_t n = std::min(len, HEADER_SIZE - s.header_size);
+        memcpy(s.header + s.header_size, in, n);
+        s.header_size += n;
+        in += n;
+        len -= n;
+        if (s.header_size < HEADER_SIZE) {
+            return 0;
+        }
+        s.open();
+    }
+
+    // everything but the last CHECKSUM::HASH_SIZE bytes is plain text, the held
+    // back bytes come first
+    const size_t total = s.num_held + len;
+    if (total <= CHECKSUM::HASH_SIZE) {
+        memcpy(s.held + s.num_held, in, len);
+        s.num_held = total;
+        return 0;
+    }
+    const size_t num_bytes = total - CHECKSUM::HASH_SIZE;
+    const size_t from_held = std::min(num_bytes, s.num_held);
+    s.process(s.held, from_held, out);
+    memmove(s.held, s.held + from_held, s.num_held - from_held);
+    s.num_held -= from_held;
+    const size_t from_in = num_bytes - from_held;
+    s.process(in, from_in, out + from_held);
+    memcpy(s.held + s.num_held, in + from_in, len - from_in);
+    s.num_held += len - from_in;
+    return num_bytes;
+}
+
+void Decryptor::finish() {
+    State &s = *_state;
+    if (!s.ready) {
+        throw std::runtime_error("decryptor is not initialized");
+    }
+    s.ready = false;
+    if (s.header_size < HEADER_SIZE || s.num_held < CHECKSUM::HASH_SIZE) {
+        throw std::runtime_error("insufficient file size");
+    }
+    uint8_t checksum[CHECKSUM::HASH_SIZE];
+    uint8_t digest[CHECKSUM::HASH_SIZE];
+    s.stream.apply(s.held, checksum, CHECKSUM::HASH_SIZE);
+    CHECKSUM::final(s.ctx, digest);
+    if (memcmp(checksum, digest, CHECKSUM::HASH_SIZE) != 0) {
+        throw std::runtime_error("checksum mismatch, file may be corrupted");
+    }
+}
+
+bool Decryptor::key(uint8_t *key) const {
+    if (_state->header_size < HEADER_SIZE || !_state->have_key) {
+        return false;
+    }
+    memcpy(key, _state->key, KEY_BUFFER_SIZE);
+    return true;
+}
+
+const char *Decryptor::provider() const {
+    return _state->provider->name;
+}
+
+// C interface, exceptions must not cross it
+
+struct acrypt_encryptor {
+    explicit acrypt_encryptor(const char *provider) : encryptor(provider) {}
+    Encryptor encryptor;
+    std::string error;
+};
+
+struct acrypt_decryptor {
+    explicit acrypt_decryptor(const char *provider) : decryptor(provider) {}
+    Decryptor decryptor;
+    std::string error;
+};
+
+acrypt_encryptor *acrypt_encryptor_new(void) {
+    return acrypt_encryptor_new_provider("builtin");
+}
+
+acrypt_encryptor *acrypt_encryptor_new_provider(const char *provider) {
+    try {
+        return new (std::nothrow) acrypt_encryptor(provider);
+    } catch (std::exception &) {
+        return nullptr;
+    }
+}
+
+void acrypt_encryptor_free(acrypt_encryptor *enc) {
+    delete enc;
+}
+
+int64_t acrypt_encryptor_init(acrypt_encryptor *enc, const char *password, size_t password_len, uint8_t *header) {
+    try {
+        return (int64_t) enc->encryptor.init(std::string(password, password_len), header);
+    } catch (std::exception &err) {
+        enc->error = err.what();
+        return -1;
+    }
+}
+
+int64_t acrypt_encryptor_update(acrypt_encryptor *enc, const uint8_t *in, size_t len, uint8_t *out) {
+    try {
+        return (int64_t) enc->encryptor.update(in, len, out);
+    } catch (std::exception &err) {
+        enc->error = err.what();
+        return -1;
+    }
+}
+
+int64_t acrypt_encryptor_finish(acrypt_encryptor *enc, uint8_t *out) {
+    try {
+        return (int64_t) enc->encryptor.finish(out);
+    } catch (std::exception &err) {
+        enc->error = err.what();
+        return -1;
+    }
+}
+
+const char *acrypt_encryptor_error(const acrypt_encryptor *enc) {
+    return enc->error.c_str();
+}
+
+acrypt_decryptor *acrypt_decryptor_new(void) {
+    return acrypt_decryptor_new_provider("builtin");
+}
+
+acrypt_decryptor *acrypt_decryptor_new_provider(const char *provider) {
+    try {
+        return new (std::nothrow) acrypt_decryptor(provider);
+    } catch (std::exception &) {
+        return nullptr;
+    }
+}
+
+void acrypt_decryptor_free(acrypt_decryptor *dec) {
+    delete dec;
+}
+
+int64_t acrypt_decryptor_init(acrypt_decryptor *dec, const char *password, size_t password_len) {
+    try {
+        dec->decryptor.init(std::string(password, password_len));
+        return 0;
+    } catch (std::exception &err) {
+        dec->error = err.what();
+        return -1;
+    }
+}
+
+int64_t acrypt_decryptor_init_key(acrypt_decryptor *dec, const uint8_t *key) {
+    dec->decryptor.init_key(key);
+    return 0;
+}
+
+int64_t acrypt_decryptor_update(acrypt_decryptor *dec, const uint8_t *in, size_t len, uint8_t *out) {
+    try {
+        return (int64_t) dec->decryptor.update(in, len, out);
+    } catch (std::exception &err) {
+        dec->error = err.what();
+        return -1;
+    }
+}
+
+int64_t acrypt_decryptor_finish(acrypt_decryptor *dec) {
+    try {
+        dec->decryptor.finish();
+        return 0;
+    } catch (std::exception &err) {
+        dec->error = err.what();
+        return -1;
+    }
+}
+
+int64_t acrypt_decryptor_key(const acrypt_decryptor *dec, uint8_t *key) {
+    return dec->decryptor.key(key) ? 0 : -1;
+}
+
+const char *acrypt_decryptor_error(const acrypt_decryptor *dec) {
+    return dec->error.c_str();
+}
+
+struct acrypt_queue {
+    CryptoQueue queue;
+    std::vector<CryptoQueue::Completion> completions;
+
+    explicit acrypt_queue(size_t num_threads) : queue(num_threads) {}
+};
+
+acrypt_queue *acrypt_queue_new(size_t num_threads) {
+    try {
+        return new acrypt_queue(num_threads);
+    } catch (std::exception &) {
+        return nullptr;
+    }
+}
+
+void acrypt_queue_free(acrypt_queue *queue) {
+    delete queue;
+}
+
+int acrypt_queue_fd(const acrypt_queue *queue) {
+    return queue->queue.fd();
+}
+
+int64_t acrypt_queue_encrypt_init(acrypt_queue *queue, acrypt_encryptor *enc, const char *password, size_t password_len,
+                                  uint8_t *header, void *user) {
+    try {
+        queue->queue.encrypt_init(enc->encryptor, std::string(password, password_len), header, user);
+        return 0;
+    } catch (std::exception &) {
+        return -1;
+    }
+}
+
+int64_t acrypt_queue_encrypt(acrypt_queue *queue, acrypt_encryptor *enc, const uint8_t *in, size_t len, uint8_t *out, void *user) {
+    try {
+        queue->queue.encrypt(enc->encryptor, in, len, out, user);
+        return 0;
+    } catch (std::exception &) {
+        return -1;
+    }
+}
+
+int64_t acrypt_queue_encrypt_finish(acrypt_queue *queue, acrypt_encryptor *enc, uint8_t *out, void *user) {
+    try {
+        queue->queue.encrypt_finish(enc->encryptor, out, user);
+        return 0;
+    } catch (std::exception &) {
+        return -1;
+    }
+}
+
+int64_t acrypt_queue_decrypt(acrypt_queue *queue, acrypt_decryptor *dec, const uint8_t *in, size_t len, uint8_t *out, void *user) {
+    try {
+        queue->queue.decrypt(dec->decryptor, in, len, out, user);
+        return 0;
+    } catch (std::exception &) {
+        return -1;
+    }
+}
+
+int64_t acrypt_queue_decrypt_finish(acrypt_queue *queue, acrypt_decryptor *dec, void *user) {
+    try {
+        queue->queue.decrypt_finish(dec->decryptor, user);
+        return 0;
+    } catch (std::exception &) {
+        return -1;
+    }
+}
+
+size_t acrypt_queue_poll(acrypt_queue *queue, acrypt_completion *completions, size_t max_completions) {
+    // the error strings live in the queue until the next poll
+    queue->completions.clear();
+    try {
+        queue->queue.poll(queue->completions, max_completions);
+    } catch (std::exception &) {
+        return 0;
+    }
+    for (size_t i = 0; i < queue->completions.size(); ++i) {
+        completions[i].user = queue->completions[i].user;
+        completions[i].result = queue->completions[i].result;
+        completions[i].error = queue->completions[i].error.c_str();
+    }
+    return queue->completions.size();
+}
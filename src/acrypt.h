@@ -0,0 +1,189 @@
+#ifndef __ACRYPT_H
+#define __ACRYPT_H
+
+/*
+ * C interface of libacrypt, streams of the acrypt file format (see file_format.txt)
+ * are encrypted and decrypted through caller-owned buffers. The library keeps no
+ * state outside of the objects, different objects may be used by different threads.
+ * Functions that can fail return a negative value, the reason is available through
+ * acrypt_*_error() of the object until the next call on it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// iv and encrypted hash of the key in front of the cipher text
+#define ACRYPT_HEADER_SIZE      (48)
+
+// encrypted checksum behind the cipher text
+#define ACRYPT_TRAILER_SIZE     (20)
+
+// size of a derived key
+#define ACRYPT_KEY_SIZE         (32)
+
+typedef struct acrypt_encryptor acrypt_encryptor;
+
+typedef struct acrypt_decryptor acrypt_decryptor;
+
+typedef struct acrypt_queue acrypt_queue;
+
+/***
+ * finished work of an acrypt_queue
+ */
+typedef struct acrypt_completion {
+    void *user;             // as passed in
+    int64_t result;         // return value the direct call would have had
+    const char *error;      // reason if result is negative, valid until the next poll
+} acrypt_completion;
+
+/***
+ * @return NULL if out of memory
+ */
+acrypt_encryptor *acrypt_encryptor_new(void);
+
+/***
+ * like acrypt_encryptor_new(), with AES-256 CTR routines other than the built-in ones
+ * @param provider "builtin", "afalg" or "openssl"
+ * @return NULL if out of memory or the provider is not available
+ */
+acrypt_encryptor *acrypt_encryptor_new_provider(const char *provider);
+
+void acrypt_encryptor_free(acrypt_encryptor *enc);
+
+/***
+ * start a new stream, derives the key from the password and a fresh iv
+ * @param enc
+ * @param password
+ * @param password_len
+ * @param header receives ACRYPT_HEADER_SIZE bytes
+ * @return ACRYPT_HEADER_SIZE or -1
+ */
+int64_t acrypt_encryptor_init(acrypt_encryptor *enc, const char *password, size_t password_len, uint8_t *header);
+
+/***
+ * encrypt the next part of the plain text
+ * @param enc
+ * @param in
+ * @param len
+ * @param out receives len bytes, may be the same as in
+ * @return len or -1
+ */
+int64_t acrypt_encryptor_update(acrypt_encryptor *enc, const uint8_t *in, size_t len, uint8_t *out);
+
+/***
+ * end the stream
+ * @param enc
+ * @param out receives ACRYPT_TRAILER_SIZE bytes
+ * @return ACRYPT_TRAILER_SIZE or -1
+ */
+int64_t acrypt_encryptor_finish(acrypt_encryptor *enc, uint8_t *out);
+
+const char *acrypt_encryptor_error(const acrypt_encryptor *enc);
+
+/***
+ * @return NULL if out of memory
+ */
+acrypt_decryptor *acrypt_decryptor_new(void);
+
+/***
+ * like acrypt_decryptor_new(), with AES-256 CTR routines other than the built-in ones
+ * @param provider "builtin", "afalg" or "openssl"
+ * @return NULL if out of memory or the provider is not available
+ */
+acrypt_decryptor *acrypt_decryptor_new_provider(const char *provider);
+
+void acrypt_decryptor_free(acrypt_decryptor *dec);
+
+/***
+ * start a new stream, the key is derived once the iv has been passed in
+ * @param dec
+ * @param password
+ * @param password_len
+ * @return 0 or -1
+ */
+int64_t acrypt_decryptor_init(acrypt_decryptor *dec, const char *password, size_t password_len);
+
+/***
+ * start a new stream with a key derived before, e.g. taken from acrypt_decryptor_key()
+ * of a stream with the same iv, which skips the key derivation
+ * @param dec
+ * @param key ACRYPT_KEY_SIZE bytes
+ * @return 0 or -1
+ */
+int64_t acrypt_decryptor_init_key(acrypt_decryptor *dec, const uint8_t *key);
+
+/***
+ * decrypt the next part of the stream, including header and trailer, the last
+ * ACRYPT_TRAILER_SIZE bytes seen so far are held back
+ * @param dec
+ * @param in
+ * @param len
+ * @param out receives at most len bytes, must not overlap in
+ * @return number of plain bytes written to out or -1
+ */
+int64_t acrypt_decryptor_update(acrypt_decryptor *dec, const uint8_t *in, size_t len, uint8_t *out);
+
+/***
+ * end the stream and verify the checksum
+ * @param dec
+ * @return 0 or -1
+ */
+int64_t acrypt_decryptor_finish(acrypt_decryptor *dec);
+
+/***
+ * get the key of the stream, available once the header has been passed in
+ * @param dec
+ * @param key receives ACRYPT_KEY_SIZE bytes
+ * @return 0 or -1
+ */
+int64_t acrypt_decryptor_key(const acrypt_decryptor *dec, uint8_t *key);
+
+const char *acrypt_decryptor_error(const acrypt_decryptor *dec);
+
+/***
+ * Offload queue for event loops: the acrypt_queue_* calls below only queue the work
+ * of the matching direct call and return 0 (-1 if out of memory). The work of a
+ * stream is done in order on a thread of the queue, streams and buffers must stay
+ * untouched until the work is collected with acrypt_queue_poll(). The descriptor of
+ * acrypt_queue_fd() becomes readable whenever finished work is waiting.
+ * @param num_threads 0 for one
+ * @return NULL if out of memory or out of threads
+ */
+acrypt_queue *acrypt_queue_new(size_t num_threads);
+
+/***
+ * finishes the work queued before
+ */
+void acrypt_queue_free(acrypt_queue *queue);
+
+int acrypt_queue_fd(const acrypt_queue *queue);
+
+int64_t acrypt_queue_encrypt_init(acrypt_queue *queue, acrypt_encryptor *enc, const char *password, size_t password_len,
+                                  uint8_t *header, void *user);
+
+int64_t acrypt_queue_encrypt(acrypt_queue *queue, acrypt_encryptor *enc, const uint8_t *in, size_t len, uint8_t *out, void *user);
+
+int64_t acrypt_queue_encrypt_finish(acrypt_queue *queue, acrypt_encryptor *enc, uint8_t *out, void *user);
+
+int64_t acrypt_queue_decrypt(acrypt_queue *queue, acrypt_decryptor *dec, const uint8_t *in, size_t len, uint8_t *out, void *user);
+
+int64_t acrypt_queue_decrypt_finish(acrypt_queue *queue, acrypt_decryptor *dec, void *user);
+
+/***
+ * collect finished work, never blocks
+ * @param queue
+ * @param completions receives at most max_completions entries
+ * @param max_completions
+ * @return number of entries
+ */
+size_t acrypt_queue_poll(acrypt_queue *queue, acrypt_completion *completions, size_t max_completions);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __ACRYPT_H
@@ -0,0 +1,197 @@
+#ifndef __ACRYPT_HPP
+#define __ACRYPT_HPP
+
+#include <acrypt.h>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+/***
+ * Encrypts a stream into the acrypt file format: header, cipher text and trailer.
+ * Errors are thrown as std::runtime_error. An object is used by one thread at a
+ * time, it can be reused for the next stream by calling init() again.
+ */
+class Encryptor {
+public:
+
+    /***
+     * @param provider of the AES-256 CTR routines, "builtin", "afalg" or "openssl"
+     */
+    explicit Encryptor(const std::string &provider="builtin");
+
+    ~Encryptor();
+
+    Encryptor(const Encryptor &) = delete;
+
+    Encryptor &operator=(const Encryptor &) = delete;
+
+    /***
+     * start a new stream, derives the key from the password and a fresh iv
+     * @param password
+     * @param header receives ACRYPT_HEADER_SIZE bytes
+     * @return ACRYPT_HEADER_SIZE
+     */
+    size_t init(const std::string &password, uint8_t *header);
+
+    /***
+     * encrypt the next part of the plain text, the parts may have any size
+     * @param in
+     * @param len
+     * @param out receives len bytes, may be the same as in
+     * @return len
+     */
+    size_t update(const uint8_t *in, size_t len, uint8_t *out);
+
+    /***
+     * end the stream
+     * @param out receives ACRYPT_TRAILER_SIZE bytes
+     * @return ACRYPT_TRAILER_SIZE
+     */
+    size_t finish(uint8_t *out);
+
+    /***
+     * @return name of the provider the stream is computed with
+     */
+    const char *provider() const;
+
+private:
+
+    struct State;
+
+    std::unique_ptr<State> _state;
+
+};
+
+/***
+ * Decrypts a stream of the acrypt file format. The whole stream is passed through
+ * update(), the header is consumed and the trailer is held back until finish()
+ * checks it. Errors are thrown as std::runtime_error.
+ */
+class Decryptor {
+public:
+
+    /***
+     * @param provider of the AES-256 CTR routines, "builtin", "afalg" or "openssl"
+     */
+    explicit Decryptor(const std::string &provider="builtin");
+
+    ~Decryptor();
+
+    Decryptor(const Decryptor &) = delete;
+
+    Decryptor &operator=(const Decryptor &) = delete;
+
+    /***
+     * start a new stream, the key is derived once the iv has been passed in
+     * @param password
+     */
+    void init(const std::string &password);
+
+    /***
+     * start a new stream with a key derived before, which skips the key derivation
+     * @param key ACRYPT_KEY_SIZE bytes
+     */
+    void init_key(const uint8_t *key);
+
+    /***
+     * decrypt the next part of the stream
+     * @param in
+     * @param len
+     * @param out receives at most len bytes, must not overlap in
+     * @return number of plain bytes written to out
+     */
+    size_t update(const uint8_t *in, size_t len, uint8_t *out);
+
+    /***
+     * end the stream and verify the checksum
+     */
+    void finish();
+
+    /***
+     * get the key of the stream, e.g. to cache it by iv
+     * @param key receives ACRYPT_KEY_SIZE bytes
+     * @return false if the header has not been passed in yet
+     */
+    bool key(uint8_t *key) const;
+
+    /***
+     * @return name of the provider the stream is computed with
+     */
+    const char *provider() const;
+
+private:
+
+    struct State;
+
+    std::unique_ptr<State> _state;
+
+};
+
+/***
+ * Runs the work of many streams on a few threads of its own, for event loops that
+ * must not stall on the key derivation or on large parts. Every call only queues
+ * the work and returns at once. The work of one stream is always done by the same
+ * thread and in order, a thread does all the work queued for it in one go. Parts of
+ * different streams share the thread and its wakeup but not a cipher pass, every
+ * stream has its own key and checksum and the checksum takes most of the time.
+ * Finished work is collected with poll(), the descriptor from fd() becomes readable
+ * whenever there is some, so it can be waited for with epoll or poll.
+ * Streams and buffers passed in must stay untouched until their work is collected.
+ */
+class CryptoQueue {
+public:
+
+    struct Completion {
+        void *user;                     // as passed in
+        int64_t result;                 // return value of the call, -1 if it threw
+        std::string error;              // what it threw
+    };
+
+    /***
+     * @param num_threads 0 for one
+     */
+    explicit CryptoQueue(size_t num_threads=1);
+
+    /***
+     * finishes the work queued before
+     */
+    ~CryptoQueue();
+
+    CryptoQueue(const CryptoQueue &) = delete;
+
+    CryptoQueue &operator=(const CryptoQueue &) = delete;
+
+    /***
+     * @return eventfd, readable while there is finished work
+     */
+    int fd() const;
+
+    void encrypt_init(Encryptor &enc, const std::string &password, uint8_t *header, void *user);
+
+    void encrypt(Encryptor &enc, const uint8_t *in, size_t len, uint8_t *out, void *user);
+
+    void encrypt_finish(Encryptor &enc, uint8_t *out, void *user);
+
+    void decrypt(Decryptor &dec, const uint8_t *in, size_t len, uint8_t *out, void *user);
+
+    void decrypt_finish(Decryptor &dec, void *user);
+
+    /***
+     * collect finished work, never blocks
+     * @param completions the finished work is appended
+     * @param max_completions at most this many
+     * @return number appended
+     */
+    size_t poll(std::vector<Completion> &completions, size_t max_completions=SIZE_MAX);
+
+private:
+
+    struct State;
+
+    std::unique_ptr<State> _state;
+
+};
+
+#endif // __ACRYPT_HPP
@@ -0,0 +1,188 @@
+#include <acrypt.hpp>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+struct CryptoQueue::State {
+
+    // a call to be made on a worker, with the user pointer to report it by
+    struct Job {
+        std::function<int64_t()> work;
+        void *user;
+    };
+
+    // every worker has a queue of its own, streams are mapped to workers by address
+    struct Worker {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<Job> jobs;
+        bool stop = false;
+    };
+
+    int fd = -1;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex mutex;
+    std::deque<Completion> done;
+
+    void submit(const void *stream, std::function<int64_t()> work, void *user) {
+        // the low bits of an address are mostly alignment
+        Worker &worker = *workers[((uintptr_t) stream >> 4) % workers.size()];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.jobs.push_back(Job{ std::move(work), user });
+        }
+        worker.cv.notify_one();
+    }
+
+    void run(Worker &worker) {
+        std::deque<Job> batch;
+        std::vector<Completion> completions;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(worker.mutex);
+                worker.cv.wait(lock, [&worker]() {
+                    return worker.stop || !worker.jobs.empty();
+                });
+                if (worker.jobs.empty()) {
+                    return;
+                }
+                batch.swap(worker.jobs);
+            }
+
+            // everything queued so far is done in one go and reported at once
+            for (Job &job : batch) {
+                Completion completion = { job.user, 0, std::string() };
+                try {
+                    completion.result = job.work();
+                } catch (std::exception &err) {
+                    completion.result = -1;
+                    completion.error = err.what();
+                }
+                completions.push_back(std::move(completion));
+            }
+            batch.clear();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (Completion &completion : completions) {
+                    done.push_back(std::move(completion));
+                }
+            }
+            signal(completions.size());
+            completions.clear();
+        }
+    }
+
+    void signal(uint64_t n) {
+        while (write(fd, &n, sizeof(n)) < 0 && errno == EINTR) {}
+    }
+
+    // the workers finish their queues before they stop
+    void shutdown() {
+        for (auto &worker : workers) {
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                worker->stop = true;
+            }
+            worker->cv.notify_one();
+        }
+        for (auto &worker : workers) {
+            if (worker->thread.joinable()) {
+                worker->thread.join();
+            }
+        }
+        workers.clear();
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+};
+
+CryptoQueue::CryptoQueue(size_t num_threads) : _state(new State) {
+    _state->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_state->fd < 0) {
+        throw std::runtime_error("unable to create eventfd");
+    }
+    try {
+        for (size_t i = 0; i < std::max<size_t>(num_threads, 1); ++i) {
+            _state->workers.emplace_back(new State::Worker);
+            State::Worker *worker = _state->workers.back().get();
+            worker->thread = std::thread([this, worker]() {
+                _state->run(*worker);
+            });
+        }
+    } catch (...) {
+        _state->shutdown();
+        throw;
+    }
+}
+
+CryptoQueue::~CryptoQueue() {
+    _state->shutdown();
+}
+
+int CryptoQueue::fd() const {
+    return _state->fd;
+}
+
+void CryptoQueue::encrypt_init(Encryptor &enc, const std::string &password, uint8_t *header, void *user) {
+    Encryptor *e = &enc;
+    _state->submit(e, [e, password, header]() -> int64_t {
+        return (int64_t) e->init(password, header);
+    }, user);
+}
+
+void CryptoQueue::encrypt(Encryptor &enc, const uint8_t *in, size_t len, uint8_t *out, void *user) {
+    Encryptor *e = &enc;
+    _state->submit(e, [e, in, len, out]() -> int64_t {
+        return (int64_t) e->update(in, len, out);
+    }, user);
+}
+
+void CryptoQueue::encrypt_finish(Encryptor &enc, uint8_t *out, void *user) {
+    Encryptor *e = &enc;
+    _state->submit(e, [e, out]() -> int64_t {
+        return (int64_t) e->finish(out);
+    }, user);
+}
+
+void CryptoQueue::decrypt(Decryptor &dec, const uint8_t *in, size_t len, uint8_t *out, void *user) {
+    Decryptor *d = &dec;
+    _state->submit(d, [d, in, len, out]() -> int64_t {
+        return (int64_t) d->update(in, len, out);
+    }, user);
+}
+
+void CryptoQueue::decrypt_finish(Decryptor &dec, void *user) {
+    Decryptor *d = &dec;
+    _state->submit(d, [d]() -> int64_t {
+        d->finish();
+        return 0;
+    }, user);
+}
+
+size_t CryptoQueue::poll(std::vector<Completion> &completions, size_t max_completions) {
+    // reset the eventfd first, work finished from now on signals it again
+    uint64_t n;
+    while (read(_state->fd, &n, sizeof(n)) < 0 && errno == EINTR) {}
+
+    std::lock_guard<std::mutex> lock(_state->mutex);
+    const size_t count = std::min(max_completions, _state->done.size());
+    for (size_t i = 0; i < count; ++i) {
+        completions.push_back(std::move(_state->done.front()));
+        _state->done.pop_front();
+    }
+    if (!_state->done.empty()) {
+        // the rest is still waiting
+        _state->signal(_state->done.size());
+    }
+    return count;
+}
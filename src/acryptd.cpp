@@ -0,0 +1,89 @@
+#include <iostream>
+#include <cstdlib>
+#include <string>
+#include <utils.hpp>
+#include <buffer_pool.hpp>
+#include <thread_pool.hpp>
+#include <daemon.hpp>
+#include <crypt.hpp>
+#include <provider.hpp>
+
+// size of the I/O transfers of a request
+#define DEFAULT_BUF_SIZE        (4 * 1024 * 1024)
+
+static void print_help() {
+  std::cout << "acryptd [options...]" << std::endl;
+  std::cout << "serves encrypt/decrypt/verify requests of acrypt --daemon over a UNIX socket" << std::endl;
+  std::cout << "options:" << std::endl;
+  std::cout << "--socket=PATH                socket to listen on, default is $XDG_RUNTIME_DIR/acryptd.sock" << std::endl
+            << "                             or /tmp/acryptd-<uid>/acryptd.sock" << std::endl;
+  std::cout << "--threads=N, -j N            number of worker threads, default is one per CPU" << std::endl;
+  std::cout << "--buffersize=SIZE            I/O buffer size per request in bytes, default is 4 MiB" << std::endl;
+  std::cout << "--memlimit=SIZE              upper bound of the memory used for I/O buffers in bytes," << std::endl
+            << "                             default is 512M" << std::endl;
+  std::cout << "--keys=N                     number of derived keys kept for decryption, default is 64" << std::endl;
+  std::cout << "--provider=NAME              AES-256 CTR implementation { auto, builtin, afalg, openssl }," << std::endl
+            << "                             default is the fastest one on this host" << std::endl;
+  std::cout << "--stats                      print the metrics of the running daemon and exit" << std::endl;
+}
+
+int main(int argc, const char *argv[]) {
+    const std::vector<std::string> args(argv, argv + argc);
+
+    std::string socket_path = daemon_socket_path();
+    size_t num_threads = 0;
+    uint64_t buffer_size = DEFAULT_BUF_SIZE;
+    uint64_t memory_limit = DEFAULT_POOL_CAPACITY;
+    size_t num_keys = DAEMON_DEFAULT_KEYS;
+    std::string provider_name = "auto";
+    bool stats = false;
+
+    for (size_t i = 1; i < args.size(); ++i) {
+        const auto &arg = args[i];
+        if (arg == "--help") {
+            print_help();
+            return EXIT_SUCCESS;
+        } else if (starts_with(arg, "--socket=")) {
+            socket_path = arg.substr(arg.find('=') + 1);
+        } else if (starts_with(arg, "--threads=")) {
+            num_threads = strto<size_t>(arg.substr(arg.find('=') + 1));
+        } else if (arg == "-j" && i + 1 < args.size()) {
+            num_threads = strto<size_t>(args[++i]);
+        } else if (starts_with(arg, "--buffersize=")) {
+            buffer_size = strto<uint64_t>(arg.substr(arg.find('=') + 1));
+        } else if (starts_with(arg, "--memlimit=")) {
+            memory_limit = strto<uint64_t>(arg.substr(arg.find('=') + 1));
+        } else if (starts_with(arg, "--keys=")) {
+            num_keys = strto<size_t>(arg.substr(arg.find('=') + 1));
+        } else if (starts_with(arg, "--provider=")) {
+            provider_name = arg.substr(arg.find('=') + 1);
+        } else if (arg == "--stats") {
+            stats = true;
+        } else {
+            std::cerr << "unrecognized argument '" << arg << '\'' << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (buffer_size == 0 || buffer_size > memory_limit) {
+        std::cerr << "invalid buffer size" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        if (stats) {
+            const std::string reply = daemon_request(socket_path, "op=stats\npassword=", std::vector<int>());
+            std::cout << (starts_with(reply, "ok\n") ? reply.substr(3) : reply);
+            return starts_with(reply, "ok\n") ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        set_crypt_provider(provider_name == "auto" ? cipher_fastest() : cipher_provider(provider_name));
+        BufferPool::global().set_capacity(memory_limit);
+        ThreadPool pool(num_threads);
+        Daemon daemon(socket_path, pool, buffer_size, num_keys);
+        daemon.run();
+    } catch (std::exception &err) {
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,6 +1,7 @@
 #include <cstdlib>
 #include <ctime>
 #include <cstddef>
+#include <cstring>
 #include <aes.hpp>
 
 #ifdef __AMD64__
@@ -142,8 +143,10 @@ static constexpr uint32_t FT3[256] = { FT };
 
 /* super fast platform independent byte getter and setter */
 
+// memcpy instead of a cast, the blocks are also accessed as uint64_t and the compiler
+// must not assume that the two do not alias
 #if defined(__GNUC__)
-#define GET_UINT32(n,b,i)	(n) = __builtin_bswap32(((const uint32_t *) b)[i >> 2])
+#define GET_UINT32(n,b,i)	{ uint32_t _w; memcpy(&_w, (b) + (i), 4); (n) = __builtin_bswap32(_w); }
 #else
 #define GET_UINT32(n,b,i)                       \
 {                                               \
@@ -155,7 +158,7 @@ static constexpr uint32_t FT3[256] = { FT };
 #endif
 
 #if defined(__GNUC__)
-#define PUT_UINT32(n,b,i)	((uint32_t *) b)[i >> 2] = __builtin_bswap32(n)
+#define PUT_UINT32(n,b,i)	{ const uint32_t _w = __builtin_bswap32(n); memcpy((b) + (i), &_w, 4); }
 #else
 #define PUT_UINT32(n,b,i)                       \
 {                                               \
@@ -302,12 +305,16 @@ static inline void inc_counter(uint8_t *counter, uint64_t inc=1) {
   #endif
 }
 
+void aes_ctr_advance(uint8_t *iv, uint64_t n) {
+    inc_counter(iv, n);
+}
+
 void aes_ctr_encdec_generic(const uint8_t *input, uint8_t *output, const uint32_t *exp_key,
 		uint8_t *iv, uint64_t n)
 {
     for (uint64_t i = 0; i < n; ++i) {
       // load counter
-      const uint64_t xor_key[2] = {
+      uint64_t xor_key[2] = {
               ((uint64_t *) iv)[0],
               ((uint64_t *) iv)[1]
       };
@@ -417,8 +424,8 @@ void aes_ctr_encdec_aesni(const uint8_t *input, uint8_t *output, const uint32_t
     ctr_block = _mm_shuffle_epi8(ctr_block, BSWAP_EPI64);
 
     // Running 2 blocks in parallel exploiting instruction level parallelism
-    int c = 0;
-    for (int i = 0; i < (int) n; i += 2) {
+    uint64_t c = 0;
+    for (uint64_t i = 0; i + 1 < n; i += 2) {
         tmp0 = _mm_shuffle_epi8(ctr_block, BSWAP_EPI64);
         ctr_block = _mm_add_epi64(ctr_block, ONE);
         tmp1 = _mm_shuffle_epi8(ctr_block, BSWAP_EPI64);
@@ -466,3 +473,23 @@ void aes_ctr_encdec_aesni(const uint8_t *input, uint8_t *output, const uint32_t
 
 	#endif
 }
+
+static void aes_ctr_expand_key_builtin(const uint8_t *key, uint32_t *exp_key) {
+    static const bool hw_support = aes_has_cpu_support();
+    if (hw_support) {
+        aes_ctr_expand_key_aesni(key, exp_key);
+    } else {
+        aes_ctr_expand_key_generic(key, exp_key);
+    }
+}
+
+static void aes_ctr_encdec_builtin(const uint8_t *input, uint8_t *output, const uint32_t *exp_key, uint8_t *iv, uint64_t n) {
+    static const bool hw_support = aes_has_cpu_support();
+    if (hw_support) {
+        aes_ctr_encdec_aesni(input, output, exp_key, iv, n);
+    } else {
+        aes_ctr_encdec_generic(input, output, exp_key, iv, n);
+    }
+}
+
+const CipherProvider aes_builtin_provider = { "builtin", aes_ctr_expand_key_builtin, aes_ctr_encdec_builtin };
@@ -2,6 +2,7 @@
 #define __AES_HPP
 
 #include <cstdint>
+#include <cstring>
 #include <random>
 #include <ctime>
 
@@ -13,6 +14,11 @@
 #define AES_KEY_SIZE        (32)
 #define AES_EXP_KEY_SIZE    (240)
 
+// room for an expanded key, the generic key expansion writes one block past AES_EXP_KEY_SIZE,
+// aes_ctr_expand_key keeps the provider of the key in the block behind
+#define AES_EXP_KEY_PROVIDER_OFFSET (AES_EXP_KEY_SIZE + AES_BLOCK_SIZE)
+#define AES_EXP_KEY_BUFFER_SIZE     (AES_EXP_KEY_PROVIDER_OFFSET + AES_BLOCK_SIZE)
+
 // constants for convenience
 #define aes_ctr_enc         aes_ctr_encdec
 #define aes_ctr_dec         aes_ctr_encdec
@@ -23,6 +29,13 @@ extern void aes_ctr_encdec_generic(const uint8_t *input, uint8_t *output, const
 extern void aes_ctr_expand_key_aesni(const uint8_t *key, uint32_t *exp_key);
 extern void aes_ctr_encdec_aesni(const uint8_t *input, uint8_t *output, const uint32_t *exp_key, uint8_t *iv, uint64_t n);
 
+/***
+ * advance the counter by n blocks, the same way the cipher routines do
+ * @param iv
+ * @param n
+ */
+extern void aes_ctr_advance(uint8_t *iv, uint64_t n);
+
 #define cpuid(func,ax,bx,cx,dx)\
 						__asm__ __volatile__ ("cpuid":\
 						"=a" (ax), "=b" (bx), "=c" (cx), "=d" (dx) : "a" (func));
@@ -46,43 +59,56 @@ inline bool aes_has_cpu_support() {
  * @param iv
  */
 inline void aes_generate_iv(uint8_t *iv) {
-    std::default_random_engine generator(clock());
-    std::uniform_int_distribution<uint8_t> distribution(std::numeric_limits<uint8_t>::min(), std::numeric_limits<uint8_t>::max());
-
-    for (auto it = iv; it != iv + AES_BLOCK_SIZE; ++it) {
-        *it = distribution(generator);
+    // taken from the system's entropy source, files encrypted at the same time
+    // with the same password must never share an iv
+    std::random_device device;
+    for (int i = 0; i < AES_BLOCK_SIZE; i += 4) {
+        const uint32_t r = device();
+        iv[i] = (uint8_t) r;
+        iv[i + 1] = (uint8_t) (r >> 8);
+        iv[i + 2] = (uint8_t) (r >> 16);
+        iv[i + 3] = (uint8_t) (r >> 24);
     }
 }
 
 /***
- * compute the expanded key from the 256 bit key
+ * Routines behind aes_ctr_expand_key and aes_ctr_encdec, see provider.hpp. The layout of
+ * the expanded key is up to the provider, aes_ctr_expand_key stores the provider in the
+ * key so that aes_ctr_encdec uses the one that expanded it.
+ */
+struct CipherProvider {
+    const char *name;
+    void (*expand_key)(const uint8_t *key, uint32_t *exp_key);
+    void (*encdec)(const uint8_t *input, uint8_t *output, const uint32_t *exp_key, uint8_t *iv, uint64_t n);
+};
+
+// AES-NI if the cpu supports it, else the generic routines
+extern const CipherProvider aes_builtin_provider;
+
+/***
+ * compute the expanded key from the 256 bit key, the key remembers its provider
  * @param key
- * @param exp_key
+ * @param exp_key 16 byte aligned, AES_EXP_KEY_BUFFER_SIZE bytes
+ * @param provider runs aes_ctr_encdec with this key
  */
-inline void aes_ctr_expand_key(const uint8_t *key, uint32_t *exp_key) {
-    static const bool hw_support = aes_has_cpu_support();
-    if (hw_support) {
-        aes_ctr_expand_key_aesni(key, exp_key);
-    } else {
-        aes_ctr_expand_key_generic(key, exp_key);
-    }
+inline void aes_ctr_expand_key(const uint8_t *key, uint32_t *exp_key, const CipherProvider &provider=aes_builtin_provider) {
+    const CipherProvider *p = &provider;
+    provider.expand_key(key, exp_key);
+    memcpy((uint8_t *) exp_key + AES_EXP_KEY_PROVIDER_OFFSET, &p, sizeof(p));
 }
 
 /***
- * run enc/dec routine on data
+ * run enc/dec routine on data with the provider of the key
  * @param input input data
  * @param output output buffer
- * @param exp_key
+ * @param exp_key from aes_ctr_expand_key
  * @param iv
  * @param n number of blocks
  */
 inline void aes_ctr_encdec(const uint8_t *input, uint8_t *output, const uint32_t *exp_key, uint8_t *iv, uint64_t n) {
-    static const bool hw_support = aes_has_cpu_support();
-    if (hw_support) {
-        aes_ctr_encdec_aesni(input, output, exp_key, iv, n);
-    } else {
-        aes_ctr_encdec_generic(input, output, exp_key, iv, n);
-    }
+    const CipherProvider *provider;
+    memcpy(&provider, (const uint8_t *) exp_key + AES_EXP_KEY_PROVIDER_OFFSET, sizeof(provider));
+    provider->encdec(input, output, exp_key, iv, n);
 }
 
 #endif // __AES_HPP
@@ -0,0 +1,381 @@
+#include <archive.hpp>
+#include <buffer_pool.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+
+#define PAGE_SIZE_BYTES     (4096)
+
+static inline uint64_t round_up(uint64_t x, uint64_t align) {
+    return (x + align - 1) & ~(align - 1);
+}
+
+struct archive_member {
+    std::string name;
+    std::string path;
+    uint64_t length;
+};
+
+// collect the regular files below a directory, names are relative to the top directory
+static void collect(const std::string &path, const std::string &name, std::vector<archive_member> &members) {
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        throw std::runtime_error("unable to open directory '" + path + "'");
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        const std::string child(entry->d_name);
+        if (child == "." || child == "..") {
+            continue;
+        }
+        struct stat st;
+        if (stat((path + "/" + child).c_str(), &st) < 0) {
+            continue;
+        } else if (S_ISDIR(st.st_mode)) {
+            collect(path + "/" + child, name + child + "/", members);
+        } else if (S_ISREG(st.st_mode)) {
+            archive_member member;
+            member.name = name + child;
+            member.path = path + "/" + child;
+            member.length = (uint64_t) st.st_size;
+            members.push_back(member);
+        }
+    }
+    closedir(dir);
+}
+
+/***
+ * encrypt one member into its place in the archive
+ */
+static void encrypt_member(const archive_member &member, archive_entry &entry, int out, const uint8_t *iv,
+                           const uint32_t *exp_key, uint64_t bufsize) {
+    FileDescriptor in(member.path, O_RDONLY);
+    PoolBuffer pool_buffer(bufsize + AES_BLOCK_SIZE);
+    uint8_t *buffer = pool_buffer.data();
+
+    CHECKSUM::context ctx;
+    CHECKSUM::init(ctx);
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_at(iv, entry.offset, counter);
+
+    for (uint64_t pos = 0; pos < entry.length; pos += bufsize) {
+        const uint64_t n = std::min(bufsize, entry.length - pos);
+        if (pread_full(buffer, n, pos, in) < n) {
+            throw std::runtime_error("file changed while being archived");
+        }
+        const uint64_t num_blocks = n / AES_BLOCK_SIZE;
+        encrypt_blocks(ctx, buffer, num_blocks, exp_key, counter);
+
+        // the last block of a member is padded, the padding is not written
+        const uint64_t rest = n - num_blocks * AES_BLOCK_SIZE;
+        if (rest > 0) {
+            uint8_t *tail = buffer + num_blocks * AES_BLOCK_SIZE;
+            CHECKSUM::update(ctx, tail, rest);
+            aes_ctr_enc(tail, tail, exp_key, counter, 1);
+        }
+        pwrite_full(buffer, n, ARCHIVE_HEADER_SIZE + entry.offset + pos, out);
+    }
+    CHECKSUM::final(ctx, entry.digest);
+}
+
+void archive_create(const std::string &src, const std::string &fname, const std::string &password,
+                    uint64_t bufsize, ThreadPool &pool) {
+    std::vector<archive_member> members;
+    struct stat st;
+    if (stat(src.c_str(), &st) < 0) {
+        throw std::runtime_error("unable to stat '" + src + "'");
+    } else if (S_ISDIR(st.st_mode)) {
+        collect(src, "", members);
+    } else {
+        archive_member member;
+        member.name = src.substr(src.find_last_of('/') + 1);
+        member.path = src;
+        member.length = (uint64_t) st.st_size;
+        members.push_back(member);
+    }
+
+    // sorted by name so that members can be found by binary search in the index
+    std::sort(members.begin(), members.end(), [](const archive_member &a, const archive_member &b) -> bool {
+        return a.name < b.name;
+    });
+
+    // every member starts at a block boundary and thereby at a counter of its own
+    std::vector<archive_entry> entries(members.size());
+    std::string strings;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < members.size(); ++i) {
+        archive_entry &entry = entries[i];
+        memset(&entry, 0, sizeof(archive_entry));
+        entry.name_offset = strings.size();
+        entry.name_length = members[i].name.size();
+        entry.offset = offset;
+        entry.length = members[i].length;
+        entry.counter = offset / AES_BLOCK_SIZE;
+        strings += members[i].name;
+        offset += round_up(members[i].length, AES_BLOCK_SIZE);
+    }
+
+    FileDescriptor out(fname, O_WRONLY | O_CREAT | O_TRUNC);
+
+    // magic, iv and threefold hash of key
+    uint8_t header[ARCHIVE_HEADER_SIZE];
+    uint8_t *iv = header + ARCHIVE_MAGIC_SIZE;
+    memcpy(header, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE);
+    aes_generate_iv(iv);
+    uint8_t key[KEY_BUFFER_SIZE];
+    alignas(16) uint8_t exp_key[AES_EXP_KEY_BUFFER_SIZE];
+    derive_key(password, iv, key);
+    aes_ctr_expand_key(key, (uint32_t *) exp_key, crypt_provider());
+    uint8_t counter[AES_BLOCK_SIZE];
+    memcpy(counter, iv, AES_BLOCK_SIZE);
+    hash_key(key, iv + AES_BLOCK_SIZE);
+    aes_ctr_enc(iv + AES_BLOCK_SIZE, iv + AES_BLOCK_SIZE, (uint32_t *) exp_key, counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+    pwrite_full(header, ARCHIVE_HEADER_SIZE, 0, out);
+
+    std::mutex error_mutex;
+    std::string error;
+    for (size_t i = 0; i < members.size(); ++i) {
+        pool.submit([&, i]() {
+            try {
+                encrypt_member(members[i], entries[i], out, iv, (const uint32_t *) exp_key, bufsize);
+            } catch (std::exception &err) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                error = members[i].path + ": " + err.what();
+            }
+        });
+    }
+    pool.wait();
+    if (!error.empty()) {
+        unlink(fname.c_str());
+        throw std::runtime_error(error);
+    }
+
+    // index and string table, followed by the footer
+    const uint64_t index_size = entries.size() * sizeof(archive_entry) + round_up(strings.size(), AES_BLOCK_SIZE);
+    std::vector<uint8_t> index(index_size + sizeof(archive_footer), 0);
+    memcpy(index.data(), entries.data(), entries.size() * sizeof(archive_entry));
+    memcpy(index.data() + entries.size() * sizeof(archive_entry), strings.data(), strings.size());
+
+    archive_footer footer;
+    memset(&footer, 0, sizeof(archive_footer));
+    footer.index_offset = offset;
+    footer.num_entries = entries.size();
+    footer.strings_size = strings.size();
+    CHECKSUM::hash(index.data(), index_size, footer.digest);
+    memcpy(index.data() + index_size, &footer, sizeof(archive_footer));
+
+    counter_at(iv, offset, counter);
+    aes_ctr_enc(index.data(), index.data(), (uint32_t *) exp_key, counter, index.size() / AES_BLOCK_SIZE);
+    pwrite_full(index.data(), index.size(), ARCHIVE_HEADER_SIZE + offset, out);
+}
+
+ArchiveReader::ArchiveReader(const std::string &fname, const std::string &password) {
+    _fd = open(fname.c_str(), O_RDONLY);
+    if (_fd < 0) {
+        throw std::runtime_error("unable to open archive '" + fname + "'");
+    }
+
+    try {
+        struct stat st;
+        if (fstat(_fd, &st) < 0) {
+            throw std::runtime_error("unable to stat archive");
+        }
+        const uint64_t file_size = (uint64_t) st.st_size;
+        uint8_t header[ARCHIVE_HEADER_SIZE];
+        if (file_size < ARCHIVE_HEADER_SIZE + sizeof(archive_footer) ||
+            pread_full(header, ARCHIVE_HEADER_SIZE, 0, _fd) < ARCHIVE_HEADER_SIZE ||
+            memcmp(header, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE) != 0) {
+            throw std::runtime_error("not an archive");
+        }
+
+        // check if the key hashes match
+        memcpy(_iv, header + ARCHIVE_MAGIC_SIZE, AES_BLOCK_SIZE);
+        uint8_t key[KEY_BUFFER_SIZE];
+        uint8_t hash_of_key[SHA256::HASH_SIZE];
+        uint8_t counter[AES_BLOCK_SIZE];
+        derive_key(password, _iv, key);
+        aes_ctr_expand_key(key, (uint32_t *) _exp_key, crypt_provider());
+        hash_key(key, hash_of_key);
+        memcpy(counter, _iv, AES_BLOCK_SIZE);
+        uint8_t *key_hash = header + ARCHIVE_MAGIC_SIZE + AES_BLOCK_SIZE;
+        aes_ctr_dec(key_hash, key_hash, (uint32_t *) _exp_key, counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+        if (memcmp(key_hash, hash_of_key, SHA256::HASH_SIZE) != 0) {
+            throw std::runtime_error("invalid password or compromised iv");
+        }
+
+        const uint64_t footer_offset = file_size - ARCHIVE_HEADER_SIZE - sizeof(archive_footer);
+        if (footer_offset % AES_BLOCK_SIZE != 0) {
+            throw std::runtime_error("archive is corrupted");
+        }
+        pread_full((uint8_t *) &_footer, sizeof(archive_footer), ARCHIVE_HEADER_SIZE + footer_offset, _fd);
+        counter_at(_iv, footer_offset, counter);
+        aes_ctr_dec((uint8_t *) &_footer, (uint8_t *) &_footer, (uint32_t *) _exp_key, counter, sizeof(archive_footer) / AES_BLOCK_SIZE);
+
+        const uint64_t index_size = footer_offset - _footer.index_offset;
+        if (_footer.index_offset > footer_offset || _footer.num_entries > index_size / sizeof(archive_entry) ||
+            index_size != _footer.num_entries * sizeof(archive_entry) + round_up(_footer.strings_size, AES_BLOCK_SIZE)) {
+            throw std::runtime_error("archive index is corrupted");
+        }
+
+        if (index_size == 0) {
+            return;
+        }
+
+        // map the index privately and decrypt it in place
+        const uint64_t index_pos = ARCHIVE_HEADER_SIZE + _footer.index_offset;
+        const uint64_t map_start = index_pos & ~((uint64_t) PAGE_SIZE_BYTES - 1);
+        _map_size = index_pos + index_size - map_start;
+        void *ptr = mmap(nullptr, _map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, _fd, map_start);
+        if (ptr == MAP_FAILED) {
+            _map_size = 0;
+            throw std::runtime_error("unable to map archive index");
+        }
+        _map = (uint8_t *) ptr;
+        uint8_t *index = _map + (index_pos - map_start);
+        counter_at(_iv, _footer.index_offset, counter);
+        aes_ctr_dec(index, index, (uint32_t *) _exp_key, counter, index_size / AES_BLOCK_SIZE);
+
+        uint8_t digest[CHECKSUM::HASH_SIZE];
+        CHECKSUM::hash(index, index_size, digest);
+        if (memcmp(digest, _footer.digest, CHECKSUM::HASH_SIZE) != 0) {
+            throw std::runtime_error("checksum mismatch, archive index may be corrupted");
+        }
+        _entries = (const archive_entry *) index;
+        _strings = (const char *) (index + _footer.num_entries * sizeof(archive_entry));
+
+        for (size_t i = 0; i < size(); ++i) {
+            if (_entries[i].name_offset + _entries[i].name_length > _footer.strings_size ||
+                _entries[i].offset + _entries[i].length > _footer.index_offset) {
+                throw std::runtime_error("archive index is corrupted");
+            }
+        }
+    } catch (...) {
+        if (_map != nullptr) {
+            munmap(_map, _map_size);
+        }
+        close(_fd);
+        throw;
+    }
+}
+
+ArchiveReader::~ArchiveReader() {
+    if (_map != nullptr) {
+        munmap(_map, _map_size);
+    }
+    close(_fd);
+}
+
+const archive_entry *ArchiveReader::find(const std::string &name) const {
+    const archive_entry *end = _entries + size();
+    const archive_entry *it = std::lower_bound(_entries, end, name, [this](const archive_entry &entry, const std::string &key) -> bool {
+        return this->name(entry) < key;
+    });
+    return it != end && name == this->name(*it) ? it : nullptr;
+}
+
+void ArchiveReader::extract(const archive_entry &entry, const std::string &output, uint64_t bufsize) const {
+    FileDescriptor out(output, O_WRONLY | O_CREAT | O_TRUNC);
+    decrypt_member(entry, bufsize, out);
+}
+
+void ArchiveReader::verify(const archive_entry &entry, uint64_t bufsize) const {
+    decrypt_member(entry, bufsize, -1);
+}
+
+void ArchiveReader::decrypt_member(const archive_entry &entry, uint64_t bufsize, int out) const {
+    PoolBuffer pool_buffer(bufsize + AES_BLOCK_SIZE);
+    uint8_t *buffer = pool_buffer.data();
+
+    CHECKSUM::context ctx;
+    CHECKSUM::init(ctx);
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_at(_iv, entry.offset, counter);
+
+    for (uint64_t pos = 0; pos < entry.length; pos += bufsize) {
+        const uint64_t n = std::min(bufsize, entry.length - pos);
+        if (pread_full(buffer, n, ARCHIVE_HEADER_SIZE + entry.offset + pos, _fd) < n) {
+            throw std::runtime_error("insufficient file size");
+        }
+        const uint64_t num_blocks = n / AES_BLOCK_SIZE;
+        decrypt_blocks(ctx, buffer, num_blocks, (const uint32_t *) _exp_key, counter);
+        const uint64_t rest = n - num_blocks * AES_BLOCK_SIZE;
+        if (rest > 0) {
+            uint8_t *tail = buffer + num_blocks * AES_BLOCK_SIZE;
+            aes_ctr_dec(tail, tail, (const uint32_t *) _exp_key, counter, 1);
+            CHECKSUM::update(ctx, tail, rest);
+        }
+        if (out >= 0) {
+            pwrite_full(buffer, n, pos, out);
+        }
+    }
+
+    uint8_t digest[CHECKSUM::HASH_SIZE];
+    CHECKSUM::final(ctx, digest);
+    if (memcmp(digest, entry.digest, CHECKSUM::HASH_SIZE) != 0) {
+        throw std::runtime_error("checksum mismatch, member may be corrupted");
+    }
+}
+
+// member names must stay below the directory they are extracted to
+static bool safe_name(const std::string &name) {
+    if (name.empty() || name[0] == '/') {
+        return false;
+    }
+    size_t begin = 0;
+    while (begin <= name.size()) {
+        size_t end = name.find('/', begin);
+        if (end == std::string::npos) {
+            end = name.size();
+        }
+        if (name.compare(begin, end - begin, "..") == 0) {
+            return false;
+        }
+        begin = end + 1;
+    }
+    return true;
+}
+
+// create the directories leading to a file
+static void make_parents(const std::string &path) {
+    for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        if (mkdir(path.substr(0, pos).c_str(), 0777) < 0 && errno != EEXIST) {
+            throw std::runtime_error("unable to create directory '" + path.substr(0, pos) + "'");
+        }
+    }
+}
+
+size_t ArchiveReader::extract_all(const std::string &dst, uint64_t bufsize, ThreadPool &pool) const {
+    std::mutex report_mutex;
+    size_t failed = 0;
+    for (size_t i = 0; i < size(); ++i) {
+        const archive_entry *entry = _entries + i;
+        const std::string member = name(*entry);
+        if (!safe_name(member)) {
+            std::lock_guard<std::mutex> lock(report_mutex);
+            std::cerr << member << ": refusing to extract outside of '" << dst << '\'' << std::endl;
+            ++failed;
+            continue;
+        }
+        pool.submit([&, entry, member]() {
+            try {
+                const std::string output = dst + "/" + member;
+                make_parents(output);
+                extract(*entry, output, bufsize);
+            } catch (std::exception &err) {
+                std::lock_guard<std::mutex> lock(report_mutex);
+                std::cerr << member << ": " << err.what() << std::endl;
+                ++failed;
+            }
+        });
+    }
+    pool.wait();
+    return failed;
+}
@@ -0,0 +1,131 @@
+#ifndef __ARCHIVE_HPP
+#define __ARCHIVE_HPP
+
+#include <crypt.hpp>
+#include <thread_pool.hpp>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// layout of an archive, all offsets of the index are relative to the start of the data
+// and the whole data part is a single key stream that starts at counter iv + 2:
+// magic | iv | E(threefold hash of key) | E(members) | E(index) | E(string table) | E(footer)
+#define ARCHIVE_MAGIC           "ACRYPTA1"
+#define ARCHIVE_MAGIC_SIZE      (8)
+#define ARCHIVE_HEADER_SIZE     (ARCHIVE_MAGIC_SIZE + HEADER_SIZE)
+
+/***
+ * index entry of a member, the index is sorted by name
+ */
+struct archive_entry {
+    uint64_t name_offset;                   // into the string table
+    uint64_t name_length;
+    uint64_t offset;                        // of the first byte, a multiple of the block size
+    uint64_t length;
+    uint64_t counter;                       // counter of the first block, relative to iv + 2
+    uint8_t digest[CHECKSUM::HASH_SIZE];    // checksum of the plain text
+    uint8_t reserved[4];
+};
+
+/***
+ * last three blocks of an archive
+ */
+struct archive_footer {
+    uint64_t index_offset;
+    uint64_t num_entries;
+    uint64_t strings_size;
+    uint8_t digest[CHECKSUM::HASH_SIZE];    // checksum of the index and the string table
+    uint8_t reserved[4];
+};
+
+/***
+ * Pack a file or all regular files below a directory into an archive. The members are
+ * encrypted in parallel, each of them is streamed through a buffer of bufsize bytes.
+ * The key is derived once for the whole archive.
+ * @param src file or directory, member names are relative to it
+ * @param fname archive to create
+ * @param password
+ * @param bufsize
+ * @param pool
+ */
+extern void archive_create(const std::string &src, const std::string &fname, const std::string &password,
+                           uint64_t bufsize, ThreadPool &pool);
+
+/***
+ * Opens an archive and decrypts its index, members are extracted by seeking straight
+ * to them. All const methods may be called from several threads at once.
+ */
+class ArchiveReader {
+public:
+
+    ArchiveReader(const std::string &fname, const std::string &password);
+
+    ~ArchiveReader();
+
+    ArchiveReader(const ArchiveReader &) = delete;
+
+    ArchiveReader &operator=(const ArchiveReader &) = delete;
+
+    size_t size() const {
+        return _footer.num_entries;
+    }
+
+    const archive_entry &entry(size_t i) const {
+        return _entries[i];
+    }
+
+    std::string name(const archive_entry &entry) const {
+        return std::string(_strings + entry.name_offset, entry.name_length);
+    }
+
+    /***
+     * look a member up by name
+     * @param name
+     * @return nullptr if there is no such member
+     */
+    const archive_entry *find(const std::string &name) const;
+
+    /***
+     * decrypt a member into a file and verify its checksum
+     * @param entry
+     * @param output
+     * @param bufsize
+     */
+    void extract(const archive_entry &entry, const std::string &output, uint64_t bufsize) const;
+
+    /***
+     * decrypt a member without writing it anywhere and verify its checksum
+     * @param entry
+     * @param bufsize
+     */
+    void verify(const archive_entry &entry, uint64_t bufsize) const;
+
+    /***
+     * extract all members below a directory in parallel
+     * @param dst
+     * @param bufsize
+     * @param pool
+     * @return number of members that failed
+     */
+    size_t extract_all(const std::string &dst, uint64_t bufsize, ThreadPool &pool) const;
+
+private:
+
+    // decrypt a member and write it to out, unless out is negative
+    void decrypt_member(const archive_entry &entry, uint64_t bufsize, int out) const;
+
+    int _fd = -1;
+    uint8_t _iv[AES_BLOCK_SIZE];
+    alignas(16) uint8_t _exp_key[AES_EXP_KEY_BUFFER_SIZE];
+    archive_footer _footer;
+
+    // private mapping of the index, decrypted in place
+    uint8_t *_map = nullptr;
+    size_t _map_size = 0;
+    const archive_entry *_entries = nullptr;
+    const char *_strings = nullptr;
+
+};
+
+#endif // __ARCHIVE_HPP
@@ -0,0 +1,375 @@
+#include <batch.hpp>
+#include <crypt.hpp>
+#include <buffer_pool.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <array>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+// room behind a buffer to append the checksum
+#define SLACK_SIZE      (64)
+
+struct Batch::File {
+    std::string input;
+    std::string output;
+    int in = -1;
+    int out = -1;
+    uint64_t length = 0;                        // plain text
+    uint8_t iv[AES_BLOCK_SIZE];
+    alignas(16) std::array<uint8_t, AES_EXP_KEY_BUFFER_SIZE> exp_key;
+    CHECKSUM::context ctx;
+    uint8_t checksum[CHECKSUM::HASH_SIZE];      // encrypted checksum read from the file, when decrypting
+    SHA256::context digest;                     // of the plain text, when encrypting with a digest
+    SHA256::context *digest_ptr = nullptr;
+    bool split = false;                         // processed in ranges by several tasks
+    std::atomic<size_t> remaining;              // tasks of this file still running
+    std::vector<bool> ranges_done;              // by the cipher, guarded by mutex
+    size_t ranges_hashed = 0;                   // in order, guarded by mutex
+    bool hashing = false;                       // a task is taking the checksum, guarded by mutex
+    std::mutex mutex;
+    std::string error;
+
+    File(const std::string &input, const std::string &output) : input(input), output(output), remaining(0) {}
+
+    ~File() {
+        if (in >= 0) {
+            close(in);
+        }
+        if (out >= 0) {
+            close(out);
+        }
+    }
+
+    const uint32_t *key() const {
+        return (const uint32_t *) exp_key.data();
+    }
+
+    uint64_t body_end() const {
+        return length - length % AES_BLOCK_SIZE;
+    }
+
+    void fail(const std::string &what) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error.empty()) {
+            error = what;
+        }
+    }
+};
+
+Batch::Batch(ThreadPool &pool, int mode, const std::string &password, uint64_t bufsize, const digest_t &digest) :
+        _pool(pool), _mode(mode), _password(password), _bufsize(bufsize), _digest(digest), _failed(0) {}
+
+void Batch::add(const std::string &input, const std::string &output) {
+    std::shared_ptr<File> file(new File(input, output));
+    _pool.submit([this, file]() {
+        start(file);
+    });
+}
+
+void Batch::add_directory(const std::string &src, const std::string &dst) {
+    if (mkdir(dst.c_str(), 0777) < 0 && errno != EEXIST) {
+        std::lock_guard<std::mutex> lock(_report_mutex);
+        std::cerr << dst << ": unable to create directory" << std::endl;
+        ++_failed;
+        return;
+    }
+
+    DIR *dir = opendir(src.c_str());
+    if (dir == nullptr) {
+        std::lock_guard<std::mutex> lock(_report_mutex);
+        std::cerr << src << ": unable to open directory" << std::endl;
+        ++_failed;
+        return;
+    }
+
+    // files are queued while walking, the workers start right away
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        const std::string name(entry->d_name);
+        if (name == "." || name == "..") {
+            continue;
+        }
+        const std::string input = src + "/" + name;
+        const std::string output = dst + "/" + name;
+        struct stat st;
+        if (stat(input.c_str(), &st) < 0) {
+            continue;
+        } else if (S_ISDIR(st.st_mode)) {
+            add_directory(input, output);
+        } else if (S_ISREG(st.st_mode)) {
+            add(input, output);
+        }
+    }
+    closedir(dir);
+}
+
+void Batch::add_manifest(const std::string &fname) {
+    std::ifstream in(fname);
+    if (!in) {
+        throw std::runtime_error("unable to read manifest '" + fname + "'");
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        const size_t tab = line.find('\t');
+        if (tab == std::string::npos) {
+            std::lock_guard<std::mutex> lock(_report_mutex);
+            std::cerr << fname << ": invalid line '" << line << '\'' << std::endl;
+            ++_failed;
+            continue;
+        }
+        add(line.substr(0, tab), line.substr(tab + 1));
+    }
+}
+
+size_t Batch::wait() {
+    _pool.wait();
+    return _failed;
+}
+
+void Batch::open(File &file) {
+    file.in = ::open(file.input.c_str(), O_RDONLY);
+    if (file.in < 0) {
+        throw std::runtime_error("unable to open input file");
+    }
+    // the plain text written is read back for the checksum of a split file
+    file.out = ::open(file.output.c_str(), (_mode == ENCRYPTION ? O_WRONLY : O_RDWR) | O_CREAT | O_TRUNC, 0666);
+    if (file.out < 0) {
+        throw std::runtime_error("unable to open output file");
+    }
+    struct stat st;
+    if (fstat(file.in, &st) < 0) {
+        throw std::runtime_error("unable to stat input file");
+    }
+
+    std::array<uint8_t, KEY_BUFFER_SIZE> key = { 0 };
+    uint8_t key_hash[SHA256::HASH_SIZE];
+    uint8_t counter[AES_BLOCK_SIZE];
+    if (_mode == ENCRYPTION) {
+        file.length = (uint64_t) st.st_size;
+        aes_generate_iv(file.iv);
+        derive_key(_password, file.iv, key.data());
+        aes_ctr_expand_key(key.data(), (uint32_t *) file.exp_key.data(), crypt_provider());
+
+        // write iv and threefold hash of key
+        uint8_t header[HEADER_SIZE];
+        memcpy(header, file.iv, AES_BLOCK_SIZE);
+        hash_key(key.data(), header + AES_BLOCK_SIZE);
+        CHECKSUM::init(file.ctx);
+        CHECKSUM::update(file.ctx, header + AES_BLOCK_SIZE, SHA256::HASH_SIZE);
+        memcpy(counter, file.iv, AES_BLOCK_SIZE);
+        aes_ctr_enc(header + AES_BLOCK_SIZE, header + AES_BLOCK_SIZE, file.key(), counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+        pwrite_full(header, HEADER_SIZE, 0, file.out);
+        if (_digest) {
+            SHA256::init(file.digest);
+            file.digest_ptr = &file.digest;
+        }
+    } else {
+        if ((uint64_t) st.st_size < HEADER_SIZE + CHECKSUM::HASH_SIZE) {
+            throw std::runtime_error("insufficient file size");
+        }
+        file.length = (uint64_t) st.st_size - HEADER_SIZE - CHECKSUM::HASH_SIZE;
+        uint8_t header[HEADER_SIZE];
+        pread_full(header, HEADER_SIZE, 0, file.in);
+        pread_full(file.checksum, CHECKSUM::HASH_SIZE, HEADER_SIZE + file.length, file.in);
+        memcpy(file.iv, header, AES_BLOCK_SIZE);
+        derive_key(_password, file.iv, key.data());
+        aes_ctr_expand_key(key.data(), (uint32_t *) file.exp_key.data(), crypt_provider());
+
+        // check if the key hashes match
+        hash_key(key.data(), key_hash);
+        memcpy(counter, file.iv, AES_BLOCK_SIZE);
+        aes_ctr_dec(header + AES_BLOCK_SIZE, header + AES_BLOCK_SIZE, file.key(), counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+        if (memcmp(header + AES_BLOCK_SIZE, key_hash, SHA256::HASH_SIZE) != 0) {
+            throw std::runtime_error("invalid password or compromised iv");
+        }
+        CHECKSUM::init(file.ctx);
+        CHECKSUM::update(file.ctx, key_hash, SHA256::HASH_SIZE);
+    }
+}
+
+void Batch::start(const std::shared_ptr<File> &file) {
+    try {
+        open(*file);
+        if (file->length <= 2 * BATCH_RANGE_SIZE) {
+            crypt_serial(*file);
+            finish(*file);
+            done(file);
+            return;
+        }
+    } catch (std::exception &err) {
+        file->fail(err.what());
+        done(file);
+        return;
+    }
+
+    // the ranges run the cipher in parallel, the checksum follows them in order and is
+    // appended by the task that finishes last
+    const uint64_t body_end = file->body_end();
+    const size_t num_ranges = (body_end + BATCH_RANGE_SIZE - 1) / BATCH_RANGE_SIZE;
+    file->split = true;
+    file->remaining = num_ranges;
+    file->ranges_done.assign(num_ranges, false);
+    for (size_t range = 0; range < num_ranges; ++range) {
+        const uint64_t begin = range * BATCH_RANGE_SIZE;
+        const uint64_t end = std::min(begin + BATCH_RANGE_SIZE, body_end);
+        _pool.submit([this, file, range, begin, end]() {
+            try {
+                crypt_range(*file, begin, end);
+                hash_ranges(*file, range);
+            } catch (std::exception &err) {
+                file->fail(err.what());
+            }
+            done(file);
+        });
+    }
+}
+
+void Batch::done(const std::shared_ptr<File> &file) {
+    if (file->split) {
+        if (--file->remaining > 0) {
+            return;
+        }
+        // the other tasks of the file are done, no need to lock
+        if (file->error.empty()) {
+            try {
+                finish(*file);
+            } catch (std::exception &err) {
+                file->fail(err.what());
+            }
+        }
+    }
+    if (file->error.empty() && file->digest_ptr == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_report_mutex);
+    if (file->error.empty()) {
+        try {
+            _digest(file->input, file->digest);
+        } catch (std::exception &err) {
+            file->error = err.what();
+        }
+    }
+    if (!file->error.empty()) {
+        std::cerr << file->input << ": " << file->error << std::endl;
+        ++_failed;
+    }
+}
+
+void Batch::crypt_serial(File &file) {
+    PoolBuffer pool_buffer(_bufsize + SLACK_SIZE);
+    uint8_t *buffer = pool_buffer.data();
+    const uint64_t in_base = _mode == ENCRYPTION ? 0 : HEADER_SIZE;
+    const uint64_t out_base = _mode == ENCRYPTION ? HEADER_SIZE : 0;
+    const uint64_t body_end = file.body_end();
+
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_at(file.iv, 0, counter);
+    for (uint64_t offset = 0; offset < body_end; offset += _bufsize) {
+        const uint64_t n = std::min(_bufsize, body_end - offset);
+        if (pread_full(buffer, n, in_base + offset, file.in) < n) {
+            throw std::runtime_error("insufficient file size");
+        }
+        if (_mode == ENCRYPTION) {
+            encrypt_blocks(file.ctx, buffer, n / AES_BLOCK_SIZE, file.key(), counter, file.digest_ptr);
+        } else {
+            decrypt_blocks(file.ctx, buffer, n / AES_BLOCK_SIZE, file.key(), counter);
+        }
+        pwrite_full(buffer, n, out_base + offset, file.out);
+    }
+}
+
+void Batch::crypt_range(File &file, uint64_t begin, uint64_t end) {
+    PoolBuffer pool_buffer(_bufsize);
+    uint8_t *buffer = pool_buffer.data();
+    const uint64_t in_base = _mode == ENCRYPTION ? 0 : HEADER_SIZE;
+    const uint64_t out_base = _mode == ENCRYPTION ? HEADER_SIZE : 0;
+
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_at(file.iv, begin, counter);
+    for (uint64_t offset = begin; offset < end; offset += _bufsize) {
+        const uint64_t n = std::min(_bufsize, end - offset);
+        if (pread_full(buffer, n, in_base + offset, file.in) < n) {
+            throw std::runtime_error("insufficient file size");
+        }
+        aes_ctr_encdec(buffer, buffer, file.key(), counter, n / AES_BLOCK_SIZE);
+        pwrite_full(buffer, n, out_base + offset, file.out);
+    }
+}
+
+void Batch::hash_ranges(File &file, size_t range) {
+    // The checksum is serial. Whichever task completes the range it waits for takes it
+    // over the ranges done by then, the others return to the pool at once.
+    std::unique_lock<std::mutex> lock(file.mutex);
+    file.ranges_done[range] = true;
+    if (file.hashing) {
+        return;
+    }
+    file.hashing = true;
+    while (file.ranges_hashed < file.ranges_done.size() && file.ranges_done[file.ranges_hashed] && file.error.empty()) {
+        const uint64_t begin = file.ranges_hashed * BATCH_RANGE_SIZE;
+        const uint64_t end = std::min(begin + BATCH_RANGE_SIZE, file.body_end());
+        lock.unlock();
+        hash_range(file, begin, end);
+        lock.lock();
+        ++file.ranges_hashed;
+    }
+    file.hashing = false;
+}
+
+void Batch::hash_range(File &file, uint64_t begin, uint64_t end) {
+    PoolBuffer pool_buffer(_bufsize);
+    uint8_t *buffer = pool_buffer.data();
+
+    // the plain text is read back, the input when encrypting and the output when
+    // decrypting, so that nothing is decrypted twice
+    const int fd = _mode == ENCRYPTION ? file.in : file.out;
+    for (uint64_t offset = begin; offset < end; offset += _bufsize) {
+        const uint64_t n = std::min(_bufsize, end - offset);
+        if (pread_full(buffer, n, offset, fd) < n) {
+            throw std::runtime_error("insufficient file size");
+        }
+        CHECKSUM::update(file.ctx, buffer, n);
+        if (file.digest_ptr != nullptr) {
+            SHA256::update(file.digest, buffer, n);
+        }
+    }
+}
+
+void Batch::finish(File &file) {
+    const uint64_t body_end = file.body_end();
+    const uint64_t tail_size = file.length - body_end;
+    uint8_t tail[2 * AES_BLOCK_SIZE + CHECKSUM::HASH_SIZE];
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_at(file.iv, body_end, counter);
+
+    if (_mode == ENCRYPTION) {
+        if (pread_full(tail, tail_size, body_end, file.in) < tail_size) {
+            throw std::runtime_error("insufficient file size");
+        }
+        encrypt_tail(file.ctx, tail, tail_size, file.key(), counter, file.digest_ptr);
+        pwrite_full(tail, tail_size + CHECKSUM::HASH_SIZE, HEADER_SIZE + body_end, file.out);
+        return;
+    }
+
+    pread_full(tail, tail_size, HEADER_SIZE + body_end, file.in);
+    memcpy(tail + tail_size, file.checksum, CHECKSUM::HASH_SIZE);
+    decrypt_tail(file.ctx, tail, tail_size, file.key(), counter);
+    pwrite_full(tail, tail_size, body_end, file.out);
+
+    // check if checksum in file matches the checksum computed from the decrypted file
+    uint8_t checksum[CHECKSUM::HASH_SIZE];
+    CHECKSUM::final(file.ctx, checksum);
+    if (memcmp(checksum, tail + tail_size, CHECKSUM::HASH_SIZE) != 0) {
+        throw std::runtime_error("checksum mismatch, file may be corrupted");
+    }
+}
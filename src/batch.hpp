@@ -0,0 +1,104 @@
+#ifndef __BATCH_HPP
+#define __BATCH_HPP
+
+#include <thread_pool.hpp>
+#include <Hash.hpp>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// files with a larger body are split into counter ranges of this size, so that
+// several workers share them
+#define BATCH_RANGE_SIZE    (UINT64_C(64) * 1024 * 1024)
+
+/***
+ * Encrypts or decrypts many files on a thread pool. Every file gets its own iv and
+ * therefore its own key, the key derivation runs on the workers as well. Large
+ * files are split into ranges of the counter that are processed independently.
+ * The checksum over the plain text is serial, it is taken range by range in order
+ * from the plain text read back, by the task that completes the range it waits for,
+ * and overlaps only with the cipher work of the later ranges.
+ * Errors are reported on stderr per file, they do not stop the batch.
+ */
+class Batch {
+public:
+
+    // receives the input file name and the SHA-256 of its plain text, not finalized yet
+    typedef std::function<void(const std::string &, SHA256::context &)> digest_t;
+
+    /***
+     * @param pool
+     * @param mode ENCRYPTION or DECRYPTION
+     * @param password
+     * @param bufsize multiple of AES_BLOCK_SIZE
+     * @param digest if given, the plain text of every file encrypted successfully is hashed on
+     * its way through the cipher and passed to it, one file at a time
+     */
+    Batch(ThreadPool &pool, int mode, const std::string &password, uint64_t bufsize, const digest_t &digest=nullptr);
+
+    Batch(const Batch &) = delete;
+
+    Batch &operator=(const Batch &) = delete;
+
+    /***
+     * queue a single file
+     * @param input
+     * @param output
+     */
+    void add(const std::string &input, const std::string &output);
+
+    /***
+     * queue all regular files below src, the directory structure is recreated below dst
+     * @param src
+     * @param dst
+     */
+    void add_directory(const std::string &src, const std::string &dst);
+
+    /***
+     * queue the files listed in a manifest, one "<input>\t<output>" pair per line,
+     * empty lines and lines starting with '#' are skipped
+     * @param fname
+     */
+    void add_manifest(const std::string &fname);
+
+    /***
+     * wait until all queued files are done
+     * @return number of files that failed
+     */
+    size_t wait();
+
+private:
+
+    struct File;
+
+    void start(const std::shared_ptr<File> &file);
+
+    void open(File &file);
+
+    void crypt_serial(File &file);
+
+    void crypt_range(File &file, uint64_t begin, uint64_t end);
+
+    void hash_ranges(File &file, size_t range);
+
+    void hash_range(File &file, uint64_t begin, uint64_t end);
+
+    void finish(File &file);
+
+    void done(const std::shared_ptr<File> &file);
+
+    ThreadPool &_pool;
+    const int _mode;
+    const std::string _password;
+    const uint64_t _bufsize;
+    const digest_t _digest;
+
+    std::atomic<size_t> _failed;
+    std::mutex _report_mutex;
+
+};
+
+#endif // __BATCH_HPP
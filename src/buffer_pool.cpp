@@ -0,0 +1,167 @@
+#include <buffer_pool.hpp>
+#include <cpu.hpp>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <new>
+#include <algorithm>
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB    (21 << 26)
+#endif
+
+#define PAGE_SIZE_BYTES     (4096)
+
+static inline size_t round_up(size_t x, size_t align) {
+    return (x + align - 1) & ~(align - 1);
+}
+
+BufferPool::BufferPool(uint64_t capacity) : _capacity(capacity) {}
+
+BufferPool::~BufferPool() {
+    for (auto &entry : _free) {
+        munmap(entry.second, entry.first);
+    }
+    // buffers still in use are leaked on purpose, someone may access them yet
+}
+
+BufferPool &BufferPool::global() {
+    static BufferPool pool;
+    return pool;
+}
+
+uint8_t *BufferPool::map(size_t size, int node) {
+    // explicit huge pages, only available if the administrator reserved some. Not populated
+    // by mmap, the pages have to be bound to the node before they are faulted in below
+    uint8_t *aligned;
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (ptr != MAP_FAILED) {
+        aligned = (uint8_t *) ptr;
+    } else {
+        // otherwise map with enough room to cut out a 2 MB aligned range and ask for transparent huge pages
+        ptr = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            return nullptr;
+        }
+        auto *raw = (uint8_t *) ptr;
+        aligned = (uint8_t *) round_up((uintptr_t) raw, HUGE_PAGE_SIZE);
+        if (aligned != raw) {
+            munmap(raw, aligned - raw);
+        }
+        const size_t tail = (raw + size + HUGE_PAGE_SIZE) - (aligned + size);
+        if (tail > 0) {
+            munmap(aligned + size, tail);
+        }
+        madvise(aligned, size, MADV_HUGEPAGE);
+    }
+    if (node >= 0) {
+        cpu_mem_bind(aligned, size, node);
+    }
+
+    // pre-fault, one write per page is enough (and one per huge page if THP kicks in)
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE_BYTES) {
+        ((volatile uint8_t *) aligned)[offset] = 0;
+    }
+    return aligned;
+}
+
+void BufferPool::trim_locked(uint64_t needed) {
+    // drop cached buffers, smallest first, until 'needed' more bytes fit
+    auto it = _free.begin();
+    while (it != _free.end() && _mapped + needed > _capacity) {
+        munmap(it->second, it->first);
+        _nodes.erase(it->second);
+        _mapped -= it->first;
+        it = _free.erase(it);
+    }
+}
+
+uint8_t *BufferPool::acquire(size_t size) {
+    size = round_up(std::max<size_t>(size, 1), HUGE_PAGE_SIZE);
+    if (size > _capacity) {
+        throw std::bad_alloc();
+    }
+
+    // buffers of the node of the caller first, a single node needs no bookkeeping
+    const int node = cpu_nodes().size() > 1 ? cpu_node() : -1;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        // reuse the smallest cached buffer of the node that is large enough, one of another
+        // node only if there is no room to map a new one
+        auto it = _free.lower_bound(size);
+        auto local = it;
+        while (node >= 0 && local != _free.end() && _nodes[local->second] != node) {
+            ++local;
+        }
+        if (local == _free.end() && _mapped + size > _capacity) {
+            local = it;
+        }
+        if (local != _free.end()) {
+            uint8_t *ptr = local->second;
+            _in_use[ptr] = local->first;
+            _free.erase(local);
+            return ptr;
+        }
+
+        trim_locked(size);
+        if (_mapped + size <= _capacity) {
+            break;
+        } else if (_in_use.empty() && _mapping == 0) {
+            // nothing that could be released, buffers being mapped will be in use soon
+            throw std::bad_alloc();
+        }
+        _released.wait(lock);
+    }
+
+    // reserve the bytes, the mapping itself happens without holding the lock
+    _mapped += size;
+    ++_mapping;
+    lock.unlock();
+
+    uint8_t *ptr = map(size, node);
+
+    lock.lock();
+    --_mapping;
+    if (ptr == nullptr) {
+        _mapped -= size;
+        _released.notify_all();
+        throw std::bad_alloc();
+    }
+    _in_use[ptr] = size;
+    _nodes[ptr] = node;
+    return ptr;
+}
+
+void BufferPool::release(uint8_t *ptr) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _in_use.find(ptr);
+    if (it == _in_use.end()) {
+        return;
+    }
+    _free.emplace(it->second, ptr);
+    _in_use.erase(it);
+    _released.notify_all();
+}
+
+void BufferPool::trim() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &entry : _free) {
+        munmap(entry.second, entry.first);
+        _nodes.erase(entry.second);
+        _mapped -= entry.first;
+    }
+    _free.clear();
+}
+
+void BufferPool::set_capacity(uint64_t capacity) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _capacity = capacity;
+    trim_locked(0);
+    _released.notify_all();
+}
+
+uint64_t BufferPool::mapped() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _mapped;
+}
@@ -0,0 +1,125 @@
+#ifndef __BUFFER_POOL_HPP
+#define __BUFFER_POOL_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+#define HUGE_PAGE_SIZE              (2 * 1024 * 1024)
+
+#define DEFAULT_POOL_CAPACITY       (UINT64_C(512) * 1024 * 1024)
+
+/***
+ * Thread safe pool of large I/O buffers. Buffers are 2 MB aligned and backed by
+ * hugetlbfs pages if some are reserved, by transparent huge pages otherwise, and
+ * they are pre-faulted when mapped. Released buffers are kept and handed out again,
+ * so the mapping and page fault cost is paid once per process instead of once per
+ * file. The memory mapped by the pool never exceeds its capacity, acquire() waits
+ * for buffers in use to be released if it would.
+ * On NUMA machines a buffer is placed on the node of the thread that maps it and
+ * handed out again to threads of that node first.
+ */
+class BufferPool {
+public:
+
+    explicit BufferPool(uint64_t capacity=DEFAULT_POOL_CAPACITY);
+
+    ~BufferPool();
+
+    BufferPool(const BufferPool &) = delete;
+
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    /***
+     * process wide pool
+     * @return
+     */
+    static BufferPool &global();
+
+    /***
+     * get a buffer of at least size bytes
+     * @param size
+     * @return 2 MB aligned buffer
+     * @throws std::bad_alloc if size exceeds the capacity or mapping memory failed
+     */
+    uint8_t *acquire(size_t size);
+
+    /***
+     * hand a buffer back to the pool
+     * @param ptr buffer returned by acquire()
+     */
+    void release(uint8_t *ptr);
+
+    /***
+     * unmap all buffers that are not in use
+     */
+    void trim();
+
+    void set_capacity(uint64_t capacity);
+
+    uint64_t capacity() const {
+        return _capacity;
+    }
+
+    /***
+     * bytes currently mapped by the pool (in use or cached)
+     * @return
+     */
+    uint64_t mapped() const;
+
+private:
+
+    static uint8_t *map(size_t size, int node);
+
+    void trim_locked(uint64_t needed);
+
+    uint64_t _capacity;
+    uint64_t _mapped = 0;
+    size_t _mapping = 0;                      // reservations whose buffer is being mapped
+    std::map<uint8_t *, size_t> _in_use;      // buffer -> size
+    std::multimap<size_t, uint8_t *> _free;   // size -> buffer
+    std::map<uint8_t *, int> _nodes;          // buffer -> node, -1 if not placed
+
+    mutable std::mutex _mutex;
+    std::condition_variable _released;
+
+};
+
+/***
+ * buffer borrowed from a pool for the lifetime of the object
+ */
+class PoolBuffer {
+public:
+
+    PoolBuffer(BufferPool &pool, size_t size) : _pool(&pool), _data(pool.acquire(size)) {}
+
+    explicit PoolBuffer(size_t size) : PoolBuffer(BufferPool::global(), size) {}
+
+    ~PoolBuffer() {
+        if (_data != nullptr) {
+            _pool->release(_data);
+        }
+    }
+
+    PoolBuffer(PoolBuffer &&other) noexcept : _pool(other._pool), _data(other._data) {
+        other._data = nullptr;
+    }
+
+    PoolBuffer(const PoolBuffer &) = delete;
+
+    PoolBuffer &operator=(const PoolBuffer &) = delete;
+
+    uint8_t *data() const {
+        return _data;
+    }
+
+private:
+
+    BufferPool *_pool;
+    uint8_t *_data;
+
+};
+
+#endif // __BUFFER_POOL_HPP
@@ -0,0 +1,363 @@
+#include <checkpoint.hpp>
+#include <buffer_pool.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+#define CHECKPOINT_MAGIC        "ACRYPTC1"
+#define CHECKPOINT_MAGIC_SIZE   (8)
+
+#define MODE_ENCRYPT            (0)
+#define MODE_DECRYPT            (1)
+
+/***
+ * Contents of the checkpoint file. Everything in front of offset has been processed and
+ * synced to the output, counter and checksum context are the ones right before offset.
+ */
+struct checkpoint_record {
+    char magic[CHECKPOINT_MAGIC_SIZE];
+    uint32_t mode;
+    uint32_t reserved;
+    uint8_t header[HEADER_SIZE];                // iv and encrypted hash of the key, as in the file
+    uint64_t input_size;                        // the input may not change in between
+    int64_t input_mtime;                        // in nanoseconds
+    uint64_t offset;                            // in the plain text, a multiple of AES_BLOCK_SIZE
+    uint8_t counter[AES_BLOCK_SIZE];
+    uint8_t ctx[CHECKSUM::STATE_SIZE];          // checksum context saved by CHECKSUM::save_state()
+    uint8_t tag[HMAC_SHA256::HASH_SIZE];        // of everything in front of it
+};
+
+// the tag uses a key of its own, derived from the key of the cipher
+static void init_mac(const uint8_t *key, HMAC_SHA256::context &mac) {
+    static const char label[] = "acrypt checkpoint";
+    uint8_t mac_key[SHA256::HASH_SIZE];
+    SHA256::context ctx;
+    SHA256::init(ctx);
+    SHA256::update(ctx, key, KEY_BUFFER_SIZE);
+    SHA256::update(ctx, label, sizeof(label) - 1);
+    SHA256::final(ctx, mac_key);
+    HMAC_SHA256::init(mac, mac_key, SHA256::HASH_SIZE);
+}
+
+static void checkpoint_tag(const HMAC_SHA256::context &mac, const checkpoint_record &r, uint8_t *tag) {
+    HMAC_SHA256::context ctx = mac;
+    HMAC_SHA256::update(ctx, &r, offsetof(checkpoint_record, tag));
+    HMAC_SHA256::final(ctx, tag);
+}
+
+static void sync(int fd) {
+    if (fdatasync(fd) < 0) {
+        throw std::runtime_error(std::string("unable to sync file: ") + strerror(errno));
+    }
+}
+
+static int64_t mtime_of(const struct stat &st) {
+    return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+/***
+ * sync the output and replace the checkpoint by the record, a crash in between leaves
+ * the previous checkpoint in place
+ * @param fname
+ * @param out
+ * @param r
+ * @param mac
+ */
+static void save_checkpoint(const std::string &fname, int out, checkpoint_record &r, const HMAC_SHA256::context &mac) {
+    sync(out);
+
+    memcpy(r.magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_SIZE);
+    checkpoint_tag(mac, r, r.tag);
+
+    const std::string tmp = fname + ".tmp";
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("unable to create checkpoint '" + tmp + "'");
+    }
+    try {
+        pwrite_full((const uint8_t *) &r, sizeof(checkpoint_record), 0, fd);
+        sync(fd);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), fname.c_str()) < 0) {
+        throw std::runtime_error("unable to write checkpoint '" + fname + "'");
+    }
+}
+
+/***
+ * read the checkpoint of an interrupted run and check it against the password and the input
+ * @param fname
+ * @param mode
+ * @param password
+ * @param in_st
+ * @param r
+ * @param key receives the key derived from the password
+ * @param mac
+ * @return false if there is none
+ */
+static bool load_checkpoint(const std::string &fname, uint32_t mode, const std::string &password, const struct stat &in_st,
+                            checkpoint_record &r, uint8_t *key, HMAC_SHA256::context &mac) {
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return false;
+        }
+        throw std::runtime_error("unable to open checkpoint '" + fname + "'");
+    }
+    size_t n;
+    try {
+        n = pread_full((uint8_t *) &r, sizeof(checkpoint_record), 0, fd);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    if (n < sizeof(checkpoint_record) || memcmp(r.magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_SIZE) != 0) {
+        throw std::runtime_error("invalid checkpoint '" + fname + "'");
+    }
+    if (r.mode != mode) {
+        throw std::runtime_error(mode == MODE_ENCRYPT ? "the checkpoint belongs to a decryption, resume it with -d"
+                                                      : "the checkpoint belongs to an encryption, resume it with -e");
+    }
+
+    derive_key(password, r.header, key);
+    init_mac(key, mac);
+    uint8_t tag[HMAC_SHA256::HASH_SIZE];
+    checkpoint_tag(mac, r, tag);
+    if (memcmp(tag, r.tag, HMAC_SHA256::HASH_SIZE) != 0) {
+        throw std::runtime_error("invalid password or corrupted checkpoint");
+    }
+    if (r.input_size != (uint64_t) in_st.st_size || r.input_mtime != mtime_of(in_st)) {
+        throw std::runtime_error("the input has changed since the checkpoint");
+    }
+    return true;
+}
+
+/***
+ * run the operation from the offset of the record to the end
+ * @param in
+ * @param out
+ * @param fname of the checkpoint
+ * @param r
+ * @param exp_key
+ * @param mac
+ * @param length of the plain text
+ * @param bufsize
+ * @param interval
+ */
+static void process(int in, int out, const std::string &fname, checkpoint_record &r, const uint32_t *exp_key,
+                    const HMAC_SHA256::context &mac, uint64_t length, uint64_t bufsize, uint64_t interval) {
+    // the header is in front of the cipher text only
+    const uint64_t in_offset = r.mode == MODE_ENCRYPT ? 0 : HEADER_SIZE;
+    const uint64_t out_offset = r.mode == MODE_ENCRYPT ? HEADER_SIZE : 0;
+    const uint64_t body_end = length - length % AES_BLOCK_SIZE;
+    const uint64_t tail_size = length - body_end;
+
+    PoolBuffer pool_buffer(bufsize);
+    uint8_t *buffer = pool_buffer.data();
+    uint8_t counter[AES_BLOCK_SIZE];
+    memcpy(counter, r.counter, AES_BLOCK_SIZE);
+    CHECKSUM::context ctx;
+    CHECKSUM::load_state(ctx, r.ctx);
+
+    uint64_t next = r.offset + interval;
+    while (r.offset < body_end) {
+        const uint64_t n = std::min(bufsize, body_end - r.offset);
+        if (pread_full(buffer, n, in_offset + r.offset, in) < n) {
+            throw std::runtime_error("insufficient file size");
+        }
+        if (r.mode == MODE_ENCRYPT) {
+            encrypt_blocks(ctx, buffer, n / AES_BLOCK_SIZE, exp_key, counter);
+        } else {
+            decrypt_blocks(ctx, buffer, n / AES_BLOCK_SIZE, exp_key, counter);
+        }
+        pwrite_full(buffer, n, out_offset + r.offset, out);
+        r.offset += n;
+
+        if (r.offset >= next && r.offset < body_end) {
+            memcpy(r.counter, counter, AES_BLOCK_SIZE);
+            CHECKSUM::save_state(ctx, r.ctx);
+            save_checkpoint(fname, out, r, mac);
+            next = r.offset + interval;
+        }
+    }
+
+    // the last incomplete block together with the checksum
+    uint8_t tail[AES_BLOCK_SIZE + CHECKSUM::HASH_SIZE + AES_BLOCK_SIZE];
+    if (r.mode == MODE_ENCRYPT) {
+        if (pread_full(tail, tail_size, body_end, in) < tail_size) {
+            throw std::runtime_error("insufficient file size");
+        }
+        encrypt_tail(ctx, tail, tail_size, exp_key, counter);
+        pwrite_full(tail, tail_size + CHECKSUM::HASH_SIZE, HEADER_SIZE + body_end, out);
+        unlink(fname.c_str());
+        return;
+    }
+
+    if (pread_full(tail, tail_size + CHECKSUM::HASH_SIZE, HEADER_SIZE + body_end, in) < tail_size + CHECKSUM::HASH_SIZE) {
+        throw std::runtime_error("insufficient file size");
+    }
+    decrypt_tail(ctx, tail, tail_size, exp_key, counter);
+    pwrite_full(tail, tail_size, body_end, out);
+    unlink(fname.c_str());
+
+    uint8_t checksum[CHECKSUM::HASH_SIZE];
+    CHECKSUM::final(ctx, checksum);
+    if (memcmp(checksum, tail + tail_size, CHECKSUM::HASH_SIZE) != 0) {
+        throw std::runtime_error("checksum mismatch, file may be corrupted");
+    }
+}
+
+/***
+ * open the output of a resumed run, it has to start with the header of the checkpoint
+ * (when encrypting) and is cut back to the offset of the checkpoint
+ * @param fname
+ * @param r
+ * @param size of the output at the checkpoint
+ * @return
+ */
+static int reopen_output(const std::string &fname, const checkpoint_record &r, uint64_t size) {
+    const int fd = open(fname.c_str(), O_RDWR);
+    if (fd < 0) {
+        throw std::runtime_error("unable to open output file");
+    }
+    struct stat st;
+    uint8_t header[HEADER_SIZE];
+    if (fstat(fd, &st) < 0 || (uint64_t) st.st_size < size ||
+        (r.mode == MODE_ENCRYPT && (pread_full(header, HEADER_SIZE, 0, fd) < HEADER_SIZE ||
+                                    memcmp(header, r.header, HEADER_SIZE) != 0))) {
+        close(fd);
+        throw std::runtime_error("the output does not match the checkpoint");
+    }
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        throw std::runtime_error("unable to truncate output file");
+    }
+    return fd;
+}
+
+void encrypt_checkpointed(const std::string &input_filename, const std::string &output_filename,
+                          const std::string &password, uint64_t bufsize, uint64_t interval, bool resume) {
+    const std::string fname = output_filename + CHECKPOINT_SUFFIX;
+    FileDescriptor in(input_filename, O_RDONLY);
+    struct stat in_st;
+    if (fstat(in, &in_st) < 0 || !S_ISREG(in_st.st_mode)) {
+        throw std::runtime_error("checkpoints need a regular input file");
+    }
+
+    checkpoint_record r;
+    std::array<uint8_t, KEY_BUFFER_SIZE> key = { 0 };
+    HMAC_SHA256::context mac;
+    int out;
+    if (resume && load_checkpoint(fname, MODE_ENCRYPT, password, in_st, r, key.data(), mac)) {
+        out = reopen_output(output_filename, r, HEADER_SIZE + r.offset);
+    } else {
+        memset(&r, 0, sizeof(checkpoint_record));
+        r.mode = MODE_ENCRYPT;
+        r.input_size = (uint64_t) in_st.st_size;
+        r.input_mtime = mtime_of(in_st);
+        aes_generate_iv(r.header);
+        derive_key(password, r.header, key.data());
+        init_mac(key.data(), mac);
+        unlink(fname.c_str());
+        out = open(output_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (out < 0) {
+            throw std::runtime_error("unable to open output file");
+        }
+    }
+    alignas(16) std::array<uint8_t, AES_EXP_KEY_BUFFER_SIZE> exp_key = { 0 };
+    aes_ctr_expand_key(key.data(), (uint32_t *) exp_key.data(), crypt_provider());
+
+    try {
+        if (r.offset == 0) {
+            // the hash of the key goes into the checksum in plain, into the header encrypted
+            uint8_t *key_hash = r.header + AES_BLOCK_SIZE;
+            CHECKSUM::context ctx;
+            hash_key(key.data(), key_hash);
+            CHECKSUM::init(ctx);
+            CHECKSUM::update(ctx, key_hash, SHA256::HASH_SIZE);
+            CHECKSUM::save_state(ctx, r.ctx);
+            memcpy(r.counter, r.header, AES_BLOCK_SIZE);
+            aes_ctr_enc(key_hash, key_hash, (uint32_t *) exp_key.data(), r.counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+            pwrite_full(r.header, HEADER_SIZE, 0, out);
+        }
+        process(in, out, fname, r, (uint32_t *) exp_key.data(), mac, (uint64_t) in_st.st_size, bufsize, interval);
+    } catch (...) {
+        close(out);
+        throw;
+    }
+    close(out);
+}
+
+void decrypt_checkpointed(const std::string &input_filename, const std::string &output_filename,
+                          const std::string &password, uint64_t bufsize, uint64_t interval, bool resume) {
+    const std::string fname = output_filename + CHECKPOINT_SUFFIX;
+    FileDescriptor in(input_filename, O_RDONLY);
+    struct stat in_st;
+    if (fstat(in, &in_st) < 0 || !S_ISREG(in_st.st_mode)) {
+        throw std::runtime_error("checkpoints need a regular input file");
+    }
+    if ((uint64_t) in_st.st_size < HEADER_SIZE + CHECKSUM::HASH_SIZE) {
+        throw std::runtime_error("insufficient file size");
+    }
+    const uint64_t length = (uint64_t) in_st.st_size - HEADER_SIZE - CHECKSUM::HASH_SIZE;
+
+    checkpoint_record r;
+    std::array<uint8_t, KEY_BUFFER_SIZE> key = { 0 };
+    HMAC_SHA256::context mac;
+    const bool resumed = resume && load_checkpoint(fname, MODE_DECRYPT, password, in_st, r, key.data(), mac);
+    alignas(16) std::array<uint8_t, AES_EXP_KEY_BUFFER_SIZE> exp_key = { 0 };
+
+    int out;
+    if (resumed) {
+        aes_ctr_expand_key(key.data(), (uint32_t *) exp_key.data(), crypt_provider());
+        out = reopen_output(output_filename, r, r.offset);
+    } else {
+        memset(&r, 0, sizeof(checkpoint_record));
+        r.mode = MODE_DECRYPT;
+        r.input_size = (uint64_t) in_st.st_size;
+        r.input_mtime = mtime_of(in_st);
+        pread_full(r.header, HEADER_SIZE, 0, in);
+        derive_key(password, r.header, key.data());
+        aes_ctr_expand_key(key.data(), (uint32_t *) exp_key.data(), crypt_provider());
+        init_mac(key.data(), mac);
+
+        // check if the key hashes match
+        uint8_t hash_of_key[SHA256::HASH_SIZE];
+        uint8_t key_hash[SHA256::HASH_SIZE];
+        hash_key(key.data(), hash_of_key);
+        memcpy(key_hash, r.header + AES_BLOCK_SIZE, SHA256::HASH_SIZE);
+        memcpy(r.counter, r.header, AES_BLOCK_SIZE);
+        aes_ctr_dec(key_hash, key_hash, (uint32_t *) exp_key.data(), r.counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+        if (memcmp(key_hash, hash_of_key, SHA256::HASH_SIZE) != 0) {
+            throw std::runtime_error("invalid password or compromised iv");
+        }
+
+        CHECKSUM::context ctx;
+        CHECKSUM::init(ctx);
+        CHECKSUM::update(ctx, hash_of_key, SHA256::HASH_SIZE);
+        CHECKSUM::save_state(ctx, r.ctx);
+        unlink(fname.c_str());
+        out = open(output_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (out < 0) {
+            throw std::runtime_error("unable to open output file");
+        }
+    }
+
+    try {
+        process(in, out, fname, r, (uint32_t *) exp_key.data(), mac, length, bufsize, interval);
+    } catch (...) {
+        close(out);
+        throw;
+    }
+    close(out);
+}
@@ -0,0 +1,43 @@
+#ifndef __CHECKPOINT_HPP
+#define __CHECKPOINT_HPP
+
+#include <crypt.hpp>
+#include <cstdint>
+#include <string>
+
+// the checkpoint lives next to the output file while it is being written
+#define CHECKPOINT_SUFFIX               ".acrypt-checkpoint"
+
+// plain bytes processed between two checkpoints by default
+#define DEFAULT_CHECKPOINT_INTERVAL     (UINT64_C(1) << 30)
+
+/***
+ * Encrypt a regular file into the regular format and write a checkpoint every interval
+ * bytes. Before a checkpoint is written the output is synced, the checkpoint records the
+ * header, the offset reached, the counter there and the checksum context. It is
+ * authenticated with a key derived from the password and deleted once the file is done.
+ * @param input_filename
+ * @param output_filename
+ * @param password
+ * @param bufsize multiple of AES_BLOCK_SIZE
+ * @param interval bytes between two checkpoints
+ * @param resume continue from the checkpoint of an interrupted run, if there is one,
+ * the output is the same as if the run had not been interrupted
+ */
+extern void encrypt_checkpointed(const std::string &input_filename, const std::string &output_filename,
+                                 const std::string &password, uint64_t bufsize, uint64_t interval, bool resume);
+
+/***
+ * Decrypt a file of the regular format with checkpoints, the checksum is checked at
+ * the end as usual.
+ * @param input_filename
+ * @param output_filename
+ * @param password
+ * @param bufsize multiple of AES_BLOCK_SIZE
+ * @param interval bytes between two checkpoints
+ * @param resume continue from the checkpoint of an interrupted run, if there is one
+ */
+extern void decrypt_checkpointed(const std::string &input_filename, const std::string &output_filename,
+                                 const std::string &password, uint64_t bufsize, uint64_t interval, bool resume);
+
+#endif // __CHECKPOINT_HPP
@@ -0,0 +1,953 @@
+#include <chunked.hpp>
+#include <buffer_pool.hpp>
+#include <pipe.hpp>
+#include <lz.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+static_assert(sizeof(v2_header) == 80, "v2_header must have 80 bytes");
+static_assert(sizeof(v2_entry) == 64, "v2_entry must have 64 bytes");
+static_assert(sizeof(v2_footer) == 64, "v2_footer must have 64 bytes");
+static_assert(sizeof(v2_key_slot) == 64, "v2_key_slot must have 64 bytes");
+
+// the tags cover the entry from the counter up to the tag itself, the offset is left
+// out so that chunks can be tagged before their place in the file is known
+#define V2_ENTRY_TAGGED_BEGIN   (offsetof(v2_entry, counter))
+#define V2_ENTRY_TAGGED_SIZE    (offsetof(v2_entry, tag) - V2_ENTRY_TAGGED_BEGIN)
+#define V2_FOOTER_TAGGED_SIZE   (offsetof(v2_footer, tag))
+// the generation has to be known before the rest of the footer can be decrypted
+#define V2_FOOTER_SEALED_SIZE   (offsetof(v2_footer, generation))
+#define V2_FOOTER_PLAIN_SIZE    (sizeof(v2_footer) - V2_FOOTER_SEALED_SIZE)
+
+// headers of later versions may be larger, but not arbitrarily
+#define V2_MAX_HEADER_SIZE      (4096)
+
+// the key slots follow the header, the tag of the index only covers the header itself
+// so that passwords can be added and removed without touching anything else
+#define V2_KEY_TABLE_SIZE       (V2_KEY_SLOTS * sizeof(v2_key_slot))
+
+static void counter_from(const uint8_t *iv, uint64_t block, uint8_t *counter) {
+    memcpy(counter, iv, AES_BLOCK_SIZE);
+    aes_ctr_advance(counter, block);
+}
+
+// tags and digests use keys of their own, derived from the key of the cipher
+static void init_mac(const uint8_t *key, const char *label, HMAC_SHA256::context &mac) {
+    uint8_t mac_key[SHA256::HASH_SIZE];
+    SHA256::context ctx;
+    SHA256::init(ctx);
+    SHA256::update(ctx, key, KEY_BUFFER_SIZE);
+    SHA256::update(ctx, label, strlen(label));
+    SHA256::final(ctx, mac_key);
+    HMAC_SHA256::init(mac, mac_key, SHA256::HASH_SIZE);
+}
+
+static void init_macs(const uint8_t *key, HMAC_SHA256::context &mac, HMAC_SHA256::context &digest_mac) {
+    init_mac(key, "acrypt v2 chunk tag", mac);
+    init_mac(key, "acrypt v2 chunk digest", digest_mac);
+}
+
+// the chunk number is part of the tag, chunks cannot be swapped
+static void chunk_tag(const HMAC_SHA256::context &mac, uint64_t i, const v2_entry &entry, const uint8_t *data, uint8_t *tag) {
+    HMAC_SHA256::context ctx = mac;
+    uint8_t digest[HMAC_SHA256::HASH_SIZE];
+    HMAC_SHA256::update(ctx, &i, sizeof(i));
+    HMAC_SHA256::update(ctx, (const uint8_t *) &entry + V2_ENTRY_TAGGED_BEGIN, V2_ENTRY_TAGGED_SIZE);
+    HMAC_SHA256::update(ctx, data, entry.stored_length);
+    HMAC_SHA256::final(ctx, digest);
+    memcpy(tag, digest, V2_TAG_SIZE);
+}
+
+static void index_tag(const HMAC_SHA256::context &mac, const uint8_t *header, size_t header_size,
+                      const uint8_t *index, size_t index_size, const v2_footer &footer, uint8_t *tag) {
+    HMAC_SHA256::context ctx = mac;
+    uint8_t digest[HMAC_SHA256::HASH_SIZE];
+    HMAC_SHA256::update(ctx, header, header_size);
+    HMAC_SHA256::update(ctx, index, index_size);
+    HMAC_SHA256::update(ctx, &footer, V2_FOOTER_TAGGED_SIZE);
+    HMAC_SHA256::update(ctx, &footer.generation, V2_FOOTER_PLAIN_SIZE);
+    HMAC_SHA256::final(ctx, digest);
+    memcpy(tag, digest, V2_TAG_SIZE);
+}
+
+static void plain_digest(const HMAC_SHA256::context &digest_mac, const uint8_t *data, size_t length, uint8_t *digest) {
+    HMAC_SHA256::context ctx = digest_mac;
+    uint8_t hash[HMAC_SHA256::HASH_SIZE];
+    HMAC_SHA256::update(ctx, data, length);
+    HMAC_SHA256::final(ctx, hash);
+    memcpy(digest, hash, V2_TAG_SIZE);
+}
+
+// tag the footer, encrypt index and footer of its generation, the result ends the file
+static std::vector<uint8_t> seal_index(const uint8_t *header, size_t header_size, const uint8_t *iv, const uint32_t *exp_key,
+                                       const HMAC_SHA256::context &mac, const std::vector<v2_entry> &entries, v2_footer &footer) {
+    const size_t index_size = entries.size() * sizeof(v2_entry);
+    if (index_size / AES_BLOCK_SIZE > V2_GENERATION_BLOCKS) {
+        throw std::runtime_error("too many chunks");
+    }
+    std::vector<uint8_t> sealed(index_size + sizeof(v2_footer));
+    memcpy(sealed.data(), entries.data(), index_size);
+    index_tag(mac, header, header_size, sealed.data(), index_size, footer, footer.tag);
+    memcpy(sealed.data() + index_size, &footer, sizeof(v2_footer));
+
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_from(iv, V2_INDEX_COUNTER + footer.generation * V2_GENERATION_BLOCKS, counter);
+    aes_ctr_enc(sealed.data(), sealed.data(), exp_key, counter, index_size / AES_BLOCK_SIZE);
+    counter_from(iv, V2_FOOTER_COUNTER + footer.generation * (V2_FOOTER_SEALED_SIZE / AES_BLOCK_SIZE), counter);
+    aes_ctr_enc(sealed.data() + index_size, sealed.data() + index_size, exp_key, counter, V2_FOOTER_SEALED_SIZE / AES_BLOCK_SIZE);
+    return sealed;
+}
+
+// compare without an early exit, the time taken tells nothing about the tag
+static bool tags_equal(const uint8_t *a, const uint8_t *b) {
+    uint8_t diff = 0;
+    for (int i = 0; i < V2_TAG_SIZE; ++i) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+static bool slot_used(const v2_key_slot &slot) {
+    const uint8_t *p = (const uint8_t *) &slot;
+    return std::any_of(p, p + sizeof(v2_key_slot), [](uint8_t b) {
+        return b != 0;
+    });
+}
+
+// the key derived from the password and the salt of the slot wraps the key of the file
+// and keys the tag of the slot
+static void slot_keys(const std::string &password, const uint8_t *salt, uint32_t *exp_key, HMAC_SHA256::context &mac) {
+    uint8_t key[KEY_BUFFER_SIZE];
+    derive_key(password, salt, key);
+    aes_ctr_expand_key(key, exp_key, crypt_provider());
+    init_mac(key, "acrypt v2 key slot", mac);
+}
+
+static void slot_tag(const HMAC_SHA256::context &mac, const v2_key_slot &slot, uint8_t *tag) {
+    HMAC_SHA256::context ctx = mac;
+    uint8_t digest[HMAC_SHA256::HASH_SIZE];
+    HMAC_SHA256::update(ctx, &slot, offsetof(v2_key_slot, tag));
+    HMAC_SHA256::final(ctx, digest);
+    memcpy(tag, digest, V2_TAG_SIZE);
+}
+
+static void wrap_key(const std::string &password, const uint8_t *key, v2_key_slot &slot) {
+    alignas(16) uint8_t exp_key[AES_EXP_KEY_BUFFER_SIZE];
+    HMAC_SHA256::context mac;
+    uint8_t counter[AES_BLOCK_SIZE];
+    aes_generate_iv(slot.salt);
+    slot_keys(password, slot.salt, (uint32_t *) exp_key, mac);
+    memcpy(counter, slot.salt, AES_BLOCK_SIZE);
+    aes_ctr_enc(key, slot.wrapped_key, (const uint32_t *) exp_key, counter, KEY_BUFFER_SIZE / AES_BLOCK_SIZE);
+    slot_tag(mac, slot, slot.tag);
+}
+
+/***
+ * find the slot the password opens, every used slot costs a key derivation
+ * @param password
+ * @param slots V2_KEY_SLOTS slots
+ * @param key receives the key of the file
+ * @return index of the slot, -1 if there is none
+ */
+static int unwrap_key(const std::string &password, const v2_key_slot *slots, uint8_t *key) {
+    for (int i = 0; i < V2_KEY_SLOTS; ++i) {
+        if (!slot_used(slots[i])) {
+            continue;
+        }
+        alignas(16) uint8_t exp_key[AES_EXP_KEY_BUFFER_SIZE];
+        HMAC_SHA256::context mac;
+        uint8_t tag[V2_TAG_SIZE];
+        slot_keys(password, slots[i].salt, (uint32_t *) exp_key, mac);
+        slot_tag(mac, slots[i], tag);
+        if (tags_equal(tag, slots[i].tag)) {
+            uint8_t counter[AES_BLOCK_SIZE];
+            memcpy(counter, slots[i].salt, AES_BLOCK_SIZE);
+            aes_ctr_dec(slots[i].wrapped_key, key, (const uint32_t *) exp_key, counter, KEY_BUFFER_SIZE / AES_BLOCK_SIZE);
+            return i;
+        }
+    }
+    return -1;
+}
+
+// check the key against the encrypted hash in the header
+static bool key_matches(const v2_header &header, const uint8_t *key, const uint32_t *exp_key) {
+    uint8_t hash_of_key[SHA256::HASH_SIZE];
+    uint8_t key_hash[SHA256::HASH_SIZE];
+    uint8_t counter[AES_BLOCK_SIZE];
+    hash_key(key, hash_of_key);
+    counter_from(header.iv, 0, counter);
+    aes_ctr_dec(header.key_hash, key_hash, exp_key, counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+    return memcmp(key_hash, hash_of_key, SHA256::HASH_SIZE) == 0;
+}
+
+/***
+ * Key slots of a file with a wrapped key, read with one of its passwords. The slots
+ * are written back in place, nothing else of the file is touched.
+ */
+class KeySlots {
+public:
+
+    KeySlots(const std::string &fname, const std::string &password) : _fd(fname, O_RDWR) {
+        if (pread_full((uint8_t *) &_header, sizeof(v2_header), 0, _fd) < sizeof(v2_header) ||
+            memcmp(_header.magic, V2_MAGIC, V2_MAGIC_SIZE) != 0) {
+            throw std::runtime_error("not a file of the chunked format");
+        }
+        if ((_header.flags & V2_FLAG_WRAPPED) == 0) {
+            throw std::runtime_error("the key of the file is not wrapped, encrypt it with --wrap");
+        }
+        if (_header.header_size < sizeof(v2_header) + V2_KEY_TABLE_SIZE ||
+            pread_full((uint8_t *) _slots, V2_KEY_TABLE_SIZE, sizeof(v2_header), _fd) < V2_KEY_TABLE_SIZE) {
+            throw std::runtime_error("insufficient file size");
+        }
+
+        uint8_t key[KEY_BUFFER_SIZE];
+        alignas(16) uint8_t exp_key[AES_EXP_KEY_BUFFER_SIZE];
+        _slot = unwrap_key(password, _slots, key);
+        if (_slot >= 0) {
+            aes_ctr_expand_key(key, (uint32_t *) exp_key, crypt_provider());
+        }
+        if (_slot < 0 || !key_matches(_header, key, (const uint32_t *) exp_key)) {
+            throw std::runtime_error("invalid password or compromised iv");
+        }
+        memcpy(_key, key, KEY_BUFFER_SIZE);
+    }
+
+    KeySlots(const KeySlots &) = delete;
+
+    KeySlots &operator=(const KeySlots &) = delete;
+
+    /***
+     * wrap the key with the password into the slot
+     * @param slot
+     * @param password
+     */
+    void wrap(int slot, const std::string &password) {
+        uint8_t key[KEY_BUFFER_SIZE];
+        if (unwrap_key(password, _slots, key) >= 0) {
+            throw std::runtime_error("the new password opens the file already");
+        }
+        wrap_key(password, _key, _slots[slot]);
+    }
+
+    void clear(int slot) {
+        memset(&_slots[slot], 0, sizeof(v2_key_slot));
+    }
+
+    // the slot the password opens
+    int slot() const {
+        return _slot;
+    }
+
+    int free_slot() const {
+        for (int i = 0; i < V2_KEY_SLOTS; ++i) {
+            if (!slot_used(_slots[i])) {
+                return i;
+            }
+        }
+        throw std::runtime_error("all " + std::to_string(V2_KEY_SLOTS) + " key slots are in use");
+    }
+
+    int used_slots() const {
+        return (int) std::count_if(_slots, _slots + V2_KEY_SLOTS, slot_used);
+    }
+
+    void write() {
+        pwrite_full((const uint8_t *) _slots, V2_KEY_TABLE_SIZE, sizeof(v2_header), _fd);
+        if (fdatasync(_fd) < 0) {
+            throw std::runtime_error("unable to sync file");
+        }
+    }
+
+private:
+
+    FileDescriptor _fd;
+    v2_header _header;
+    v2_key_slot _slots[V2_KEY_SLOTS];
+    uint8_t _key[KEY_BUFFER_SIZE];
+    int _slot;
+
+};
+
+void chunked_add_key(const std::string &fname, const std::string &password, const std::string &new_password) {
+    KeySlots slots(fname, password);
+    slots.wrap(slots.free_slot(), new_password);
+    slots.write();
+}
+
+void chunked_change_key(const std::string &fname, const std::string &password, const std::string &new_password) {
+    KeySlots slots(fname, password);
+    slots.wrap(slots.slot(), new_password);
+    slots.write();
+}
+
+void chunked_remove_key(const std::string &fname, const std::string &password) {
+    KeySlots slots(fname, password);
+    if (slots.used_slots() == 1) {
+        throw std::runtime_error("the last password of a file cannot be removed");
+    }
+    slots.clear(slots.slot());
+    slots.write();
+}
+
+bool is_chunked(const std::string &fname) {
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    char magic[V2_MAGIC_SIZE];
+    const bool chunked = pread_full((uint8_t *) magic, V2_MAGIC_SIZE, 0, fd) == V2_MAGIC_SIZE &&
+                         memcmp(magic, V2_MAGIC, V2_MAGIC_SIZE) == 0;
+    close(fd);
+    return chunked;
+}
+
+/***
+ * Reads the plain text chunk by chunk. Regular files are read with pread, chunks
+ * that lie within a hole of them (see lseek(2), SEEK_DATA and SEEK_HOLE) are not
+ * read at all. Anything else is read sequentially.
+ */
+class ChunkSource {
+public:
+
+    ChunkSource(int fd, uint64_t chunk_size) : _fd(fd), _chunk_size(chunk_size) {
+        struct stat st;
+        const off_t pos = lseek(fd, 0, SEEK_CUR);
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && pos >= 0) {
+            _seekable = true;
+            _pos = (uint64_t) pos;
+            _size = std::max<uint64_t>((uint64_t) st.st_size, _pos);
+            _hole = _pos;
+        }
+    }
+
+    /***
+     * @param buffer receives the plain bytes, unless they are a hole
+     * @param hole set if the chunk lies within a hole and was not read
+     * @return bytes of the chunk, less than the chunk size at the end
+     */
+    size_t next(uint8_t *buffer, bool &hole) {
+        hole = false;
+        if (!_seekable) {
+            return read_full(_fd, buffer, _chunk_size);
+        }
+
+        const size_t n = (size_t) std::min(_chunk_size, _size - _pos);
+        if (_pos >= _hole) {
+            // past the hole found last, look for the next data and the hole behind it
+            const off_t data = lseek(_fd, (off_t) _pos, SEEK_DATA);
+            _data = data < 0 ? _size : (uint64_t) data;
+            const off_t next_hole = lseek(_fd, (off_t) _data, SEEK_HOLE);
+            _hole = next_hole < 0 ? _size : (uint64_t) next_hole;
+        }
+        if (n > 0 && _pos + n <= _data) {
+            hole = true;
+        } else if (pread_full(buffer, n, _pos, _fd) < n) {
+            throw std::runtime_error("unable to read from file");
+        }
+        _pos += n;
+        return n;
+    }
+
+private:
+
+    const int _fd;
+    const uint64_t _chunk_size;
+    bool _seekable = false;
+    uint64_t _pos = 0;
+    uint64_t _size = 0;
+    uint64_t _data = 0;                 // first byte of data at or behind _pos
+    uint64_t _hole = 0;                 // first byte of the hole behind _data
+};
+
+/***
+ * a chunk on its way through the encoder
+ */
+struct encode_slot {
+    std::vector<uint8_t> plain;
+    std::vector<uint8_t> packed;
+    size_t length = 0;
+    bool hole = false;
+    uint8_t digest[V2_TAG_SIZE];
+    const uint8_t *stored = nullptr;
+    v2_entry entry;
+
+    explicit encode_slot(uint64_t chunk_size) : plain(chunk_size + AES_BLOCK_SIZE), packed(chunk_size + AES_BLOCK_SIZE) {}
+};
+
+// compress if it pays off, encrypt and tag a chunk whose digest is known
+static void encode_chunk(encode_slot &slot, uint64_t i, uint64_t counter_offset, const v2_header &header,
+                         const uint32_t *exp_key, const HMAC_SHA256::context &mac, bool compress) {
+    v2_entry &entry = slot.entry;
+    memset(&entry, 0, sizeof(v2_entry));
+    entry.counter = counter_offset;
+    entry.length = (uint32_t) slot.length;
+    if (slot.hole) {
+        // nothing to store, only the length is tagged
+        entry.counter = 0;
+        entry.flags = V2_CHUNK_HOLE;
+        chunk_tag(mac, i, entry, nullptr, entry.tag);
+        slot.stored = nullptr;
+        return;
+    }
+    memcpy(entry.digest, slot.digest, V2_TAG_SIZE);
+
+    uint8_t *data = slot.plain.data();
+    size_t stored = slot.length;
+    if (compress && lz_entropy(data, slot.length) < LZ_ENTROPY_LIMIT) {
+        // at least a sixteenth has to go, otherwise the chunk is stored as it is
+        const size_t n = lz_compress(data, slot.length, slot.packed.data(), slot.length - slot.length / 16);
+        if (n > 0) {
+            data = slot.packed.data();
+            stored = n;
+            entry.flags |= V2_CHUNK_COMPRESSED;
+        }
+    }
+    entry.stored_length = (uint32_t) stored;
+
+    // the last block is padded, the padding is not written
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_from(header.iv, entry.counter, counter);
+    aes_ctr_enc(data, data, exp_key, counter, (stored + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+    chunk_tag(mac, i, entry, data, entry.tag);
+    slot.stored = data;
+}
+
+void chunked_encrypt(int in, int out, const std::string &password, uint64_t chunk_size, bool compress, bool wrap,
+                     ThreadPool &pool) {
+    chunk_size = (chunk_size + AES_BLOCK_SIZE - 1) & ~((uint64_t) AES_BLOCK_SIZE - 1);
+    if (chunk_size == 0 || chunk_size > V2_MAX_CHUNK_SIZE) {
+        throw std::runtime_error("invalid chunk size");
+    }
+
+    v2_header header;
+    memset(&header, 0, sizeof(v2_header));
+    memcpy(header.magic, V2_MAGIC, V2_MAGIC_SIZE);
+    header.header_size = sizeof(v2_header) + (wrap ? V2_KEY_TABLE_SIZE : 0);
+    header.entry_size = sizeof(v2_entry);
+    header.chunk_size = chunk_size;
+    header.flags = (compress ? V2_FLAG_COMPRESSED : 0) | (wrap ? V2_FLAG_WRAPPED : 0);
+    aes_generate_iv(header.iv);
+
+    uint8_t key[KEY_BUFFER_SIZE];
+    alignas(16) uint8_t exp_key[AES_EXP_KEY_BUFFER_SIZE];
+    uint8_t counter[AES_BLOCK_SIZE];
+    v2_key_slot key_slots[V2_KEY_SLOTS];
+    if (wrap) {
+        // a random key, the password only unlocks it
+        for (uint64_t i = 0; i < KEY_BUFFER_SIZE; i += AES_BLOCK_SIZE) {
+            aes_generate_iv(key + i);
+        }
+        memset(key_slots, 0, V2_KEY_TABLE_SIZE);
+        wrap_key(password, key, key_slots[0]);
+    } else {
+        derive_key(password, header.iv, key);
+    }
+    aes_ctr_expand_key(key, (uint32_t *) exp_key, crypt_provider());
+    hash_key(key, header.key_hash);
+    counter_from(header.iv, 0, counter);
+    aes_ctr_enc(header.key_hash, header.key_hash, (uint32_t *) exp_key, counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+    HMAC_SHA256::context mac;
+    HMAC_SHA256::context digest_mac;
+    init_macs(key, mac, digest_mac);
+    write_full(out, (const uint8_t *) &header, sizeof(v2_header));
+    if (wrap) {
+        write_full(out, (const uint8_t *) key_slots, V2_KEY_TABLE_SIZE);
+    }
+
+    // chunks are read in order and handed to the workers right away, once a round
+    // of them is done they are written in order
+    std::vector<std::unique_ptr<encode_slot>> slots;
+    for (size_t i = 0; i < pool.size() + 1; ++i) {
+        slots.emplace_back(new encode_slot(chunk_size));
+    }
+    ChunkSource source(in, chunk_size);
+    std::vector<v2_entry> entries;
+    uint64_t offset = header.header_size;
+    uint64_t length = 0;
+    bool end = false;
+    while (!end) {
+        size_t count = 0;
+        while (count < slots.size() && !end) {
+            encode_slot *slot = slots[count].get();
+            slot->length = source.next(slot->plain.data(), slot->hole);
+            end = slot->length < chunk_size;
+            if (slot->length == 0) {
+                break;
+            }
+            const uint64_t i = entries.size() + count;
+            pool.submit([slot, i, &header, &exp_key, &mac, &digest_mac, compress]() {
+                if (!slot->hole) {
+                    plain_digest(digest_mac, slot->plain.data(), slot->length, slot->digest);
+                }
+                encode_chunk(*slot, i, V2_CHUNK_COUNTER + i * (header.chunk_size / AES_BLOCK_SIZE), header,
+                             (const uint32_t *) exp_key, mac, compress);
+            });
+            ++count;
+        }
+        pool.wait();
+
+        for (size_t k = 0; k < count; ++k) {
+            encode_slot &slot = *slots[k];
+            if (!slot.hole) {
+                slot.entry.offset = offset;
+                write_full(out, slot.stored, slot.entry.stored_length);
+                offset += slot.entry.stored_length;
+            }
+            entries.push_back(slot.entry);
+            length += slot.length;
+        }
+    }
+
+    v2_footer footer;
+    memset(&footer, 0, sizeof(v2_footer));
+    footer.index_offset = offset;
+    footer.num_entries = entries.size();
+    footer.length = length;
+    footer.next_counter = V2_CHUNK_COUNTER + entries.size() * (chunk_size / AES_BLOCK_SIZE);
+    const std::vector<uint8_t> sealed = seal_index((const uint8_t *) &header, sizeof(v2_header), header.iv,
+                                                   (const uint32_t *) exp_key, mac, entries, footer);
+    write_full(out, sealed.data(), sealed.size());
+}
+
+// an update journals the size of the file before it, everything behind is dropped
+// if the update does not complete
+#define V2_UPDATE_MAGIC         "ACRYPTU2"
+
+struct v2_update_journal {
+    char magic[V2_MAGIC_SIZE];
+    uint64_t size;
+};
+
+static void write_update_journal(const std::string &fname, uint64_t size) {
+    v2_update_journal journal;
+    memcpy(journal.magic, V2_UPDATE_MAGIC, V2_MAGIC_SIZE);
+    journal.size = size;
+    const int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("unable to create journal '" + fname + "'");
+    }
+    try {
+        pwrite_full((const uint8_t *) &journal, sizeof(journal), 0, fd);
+        if (fdatasync(fd) < 0) {
+            throw std::runtime_error("unable to sync journal '" + fname + "'");
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+// 0 if there is no journal or it has been torn
+static uint64_t read_update_journal(const std::string &fname) {
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    v2_update_journal journal;
+    const bool complete = pread_full((uint8_t *) &journal, sizeof(journal), 0, fd) == sizeof(journal) &&
+                          memcmp(journal.magic, V2_UPDATE_MAGIC, V2_MAGIC_SIZE) == 0;
+    close(fd);
+    return complete ? journal.size : 0;
+}
+
+ChunkedFile::ChunkedFile(const std::string &fname, const std::string &password, bool writable) : _fname(fname) {
+    _fd = open(fname.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (_fd < 0) {
+        throw std::runtime_error("unable to open file '" + fname + "'");
+    }
+
+    try {
+        struct stat st;
+        if (fstat(_fd, &st) < 0) {
+            throw std::runtime_error("unable to stat file");
+        }
+        const uint64_t file_size = (uint64_t) st.st_size;
+        if (file_size < sizeof(v2_header) + sizeof(v2_footer) ||
+            pread_full((uint8_t *) &_header, sizeof(v2_header), 0, _fd) < sizeof(v2_header) ||
+            memcmp(_header.magic, V2_MAGIC, V2_MAGIC_SIZE) != 0) {
+            throw std::runtime_error("not a file of the chunked format");
+        }
+        if (_header.header_size < sizeof(v2_header) || _header.header_size > V2_MAX_HEADER_SIZE ||
+            _header.entry_size < sizeof(v2_entry) || _header.entry_size % AES_BLOCK_SIZE != 0 ||
+            _header.chunk_size == 0 || _header.chunk_size % AES_BLOCK_SIZE != 0 ||
+            _header.chunk_size > V2_MAX_CHUNK_SIZE || (_header.flags & ~(uint64_t) (V2_FLAG_COMPRESSED | V2_FLAG_WRAPPED)) != 0 ||
+            ((_header.flags & V2_FLAG_WRAPPED) != 0 && _header.header_size < sizeof(v2_header) + V2_KEY_TABLE_SIZE)) {
+            throw std::runtime_error("unsupported variant of the chunked format");
+        }
+        std::vector<uint8_t> header(_header.header_size);
+        if (pread_full(header.data(), header.size(), 0, _fd) < header.size()) {
+            throw std::runtime_error("insufficient file size");
+        }
+
+        // the key is either derived from the password or wrapped in one of the slots, the
+        // tag of the index covers the header up to the slots
+        const bool wrapped = (_header.flags & V2_FLAG_WRAPPED) != 0;
+        const size_t tagged_header_size = wrapped ? sizeof(v2_header) : header.size();
+        uint8_t key[KEY_BUFFER_SIZE];
+        if (wrapped) {
+            if (unwrap_key(password, (const v2_key_slot *) (header.data() + sizeof(v2_header)), key) < 0) {
+                throw std::runtime_error("invalid password or compromised iv");
+            }
+        } else {
+            derive_key(password, _header.iv, key);
+        }
+        aes_ctr_expand_key(key, (uint32_t *) _exp_key, crypt_provider());
+        // check if the key hashes match
+        if (!key_matches(_header, key, (const uint32_t *) _exp_key)) {
+            throw std::runtime_error("invalid password or compromised iv");
+        }
+        init_macs(key, _mac, _digest_mac);
+
+        // an update that did not complete has left the size the file had before in its
+        // journal, index and footer of the previous generation end the file there
+        const std::string journal = fname + V2_UPDATE_SUFFIX;
+        const uint64_t old_size = read_update_journal(journal);
+        _size = file_size;
+        try {
+            load_index(header, tagged_header_size);
+        } catch (const std::runtime_error &) {
+            if (old_size < sizeof(v2_header) + sizeof(v2_footer) || old_size >= file_size) {
+                throw;
+            }
+            _size = old_size;
+            load_index(header, tagged_header_size);
+            if (writable && ftruncate(_fd, (off_t) _size) < 0) {
+                throw std::runtime_error("unable to truncate file");
+            }
+        }
+        if (writable && old_size > 0) {
+            unlink(journal.c_str());
+        }
+    } catch (...) {
+        close(_fd);
+        throw;
+    }
+}
+
+void ChunkedFile::load_index(const std::vector<uint8_t> &header, size_t tagged_header_size) {
+    uint8_t counter[AES_BLOCK_SIZE];
+    // the generation in the plain part of the footer selects the counters of index and footer
+    pread_full((uint8_t *) &_footer, sizeof(v2_footer), _size - sizeof(v2_footer), _fd);
+    if (_footer.generation > V2_MAX_GENERATION || _footer.reserved != 0) {
+        throw std::runtime_error("index is corrupted");
+    }
+    counter_from(_header.iv, V2_FOOTER_COUNTER + _footer.generation * (V2_FOOTER_SEALED_SIZE / AES_BLOCK_SIZE), counter);
+    aes_ctr_dec((uint8_t *) &_footer, (uint8_t *) &_footer, (const uint32_t *) _exp_key, counter, V2_FOOTER_SEALED_SIZE / AES_BLOCK_SIZE);
+
+    const uint64_t index_end = _size - sizeof(v2_footer);
+    if (_footer.index_offset < _header.header_size || _footer.index_offset > index_end ||
+        _footer.num_entries != (index_end - _footer.index_offset) / _header.entry_size ||
+        (index_end - _footer.index_offset) % _header.entry_size != 0 ||
+        (index_end - _footer.index_offset) / AES_BLOCK_SIZE > V2_GENERATION_BLOCKS ||
+        _footer.next_counter < V2_CHUNK_COUNTER || _footer.next_counter > V2_INDEX_COUNTER) {
+        throw std::runtime_error("index is corrupted");
+    }
+
+    const size_t index_size = index_end - _footer.index_offset;
+    std::vector<uint8_t> index(index_size);
+    if (pread_full(index.data(), index_size, _footer.index_offset, _fd) < index_size) {
+        throw std::runtime_error("insufficient file size");
+    }
+    counter_from(_header.iv, V2_INDEX_COUNTER + _footer.generation * V2_GENERATION_BLOCKS, counter);
+    aes_ctr_dec(index.data(), index.data(), (const uint32_t *) _exp_key, counter, index_size / AES_BLOCK_SIZE);
+    uint8_t tag[V2_TAG_SIZE];
+    index_tag(_mac, header.data(), tagged_header_size, index.data(), index_size, _footer, tag);
+    if (!tags_equal(tag, _footer.tag)) {
+        throw std::runtime_error("authentication of the index failed, file may be corrupted");
+    }
+
+    // entries of later versions may be larger, the known part comes first,
+    // chunks are only compressed if the header says so
+    const uint32_t chunk_flags = (_header.flags & V2_FLAG_COMPRESSED) != 0 ? V2_CHUNK_COMPRESSED : 0;
+    const uint64_t chunk_blocks = _header.chunk_size / AES_BLOCK_SIZE;
+    _entries.resize(_footer.num_entries);
+    uint64_t length = 0;
+    for (uint64_t i = 0; i < _footer.num_entries; ++i) {
+        v2_entry &entry = _entries[i];
+        memcpy(&entry, index.data() + i * _header.entry_size, sizeof(v2_entry));
+        // holes are neither stored nor encrypted
+        const bool stored = entry.flags == V2_CHUNK_HOLE ?
+                            entry.offset == 0 && entry.counter == 0 && entry.stored_length == 0 :
+                            entry.offset >= _header.header_size && entry.offset + entry.stored_length <= _footer.index_offset &&
+                            (entry.flags & ~chunk_flags) == 0 &&
+                            ((entry.flags & V2_CHUNK_COMPRESSED) != 0 ? entry.stored_length <= entry.length : entry.stored_length == entry.length) &&
+                            entry.counter >= V2_CHUNK_COUNTER && entry.counter <= _footer.next_counter &&
+                            _footer.next_counter - entry.counter >= chunk_blocks;
+        if (!stored || entry.length > _header.chunk_size || (i + 1 < _footer.num_entries && entry.length != _header.chunk_size)) {
+            throw std::runtime_error("index is corrupted");
+        }
+        length += entry.length;
+    }
+    if (length != _footer.length) {
+        throw std::runtime_error("index is corrupted");
+    }
+}
+
+ChunkedFile::~ChunkedFile() {
+    close(_fd);
+}
+
+void ChunkedFile::verify_chunk(uint64_t i, uint8_t *buffer) const {
+    const v2_entry &entry = _entries[i];
+    if (pread_full(buffer, entry.stored_length, entry.offset, _fd) < entry.stored_length) {
+        throw std::runtime_error("insufficient file size");
+    }
+    uint8_t tag[V2_TAG_SIZE];
+    chunk_tag(_mac, i, entry, buffer, tag);
+    if (!tags_equal(tag, entry.tag)) {
+        throw std::runtime_error("authentication of chunk " + std::to_string(i) + " failed, file may be corrupted");
+    }
+}
+
+size_t ChunkedFile::read_chunk(uint64_t i, uint8_t *buffer) const {
+    const v2_entry &entry = _entries[i];
+    if (entry.flags == V2_CHUNK_HOLE) {
+        verify_chunk(i, buffer);
+        memset(buffer, 0, entry.length);
+        return entry.length;
+    }
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_from(_header.iv, entry.counter, counter);
+    if ((entry.flags & V2_CHUNK_COMPRESSED) == 0) {
+        verify_chunk(i, buffer);
+        aes_ctr_dec(buffer, buffer, (const uint32_t *) _exp_key, counter, (entry.length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+        return entry.length;
+    }
+
+    // compressed chunks are decrypted into a buffer of the thread and unpacked from there
+    static thread_local std::vector<uint8_t> packed;
+    packed.resize(std::max<size_t>(packed.size(), chunk_size() + AES_BLOCK_SIZE));
+    verify_chunk(i, packed.data());
+    aes_ctr_dec(packed.data(), packed.data(), (const uint32_t *) _exp_key, counter, (entry.stored_length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+    if (lz_decompress(packed.data(), entry.stored_length, buffer, entry.length) != entry.length) {
+        throw std::runtime_error("chunk " + std::to_string(i) + " is corrupted");
+    }
+    return entry.length;
+}
+
+void ChunkedFile::decrypt(int out) const {
+    // holes are skipped over in regular files, so that they are holes again
+    struct stat st;
+    const bool sparse = fstat(out, &st) == 0 && S_ISREG(st.st_mode);
+    PoolBuffer pool_buffer(chunk_size() + AES_BLOCK_SIZE);
+    uint8_t *buffer = pool_buffer.data();
+    bool skipped = false;
+    for (uint64_t i = 0; i < num_chunks(); ++i) {
+        const size_t n = read_chunk(i, buffer);
+        skipped = sparse && _entries[i].flags == V2_CHUNK_HOLE;
+        if (skipped) {
+            if (lseek(out, (off_t) n, SEEK_CUR) < 0) {
+                throw std::runtime_error("unable to seek in output file");
+            }
+        } else {
+            write_full(out, buffer, n);
+        }
+    }
+    // a hole at the end needs the size set
+    const off_t end = lseek(out, 0, SEEK_CUR);
+    if (skipped && (end < 0 || ftruncate(out, end) < 0)) {
+        throw std::runtime_error("unable to truncate output file");
+    }
+}
+
+uint64_t ChunkedFile::update(int in, ThreadPool &pool) {
+    // later versions may carry more than this one knows how to rewrite
+    const uint64_t header_size = sizeof(v2_header) + ((_header.flags & V2_FLAG_WRAPPED) != 0 ? V2_KEY_TABLE_SIZE : 0);
+    if (_header.header_size != header_size || _header.entry_size != sizeof(v2_entry)) {
+        throw std::runtime_error("unsupported variant of the chunked format");
+    }
+    if (_footer.generation == V2_MAX_GENERATION) {
+        throw std::runtime_error("the file has been updated too often, encrypt it anew");
+    }
+    const bool compress = (_header.flags & V2_FLAG_COMPRESSED) != 0;
+    const uint64_t chunk_blocks = chunk_size() / AES_BLOCK_SIZE;
+
+    // every round of chunks is hashed first, the changed ones get fresh counters in
+    // order and are encoded in a second pass, then written
+    std::vector<std::unique_ptr<encode_slot>> slots;
+    std::vector<bool> changed(pool.size() + 1);
+    for (size_t i = 0; i < pool.size() + 1; ++i) {
+        slots.emplace_back(new encode_slot(chunk_size()));
+    }
+    // nothing the current index refers to is overwritten, changed chunks go into the gaps
+    // it leaves between its chunks or behind the end of the file
+    std::vector<v2_entry> live;
+    for (const v2_entry &entry : _entries) {
+        if ((entry.flags & V2_CHUNK_HOLE) == 0) {
+            live.push_back(entry);
+        }
+    }
+    std::sort(live.begin(), live.end(), [](const v2_entry &a, const v2_entry &b) {
+        return a.offset < b.offset;
+    });
+    std::vector<std::pair<uint64_t, uint64_t>> gaps;
+    uint64_t gap_begin = header_size;
+    for (const v2_entry &entry : live) {
+        if (entry.offset > gap_begin) {
+            gaps.emplace_back(gap_begin, entry.offset);
+        }
+        gap_begin = std::max(gap_begin, entry.offset + entry.stored_length);
+    }
+    if (_footer.index_offset > gap_begin) {
+        gaps.emplace_back(gap_begin, _footer.index_offset);
+    }
+    // the size before is journaled first, an update that does not complete is cut off
+    // there when the file is opened again
+    const std::string journal = _fname + V2_UPDATE_SUFFIX;
+    write_update_journal(journal, _size);
+
+    ChunkSource source(in, chunk_size());
+    std::vector<v2_entry> entries;
+    uint64_t next_counter = _footer.next_counter;
+    uint64_t append_offset = _size;
+    uint64_t length = 0;
+    uint64_t num_written = 0;
+    bool end = false;
+    while (!end) {
+        size_t count = 0;
+        while (count < slots.size() && !end) {
+            encode_slot *slot = slots[count].get();
+            slot->length = source.next(slot->plain.data(), slot->hole);
+            end = slot->length < chunk_size();
+            if (slot->length == 0) {
+                break;
+            }
+            if (!slot->hole) {
+                pool.submit([this, slot]() {
+                    plain_digest(_digest_mac, slot->plain.data(), slot->length, slot->digest);
+                });
+            }
+            ++count;
+        }
+        pool.wait();
+
+        for (size_t k = 0; k < count; ++k) {
+            encode_slot *slot = slots[k].get();
+            const uint64_t i = entries.size() + k;
+            // holes only match holes, they have no digest
+            changed[k] = i >= num_chunks() || _entries[i].length != slot->length ||
+                         (_entries[i].flags & V2_CHUNK_HOLE) != (slot->hole ? V2_CHUNK_HOLE : 0) ||
+                         (!slot->hole && memcmp(_entries[i].digest, slot->digest, V2_TAG_SIZE) != 0);
+            if (!changed[k]) {
+                continue;
+            } else if (slot->hole) {
+                encode_chunk(*slot, i, 0, _header, (const uint32_t *) _exp_key, _mac, compress);
+                continue;
+            }
+            if (next_counter > V2_INDEX_COUNTER - chunk_blocks) {
+                throw std::runtime_error("counters of the file are used up, encrypt it anew");
+            }
+            const uint64_t counter = next_counter;
+            next_counter += chunk_blocks;
+            pool.submit([this, slot, i, counter, compress]() {
+                encode_chunk(*slot, i, counter, _header, (const uint32_t *) _exp_key, _mac, compress);
+            });
+        }
+        pool.wait();
+
+        for (size_t k = 0; k < count; ++k) {
+            encode_slot &slot = *slots[k];
+            const uint64_t i = entries.size();
+            if (changed[k] && slot.hole) {
+                entries.push_back(slot.entry);
+                ++num_written;
+            } else if (changed[k]) {
+                // the first gap the chunk fits into
+                const uint64_t stored_length = slot.entry.stored_length;
+                auto gap = std::find_if(gaps.begin(), gaps.end(), [stored_length](const std::pair<uint64_t, uint64_t> &g) {
+                    return g.second - g.first >= stored_length;
+                });
+                if (gap != gaps.end()) {
+                    slot.entry.offset = gap->first;
+                    gap->first += stored_length;
+                } else {
+                    slot.entry.offset = append_offset;
+                    append_offset += stored_length;
+                }
+                pwrite_full(slot.stored, slot.entry.stored_length, slot.entry.offset, _fd);
+                entries.push_back(slot.entry);
+                ++num_written;
+            } else {
+                entries.push_back(_entries[i]);
+            }
+            length += slot.length;
+        }
+    }
+
+    // index and footer of the next generation follow everything written, once they are
+    // on disk the update is complete
+    v2_footer footer;
+    memset(&footer, 0, sizeof(v2_footer));
+    footer.index_offset = append_offset;
+    footer.num_entries = entries.size();
+    footer.length = length;
+    footer.next_counter = next_counter;
+    footer.generation = _footer.generation + 1;
+    std::vector<uint8_t> sealed = seal_index((const uint8_t *) &_header, sizeof(v2_header), _header.iv,
+                                             (const uint32_t *) _exp_key, _mac, entries, footer);
+    pwrite_full(sealed.data(), sealed.size(), footer.index_offset, _fd);
+    if (fdatasync(_fd) < 0) {
+        throw std::runtime_error("unable to sync file");
+    }
+    unlink(journal.c_str());
+    uint64_t size = footer.index_offset + sealed.size();
+
+    // The space behind the last chunk still in use is given back: index and footer are
+    // written there once more, with the counters of yet another generation, and the file
+    // is cut behind them. Until then the copy at the end is the valid one.
+    uint64_t chunks_end = header_size;
+    for (const v2_entry &entry : entries) {
+        if ((entry.flags & V2_CHUNK_HOLE) == 0) {
+            chunks_end = std::max(chunks_end, entry.offset + entry.stored_length);
+        }
+    }
+    if (chunks_end + sealed.size() <= footer.index_offset && footer.generation < V2_MAX_GENERATION) {
+        footer.index_offset = chunks_end;
+        ++footer.generation;
+        sealed = seal_index((const uint8_t *) &_header, sizeof(v2_header), _header.iv,
+                            (const uint32_t *) _exp_key, _mac, entries, footer);
+        pwrite_full(sealed.data(), sealed.size(), footer.index_offset, _fd);
+        if (fdatasync(_fd) < 0) {
+            throw std::runtime_error("unable to sync file");
+        }
+        size = footer.index_offset + sealed.size();
+        if (ftruncate(_fd, (off_t) size) < 0) {
+            throw std::runtime_error("unable to truncate file");
+        }
+    }
+
+    // Chunks are never moved, so a chunk rewritten in the middle of the file leaves its
+    // old range behind the index no longer refers to, as does the index before. Those
+    // ranges are punched out, the file keeps its size but not their blocks, and the next
+    // update fills them first. File systems that cannot punch holes keep the blocks.
+    std::vector<v2_entry> in_use;
+    for (const v2_entry &entry : entries) {
+        if ((entry.flags & V2_CHUNK_HOLE) == 0) {
+            in_use.push_back(entry);
+        }
+    }
+    std::sort(in_use.begin(), in_use.end(), [](const v2_entry &a, const v2_entry &b) {
+        return a.offset < b.offset;
+    });
+    uint64_t free_begin = header_size;
+    for (size_t i = 0; i <= in_use.size(); ++i) {
+        const uint64_t free_end = i < in_use.size() ? in_use[i].offset : footer.index_offset;
+        if (free_end > free_begin) {
+            fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) free_begin, (off_t) (free_end - free_begin));
+        }
+        if (i < in_use.size()) {
+            free_begin = std::max(free_begin, in_use[i].offset + in_use[i].stored_length);
+        }
+    }
+    _size = size;
+    _footer = footer;
+    _entries.swap(entries);
+    return num_written;
+}
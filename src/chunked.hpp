@@ -0,0 +1,238 @@
+#ifndef __CHUNKED_HPP
+#define __CHUNKED_HPP
+
+#include <crypt.hpp>
+#include <thread_pool.hpp>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// layout of the chunked (v2) format, every chunk has its own range of the key stream
+// and its own tag, so that any chunk can be checked and decrypted alone:
+// header | E(chunk 0) | E(chunk 1) | ... | E(index) | E(footer)
+#define V2_MAGIC                "ACRYPT\x02"    // including the terminating zero
+#define V2_MAGIC_SIZE           (8)
+#define V2_DEFAULT_CHUNK_SIZE   (1024 * 1024)
+#define V2_MAX_CHUNK_SIZE       (UINT64_C(1) << 30)
+
+// header flags: chunks may be compressed, the key is random and wrapped in the key
+// slots behind the header
+#define V2_FLAG_COMPRESSED      (1)
+#define V2_FLAG_WRAPPED         (2)
+
+// number of passwords a wrapped key can be opened with
+#define V2_KEY_SLOTS            (8)
+
+// entry flags: the stored bytes are the compressed plain text (see lz.hpp), the
+// chunk is a hole of zeros that is not stored at all
+#define V2_CHUNK_COMPRESSED     (1)
+#define V2_CHUNK_HOLE           (2)
+
+// bytes of the HMAC-SHA256 kept as tag
+#define V2_TAG_SIZE             (16)
+
+// counters relative to iv, the chunks start at 2 right behind the hash of the key,
+// index and footer live far above any counter a chunk can reach. Every update of a
+// file moves index and footer on to counters of their own.
+#define V2_CHUNK_COUNTER        (UINT64_C(2))
+#define V2_INDEX_COUNTER        (UINT64_C(1) << 62)
+#define V2_FOOTER_COUNTER       (UINT64_C(1) << 63)
+#define V2_GENERATION_BLOCKS    (UINT64_C(1) << 40)
+#define V2_MAX_GENERATION       ((V2_FOOTER_COUNTER - V2_INDEX_COUNTER) / V2_GENERATION_BLOCKS - 1)
+
+// journal of an update in flight, next to the file
+#define V2_UPDATE_SUFFIX        ".acrypt-update"
+
+/***
+ * plain header, only the hash of the key is encrypted
+ */
+struct v2_header {
+    char magic[V2_MAGIC_SIZE];
+    uint32_t header_size;                   // offset of the first chunk
+    uint32_t entry_size;                    // size of an index entry
+    uint64_t chunk_size;                    // plain bytes per chunk, a multiple of the block size
+    uint64_t flags;                         // V2_FLAG_*
+    uint8_t iv[AES_BLOCK_SIZE];
+    uint8_t key_hash[SHA256::HASH_SIZE];    // threefold hash of key, encrypted with counter iv + 0
+};
+
+/***
+ * the key of the file wrapped with the key derived from one password, an unused slot
+ * is all zero
+ */
+struct v2_key_slot {
+    uint8_t salt[AES_BLOCK_SIZE];           // salt of the password, iv of the wrapping
+    uint8_t wrapped_key[KEY_BUFFER_SIZE];   // encrypted with counter salt + 0
+    uint8_t tag[V2_TAG_SIZE];               // HMAC of salt and wrapped key
+};
+
+/***
+ * index entry of a chunk, chunk i holds the plain bytes from i * chunk_size on
+ */
+struct v2_entry {
+    uint64_t offset;                        // in the file
+    uint64_t counter;                       // counter of the first block, relative to iv
+    uint32_t stored_length;                 // bytes in the file
+    uint32_t length;                        // plain bytes, chunk_size for all but the last chunk
+    uint32_t flags;                         // V2_CHUNK_*
+    uint32_t reserved;
+    uint8_t tag[V2_TAG_SIZE];               // HMAC of chunk number, the fields above but the offset and the stored bytes
+    uint8_t digest[V2_TAG_SIZE];            // keyed hash of the plain bytes, finds the chunks an update changes
+};
+
+/***
+ * last four blocks of the file, the first three are encrypted
+ */
+struct v2_footer {
+    uint64_t index_offset;
+    uint64_t num_entries;
+    uint64_t length;                        // of the plain text
+    uint64_t next_counter;                  // no chunk has used a counter from here on
+    uint8_t tag[V2_TAG_SIZE];               // HMAC of header, index and the other fields
+    uint64_t generation;                    // plain, number of updates
+    uint64_t reserved;                      // plain, zero
+};
+
+/***
+ * check if a file starts with the magic of the chunked format
+ * @param fname
+ * @return
+ */
+extern bool is_chunked(const std::string &fname);
+
+/***
+ * Encrypt into the chunked format. Input and output are processed strictly
+ * sequentially, so both may be pipes, the chunks in between are compressed,
+ * encrypted and tagged on the workers. Chunks within holes of a regular input
+ * file are not read and only recorded in the index.
+ * @param in
+ * @param out
+ * @param password
+ * @param chunk_size
+ * @param compress compress the chunks that look compressible
+ * @param wrap use a random key, wrapped with the password in the first of V2_KEY_SLOTS slots
+ * @param pool
+ */
+extern void chunked_encrypt(int in, int out, const std::string &password, uint64_t chunk_size, bool compress, bool wrap,
+                            ThreadPool &pool);
+
+/***
+ * Let new_password open a file with a wrapped key as well, only its key slots are rewritten.
+ * @param fname
+ * @param password one that opens the file
+ * @param new_password
+ */
+extern void chunked_add_key(const std::string &fname, const std::string &password, const std::string &new_password);
+
+/***
+ * Replace password by new_password in the key slots of a file with a wrapped key.
+ * @param fname
+ * @param password
+ * @param new_password
+ */
+extern void chunked_change_key(const std::string &fname, const std::string &password, const std::string &new_password);
+
+/***
+ * Remove password from the key slots of a file with a wrapped key, the last one cannot be removed.
+ * @param fname
+ * @param password
+ */
+extern void chunked_remove_key(const std::string &fname, const std::string &password);
+
+/***
+ * Opens a file of the chunked format, checks the password and authenticates and
+ * decrypts the index. Chunks are read with pread, so read_chunk() may be called
+ * from several threads at once.
+ */
+class ChunkedFile {
+public:
+
+    /***
+     * @param fname
+     * @param password
+     * @param writable open for update()
+     */
+    ChunkedFile(const std::string &fname, const std::string &password, bool writable=false);
+
+    ~ChunkedFile();
+
+    ChunkedFile(const ChunkedFile &) = delete;
+
+    ChunkedFile &operator=(const ChunkedFile &) = delete;
+
+    uint64_t size() const {
+        return _footer.length;
+    }
+
+    uint64_t chunk_size() const {
+        return _header.chunk_size;
+    }
+
+    uint64_t num_chunks() const {
+        return _entries.size();
+    }
+
+    const v2_entry &entry(uint64_t i) const {
+        return _entries[i];
+    }
+
+    /***
+     * read a chunk and check its tag
+     * @param i
+     * @param buffer room for chunk_size() bytes, receives the stored cipher text
+     */
+    void verify_chunk(uint64_t i, uint8_t *buffer) const;
+
+    /***
+     * read a chunk, check its tag and decrypt it
+     * @param i
+     * @param buffer room for chunk_size() + AES_BLOCK_SIZE bytes
+     * @return number of plain bytes
+     */
+    size_t read_chunk(uint64_t i, uint8_t *buffer) const;
+
+    /***
+     * decrypt all chunks in order, holes are recreated if out is a regular file
+     * @param out
+     */
+    void decrypt(int out) const;
+
+    /***
+     * Replace the plain text by the one read from in. Chunks whose digest and length
+     * did not change are kept, the others are encrypted with counters not used before
+     * and written into space no chunk in use occupies, then index and footer follow at
+     * the end and are synced. Afterwards the file is cut behind the last chunk in use
+     * if index and footer fit in front of the ones just written, and the ranges no chunk
+     * uses any more are punched out (FALLOC_FL_PUNCH_HOLE). The file has to be opened
+     * writable, an update that does not complete is rolled back the next time the file
+     * is opened (see V2_UPDATE_SUFFIX).
+     * @param in may be a pipe
+     * @param pool
+     * @return number of chunks written
+     */
+    uint64_t update(int in, ThreadPool &pool);
+
+private:
+
+    /***
+     * read, authenticate and check index and footer, the footer ends the file at _size
+     * @param header
+     * @param tagged_header_size bytes of the header the tag covers
+     */
+    void load_index(const std::vector<uint8_t> &header, size_t tagged_header_size);
+
+    const std::string _fname;
+    int _fd = -1;
+    uint64_t _size;                         // of the file, up to the end of the footer
+    v2_header _header;
+    v2_footer _footer;
+    alignas(16) uint8_t _exp_key[AES_EXP_KEY_BUFFER_SIZE];
+    // keyed, copied for every tag and digest
+    HMAC_SHA256::context _mac;
+    HMAC_SHA256::context _digest_mac;
+    std::vector<v2_entry> _entries;
+
+};
+
+#endif // __CHUNKED_HPP
@@ -0,0 +1,225 @@
+#include <cpu.hpp>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#define MIN_TILE_SIZE       (16 * 1024)
+#define FALLBACK_TILE_SIZE  (256 * 1024)
+
+// parse sizes like "2048K" as found in sysfs
+static size_t parse_size(const std::string &str) {
+    if (str.empty()) {
+        return 0;
+    }
+    size_t size = std::stoul(str);
+    switch (str.back()) {
+        case 'K': {
+            size *= 1024;
+            break;
+        } case 'M': {
+            size *= 1024 * 1024;
+            break;
+        }
+        default:
+            break;
+    }
+    return size;
+}
+
+// look the cache up in sysfs, used if sysconf does not know it
+static size_t sysfs_cache_size(int level) {
+    for (int index = 0; index < 8; ++index) {
+        const std::string dir = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/";
+        std::ifstream level_file(dir + "level");
+        if (!level_file) {
+            break;
+        }
+        int l = 0;
+        std::string type, size;
+        level_file >> l;
+        std::ifstream(dir + "type") >> type;
+        std::ifstream(dir + "size") >> size;
+        if (l == level && type != "Instruction") {
+            try {
+                return parse_size(size);
+            } catch (std::exception &) {
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+size_t cpu_cache_size(int level) {
+    long size = -1;
+    switch (level) {
+        case 1: {
+            size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+            break;
+        } case 2: {
+            size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+            break;
+        } case 3: {
+            size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+            break;
+        }
+        default:
+            return 0;
+    }
+    return size > 0 ? (size_t) size : sysfs_cache_size(level);
+}
+
+size_t cpu_tile_size() {
+    static const size_t tile_size = []() -> size_t {
+        // half of L2 leaves room for the tables, stack and the other hyperthread
+        size_t size = cpu_cache_size(2) / 2;
+        if (size == 0) {
+            size = 8 * cpu_cache_size(1);
+        }
+        if (size == 0) {
+            size = FALLBACK_TILE_SIZE;
+        }
+        size &= ~((size_t) 4095);
+        return size < MIN_TILE_SIZE ? MIN_TILE_SIZE : size;
+    }();
+    return tile_size;
+}
+
+// parse lists like "0-3,8-11" as found in sysfs
+static std::vector<int> parse_list(const std::string &str) {
+    std::vector<int> list;
+    std::stringstream stream(str);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        try {
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int i = first; i <= last; ++i) {
+                list.push_back(i);
+            }
+        } catch (std::exception &) {
+            break;
+        }
+    }
+    return list;
+}
+
+/***
+ * the topology as found at the first call, node_of maps every CPU to its node
+ */
+struct Topology {
+    std::vector<std::vector<int>> nodes;
+    std::vector<int> node_of;
+};
+
+static const Topology &topology() {
+    static const Topology topo = []() -> Topology {
+        Topology t;
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        const bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+        std::string online;
+        std::ifstream("/sys/devices/system/node/online") >> online;
+        for (int node : parse_list(online)) {
+            std::string list;
+            std::ifstream("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist") >> list;
+            std::vector<int> cpus;
+            for (int cpu : parse_list(list)) {
+                if (cpu >= (int) t.node_of.size()) {
+                    t.node_of.resize(cpu + 1, -1);
+                }
+                t.node_of[cpu] = node;
+                if (!masked || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+                    cpus.push_back(cpu);
+                }
+            }
+            if (!cpus.empty()) {
+                t.nodes.push_back(cpus);
+            }
+        }
+        // no sysfs, one node without any known CPU
+        if (t.nodes.empty()) {
+            t.nodes.emplace_back();
+        }
+        return t;
+    }();
+    return topo;
+}
+
+const std::vector<std::vector<int>> &cpu_nodes() {
+    return topology().nodes;
+}
+
+int cpu_node() {
+    const int cpu = sched_getcpu();
+    const Topology &t = topology();
+    return cpu >= 0 && cpu < (int) t.node_of.size() ? t.node_of[cpu] : -1;
+}
+
+int cpu_worker_cpu(size_t index) {
+    const auto &nodes = cpu_nodes();
+    if (nodes.size() < 2) {
+        return -1;
+    }
+    const auto &cpus = nodes[index % nodes.size()];
+    return cpus[(index / nodes.size()) % cpus.size()];
+}
+
+bool cpu_pin(int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool cpu_bind_node(int node) {
+    const Topology &t = topology();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    bool any = false;
+    for (const auto &cpus : t.nodes) {
+        for (int cpu : cpus) {
+            if (cpu < CPU_SETSIZE && t.node_of[cpu] == node) {
+                CPU_SET(cpu, &set);
+                any = true;
+            }
+        }
+    }
+    return any && sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+int cpu_device_node(const std::string &fname) {
+    struct stat st;
+    if (stat(fname.c_str(), &st) < 0) {
+        return -1;
+    }
+    const dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    const std::string dir = "/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+
+    // a partition has no device of its own, the disk it belongs to has
+    int node = -1;
+    if (!(std::ifstream(dir + "/device/numa_node") >> node)) {
+        std::ifstream(dir + "/../device/numa_node") >> node;
+    }
+    return node;
+}
+
+bool cpu_mem_bind(void *ptr, size_t size, int node) {
+    unsigned long mask = 0;
+    if (node < 0 || node >= (int) (8 * sizeof(mask))) {
+        return false;
+    }
+    mask = 1UL << node;
+    return syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0) == 0;
+}
@@ -0,0 +1,74 @@
+#ifndef __CPU_HPP
+#define __CPU_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/***
+ * size of the data (or unified) cache of the given level
+ * @param level 1, 2 or 3
+ * @return size in bytes, 0 if unknown
+ */
+extern size_t cpu_cache_size(int level);
+
+/***
+ * size of the tiles the crypto loops work on, chosen such that a tile stays
+ * in L2 between the hash and the cipher pass over it
+ * @return size in bytes, a multiple of 4096
+ */
+extern size_t cpu_tile_size();
+
+/***
+ * NUMA nodes and the CPUs of each that the process may run on, read from sysfs on the
+ * first call, before any thread is pinned. A machine without NUMA is a single node.
+ * @return CPUs by node, nodes without allowed CPUs are left out
+ */
+extern const std::vector<std::vector<int>> &cpu_nodes();
+
+/***
+ * node of the CPU the calling thread runs on
+ * @return -1 if unknown
+ */
+extern int cpu_node();
+
+/***
+ * CPU for a worker of a pool, the workers are spread round robin over the nodes so
+ * that all memory controllers are used
+ * @param index of the worker
+ * @return -1 if there is a single node only, pinning would gain nothing then
+ */
+extern int cpu_worker_cpu(size_t index);
+
+/***
+ * pin the calling thread to a CPU
+ * @param cpu
+ * @return false if not allowed
+ */
+extern bool cpu_pin(int cpu);
+
+/***
+ * let the calling thread run on the CPUs of a node only
+ * @param node
+ * @return false if not allowed
+ */
+extern bool cpu_bind_node(int node);
+
+/***
+ * node of the device a file is stored on, as reported for its PCI device
+ * @param fname
+ * @return -1 if unknown (no NUMA, virtual or stacked devices)
+ */
+extern int cpu_device_node(const std::string &fname);
+
+/***
+ * place the pages of a range on a node (mbind with MPOL_PREFERRED), pages that are
+ * already there are not moved
+ * @param ptr page aligned
+ * @param size
+ * @param node
+ * @return false if not possible
+ */
+extern bool cpu_mem_bind(void *ptr, size_t size, int node);
+
+#endif // __CPU_HPP
@@ -0,0 +1,194 @@
+#include <crypt.hpp>
+#include <cpu.hpp>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+// tile size of the crypto loops, the I/O buffers are processed in tiles of this size
+static size_t _tile_size = 0;
+
+// cipher routines of the executables, the library itself always gets them passed in
+static std::atomic<const CipherProvider *> _crypt_provider(&aes_builtin_provider);
+
+void counter_at(const uint8_t *iv, uint64_t offset, uint8_t *counter) {
+    memcpy(counter, iv, AES_BLOCK_SIZE);
+    aes_ctr_advance(counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE + offset / AES_BLOCK_SIZE);
+}
+
+void set_tile_size(size_t size) {
+    if (size == 0) {
+        size = cpu_tile_size();
+    }
+    _tile_size = std::max<size_t>(size & ~((size_t) AES_BLOCK_SIZE - 1), AES_BLOCK_SIZE);
+}
+
+size_t tile_size() {
+    if (_tile_size == 0) {
+        set_tile_size(0);
+    }
+    return _tile_size;
+}
+
+void set_crypt_provider(const CipherProvider &provider) {
+    _crypt_provider = &provider;
+}
+
+const CipherProvider &crypt_provider() {
+    return *_crypt_provider;
+}
+
+void encrypt_blocks(CHECKSUM::context &ctx, uint8_t *data, uint64_t num_blocks, const uint32_t *exp_key, uint8_t *iv,
+                    SHA256::context *digest) {
+    const uint64_t tile_blocks = tile_size() / AES_BLOCK_SIZE;
+    while (num_blocks) {
+        const uint64_t n = std::min(num_blocks, tile_blocks);
+        CHECKSUM::update(ctx, data, n * AES_BLOCK_SIZE);
+        if (digest != nullptr) {
+            SHA256::update(*digest, data, n * AES_BLOCK_SIZE);
+        }
+        aes_ctr_enc(data, data, exp_key, iv, n);
+        data += n * AES_BLOCK_SIZE;
+        num_blocks -= n;
+    }
+}
+
+void decrypt_blocks(CHECKSUM::context &ctx, uint8_t *data, uint64_t num_blocks, const uint32_t *exp_key, uint8_t *iv) {
+    const uint64_t tile_blocks = tile_size() / AES_BLOCK_SIZE;
+    while (num_blocks) {
+        const uint64_t n = std::min(num_blocks, tile_blocks);
+        aes_ctr_dec(data, data, exp_key, iv, n);
+        CHECKSUM::update(ctx, data, n * AES_BLOCK_SIZE);
+        data += n * AES_BLOCK_SIZE;
+        num_blocks -= n;
+    }
+}
+
+void encrypt_tail(CHECKSUM::context &ctx, uint8_t *tail, uint64_t tail_size, const uint32_t *exp_key, uint8_t *iv,
+                  SHA256::context *digest) {
+    CHECKSUM::update(ctx, tail, tail_size);
+    if (digest != nullptr) {
+        SHA256::update(*digest, tail, tail_size);
+    }
+    CHECKSUM::final(ctx, tail + tail_size);
+    aes_ctr_enc(tail, tail, exp_key, iv, (tail_size + CHECKSUM::HASH_SIZE + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+}
+
+void decrypt_tail(CHECKSUM::context &ctx, uint8_t *tail, uint64_t tail_size, const uint32_t *exp_key, uint8_t *iv) {
+    aes_ctr_dec(tail, tail, exp_key, iv, (tail_size + CHECKSUM::HASH_SIZE + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+    CHECKSUM::update(ctx, tail, tail_size);
+}
+
+// header | plain text | checksum, plus one block for the encryption of the last one
+#define SMALL_BUFFER_SIZE   (HEADER_SIZE + SMALL_FILE_SIZE + CHECKSUM::HASH_SIZE + AES_BLOCK_SIZE)
+
+void encrypt_small(int in, int out, uint64_t size, const std::string &password, SHA256::context *digest) {
+    if (size > SMALL_FILE_SIZE) {
+        throw std::runtime_error("input too large for the small file path");
+    }
+    alignas(16) uint8_t buffer[SMALL_BUFFER_SIZE];
+    if (pread_full(buffer + HEADER_SIZE, size, 0, in) < size) {
+        throw std::runtime_error("unable to read from file");
+    }
+
+    uint8_t key[KEY_BUFFER_SIZE] = { 0 };
+    alignas(16) uint8_t exp_key[AES_EXP_KEY_BUFFER_SIZE] = { 0 };
+    uint8_t iv[AES_BLOCK_SIZE];
+    aes_generate_iv(buffer);
+    memcpy(iv, buffer, AES_BLOCK_SIZE);
+    derive_key(password, iv, key);
+    aes_ctr_expand_key(key, (uint32_t *) exp_key, crypt_provider());
+
+    // the hash of the key is part of the checksum but not of the digest
+    CHECKSUM::context ctx;
+    CHECKSUM::init(ctx);
+    uint8_t *data = buffer + AES_BLOCK_SIZE;
+    hash_key(key, data);
+    encrypt_blocks(ctx, data, SHA256::HASH_SIZE / AES_BLOCK_SIZE, (const uint32_t *) exp_key, iv);
+    data += SHA256::HASH_SIZE;
+    const uint64_t num_blocks = size / AES_BLOCK_SIZE;
+    encrypt_blocks(ctx, data, num_blocks, (const uint32_t *) exp_key, iv, digest);
+    encrypt_tail(ctx, data + num_blocks * AES_BLOCK_SIZE, size - num_blocks * AES_BLOCK_SIZE, (const uint32_t *) exp_key, iv,
+                 digest);
+
+    pwrite_full(buffer, HEADER_SIZE + size + CHECKSUM::HASH_SIZE, 0, out);
+}
+
+void decrypt_small(int in, int out, uint64_t size, const std::string &password) {
+    if (size > HEADER_SIZE + SMALL_FILE_SIZE + CHECKSUM::HASH_SIZE) {
+        throw std::runtime_error("input too large for the small file path");
+    }
+    if (size < HEADER_SIZE + CHECKSUM::HASH_SIZE) {
+        throw std::runtime_error("insufficient file size");
+    }
+    alignas(16) uint8_t buffer[SMALL_BUFFER_SIZE];
+    if (pread_full(buffer, size, 0, in) < size) {
+        throw std::runtime_error("unable to read from file");
+    }
+
+    uint8_t key[KEY_BUFFER_SIZE] = { 0 };
+    alignas(16) uint8_t exp_key[AES_EXP_KEY_BUFFER_SIZE] = { 0 };
+    uint8_t iv[AES_BLOCK_SIZE];
+    memcpy(iv, buffer, AES_BLOCK_SIZE);
+    derive_key(password, iv, key);
+    aes_ctr_expand_key(key, (uint32_t *) exp_key, crypt_provider());
+
+    // check if the key hashes match
+    uint8_t hash_of_key[SHA256::HASH_SIZE];
+    hash_key(key, hash_of_key);
+    uint8_t *data = buffer + AES_BLOCK_SIZE;
+    aes_ctr_dec(data, data, (const uint32_t *) exp_key, iv, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+    if (memcmp(data, hash_of_key, SHA256::HASH_SIZE) != 0) {
+        throw std::runtime_error("invalid password or compromised iv");
+    }
+
+    CHECKSUM::context ctx;
+    CHECKSUM::init(ctx);
+    CHECKSUM::update(ctx, hash_of_key, SHA256::HASH_SIZE);
+    data += SHA256::HASH_SIZE;
+    const uint64_t body = size - HEADER_SIZE - CHECKSUM::HASH_SIZE;
+    const uint64_t num_blocks = body / AES_BLOCK_SIZE;
+    decrypt_blocks(ctx, data, num_blocks, (const uint32_t *) exp_key, iv);
+    decrypt_tail(ctx, data + num_blocks * AES_BLOCK_SIZE, body - num_blocks * AES_BLOCK_SIZE, (const uint32_t *) exp_key, iv);
+
+    uint8_t checksum[CHECKSUM::HASH_SIZE];
+    CHECKSUM::final(ctx, checksum);
+    if (memcmp(checksum, data + body, CHECKSUM::HASH_SIZE) != 0) {
+        throw std::runtime_error("checksum mismatch, file may be corrupted");
+    }
+    pwrite_full(data, body, 0, out);
+}
+
+size_t pread_full(uint8_t *ptr, size_t num_bytes, uint64_t offset, int fd) {
+    size_t b = 0;
+    while (num_bytes) {
+        auto bytes_read = pread(fd, ptr, num_bytes, offset + b);
+        if (bytes_read < 0 && errno != EINTR) {
+            throw std::runtime_error("unable to read from file");
+        } else if (bytes_read == 0) {
+            break;
+        } else if (bytes_read > 0) {
+            num_bytes -= bytes_read;
+            ptr += bytes_read;
+            b += bytes_read;
+        }
+    }
+    return b;
+}
+
+size_t pwrite_full(const uint8_t *ptr, size_t num_bytes, uint64_t offset, int fd) {
+    size_t b = 0;
+    while (num_bytes) {
+        auto bytes_written = pwrite(fd, ptr, num_bytes, offset + b);
+        if (bytes_written < 0 && errno != EINTR) {
+            throw std::runtime_error("unable to write to file");
+        } else if (bytes_written > 0) {
+            num_bytes -= bytes_written;
+            ptr += bytes_written;
+            b += bytes_written;
+        }
+    }
+    return b;
+}
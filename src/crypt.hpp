@@ -0,0 +1,183 @@
+#ifndef __CRYPT_HPP
+#define __CRYPT_HPP
+
+#include <aes.hpp>
+#include <Hash.hpp>
+#include <kdf.hpp>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// what kind of checksum shall be used
+// SHA1 means less security but better performance
+// use SHA256 for the reverse
+#define PERFORMANCE     SHA1
+#define SECURITY        SHA256
+#define CHECKSUM        PERFORMANCE
+
+#define ENCRYPTION      0
+#define DECRYPTION      1
+#define VERIFICATION    2
+
+// header of the file format: iv + encrypted threefold hash of key
+#define HEADER_SIZE     (AES_BLOCK_SIZE + SHA256::HASH_SIZE)
+
+// plain text up to this size takes the small file path
+#define SMALL_FILE_SIZE (64 * 1024)
+
+/***
+ * counter of the block at the given offset of the plain text, the first two
+ * blocks belong to the hash of the key
+ * @param iv
+ * @param offset multiple of AES_BLOCK_SIZE
+ * @param counter
+ */
+extern void counter_at(const uint8_t *iv, uint64_t offset, uint8_t *counter);
+
+/***
+ * set the size of the tiles the crypto loops work on, 0 selects cpu_tile_size()
+ * @param size
+ */
+extern void set_tile_size(size_t size);
+
+extern size_t tile_size();
+
+/***
+ * set the provider acrypt and acryptd expand their keys with, the built-in one until then
+ * @param provider
+ */
+extern void set_crypt_provider(const CipherProvider &provider);
+
+extern const CipherProvider &crypt_provider();
+
+/***
+ * hash and encrypt whole blocks tile by tile, so the cipher pass over a tile
+ * finds it still in cache after the hash pass
+ * @param ctx checksum context
+ * @param data
+ * @param num_blocks
+ * @param exp_key
+ * @param iv
+ * @param digest if given, the plain text is hashed into it as well, tile by tile
+ */
+extern void encrypt_blocks(CHECKSUM::context &ctx, uint8_t *data, uint64_t num_blocks, const uint32_t *exp_key, uint8_t *iv,
+                           SHA256::context *digest=nullptr);
+
+/***
+ * decrypt and hash whole blocks tile by tile
+ * @param ctx checksum context
+ * @param data
+ * @param num_blocks
+ * @param exp_key
+ * @param iv
+ */
+extern void decrypt_blocks(CHECKSUM::context &ctx, uint8_t *data, uint64_t num_blocks, const uint32_t *exp_key, uint8_t *iv);
+
+/***
+ * hash the bytes of the last incomplete block, append the checksum behind them and
+ * encrypt both, the buffer must have room for the checksum plus one block
+ * @param ctx checksum context
+ * @param tail
+ * @param tail_size number of bytes, less than AES_BLOCK_SIZE
+ * @param exp_key
+ * @param iv
+ * @param digest if given, the plain bytes are hashed into it as well
+ */
+extern void encrypt_tail(CHECKSUM::context &ctx, uint8_t *tail, uint64_t tail_size, const uint32_t *exp_key, uint8_t *iv,
+                         SHA256::context *digest=nullptr);
+
+/***
+ * decrypt the bytes of the last incomplete block together with the checksum behind
+ * them and hash the former
+ * @param ctx checksum context
+ * @param tail
+ * @param tail_size number of bytes, less than AES_BLOCK_SIZE
+ * @param exp_key
+ * @param iv
+ */
+extern void decrypt_tail(CHECKSUM::context &ctx, uint8_t *tail, uint64_t tail_size, const uint32_t *exp_key, uint8_t *iv);
+
+/***
+ * encrypt a small regular file with a single read and a single write, all buffers are
+ * on the stack, nothing is taken from the heap
+ * @param in
+ * @param out
+ * @param size size of the input, at most SMALL_FILE_SIZE
+ * @param password
+ * @param digest if given, the plain text is hashed into it
+ */
+extern void encrypt_small(int in, int out, uint64_t size, const std::string &password, SHA256::context *digest=nullptr);
+
+/***
+ * decrypt a small regular file with a single read and a single write, unlike the
+ * streaming paths nothing is written unless the checksum matches
+ * @param in
+ * @param out
+ * @param size size of the input, at most HEADER_SIZE + SMALL_FILE_SIZE + CHECKSUM::HASH_SIZE
+ * @param password
+ */
+extern void decrypt_small(int in, int out, uint64_t size, const std::string &password);
+
+/***
+ * pread until num_bytes have been read or end of file is reached
+ * @param ptr
+ * @param num_bytes
+ * @param offset
+ * @param fd
+ * @return number of bytes read
+ */
+extern size_t pread_full(uint8_t *ptr, size_t num_bytes, uint64_t offset, int fd);
+
+/***
+ * pwrite all num_bytes
+ * @param ptr
+ * @param num_bytes
+ * @param offset
+ * @param fd
+ * @return number of bytes written
+ */
+extern size_t pwrite_full(const uint8_t *ptr, size_t num_bytes, uint64_t offset, int fd);
+
+/***
+ * file descriptor that is closed when leaving the scope
+ */
+class FileDescriptor {
+public:
+
+    FileDescriptor(const std::string &fname, int flags) : _fd(open(fname.c_str(), flags, 0666)) {
+        if (_fd < 0) {
+            throw std::runtime_error("unable to open file '" + fname + "'");
+        }
+    }
+
+    ~FileDescriptor() {
+        close(_fd);
+    }
+
+    FileDescriptor(const FileDescriptor &) = delete;
+
+    FileDescriptor &operator=(const FileDescriptor &) = delete;
+
+    operator int() const {
+        return _fd;
+    }
+
+    uint64_t size() const {
+        struct stat st;
+        if (fstat(_fd, &st) < 0) {
+            throw std::runtime_error("unable to stat file");
+        }
+        return (uint64_t) st.st_size;
+    }
+
+private:
+
+    const int _fd;
+
+};
+
+#endif // __CRYPT_HPP
@@ -0,0 +1,576 @@
+#include <daemon.hpp>
+#include <acrypt.hpp>
+#include <crypt.hpp>
+#include <chunked.hpp>
+#include <buffer_pool.hpp>
+#include <pipe.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int) {
+    stop_requested = 1;
+}
+
+static sockaddr_un socket_address(const std::string &socket_path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("socket path too long");
+    }
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+    return addr;
+}
+
+// one message with the descriptors that came along
+static std::string receive(int sock, std::vector<int> &fds) {
+    std::vector<char> data(DAEMON_MAX_MESSAGE);
+    char control[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))];
+    iovec iov = { data.data(), data.size() };
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {}
+    if (n < 0) {
+        throw std::runtime_error("unable to receive message");
+    }
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            const size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < num_fds; ++i) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                fds.push_back(fd);
+            }
+        }
+    }
+    if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0) {
+        throw std::runtime_error("message too long");
+    }
+    return std::string(data.data(), (size_t) n);
+}
+
+static void send_message(int sock, const std::string &message, const std::vector<int> &fds) {
+    iovec iov = { (void *) message.data(), message.size() };
+    char control[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (!fds.empty()) {
+        if (fds.size() > DAEMON_MAX_FDS) {
+            throw std::runtime_error("too many descriptors");
+        }
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    }
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+    if (n < 0) {
+        throw std::runtime_error("unable to send message");
+    }
+}
+
+// directory of the default socket if there is no runtime directory
+static std::string fallback_dir() {
+    return "/tmp/acryptd-" + std::to_string(getuid());
+}
+
+/***
+ * The fallback directory lives in /tmp where anybody could have created it first,
+ * it has to be a directory of our own that nobody else may enter. Other socket paths
+ * are left to the user.
+ * @param socket_path
+ * @param create the directory if it does not exist yet
+ */
+static void check_socket_dir(const std::string &socket_path, bool create) {
+    const std::string dir = fallback_dir();
+    if (socket_path.compare(0, dir.size() + 1, dir + "/") != 0 || socket_path.find('/', dir.size() + 1) != std::string::npos) {
+        return;
+    }
+    if (create && mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+        throw std::runtime_error("unable to create directory '" + dir + "'");
+    }
+    struct stat st;
+    if (lstat(dir.c_str(), &st) < 0) {
+        throw std::runtime_error("unable to access directory '" + dir + "'");
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        throw std::runtime_error("'" + dir + "' is not a private directory of this user");
+    }
+}
+
+// requests and replies carry passwords, both ends have to run as the same user
+static bool peer_is_owner(int sock) {
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+std::string daemon_socket_path() {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir != nullptr && *runtime_dir != '\0') {
+        return std::string(runtime_dir) + "/acryptd.sock";
+    }
+    return fallback_dir() + "/acryptd.sock";
+}
+
+std::string daemon_request(const std::string &socket_path, const std::string &request, const std::vector<int> &fds) {
+    const sockaddr_un addr = socket_address(socket_path);
+    check_socket_dir(socket_path, false);
+    const int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        throw std::runtime_error("unable to create socket");
+    }
+    try {
+        if (connect(sock, (const sockaddr *) &addr, sizeof(addr)) < 0) {
+            throw std::runtime_error("unable to connect to daemon at '" + socket_path + "'");
+        }
+        if (!peer_is_owner(sock)) {
+            throw std::runtime_error("daemon at '" + socket_path + "' runs as another user");
+        }
+        send_message(sock, request, fds);
+        std::vector<int> no_fds;
+        const std::string reply = receive(sock, no_fds);
+        for (int fd : no_fds) {
+            close(fd);
+        }
+        close(sock);
+        if (reply.empty()) {
+            throw std::runtime_error("daemon closed the connection");
+        }
+        return reply;
+    } catch (...) {
+        close(sock);
+        throw;
+    }
+}
+
+std::string KeyCache::id_of(const std::string &password, const uint8_t *iv) {
+    // the password itself is not kept
+    uint8_t id[SHA256::HASH_SIZE];
+    SHA256::context ctx;
+    SHA256::init(ctx);
+    SHA256::update(ctx, iv, AES_BLOCK_SIZE);
+    SHA256::update(ctx, password.data(), password.size());
+    SHA256::final(ctx, id);
+    return std::string((const char *) id, SHA256::HASH_SIZE);
+}
+
+bool KeyCache::lookup(const std::string &password, const uint8_t *iv, uint8_t *key) {
+    const std::string id = id_of(password, iv);
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _entries.find(id);
+    if (it == _entries.end()) {
+        return false;
+    }
+    _lru.splice(_lru.begin(), _lru, it->second);
+    memcpy(key, it->second->key, KEY_BUFFER_SIZE);
+    return true;
+}
+
+void KeyCache::insert(const std::string &password, const uint8_t *iv, const uint8_t *key) {
+    if (_capacity == 0) {
+        return;
+    }
+    const std::string id = id_of(password, iv);
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_entries.count(id) > 0) {
+        return;
+    }
+    if (_entries.size() >= _capacity) {
+        Entry &last = _lru.back();
+        memset(last.key, 0, KEY_BUFFER_SIZE);
+        _entries.erase(last.id);
+        _lru.pop_back();
+    }
+    _lru.push_front(Entry());
+    _lru.front().id = id;
+    memcpy(_lru.front().key, key, KEY_BUFFER_SIZE);
+    _entries[id] = _lru.begin();
+}
+
+/***
+ * a parsed request, owns the descriptors
+ */
+struct Daemon::Request {
+    std::string op;
+    std::string password;
+    std::string input;                          // paths, empty if passed as descriptor
+    std::string output;
+    std::vector<int> fds;                       // passed along
+    std::vector<int> opened;
+    int in = -1;
+    int out = -1;
+
+    ~Request() {
+        for (int fd : fds) {
+            close(fd);
+        }
+        for (int fd : opened) {
+            close(fd);
+        }
+    }
+
+    int open_file(const std::string &fname, int flags) {
+        const int fd = open(fname.c_str(), flags | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            throw std::runtime_error("unable to open file '" + fname + "'");
+        }
+        opened.push_back(fd);
+        return fd;
+    }
+};
+
+Daemon::Daemon(const std::string &socket_path, ThreadPool &pool, uint64_t bufsize, size_t num_keys) :
+        _socket_path(socket_path), _pool(pool), _bufsize(bufsize), _keys(num_keys),
+        _start(std::chrono::steady_clock::now()), _queued(0), _active(0), _requests(0), _failed(0),
+        _bytes_in(0), _bytes_out(0), _key_hits(0), _key_misses(0),
+        _provider(crypt_provider().name) {
+    const sockaddr_un addr = socket_address(socket_path);
+    check_socket_dir(socket_path, true);
+    _fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (_fd < 0) {
+        throw std::runtime_error("unable to create socket");
+    }
+    // a socket left behind by a daemon that is gone is replaced, nothing else is
+    struct stat st;
+    if (lstat(socket_path.c_str(), &st) == 0) {
+        const int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        const bool alive = S_ISSOCK(st.st_mode) && probe >= 0 && connect(probe, (const sockaddr *) &addr, sizeof(addr)) == 0;
+        if (probe >= 0) {
+            close(probe);
+        }
+        if (!S_ISSOCK(st.st_mode) || alive) {
+            close(_fd);
+            throw std::runtime_error("'" + socket_path + "' is in use");
+        }
+        unlink(socket_path.c_str());
+    }
+    // only the owner may connect, requests carry passwords
+    const mode_t mask = umask(0177);
+    const int result = bind(_fd, (const sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if (result < 0 || listen(_fd, SOMAXCONN) < 0) {
+        close(_fd);
+        throw std::runtime_error("unable to listen on '" + socket_path + "'");
+    }
+}
+
+Daemon::~Daemon() {
+    close(_fd);
+    unlink(_socket_path.c_str());
+}
+
+void Daemon::run() {
+    // no SA_RESTART, poll() returns when a signal arrives
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    // connections are read here until their request is complete, a worker of the pool
+    // only gets requests it can start on at once. A client that is slow to send does
+    // not hold a worker.
+    struct Pending {
+        int conn;
+        std::chrono::steady_clock::time_point deadline;
+    };
+    std::vector<Pending> pending;
+    std::vector<pollfd> polled;
+    while (!stop_requested) {
+        const auto now = std::chrono::steady_clock::now();
+        int timeout = -1;
+        polled.clear();
+        for (const Pending &p : pending) {
+            const int left = (int) std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(p.deadline - now).count());
+            timeout = timeout < 0 ? left : std::min(timeout, left);
+            polled.push_back({ p.conn, POLLIN, 0 });
+        }
+        // the backlog of the socket holds further clients
+        const bool listening = pending.size() < DAEMON_MAX_PENDING;
+        if (listening) {
+            polled.push_back({ _fd, POLLIN, 0 });
+        }
+        if (poll(polled.data(), polled.size(), timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("unable to wait for connections");
+        }
+
+        const auto after = std::chrono::steady_clock::now();
+        std::vector<Pending> waiting;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            const int conn = pending[i].conn;
+            if (polled[i].revents == 0) {
+                if (after < pending[i].deadline) {
+                    waiting.push_back(pending[i]);
+                } else {
+                    close(conn);
+                }
+                continue;
+            }
+            std::string message;
+            std::vector<int> fds;
+            try {
+                message = receive(conn, fds);
+            } catch (std::exception &err) {
+                for (int fd : fds) {
+                    close(fd);
+                }
+                ++_failed;
+                try {
+                    send_message(conn, std::string("error: ") + err.what() + "\n", std::vector<int>());
+                } catch (std::exception &) {
+                    // the client is gone
+                }
+                close(conn);
+                continue;
+            }
+            if (message.empty()) {
+                close(conn);
+                continue;
+            }
+            ++_queued;
+            _pool.submit([this, conn, message, fds]() {
+                --_queued;
+                ++_active;
+                serve(conn, message, fds);
+                --_active;
+            });
+        }
+        pending.swap(waiting);
+
+        if (listening && (polled.back().revents & POLLIN) != 0) {
+            const int conn = accept4(_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (conn < 0) {
+                if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                    throw std::runtime_error("unable to accept connections");
+                }
+            } else if (!peer_is_owner(conn)) {
+                close(conn);
+            } else {
+                pending.push_back({ conn, after + std::chrono::seconds(DAEMON_TIMEOUT) });
+            }
+        }
+    }
+    for (const Pending &p : pending) {
+        close(p.conn);
+    }
+    _pool.wait();
+}
+
+void Daemon::serve(int conn, const std::string &message, const std::vector<int> &fds) {
+    std::string reply;
+    try {
+        Request request;
+        request.fds = fds;
+
+        // key=value lines, the password is last and may contain anything
+        size_t pos = 0;
+        while (pos < message.size()) {
+            if (message.compare(pos, 9, "password=") == 0) {
+                request.password = message.substr(pos + 9);
+                break;
+            }
+            const size_t end = std::min(message.find('\n', pos), message.size());
+            const std::string line = message.substr(pos, end - pos);
+            const size_t eq = line.find('=');
+            if (eq == std::string::npos) {
+                throw std::runtime_error("malformed request");
+            }
+            const std::string key = line.substr(0, eq);
+            const std::string value = line.substr(eq + 1);
+            if (key == "op") {
+                request.op = value;
+            } else if (key == "in") {
+                request.input = value;
+            } else if (key == "out") {
+                request.output = value;
+            } else {
+                throw std::runtime_error("unknown field '" + key + "'");
+            }
+            pos = end + 1;
+        }
+
+        ++_requests;
+        process(request);
+        reply = request.op == "stats" ? "ok\n" + stats() : "ok\n";
+    } catch (std::exception &err) {
+        ++_failed;
+        reply = std::string("error: ") + err.what() + "\n";
+    }
+    // the reply is small, it fits into the socket buffer of a connection that is still
+    // non-blocking
+    try {
+        send_message(conn, reply, std::vector<int>());
+    } catch (std::exception &) {
+        // the client is gone
+    }
+    close(conn);
+}
+
+void Daemon::process(Request &request) {
+    if (request.op == "stats") {
+        return;
+    }
+    // the descriptors passed along stand in for the paths not given, input first
+    size_t next_fd = 0;
+    if (!request.input.empty()) {
+        request.in = request.open_file(request.input, O_RDONLY);
+    } else if (next_fd < request.fds.size()) {
+        request.in = request.fds[next_fd++];
+    } else {
+        throw std::runtime_error("no input given");
+    }
+    if (request.op == "verify") {
+        // nothing is written
+    } else if (!request.output.empty()) {
+        request.out = request.open_file(request.output, O_WRONLY | O_CREAT | O_TRUNC);
+    } else if (next_fd < request.fds.size()) {
+        request.out = request.fds[next_fd++];
+    } else {
+        throw std::runtime_error("no output given");
+    }
+
+    if (request.op == "encrypt") {
+        encrypt(request);
+    } else if (request.op == "decrypt") {
+        decrypt(request, false);
+    } else if (request.op == "verify") {
+        decrypt(request, true);
+    } else {
+        throw std::runtime_error("unknown operation '" + request.op + "'");
+    }
+}
+
+void Daemon::encrypt(Request &request) {
+    // every file gets a fresh iv, the key derivation cannot be skipped here
+    PoolBuffer pool_buffer(_bufsize + ACRYPT_TRAILER_SIZE);
+    uint8_t *buffer = pool_buffer.data();
+    Encryptor enc(crypt_provider().name);
+    _provider = enc.provider();
+    enc.init(request.password, buffer);
+    write_full(request.out, buffer, ACRYPT_HEADER_SIZE);
+    uint64_t num_bytes = ACRYPT_HEADER_SIZE;
+    bool end = false;
+    while (!end) {
+        size_t n = read_full(request.in, buffer, _bufsize);
+        _bytes_in += n;
+        end = n < _bufsize;
+        enc.update(buffer, n, buffer);
+        if (end) {
+            // the trailer goes out with the last part
+            n += enc.finish(buffer + n);
+        }
+        write_full(request.out, buffer, n);
+        num_bytes += n;
+    }
+    _bytes_out += num_bytes;
+}
+
+void Daemon::decrypt(Request &request, bool verify) {
+    uint8_t header[ACRYPT_HEADER_SIZE];
+    const size_t header_size = read_full(request.in, header, ACRYPT_HEADER_SIZE);
+    _bytes_in += header_size;
+
+    if (header_size >= V2_MAGIC_SIZE && memcmp(header, V2_MAGIC, V2_MAGIC_SIZE) == 0) {
+        // the chunked format is read at random, through the descriptor's path
+        const ChunkedFile file("/proc/self/fd/" + std::to_string(request.in), request.password);
+        _provider = crypt_provider().name;
+        if (verify) {
+            PoolBuffer buffer(file.chunk_size());
+            for (uint64_t i = 0; i < file.num_chunks(); ++i) {
+                file.verify_chunk(i, buffer.data());
+                _bytes_in += file.entry(i).stored_length;
+            }
+        } else {
+            file.decrypt(request.out);
+            _bytes_out += file.size();
+        }
+        return;
+    }
+    if (header_size < ACRYPT_HEADER_SIZE) {
+        throw std::runtime_error("insufficient file size");
+    }
+
+    Decryptor dec(crypt_provider().name);
+    _provider = dec.provider();
+    uint8_t key[KEY_BUFFER_SIZE];
+    const bool cached = _keys.lookup(request.password, header, key);
+    if (cached) {
+        ++_key_hits;
+        dec.init_key(key);
+    } else {
+        ++_key_misses;
+        dec.init(request.password);
+    }
+    PoolBuffer in_buffer(_bufsize);
+    PoolBuffer out_buffer(_bufsize);
+    dec.update(header, ACRYPT_HEADER_SIZE, out_buffer.data());
+    if (!cached && dec.key(key)) {
+        _keys.insert(request.password, header, key);
+    }
+    memset(key, 0, KEY_BUFFER_SIZE);
+
+    size_t n;
+    do {
+        n = read_full(request.in, in_buffer.data(), _bufsize);
+        _bytes_in += n;
+        const size_t m = dec.update(in_buffer.data(), n, out_buffer.data());
+        if (!verify) {
+            write_full(request.out, out_buffer.data(), m);
+            _bytes_out += m;
+        }
+    } while (n == _bufsize);
+    dec.finish();
+}
+
+std::string Daemon::stats() const {
+    const double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    out << "uptime_seconds " << uptime << "\n"
+        << "threads " << _pool.size() << "\n"
+        << "provider " << _provider.load() << "\n"
+        << "queue_depth " << _queued << "\n"
+        << "active " << _active << "\n"
+        << "requests " << _requests << "\n"
+        << "failed " << _failed << "\n"
+        << "bytes_in " << _bytes_in << "\n"
+        << "bytes_out " << _bytes_out << "\n"
+        << "throughput_in_mb_per_second " << _bytes_in / uptime / 1e6 << "\n"
+        << "key_cache_hits " << _key_hits << "\n"
+        << "key_cache_misses " << _key_misses << "\n"
+        << "buffer_pool_capacity " << BufferPool::global().capacity() << "\n";
+    return out.str();
+}
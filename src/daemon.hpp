@@ -0,0 +1,140 @@
+#ifndef __DAEMON_HPP
+#define __DAEMON_HPP
+
+#include <thread_pool.hpp>
+#include <kdf.hpp>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// requests and replies are single messages of a SOCK_SEQPACKET socket:
+// "op=<encrypt|decrypt|verify|stats>\n[in=<path>\n][out=<path>\n]password=<password>"
+// an input or output that is not given as path is passed as descriptor (SCM_RIGHTS),
+// the input first. The reply is "ok\n" followed by the metrics for stats, or
+// "error: <reason>\n". Either end drops the connection unless the peer runs as the same
+// user (SO_PEERCRED).
+#define DAEMON_MAX_MESSAGE      (64 * 1024)
+#define DAEMON_MAX_FDS          (2)
+#define DAEMON_DEFAULT_KEYS     (64)
+
+// a client that does not send its request within this time is dropped
+#define DAEMON_TIMEOUT          (10)
+
+// connections accepted whose request has not arrived yet, further clients wait in the backlog
+#define DAEMON_MAX_PENDING      (256)
+
+/***
+ * default socket, $XDG_RUNTIME_DIR/acryptd.sock or /tmp/acryptd-<uid>/acryptd.sock, the
+ * daemon creates the latter directory with mode 0700 and both ends refuse it unless it
+ * is owned by the user and closed to everybody else
+ * @return
+ */
+extern std::string daemon_socket_path();
+
+/***
+ * send a request to the daemon and wait for the reply
+ * @param socket_path
+ * @param request
+ * @param fds passed along
+ * @return the reply
+ */
+extern std::string daemon_request(const std::string &socket_path, const std::string &request, const std::vector<int> &fds);
+
+/***
+ * Keys derived recently, by password and iv, so that files decrypted again do not
+ * pay for the key derivation. Least recently used keys are dropped first.
+ */
+class KeyCache {
+public:
+
+    explicit KeyCache(size_t capacity=DAEMON_DEFAULT_KEYS) : _capacity(capacity) {}
+
+    /***
+     * @param password
+     * @param iv
+     * @param key receives KEY_BUFFER_SIZE bytes
+     * @return false if not cached
+     */
+    bool lookup(const std::string &password, const uint8_t *iv, uint8_t *key);
+
+    void insert(const std::string &password, const uint8_t *iv, const uint8_t *key);
+
+private:
+
+    struct Entry {
+        std::string id;
+        uint8_t key[KEY_BUFFER_SIZE];
+    };
+
+    static std::string id_of(const std::string &password, const uint8_t *iv);
+
+    const size_t _capacity;
+    std::mutex _mutex;
+    std::list<Entry> _lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> _entries;
+
+};
+
+/***
+ * Local daemon serving encrypt, decrypt and verify requests over a UNIX socket. Its
+ * threads, I/O buffers and recently derived keys stay warm between requests. The
+ * accepting thread receives the requests, every complete one is served by a worker
+ * of the pool. Streams of the regular format are
+ * handled through Encryptor and Decryptor, files of the chunked format are detected
+ * when decrypting or verifying.
+ */
+class Daemon {
+public:
+
+    Daemon(const std::string &socket_path, ThreadPool &pool, uint64_t bufsize, size_t num_keys);
+
+    ~Daemon();
+
+    Daemon(const Daemon &) = delete;
+
+    Daemon &operator=(const Daemon &) = delete;
+
+    /***
+     * accept connections and receive their requests until SIGINT or SIGTERM
+     */
+    void run();
+
+private:
+
+    struct Request;
+
+    void serve(int conn, const std::string &message, const std::vector<int> &fds);
+
+    void process(Request &request);
+
+    void encrypt(Request &request);
+
+    void decrypt(Request &request, bool verify);
+
+    std::string stats() const;
+
+    const std::string _socket_path;
+    ThreadPool &_pool;
+    const uint64_t _bufsize;
+    int _fd = -1;
+    KeyCache _keys;
+
+    const std::chrono::steady_clock::time_point _start;
+    std::atomic<uint64_t> _queued;              // received, not yet picked up by a worker
+    std::atomic<uint64_t> _active;
+    std::atomic<uint64_t> _requests;
+    std::atomic<uint64_t> _failed;
+    std::atomic<uint64_t> _bytes_in;
+    std::atomic<uint64_t> _bytes_out;
+    std::atomic<uint64_t> _key_hits;
+    std::atomic<uint64_t> _key_misses;
+    std::atomic<const char *> _provider;        // of the last request
+
+};
+
+#endif // __DAEMON_HPP
@@ -0,0 +1,499 @@
+#include <inplace.hpp>
+#include <buffer_pool.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <vector>
+
+#define JOURNAL_MAGIC       "ACRYPTJ3"
+
+// journals with a digest per 4096 bytes, written by earlier versions
+#define JOURNAL_MAGIC_V2    "ACRYPTJ2"
+
+// granularity of the undo information. A crash may tear a page of the page cache
+// at sector boundaries, a sector is written whole.
+#define JOURNAL_PAGE_SIZE   (512)
+
+#define MODE_ENCRYPT        (0)
+#define MODE_DECRYPT        (1)
+
+// whole blocks from offset to offset + chunk_size are in flight
+#define STAGE_BODY          (0)
+
+// the last incomplete block and the trailer are in flight
+#define STAGE_FINAL         (1)
+
+/***
+ * Fixed part of a journal record, followed by one digest per page of the chunk in flight.
+ * Everything in front of offset has been processed and synced, the checksum context
+ * is the one right before offset.
+ */
+struct journal_record {
+    char magic[INPLACE_MAGIC_SIZE];
+    uint64_t sequence;
+    uint32_t mode;
+    uint32_t stage;
+    uint8_t iv[AES_BLOCK_SIZE];
+    uint8_t key_hash[SHA256::HASH_SIZE];        // encrypted as in the header, checks the password on resume
+    uint8_t checksum[CHECKSUM::HASH_SIZE];      // encrypted checksum of the file, when decrypting
+    uint64_t length;                            // plain text length
+    uint64_t offset;
+    uint64_t chunk_size;
+    uint64_t num_pages;
+    uint8_t ctx[CHECKSUM::STATE_SIZE];          // checksum context saved by CHECKSUM::save_state()
+    uint8_t digest[SHA1::HASH_SIZE];            // of the record and the page digests
+};
+
+// 64 bit FNV-1a on words, only has to tell the two images of a page apart
+static uint64_t page_digest(const uint8_t *data, size_t n) {
+    uint64_t h = UINT64_C(0xcbf29ce484222325) ^ n;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        h = (h ^ word) * UINT64_C(0x100000001b3);
+        h ^= h >> 29;
+    }
+    for (; i < n; ++i) {
+        h = (h ^ data[i]) * UINT64_C(0x100000001b3);
+    }
+    return h;
+}
+
+/***
+ * Journal file with two record slots that are written alternately, a record torn by
+ * a crash leaves the previous one intact. The magic of a slot is written last, once
+ * the rest of the record is on disk, a slot counts only with magic and digest.
+ */
+class Journal {
+public:
+
+    Journal(const std::string &fname, uint64_t chunk_size) :
+            _fname(fname), _new_slot_size(sizeof(journal_record) + (chunk_size / JOURNAL_PAGE_SIZE + 1) * sizeof(uint64_t)) {
+        _fd = open(fname.c_str(), O_RDWR);
+        if (_fd >= 0) {
+            // the chunk size of an interrupted run may have been different
+            struct stat st;
+            if (fstat(_fd, &st) < 0) {
+                throw std::runtime_error("unable to stat journal");
+            }
+            _slot_size = (uint64_t) st.st_size / 2;
+        } else {
+            _slot_size = _new_slot_size;
+        }
+    }
+
+    ~Journal() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    Journal(const Journal &) = delete;
+
+    Journal &operator=(const Journal &) = delete;
+
+    /***
+     * largest chunk the slots have room for
+     * @return
+     */
+    uint64_t max_chunk_size() const {
+        return ((_slot_size - sizeof(journal_record)) / sizeof(uint64_t) - 1) * JOURNAL_PAGE_SIZE;
+    }
+
+    /***
+     * read the latest valid record
+     * @param record
+     * @param pages
+     * @return false if there is no journal
+     */
+    bool load(journal_record &record, std::vector<uint64_t> &pages) {
+        if (_fd < 0) {
+            return false;
+        }
+
+        bool found = false;
+        std::vector<uint8_t> slot(_slot_size);
+        for (int i = 0; i < 2 && _slot_size >= sizeof(journal_record); ++i) {
+            if (pread_full(slot.data(), _slot_size, i * _slot_size, _fd) < _slot_size) {
+                continue;
+            }
+            journal_record r;
+            memcpy(&r, slot.data(), sizeof(journal_record));
+            if (memcmp(r.magic, JOURNAL_MAGIC_V2, INPLACE_MAGIC_SIZE) == 0) {
+                throw std::runtime_error("the journal has been written by an earlier version, finish the operation with it");
+            }
+            // a slot torn or not yet marked valid is skipped, the other one is used
+            if (memcmp(r.magic, JOURNAL_MAGIC, INPLACE_MAGIC_SIZE) != 0 ||
+                r.num_pages > (_slot_size - sizeof(journal_record)) / sizeof(uint64_t) ||
+                (found && r.sequence < record.sequence)) {
+                continue;
+            }
+            uint8_t digest[SHA1::HASH_SIZE];
+            memcpy(digest, r.digest, SHA1::HASH_SIZE);
+            memset(slot.data() + offsetof(journal_record, digest), 0, SHA1::HASH_SIZE);
+            SHA1::hash(slot.data(), sizeof(journal_record) + r.num_pages * sizeof(uint64_t), r.digest);
+            if (memcmp(digest, r.digest, SHA1::HASH_SIZE) != 0) {
+                continue;
+            }
+            record = r;
+            pages.assign((const uint64_t *) (slot.data() + sizeof(journal_record)),
+                         (const uint64_t *) (slot.data() + sizeof(journal_record)) + r.num_pages);
+            found = true;
+        }
+        if (!found) {
+            // the first record has been torn, nothing has been written to the file yet
+            remove();
+            _slot_size = _new_slot_size;
+            return false;
+        }
+        _sequence = record.sequence;
+        return true;
+    }
+
+    /***
+     * write the record to the older slot and sync it, then mark the slot valid by its
+     * magic and sync again
+     * @param record
+     * @param pages
+     */
+    void write(journal_record &record, const std::vector<uint64_t> &pages) {
+        if (_fd < 0) {
+            _fd = open(_fname.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+            if (_fd < 0 || ftruncate(_fd, 2 * _slot_size) < 0) {
+                throw std::runtime_error("unable to create journal '" + _fname + "'");
+            }
+        }
+
+        memcpy(record.magic, JOURNAL_MAGIC, INPLACE_MAGIC_SIZE);
+        record.sequence = ++_sequence;
+        record.num_pages = pages.size();
+        memset(record.digest, 0, SHA1::HASH_SIZE);
+
+        std::vector<uint8_t> slot(sizeof(journal_record) + pages.size() * sizeof(uint64_t));
+        memcpy(slot.data(), &record, sizeof(journal_record));
+        memcpy(slot.data() + sizeof(journal_record), pages.data(), pages.size() * sizeof(uint64_t));
+        SHA1::hash(slot.data(), slot.size(), record.digest);
+        memcpy(slot.data() + offsetof(journal_record, digest), record.digest, SHA1::HASH_SIZE);
+
+        // the magic is written on its own, eight aligned bytes never cross a sector. A
+        // crash before it leaves the slot invalid and the previous record in force.
+        const uint64_t offset = (_sequence % 2) * _slot_size;
+        memset(slot.data(), 0, INPLACE_MAGIC_SIZE);
+        pwrite_full(slot.data(), slot.size(), offset, _fd);
+        if (fdatasync(_fd) < 0) {
+            throw std::runtime_error("unable to sync journal");
+        }
+        pwrite_full((const uint8_t *) JOURNAL_MAGIC, INPLACE_MAGIC_SIZE, offset, _fd);
+        if (fdatasync(_fd) < 0) {
+            throw std::runtime_error("unable to sync journal");
+        }
+    }
+
+    /***
+     * delete the journal, the operation is complete
+     */
+    void remove() {
+        if (_fd >= 0) {
+            close(_fd);
+            _fd = -1;
+        }
+        unlink(_fname.c_str());
+    }
+
+private:
+
+    const std::string _fname;
+    const uint64_t _new_slot_size;
+    int _fd = -1;
+    uint64_t _slot_size;
+    uint64_t _sequence = 0;
+
+};
+
+static void sync(int fd) {
+    if (fdatasync(fd) < 0) {
+        throw std::runtime_error(std::string("unable to sync file: ") + strerror(errno));
+    }
+}
+
+// digests of the pages of a chunk starting at a block boundary
+static void digest_pages(const uint8_t *data, uint64_t size, std::vector<uint64_t> &pages) {
+    pages.clear();
+    for (uint64_t offset = 0; offset < size; offset += JOURNAL_PAGE_SIZE) {
+        pages.push_back(page_digest(data + offset, std::min<uint64_t>(JOURNAL_PAGE_SIZE, size - offset)));
+    }
+}
+
+/***
+ * bring the pages of a chunk that have already been processed back to their previous
+ * contents, the cipher stream is its own inverse
+ * @param data chunk as found in the file
+ * @param size
+ * @param offset offset of the chunk in the plain text
+ * @param iv
+ * @param exp_key
+ * @param pages digests of the pages before processing
+ * @return true if a page has been changed
+ */
+static bool roll_back(uint8_t *data, uint64_t size, uint64_t offset, const uint8_t *iv, const uint32_t *exp_key,
+                      const std::vector<uint64_t> &pages) {
+    bool changed = false;
+    uint8_t page[JOURNAL_PAGE_SIZE];
+    for (uint64_t p = 0; p * JOURNAL_PAGE_SIZE < size; ++p) {
+        uint8_t *ptr = data + p * JOURNAL_PAGE_SIZE;
+        const uint64_t n = std::min<uint64_t>(JOURNAL_PAGE_SIZE, size - p * JOURNAL_PAGE_SIZE);
+        if (p >= pages.size()) {
+            throw std::runtime_error("unable to recover, the journal does not match the file");
+        } else if (page_digest(ptr, n) == pages[p]) {
+            continue;
+        }
+
+        uint8_t counter[AES_BLOCK_SIZE];
+        counter_at(iv, offset + p * JOURNAL_PAGE_SIZE, counter);
+        memcpy(page, ptr, n);
+        aes_ctr_encdec(page, page, exp_key, counter, (n + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+        if (page_digest(page, n) != pages[p]) {
+            throw std::runtime_error("unable to recover, the journal does not match the file");
+        }
+        memcpy(ptr, page, n);
+        changed = true;
+    }
+    return changed;
+}
+
+/***
+ * run or resume the operation described by the record
+ * @param fd
+ * @param journal
+ * @param r
+ * @param pages digests of the chunk in flight if resuming
+ * @param exp_key
+ * @param bufsize
+ * @param resume
+ */
+static void process(int fd, Journal &journal, journal_record &r, std::vector<uint64_t> &pages,
+                    const uint32_t *exp_key, uint64_t bufsize, bool resume) {
+    bufsize = std::min(bufsize, journal.max_chunk_size());
+    PoolBuffer pool_buffer(bufsize);
+    uint8_t *buffer = pool_buffer.data();
+    const uint64_t body_end = r.length - r.length % AES_BLOCK_SIZE;
+    const uint64_t tail_size = r.length - body_end;
+    uint8_t counter[AES_BLOCK_SIZE];
+    CHECKSUM::context ctx;
+    CHECKSUM::load_state(ctx, r.ctx);
+
+    // undo the partially written chunk
+    if (resume && r.stage == STAGE_BODY && r.chunk_size > 0) {
+        if (pread_full(buffer, r.chunk_size, r.offset, fd) < r.chunk_size) {
+            throw std::runtime_error("unable to recover, the file has been truncated");
+        }
+        if (roll_back(buffer, r.chunk_size, r.offset, r.iv, exp_key, pages)) {
+            pwrite_full(buffer, r.chunk_size, r.offset, fd);
+            sync(fd);
+        }
+    }
+
+    while (r.stage == STAGE_BODY && r.offset < body_end) {
+        const uint64_t n = std::min(bufsize, body_end - r.offset);
+        if (pread_full(buffer, n, r.offset, fd) < n) {
+            throw std::runtime_error("insufficient file size");
+        }
+
+        // no byte of the chunk may change before the journal knows how to undo it
+        r.chunk_size = n;
+        CHECKSUM::save_state(ctx, r.ctx);
+        digest_pages(buffer, n, pages);
+        journal.write(r, pages);
+
+        counter_at(r.iv, r.offset, counter);
+        if (r.mode == MODE_ENCRYPT) {
+            encrypt_blocks(ctx, buffer, n / AES_BLOCK_SIZE, exp_key, counter);
+        } else {
+            decrypt_blocks(ctx, buffer, n / AES_BLOCK_SIZE, exp_key, counter);
+        }
+        pwrite_full(buffer, n, r.offset, fd);
+        sync(fd);
+        r.offset += n;
+    }
+
+    // the last incomplete block, the checksum and the trailer
+    uint8_t tail[INPLACE_TRAILER_SIZE + AES_BLOCK_SIZE];
+    if (pread_full(tail, tail_size, body_end, fd) < tail_size) {
+        throw std::runtime_error("insufficient file size");
+    }
+    if (r.stage == STAGE_BODY) {
+        r.stage = STAGE_FINAL;
+        r.offset = body_end;
+        r.chunk_size = tail_size;
+        CHECKSUM::save_state(ctx, r.ctx);
+        digest_pages(tail, tail_size, pages);
+        journal.write(r, pages);
+    } else {
+        roll_back(tail, tail_size, body_end, r.iv, exp_key, pages);
+    }
+
+    counter_at(r.iv, body_end, counter);
+    if (r.mode == MODE_ENCRYPT) {
+        encrypt_tail(ctx, tail, tail_size, exp_key, counter);
+        uint8_t *trailer = tail + tail_size + CHECKSUM::HASH_SIZE;
+        memcpy(trailer, r.iv, AES_BLOCK_SIZE);
+        memcpy(trailer + AES_BLOCK_SIZE, r.key_hash, SHA256::HASH_SIZE);
+        memcpy(trailer + HEADER_SIZE, INPLACE_MAGIC, INPLACE_MAGIC_SIZE);
+        pwrite_full(tail, tail_size + INPLACE_TRAILER_SIZE, body_end, fd);
+        sync(fd);
+        journal.remove();
+        return;
+    }
+
+    memcpy(tail + tail_size, r.checksum, CHECKSUM::HASH_SIZE);
+    decrypt_tail(ctx, tail, tail_size, exp_key, counter);
+    uint8_t checksum[CHECKSUM::HASH_SIZE];
+    CHECKSUM::final(ctx, checksum);
+
+    // the plain text has to be on disk before the trailer is cut off
+    pwrite_full(tail, tail_size, body_end, fd);
+    sync(fd);
+    if (ftruncate(fd, r.length) < 0) {
+        throw std::runtime_error("unable to truncate file");
+    }
+    sync(fd);
+    journal.remove();
+
+    if (memcmp(checksum, tail + tail_size, CHECKSUM::HASH_SIZE) != 0) {
+        throw std::runtime_error("checksum mismatch, file may be corrupted");
+    }
+}
+
+/***
+ * load an interrupted operation and check that it can be resumed with the password
+ * @return false if there is none
+ */
+static bool load_journal(Journal &journal, journal_record &r, std::vector<uint64_t> &pages, uint32_t mode,
+                         const std::string &password, uint32_t *exp_key) {
+    if (!journal.load(r, pages)) {
+        return false;
+    }
+    if (r.mode != mode) {
+        throw std::runtime_error(mode == MODE_ENCRYPT ? "an interrupted decryption of this file is pending, resume it with -d"
+                                                      : "an interrupted encryption of this file is pending, resume it with -e");
+    }
+
+    std::array<uint8_t, KEY_BUFFER_SIZE> key = { 0 };
+    derive_key(password, r.iv, key.data());
+    aes_ctr_expand_key(key.data(), exp_key, crypt_provider());
+
+    uint8_t hash_of_key[SHA256::HASH_SIZE];
+    uint8_t key_hash[SHA256::HASH_SIZE];
+    uint8_t counter[AES_BLOCK_SIZE];
+    hash_key(key.data(), hash_of_key);
+    memcpy(key_hash, r.key_hash, SHA256::HASH_SIZE);
+    memcpy(counter, r.iv, AES_BLOCK_SIZE);
+    aes_ctr_dec(key_hash, key_hash, exp_key, counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+    if (memcmp(key_hash, hash_of_key, SHA256::HASH_SIZE) != 0) {
+        throw std::runtime_error("invalid password for the interrupted operation");
+    }
+    return true;
+}
+
+// check if the file ends with the trailer of encrypt_in_place
+static bool has_trailer(int fd, uint64_t size) {
+    char magic[INPLACE_MAGIC_SIZE];
+    return size >= INPLACE_TRAILER_SIZE &&
+           pread_full((uint8_t *) magic, INPLACE_MAGIC_SIZE, size - INPLACE_MAGIC_SIZE, fd) == INPLACE_MAGIC_SIZE &&
+           memcmp(magic, INPLACE_MAGIC, INPLACE_MAGIC_SIZE) == 0;
+}
+
+void encrypt_in_place(const std::string &fname, const std::string &password, uint64_t bufsize) {
+    FileDescriptor fd(fname, O_RDWR);
+    Journal journal(fname + JOURNAL_SUFFIX, bufsize);
+    alignas(16) std::array<uint8_t, AES_EXP_KEY_BUFFER_SIZE> exp_key = { 0 };
+
+    journal_record r;
+    std::vector<uint64_t> pages;
+    const bool resume = load_journal(journal, r, pages, MODE_ENCRYPT, password, (uint32_t *) exp_key.data());
+    if (!resume) {
+        const uint64_t size = fd.size();
+        if (has_trailer(fd, size)) {
+            throw std::runtime_error("file is already encrypted in place");
+        }
+
+        memset(&r, 0, sizeof(journal_record));
+        r.mode = MODE_ENCRYPT;
+        r.stage = STAGE_BODY;
+        r.length = size;
+        aes_generate_iv(r.iv);
+
+        std::array<uint8_t, KEY_BUFFER_SIZE> key = { 0 };
+        derive_key(password, r.iv, key.data());
+        aes_ctr_expand_key(key.data(), (uint32_t *) exp_key.data(), crypt_provider());
+
+        // the hash of the key goes into the checksum in plain, into the trailer encrypted
+        uint8_t counter[AES_BLOCK_SIZE];
+        memcpy(counter, r.iv, AES_BLOCK_SIZE);
+        hash_key(key.data(), r.key_hash);
+        CHECKSUM::context ctx;
+        CHECKSUM::init(ctx);
+        CHECKSUM::update(ctx, r.key_hash, SHA256::HASH_SIZE);
+        CHECKSUM::save_state(ctx, r.ctx);
+        aes_ctr_enc(r.key_hash, r.key_hash, (uint32_t *) exp_key.data(), counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+    }
+
+    process(fd, journal, r, pages, (uint32_t *) exp_key.data(), bufsize, resume);
+}
+
+void decrypt_in_place(const std::string &fname, const std::string &password, uint64_t bufsize) {
+    FileDescriptor fd(fname, O_RDWR);
+    Journal journal(fname + JOURNAL_SUFFIX, bufsize);
+    alignas(16) std::array<uint8_t, AES_EXP_KEY_BUFFER_SIZE> exp_key = { 0 };
+
+    journal_record r;
+    std::vector<uint64_t> pages;
+    const bool resume = load_journal(journal, r, pages, MODE_DECRYPT, password, (uint32_t *) exp_key.data());
+    if (!resume) {
+        const uint64_t size = fd.size();
+        if (!has_trailer(fd, size)) {
+            throw std::runtime_error("file has not been encrypted in place");
+        }
+
+        memset(&r, 0, sizeof(journal_record));
+        r.mode = MODE_DECRYPT;
+        r.stage = STAGE_BODY;
+        r.length = size - INPLACE_TRAILER_SIZE;
+
+        uint8_t trailer[INPLACE_TRAILER_SIZE];
+        pread_full(trailer, INPLACE_TRAILER_SIZE, r.length, fd);
+        memcpy(r.checksum, trailer, CHECKSUM::HASH_SIZE);
+        memcpy(r.iv, trailer + CHECKSUM::HASH_SIZE, AES_BLOCK_SIZE);
+        memcpy(r.key_hash, trailer + CHECKSUM::HASH_SIZE + AES_BLOCK_SIZE, SHA256::HASH_SIZE);
+
+        std::array<uint8_t, KEY_BUFFER_SIZE> key = { 0 };
+        derive_key(password, r.iv, key.data());
+        aes_ctr_expand_key(key.data(), (uint32_t *) exp_key.data(), crypt_provider());
+
+        // check if the key hashes match
+        uint8_t hash_of_key[SHA256::HASH_SIZE];
+        uint8_t key_hash[SHA256::HASH_SIZE];
+        uint8_t counter[AES_BLOCK_SIZE];
+        hash_key(key.data(), hash_of_key);
+        memcpy(key_hash, r.key_hash, SHA256::HASH_SIZE);
+        memcpy(counter, r.iv, AES_BLOCK_SIZE);
+        aes_ctr_dec(key_hash, key_hash, (uint32_t *) exp_key.data(), counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+        if (memcmp(key_hash, hash_of_key, SHA256::HASH_SIZE) != 0) {
+            throw std::runtime_error("invalid password or compromised iv");
+        }
+
+        CHECKSUM::context ctx;
+        CHECKSUM::init(ctx);
+        CHECKSUM::update(ctx, hash_of_key, SHA256::HASH_SIZE);
+        CHECKSUM::save_state(ctx, r.ctx);
+    }
+
+    process(fd, journal, r, pages, (uint32_t *) exp_key.data(), bufsize, resume);
+}
@@ -0,0 +1,39 @@
+#ifndef __INPLACE_HPP
+#define __INPLACE_HPP
+
+#include <crypt.hpp>
+#include <cstdint>
+#include <string>
+
+// files encrypted in place end with a trailer instead of starting with the header, so the
+// body does not have to be shifted:
+// E(plain text) | E(checksum) | iv | E(threefold hash of key) | magic
+#define INPLACE_MAGIC           "ACRYPTIP"
+#define INPLACE_MAGIC_SIZE      (8)
+#define INPLACE_TRAILER_SIZE    (CHECKSUM::HASH_SIZE + HEADER_SIZE + INPLACE_MAGIC_SIZE)
+
+// the journal lives next to the file while it is being processed
+#define JOURNAL_SUFFIX          ".acrypt-journal"
+
+/***
+ * Encrypt a file where it sits, the file grows by INPLACE_TRAILER_SIZE bytes only.
+ * The file is processed in chunks of bufsize bytes, before a chunk is overwritten the
+ * progress and a digest of every page of the chunk are written to the journal and
+ * synced. If the process dies, the next call with the same file and password rolls
+ * the pages of the interrupted chunk back and resumes from there.
+ * @param fname
+ * @param password
+ * @param bufsize chunk size, a multiple of 4096
+ */
+extern void encrypt_in_place(const std::string &fname, const std::string &password, uint64_t bufsize);
+
+/***
+ * Decrypt a file that has been encrypted by encrypt_in_place(), the trailer is cut off
+ * at the end. Interrupted runs are resumed the same way.
+ * @param fname
+ * @param password
+ * @param bufsize chunk size, a multiple of 4096
+ */
+extern void decrypt_in_place(const std::string &fname, const std::string &password, uint64_t bufsize);
+
+#endif // __INPLACE_HPP
@@ -0,0 +1,31 @@
+#include <kdf.hpp>
+#include <cstring>
+
+// number of SHA256 rounds of the key derivation
+#define KDF_ROUNDS      (8192)
+
+void derive_key(const std::string &password, const uint8_t *iv, uint8_t *key) {
+    // salted password aka password + salt must be at least 32 Bytes
+    // if shorted, '#' is appended until 32 Bytes are reached, it is hashed as it goes
+    // instead of being put together on the heap first
+    SHA256::context ctx;
+    SHA256::init(ctx);
+    SHA256::update(ctx, iv, AES_BLOCK_SIZE);
+    SHA256::update(ctx, password.data(), password.size());
+    for (size_t i = password.size() + AES_BLOCK_SIZE; i < SHA256::HASH_SIZE; ++i) {
+        SHA256::update(ctx, "#", 1);
+    }
+    SHA256::final(ctx, key);
+
+    // every round hashes the first half of the previous hash only, the key is the whole
+    // last hash (this is what the file format has always used, it must stay that way)
+    for (int i = 1; i < KDF_ROUNDS; ++i) {
+        SHA256::hash(key, AES_BLOCK_SIZE, key);
+    }
+}
+
+void hash_key(const uint8_t *key, uint8_t *key_hash) {
+    SHA256::hash(key, AES_KEY_SIZE, key_hash);
+    SHA256::hash(key_hash, SHA256::HASH_SIZE, key_hash);
+    SHA256::hash(key_hash, SHA256::HASH_SIZE, key_hash);
+}
@@ -0,0 +1,27 @@
+#ifndef __KDF_HPP
+#define __KDF_HPP
+
+#include <aes.hpp>
+#include <Hash.hpp>
+#include <cstdint>
+#include <string>
+
+// size of the derived key, the cipher uses all 32 bytes
+#define KEY_BUFFER_SIZE (SHA256::HASH_SIZE)
+
+/***
+ * derive the key from the password, the iv doubles as salt
+ * @param password
+ * @param iv
+ * @param key buffer of KEY_BUFFER_SIZE bytes
+ */
+extern void derive_key(const std::string &password, const uint8_t *iv, uint8_t *key);
+
+/***
+ * threefold SHA256 hash of the key as stored in the header
+ * @param key
+ * @param key_hash buffer of SHA256::HASH_SIZE bytes
+ */
+extern void hash_key(const uint8_t *key, uint8_t *key_hash);
+
+#endif // __KDF_HPP
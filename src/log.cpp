@@ -0,0 +1,348 @@
+#include <log.hpp>
+#include <pipe.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+static void counter_from(const uint8_t *iv, uint64_t block, uint8_t *counter) {
+    memcpy(counter, iv, AES_BLOCK_SIZE);
+    aes_ctr_advance(counter, block);
+}
+
+static uint64_t file_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        throw std::runtime_error("unable to stat file");
+    }
+    return (uint64_t) st.st_size;
+}
+
+/***
+ * Key, expanded key and tag key of a log, the password is checked against the header.
+ */
+struct LogKeys {
+    std::array<uint8_t, KEY_BUFFER_SIZE> key;
+    alignas(16) std::array<uint8_t, AES_EXP_KEY_BUFFER_SIZE> exp_key;
+    HMAC_SHA256::context mac;
+
+    LogKeys(const std::string &password, const uint8_t *iv) {
+        key.fill(0);
+        exp_key.fill(0);
+        derive_key(password, iv, key.data());
+        aes_ctr_expand_key(key.data(), (uint32_t *) exp_key.data(), crypt_provider());
+
+        // the tags use a key of their own, derived from the key of the cipher
+        static const char label[] = "acrypt log segment tag";
+        uint8_t mac_key[SHA256::HASH_SIZE];
+        SHA256::context ctx;
+        SHA256::init(ctx);
+        SHA256::update(ctx, key.data(), KEY_BUFFER_SIZE);
+        SHA256::update(ctx, label, sizeof(label) - 1);
+        SHA256::final(ctx, mac_key);
+        HMAC_SHA256::init(mac, mac_key, SHA256::HASH_SIZE);
+    }
+
+    const uint32_t *expanded() const {
+        return (const uint32_t *) exp_key.data();
+    }
+
+    void check(const log_header &header) const {
+        uint8_t hash_of_key[SHA256::HASH_SIZE];
+        uint8_t key_hash[SHA256::HASH_SIZE];
+        uint8_t counter[AES_BLOCK_SIZE];
+        hash_key(key.data(), hash_of_key);
+        memcpy(key_hash, header.key_hash, SHA256::HASH_SIZE);
+        memcpy(counter, header.iv, AES_BLOCK_SIZE);
+        aes_ctr_dec(key_hash, key_hash, expanded(), counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+        if (memcmp(key_hash, hash_of_key, SHA256::HASH_SIZE) != 0) {
+            throw std::runtime_error("invalid password or compromised iv");
+        }
+    }
+};
+
+// the tags chain the segments, none can be dropped, swapped or replaced unnoticed but the
+// ones at the end
+static void segment_tag(const HMAC_SHA256::context &mac, const log_header &header, const uint8_t *previous,
+                        const log_segment_head &head, const uint8_t *data, uint8_t *tag) {
+    HMAC_SHA256::context ctx = mac;
+    uint8_t digest[HMAC_SHA256::HASH_SIZE];
+    HMAC_SHA256::update(ctx, &header, sizeof(log_header));
+    HMAC_SHA256::update(ctx, previous, LOG_TAG_SIZE);
+    HMAC_SHA256::update(ctx, &head, sizeof(log_segment_head));
+    HMAC_SHA256::update(ctx, data, head.length);
+    HMAC_SHA256::final(ctx, digest);
+    memcpy(tag, digest, LOG_TAG_SIZE);
+}
+
+static void read_header(int fd, log_header &header) {
+    if (pread_full((uint8_t *) &header, sizeof(log_header), 0, fd) < sizeof(log_header)) {
+        throw std::runtime_error("insufficient file size");
+    }
+    if (memcmp(header.magic, LOG_MAGIC, LOG_MAGIC_SIZE) != 0) {
+        throw std::runtime_error("not a file of the log format");
+    }
+    if (header.header_size < sizeof(log_header)) {
+        throw std::runtime_error("invalid log header");
+    }
+}
+
+static uint64_t segment_blocks(uint64_t length) {
+    return (length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+}
+
+/***
+ * read the segment at offset and check it against the chain
+ * @param fd
+ * @param header
+ * @param keys
+ * @param offset
+ * @param size of the file
+ * @param previous tag of the segment before, zero for the first one
+ * @param counter the segment has to start with
+ * @param tail receives the tail of the segment
+ * @param buffer receives its data and tail
+ * @return false if it is incomplete or its tag does not check out
+ */
+static bool segment_valid(int fd, const log_header &header, const LogKeys &keys, uint64_t offset, uint64_t size,
+                          const uint8_t *previous, uint64_t counter, log_segment_tail &tail, std::vector<uint8_t> &buffer) {
+    log_segment_head head;
+    if (offset + sizeof(log_segment_head) + sizeof(log_segment_tail) > size ||
+        pread_full((uint8_t *) &head, sizeof(log_segment_head), offset, fd) < sizeof(log_segment_head) ||
+        head.counter != counter || head.length > LOG_MAX_SEGMENT_SIZE ||
+        head.length > size - offset - sizeof(log_segment_head) - sizeof(log_segment_tail)) {
+        return false;
+    }
+    buffer.resize(head.length + sizeof(log_segment_tail));
+    if (pread_full(buffer.data(), buffer.size(), offset + sizeof(log_segment_head), fd) < buffer.size()) {
+        return false;
+    }
+    uint8_t tag[LOG_TAG_SIZE];
+    memcpy(&tail, buffer.data() + head.length, sizeof(log_segment_tail));
+    segment_tag(keys.mac, header, previous, head, buffer.data(), tag);
+    return tail.counter == head.counter && tail.length == head.length && memcmp(tag, tail.tag, LOG_TAG_SIZE) == 0;
+}
+
+/***
+ * Find the end of the last segment whose tag checks out. The last segment is found from
+ * the end of the file and checked against the tail of the one before, if that fails an
+ * append has been interrupted and the chain is walked from the first segment on.
+ * @param fd
+ * @param header
+ * @param keys
+ * @param size of the file
+ * @param previous receives the tag of the last valid segment
+ * @param counter receives the counter behind it
+ * @return end of the last valid segment
+ */
+static uint64_t valid_end(int fd, const log_header &header, const LogKeys &keys, uint64_t size, uint8_t *previous,
+                          uint64_t &counter) {
+    log_segment_tail tail;
+    std::vector<uint8_t> buffer;
+    if (size >= header.header_size + sizeof(log_segment_head) + sizeof(log_segment_tail) &&
+        pread_full((uint8_t *) &tail, sizeof(log_segment_tail), size - sizeof(log_segment_tail), fd) == sizeof(log_segment_tail) &&
+        tail.length <= size - header.header_size - sizeof(log_segment_head) - sizeof(log_segment_tail)) {
+        const uint64_t offset = size - sizeof(log_segment_tail) - tail.length - sizeof(log_segment_head);
+        log_segment_tail before;
+        memset(&before, 0, sizeof(log_segment_tail));
+        before.counter = LOG_SEGMENT_COUNTER;
+        if (offset == header.header_size ||
+            (offset >= header.header_size + sizeof(log_segment_head) + sizeof(log_segment_tail) &&
+             pread_full((uint8_t *) &before, sizeof(log_segment_tail), offset - sizeof(log_segment_tail), fd) == sizeof(log_segment_tail))) {
+            const uint64_t expected = offset == header.header_size ? LOG_SEGMENT_COUNTER : before.counter + segment_blocks(before.length);
+            if (segment_valid(fd, header, keys, offset, size, before.tag, expected, tail, buffer)) {
+                memcpy(previous, tail.tag, LOG_TAG_SIZE);
+                counter = tail.counter + segment_blocks(tail.length);
+                return size;
+            }
+        }
+    }
+
+    uint64_t end = header.header_size;
+    memset(previous, 0, LOG_TAG_SIZE);
+    counter = LOG_SEGMENT_COUNTER;
+    while (segment_valid(fd, header, keys, end, size, previous, counter, tail, buffer)) {
+        end += sizeof(log_segment_head) + tail.length + sizeof(log_segment_tail);
+        memcpy(previous, tail.tag, LOG_TAG_SIZE);
+        counter = tail.counter + segment_blocks(tail.length);
+    }
+    return end;
+}
+
+bool is_log(const std::string &fname) {
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    char magic[LOG_MAGIC_SIZE];
+    const bool log = pread_full((uint8_t *) magic, LOG_MAGIC_SIZE, 0, fd) == LOG_MAGIC_SIZE &&
+                     memcmp(magic, LOG_MAGIC, LOG_MAGIC_SIZE) == 0;
+    close(fd);
+    return log;
+}
+
+void log_append(int in, const std::string &fname, const std::string &password, uint64_t segment_size) {
+    if (segment_size == 0 || segment_size > LOG_MAX_SEGMENT_SIZE) {
+        throw std::runtime_error("invalid segment size");
+    }
+    FileDescriptor fd(fname, O_RDWR | O_CREAT);
+    while (flock(fd, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            throw std::runtime_error("unable to lock '" + fname + "'");
+        }
+    }
+
+    log_header header;
+    std::unique_ptr<LogKeys> keys;
+    uint8_t previous[LOG_TAG_SIZE] = { 0 };
+    uint64_t counter = LOG_SEGMENT_COUNTER;
+    uint64_t end = fd.size();
+    if (end == 0) {
+        memset(&header, 0, sizeof(log_header));
+        memcpy(header.magic, LOG_MAGIC, LOG_MAGIC_SIZE);
+        header.header_size = sizeof(log_header);
+        aes_generate_iv(header.iv);
+        keys.reset(new LogKeys(password, header.iv));
+
+        uint8_t iv[AES_BLOCK_SIZE];
+        memcpy(iv, header.iv, AES_BLOCK_SIZE);
+        hash_key(keys->key.data(), header.key_hash);
+        aes_ctr_enc(header.key_hash, header.key_hash, keys->expanded(), iv, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+        pwrite_full((const uint8_t *) &header, sizeof(log_header), 0, fd);
+        if (fdatasync(fd) < 0) {
+            throw std::runtime_error("unable to sync '" + fname + "'");
+        }
+        end = sizeof(log_header);
+    } else {
+        read_header(fd, header);
+        keys.reset(new LogKeys(password, header.iv));
+        keys->check(header);
+
+        // an interrupted append leaves at most one partial segment behind, it is cut off;
+        // anything more is not the trace of an append
+        if (end < header.header_size) {
+            throw std::runtime_error("insufficient file size");
+        } else if (end > header.header_size) {
+            const uint64_t valid = valid_end(fd, header, *keys, end, previous, counter);
+            if (end - valid > sizeof(log_segment_head) + LOG_MAX_SEGMENT_SIZE + sizeof(log_segment_tail)) {
+                throw std::runtime_error("corrupted segment at offset " + std::to_string(valid));
+            }
+            if (valid < end && (ftruncate(fd, (off_t) valid) < 0 || fdatasync(fd) < 0)) {
+                throw std::runtime_error("unable to truncate '" + fname + "'");
+            }
+            end = valid;
+        }
+    }
+
+    // head | data | tail, the last block of the data is encrypted as a whole
+    std::vector<uint8_t> buffer(sizeof(log_segment_head) + segment_size + AES_BLOCK_SIZE + sizeof(log_segment_tail));
+    uint8_t *data = buffer.data() + sizeof(log_segment_head);
+    while (true) {
+        const ssize_t n = read(in, data, segment_size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("unable to read from input");
+        } else if (n == 0) {
+            break;
+        }
+
+        log_segment_head head = { counter, (uint64_t) n };
+        uint8_t iv[AES_BLOCK_SIZE];
+        counter_from(header.iv, counter, iv);
+        aes_ctr_enc(data, data, keys->expanded(), iv, (head.length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+
+        log_segment_tail tail;
+        tail.counter = head.counter;
+        tail.length = head.length;
+        segment_tag(keys->mac, header, previous, head, data, tail.tag);
+        memcpy(buffer.data(), &head, sizeof(log_segment_head));
+        memcpy(data + head.length, &tail, sizeof(log_segment_tail));
+
+        // a segment is on disk before the next one is started, a crash tears the last one only
+        const uint64_t size = sizeof(log_segment_head) + head.length + sizeof(log_segment_tail);
+        pwrite_full(buffer.data(), size, end, fd);
+        if (fdatasync(fd) < 0) {
+            throw std::runtime_error("unable to sync '" + fname + "'");
+        }
+        end += size;
+        memcpy(previous, tail.tag, LOG_TAG_SIZE);
+        counter += segment_blocks(head.length);
+    }
+}
+
+/***
+ * wait until the file has grown to size bytes
+ * @param fd
+ * @param size
+ * @param follow
+ * @return false if it has not and is not followed
+ */
+static bool wait_for(int fd, uint64_t size, bool follow) {
+    while (file_size(fd) < size) {
+        if (!follow) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FOLLOW_INTERVAL));
+    }
+    return true;
+}
+
+void log_decrypt(int in, int out, const std::string &password, bool follow) {
+    log_header header;
+    read_header(in, header);
+    const LogKeys keys(password, header.iv);
+    keys.check(header);
+
+    uint8_t previous[LOG_TAG_SIZE] = { 0 };
+    uint64_t counter = LOG_SEGMENT_COUNTER;
+    uint64_t offset = header.header_size;
+    std::vector<uint8_t> buffer;
+    while (true) {
+        log_segment_head head;
+        if (!wait_for(in, offset + sizeof(log_segment_head), follow)) {
+            if (file_size(in) == offset) {
+                return;
+            }
+            throw std::runtime_error("the log ends within a segment");
+        }
+        pread_full((uint8_t *) &head, sizeof(log_segment_head), offset, in);
+        if (head.counter != counter || head.length > LOG_MAX_SEGMENT_SIZE) {
+            throw std::runtime_error("corrupted segment at offset " + std::to_string(offset));
+        }
+
+        const uint64_t end = offset + sizeof(log_segment_head) + head.length + sizeof(log_segment_tail);
+        if (!wait_for(in, end, follow)) {
+            throw std::runtime_error("the log ends within a segment");
+        }
+        buffer.resize(head.length + sizeof(log_segment_tail));
+        pread_full(buffer.data(), buffer.size(), offset + sizeof(log_segment_head), in);
+
+        log_segment_tail tail;
+        uint8_t tag[LOG_TAG_SIZE];
+        memcpy(&tail, buffer.data() + head.length, sizeof(log_segment_tail));
+        segment_tag(keys.mac, header, previous, head, buffer.data(), tag);
+        if (tail.counter != head.counter || tail.length != head.length || memcmp(tag, tail.tag, LOG_TAG_SIZE) != 0) {
+            throw std::runtime_error("corrupted segment at offset " + std::to_string(offset));
+        }
+
+        // the tail behind the data is room enough for the last block
+        uint8_t iv[AES_BLOCK_SIZE];
+        counter_from(header.iv, counter, iv);
+        aes_ctr_dec(buffer.data(), buffer.data(), keys.expanded(), iv, (head.length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+        write_full(out, buffer.data(), head.length);
+
+        memcpy(previous, tail.tag, LOG_TAG_SIZE);
+        counter += (head.length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+        offset = end;
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef __LOG_HPP
+#define __LOG_HPP
+
+#include <crypt.hpp>
+#include <cstdint>
+#include <string>
+
+// layout of the append-only (log) format, data is added as segments that continue the
+// key stream and are authenticated one by one, earlier bytes are never touched:
+// header | segment 0 | segment 1 | ...
+// segment: head | E(data) | tail
+#define LOG_MAGIC               "ACRYPT\x03"    // including the terminating zero
+#define LOG_MAGIC_SIZE          (8)
+#define LOG_MAX_SEGMENT_SIZE    (UINT64_C(1) << 30)
+
+// bytes of the HMAC-SHA256 kept as tag
+#define LOG_TAG_SIZE            (16)
+
+// counters relative to iv, the first segment starts at 2 right behind the hash of the key
+#define LOG_SEGMENT_COUNTER     (UINT64_C(2))
+
+// how often --follow looks for new segments, in milliseconds
+#define LOG_FOLLOW_INTERVAL     (200)
+
+/***
+ * plain header, only the hash of the key is encrypted
+ */
+struct log_header {
+    char magic[LOG_MAGIC_SIZE];
+    uint32_t header_size;                   // offset of the first segment
+    uint32_t reserved;
+    uint8_t iv[AES_BLOCK_SIZE];
+    uint8_t key_hash[SHA256::HASH_SIZE];    // threefold hash of key, encrypted with counter iv + 0
+};
+
+/***
+ * in front of the data of a segment
+ */
+struct log_segment_head {
+    uint64_t counter;                       // counter of the first block, relative to iv
+    uint64_t length;                        // plain bytes
+};
+
+/***
+ * behind the data of a segment, so that the last segment is found from the end of the file
+ */
+struct log_segment_tail {
+    uint64_t counter;
+    uint64_t length;
+    uint8_t tag[LOG_TAG_SIZE];              // HMAC of header, tag of the previous segment, head and data
+};
+
+/***
+ * check if a file starts with the magic of the log format
+ * @param fname
+ * @return
+ */
+extern bool is_log(const std::string &fname);
+
+/***
+ * Append everything read from in to the log file, in segments of at most segment_size
+ * bytes. The file is created if it does not exist, else only its header and its last
+ * segment are read; a partial segment left behind by an interrupted append is cut off.
+ * Every segment is synced before the next one is written. Input that arrives in pieces
+ * (pipes) becomes a segment per piece, so that followers see it right away. Appends to
+ * the same file are serialized with flock.
+ * @param in
+ * @param fname
+ * @param password
+ * @param segment_size
+ */
+extern void log_append(int in, const std::string &fname, const std::string &password, uint64_t segment_size);
+
+/***
+ * Decrypt the segments of a log file in order, every segment is authenticated before
+ * its plain text is written. A log that ends within a segment is an error, unless the
+ * log is followed.
+ * @param in
+ * @param out
+ * @param password
+ * @param follow do not stop at the end of the file, wait for segments to be appended
+ * (like tail -f)
+ */
+extern void log_decrypt(int in, int out, const std::string &password, bool follow);
+
+#endif // __LOG_HPP
@@ -0,0 +1,228 @@
+#include <lz.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define LZ_MIN_MATCH        (4)
+#define LZ_MAX_OFFSET       (65535)
+#define LZ_HASH_BITS        (14)
+
+// the entropy estimate looks at this many bytes at most, in pieces spread over the block
+#define LZ_SAMPLE_SIZE      (16 * 1024)
+#define LZ_SAMPLE_PIECE     (256)
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+    return (v * UINT32_C(2654435761)) >> (32 - LZ_HASH_BITS);
+}
+
+double lz_entropy(const uint8_t *data, size_t size) {
+    if (size == 0) {
+        return 0.0;
+    }
+
+    // four histograms side by side, so that runs of equal bytes do not stall on
+    // the same counter
+    uint32_t counts[4][256] = { { 0 } };
+    const size_t step = size > LZ_SAMPLE_SIZE ? size / (LZ_SAMPLE_SIZE / LZ_SAMPLE_PIECE) : LZ_SAMPLE_PIECE;
+    size_t total = 0;
+    for (size_t begin = 0; begin < size; begin += step) {
+        const uint8_t *p = data + begin;
+        const size_t n = std::min<size_t>(LZ_SAMPLE_PIECE, size - begin) & ~(size_t) 3;
+        for (size_t i = 0; i < n; i += 4) {
+            ++counts[0][p[i]];
+            ++counts[1][p[i + 1]];
+            ++counts[2][p[i + 2]];
+            ++counts[3][p[i + 3]];
+        }
+        total += n;
+    }
+    if (total == 0) {
+        return 0.0;
+    }
+
+    double entropy = 0.0;
+    for (int c = 0; c < 256; ++c) {
+        const uint32_t count = counts[0][c] + counts[1][c] + counts[2][c] + counts[3][c];
+        if (count > 0) {
+            const double p = (double) count / (double) total;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy;
+}
+
+// lengths that do not fit into the token continue in bytes of 255
+static inline uint8_t *write_length(uint8_t *op, const uint8_t *oend, size_t len) {
+    while (len >= 255) {
+        if (op >= oend) {
+            return nullptr;
+        }
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) {
+        return nullptr;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+static inline size_t read_length(const uint8_t *&ip, const uint8_t *iend) {
+    size_t len = 0;
+    uint8_t b;
+    do {
+        if (ip >= iend) {
+            throw std::runtime_error("malformed compressed data");
+        }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+// token (literal length << 4 | match length - 4), literals, offset, the last sequence has no match
+static inline uint8_t *write_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, size_t num_literals,
+                                      size_t offset, size_t match_length) {
+    if (op >= oend) {
+        return nullptr;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t) (std::min<size_t>(num_literals, 15) << 4);
+    if (num_literals >= 15 && (op = write_length(op, oend, num_literals - 15)) == nullptr) {
+        return nullptr;
+    }
+    if ((size_t) (oend - op) < num_literals) {
+        return nullptr;
+    }
+    memcpy(op, literals, num_literals);
+    op += num_literals;
+    if (match_length == 0) {
+        return op;
+    }
+
+    if (oend - op < 2) {
+        return nullptr;
+    }
+    *op++ = (uint8_t) offset;
+    *op++ = (uint8_t) (offset >> 8);
+    const size_t len = match_length - LZ_MIN_MATCH;
+    *token |= (uint8_t) std::min<size_t>(len, 15);
+    if (len >= 15) {
+        op = write_length(op, oend, len - 15);
+    }
+    return op;
+}
+
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t max_size) {
+    // positions relative to src, a stale entry is caught by comparing the bytes
+    std::vector<uint32_t> table(1 << LZ_HASH_BITS, 0);
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *const iend = src + size;
+    uint8_t *op = dst;
+    const uint8_t *const oend = dst + max_size;
+
+    while (iend - ip >= LZ_MIN_MATCH) {
+        const uint32_t h = hash32(read32(ip));
+        const uint8_t *candidate = src + table[h];
+        table[h] = (uint32_t) (ip - src);
+        if (candidate >= ip || ip - candidate > LZ_MAX_OFFSET || read32(candidate) != read32(ip)) {
+            // step further the longer nothing matched, incompressible data passes quickly
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        // extend the match word by word
+        const uint8_t *m = ip + LZ_MIN_MATCH;
+        const uint8_t *c = candidate + LZ_MIN_MATCH;
+        while (iend - m >= 8) {
+            const uint64_t diff = read64(m) ^ read64(c);
+            if (diff != 0) {
+                m += __builtin_ctzll(diff) >> 3;
+                goto found;
+            }
+            m += 8;
+            c += 8;
+        }
+        while (m < iend && *m == *c) {
+            ++m;
+            ++c;
+        }
+        found:
+
+        op = write_sequence(op, oend, anchor, ip - anchor, ip - candidate, m - ip);
+        if (op == nullptr) {
+            return 0;
+        }
+        ip = anchor = m;
+    }
+
+    op = write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    return op == nullptr ? 0 : op - dst;
+}
+
+size_t lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t max_size) {
+    const uint8_t *ip = src;
+    const uint8_t *const iend = src + size;
+    uint8_t *op = dst;
+    uint8_t *const oend = dst + max_size;
+
+    while (true) {
+        if (ip >= iend) {
+            throw std::runtime_error("malformed compressed data");
+        }
+        const uint8_t token = *ip++;
+
+        size_t num_literals = token >> 4;
+        if (num_literals == 15) {
+            num_literals += read_length(ip, iend);
+        }
+        if (num_literals > (size_t) (iend - ip) || num_literals > (size_t) (oend - op)) {
+            throw std::runtime_error("malformed compressed data");
+        }
+        memcpy(op, ip, num_literals);
+        ip += num_literals;
+        op += num_literals;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            throw std::runtime_error("malformed compressed data");
+        }
+        const size_t offset = ip[0] | ((size_t) ip[1] << 8);
+        ip += 2;
+        size_t match_length = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            match_length += read_length(ip, iend);
+        }
+        if (offset == 0 || offset > (size_t) (op - dst) || match_length > (size_t) (oend - op)) {
+            throw std::runtime_error("malformed compressed data");
+        }
+        const uint8_t *match = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, match, match_length);
+        } else {
+            // overlapping, the bytes just written are copied again
+            for (size_t i = 0; i < match_length; ++i) {
+                op[i] = match[i];
+            }
+        }
+        op += match_length;
+    }
+    return op - dst;
+}
@@ -0,0 +1,40 @@
+#ifndef __LZ_HPP
+#define __LZ_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+// blocks whose bytes look more random than this are not worth compressing
+#define LZ_ENTROPY_LIMIT    (7.5)
+
+/***
+ * Shannon entropy of the byte distribution of a block, estimated from evenly spaced
+ * samples of it. Cheap enough to run on every block before deciding to compress.
+ * @param data
+ * @param size
+ * @return bits per byte, 0 to 8
+ */
+extern double lz_entropy(const uint8_t *data, size_t size);
+
+/***
+ * Compress a block with a fast greedy LZ77 coder (sequences of literals and matches
+ * of at least 4 bytes within the last 64 KiB, in the manner of LZ4).
+ * @param src
+ * @param size
+ * @param dst
+ * @param max_size capacity of dst
+ * @return compressed size, 0 if it would exceed max_size
+ */
+extern size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t max_size);
+
+/***
+ * Decompress a block, malformed input is rejected with std::runtime_error
+ * @param src
+ * @param size
+ * @param dst
+ * @param max_size capacity of dst
+ * @return decompressed size
+ */
+extern size_t lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t max_size);
+
+#endif // __LZ_HPP
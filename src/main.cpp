@@ -9,18 +9,41 @@
 #include <utils.hpp>
 #include <fstream>
 #include <array>
+#include <iomanip>
+#include <uring.hpp>
+#include <buffer_pool.hpp>
+#include <pipe.hpp>
+#include <net.hpp>
+#include <crypt.hpp>
+#include <cpu.hpp>
+#include <provider.hpp>
+#include <inplace.hpp>
+#include <checkpoint.hpp>
+#include <stripe.hpp>
+#include <batch.hpp>
+#include <archive.hpp>
+#include <chunked.hpp>
+#include <log.hpp>
+#include <repo.hpp>
+#include <reader.hpp>
+#include <verify.hpp>
+#include <daemon.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <utility>
 
-#define ENCRYPTION              0
-#define DECRYPTION              1
+// size of the I/O transfers, the crypto loops work on smaller tiles of them (see cpu_tile_size)
+#define DEFAULT_BUF_SIZE        (4 * 1024 * 1024)
 
-#define DEFAULT_BUF_SIZE        (1000 * AES_BLOCK_SIZE)
+// I/O buffers are multiples of the page size
+#define PAGE_SIZE_BYTES         (4096)
 
-// what kind of checksum shall be used
-// SHA1 means less security but better performance
-// use SHA256 for the reverse
-#define PERFORMANCE     SHA1
-#define SECURITY        SHA256
-#define CHECKSUM        PERFORMANCE
+// I/O backends
+#define IO_AUTO                 0
+#define IO_STDIO                1
+#define IO_URING                2
+#define IO_PIPE                 3
 
 // Macro used for hex dumping byte arrays
 /*
@@ -60,6 +83,15 @@ static size_t _write(const uint8_t *ptr, uint32_t num_bytes, FILE *f) {
     return b;
 }
 
+// open a file with O_DIRECT if the file system supports it
+static int open_direct(const std::string &fname, int flags) {
+    int fd = open(fname.c_str(), flags | O_DIRECT, 0666);
+    if (fd < 0 && errno == EINVAL) {
+        fd = open(fname.c_str(), flags, 0666);
+    }
+    return fd;
+}
+
 static bool iequals(const std::string &str1, const std::string &str2) {
     return str2.size() == str2.size() ? std::equal(str1.begin(), str1.end(), str2.begin(), [](char a, char b) -> bool {
         return std::tolower(a) == std::tolower(b);
@@ -71,7 +103,10 @@ static uint64_t get_buffersize(const std::string &str) {
         auto str1 = str.substr(0, str.size() - 1);
         uint64_t mult;
         switch (str.back()) {
-            case 'M': {
+            case 'G': {
+                mult = 1000000000;
+                break;
+            } case 'M': {
                 mult = 1000000;
                 break;
             } case 'K': {
@@ -103,55 +138,103 @@ static std::string read_password(const std::string &fname) {
     return contents;
 }
 
-static void encrypt_file(uint8_t *iv, FILE *in, FILE *out, uint8_t *key, uint32_t *exp_key, uint64_t bufsize) {
-    // allocate buffer
-    auto *buffer = (uint8_t*) malloc(bufsize);
-    unsigned buffer_size = 0;
+static std::string json_escape(const std::string &str) {
+    static const char hex[] = "0123456789abcdef";
+    std::string escaped;
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += (char) c;
+        } else if (c < 0x20) {
+            escaped += "\\u00";
+            escaped += hex[c >> 4];
+            escaped += hex[c & 15];
+        } else {
+            escaped += (char) c;
+        }
+    }
+    return escaped;
+}
+
+/***
+ * report the SHA-256 of the plain text of a file, as a line in the format of sha256sum
+ * appended to fname or as a JSON object on STDERR if fname is "-"
+ * @param fname
+ * @param input_filename
+ * @param digest
+ */
+static void write_digest(const std::string &fname, const std::string &input_filename, SHA256::context &digest) {
+    static const char hex[] = "0123456789abcdef";
+    uint8_t hash[SHA256::HASH_SIZE];
+    SHA256::final(digest, hash);
+    std::string str;
+    for (uint8_t b : hash) {
+        str += hex[b >> 4];
+        str += hex[b & 15];
+    }
+
+    if (fname == "-") {
+        std::cerr << "{\"file\":\"" << json_escape(input_filename) << "\",\"sha256\":\"" << str << "\"}" << std::endl;
+        return;
+    }
+    std::ofstream out(fname, std::ios::app);
+    out << str << "  " << input_filename << '\n';
+    if (!out) {
+        throw std::runtime_error("unable to write digest to '" + fname + "'");
+    }
+}
+
+// room in front of the decryption buffer for the bytes held back from the previous read
+#define PORCH_SIZE      (64)
+
+// room behind a buffer to append the checksum
+#define SLACK_SIZE      (64)
+
+static void encrypt_file(uint8_t *iv, FILE *in, FILE *out, uint8_t *key, uint32_t *exp_key, uint64_t bufsize,
+                         SHA256::context *digest) {
+    // borrow buffer, bufsize is a multiple of the block size
+    PoolBuffer pool_buffer(bufsize + SLACK_SIZE);
+    uint8_t *buffer = pool_buffer.data();
+    uint64_t buffer_size = 0;
 
     // threefold hashing
-    SHA256::hash(key, AES_KEY_SIZE, buffer);
-    SHA256::hash(buffer, SHA256::HASH_SIZE, buffer);
-    SHA256::hash(buffer, SHA256::HASH_SIZE, buffer);
+    hash_key(key, buffer);
     buffer_size = SHA256::HASH_SIZE;
 
     // hash of file content
     CHECKSUM::context ctx;
     CHECKSUM::init(ctx);
 
-    // we attempt to fill up the buffer with as many bytes from input as possible
-    // then the hash is updated and the full blocks of the input get encrypted
-    // and written to output
-    while (!feof(in)) {
-        buffer_size += _read(buffer + buffer_size, (uint32_t) (bufsize - buffer_size), in);
-
-        const unsigned num_blocks = buffer_size / AES_BLOCK_SIZE;
-        CHECKSUM::update(ctx, buffer, num_blocks * AES_BLOCK_SIZE);
-        aes_ctr_enc(buffer, buffer, exp_key, iv, num_blocks);
-
-        _write(buffer, num_blocks * AES_BLOCK_SIZE, out);
-
-        // reduce buffer size and copy leftover bytes (those that did not form a complete block)
-        // to the beginning of the buffer
-        buffer_size -= num_blocks * AES_BLOCK_SIZE;
-        for (int i = 0; i < (int) buffer_size; ++i) {
-            buffer[i] = buffer[(num_blocks * AES_BLOCK_SIZE) + i];
+    // fill up the buffer with as many bytes from input as possible, as long as it gets
+    // filled completely it holds whole blocks only and nothing is left over, the
+    // hash of the key in front of the first one is not part of the digest
+    uint64_t start = SHA256::HASH_SIZE / AES_BLOCK_SIZE;
+    while (true) {
+        buffer_size += _read(buffer + buffer_size, bufsize - buffer_size, in);
+        if (buffer_size < bufsize) {
+            break;
         }
+        encrypt_blocks(ctx, buffer, start, exp_key, iv);
+        encrypt_blocks(ctx, buffer + start * AES_BLOCK_SIZE, buffer_size / AES_BLOCK_SIZE - start, exp_key, iv, digest);
+        _write(buffer, buffer_size, out);
+        buffer_size = 0;
+        start = 0;
     }
 
-    // finish checksum to buffer
-    CHECKSUM::update(ctx, buffer, buffer_size);
-    CHECKSUM::final(ctx, buffer + buffer_size);
-    buffer_size += SHA1::HASH_SIZE;
+    // end of input, encrypt the whole blocks and then the remaining bytes together with the checksum
+    const uint64_t num_blocks = buffer_size / AES_BLOCK_SIZE;
+    encrypt_blocks(ctx, buffer, start, exp_key, iv);
+    encrypt_blocks(ctx, buffer + start * AES_BLOCK_SIZE, num_blocks - start, exp_key, iv, digest);
+
+    encrypt_tail(ctx, buffer + num_blocks * AES_BLOCK_SIZE, buffer_size - num_blocks * AES_BLOCK_SIZE, exp_key, iv, digest);
 
-    // encrypt checksum and remaining bytes in buffer
-    aes_ctr_enc(buffer, buffer, exp_key, iv, 3);
-    _write(buffer, buffer_size, out);
+    _write(buffer, buffer_size + CHECKSUM::HASH_SIZE, out);
 }
 
 static void decrypt_file(uint8_t *iv, FILE *in, FILE *out, uint8_t *key, uint32_t *exp_key, uint64_t bufsize) {
-    // allocate buffer
-    auto *buffer = (uint8_t*) malloc(bufsize);
-    unsigned buffer_size = 0;
+    // borrow buffer, reads always go to 'buffer', held back bytes are moved into the porch in front of it
+    PoolBuffer pool_buffer(PORCH_SIZE + bufsize + SLACK_SIZE);
+    uint8_t *buffer = pool_buffer.data() + PORCH_SIZE;
 
     if (_read(buffer, SHA256::HASH_SIZE, in) < SHA256::HASH_SIZE) {
         // unable to read hash of key from file due to not enough bytes available
@@ -160,9 +243,7 @@ static void decrypt_file(uint8_t *iv, FILE *in, FILE *out, uint8_t *key, uint32_
 
     // check if the key hashes match
     uint8_t hash_of_key[AES_KEY_SIZE];
-    SHA256::hash(key, AES_KEY_SIZE, hash_of_key);
-    SHA256::hash(hash_of_key, AES_KEY_SIZE, hash_of_key);
-    SHA256::hash(hash_of_key, AES_KEY_SIZE, hash_of_key);
+    hash_key(key, hash_of_key);
     aes_ctr_dec(buffer, buffer, exp_key, iv, 2);
     if (memcmp(buffer, hash_of_key, AES_KEY_SIZE) != 0) {
         throw std::runtime_error("invalid password or compromised iv");
@@ -172,63 +253,527 @@ static void decrypt_file(uint8_t *iv, FILE *in, FILE *out, uint8_t *key, uint32_
     CHECKSUM::init(ctx);
     CHECKSUM::update(ctx, hash_of_key, SHA256::HASH_SIZE);
 
-    // empty buffer
-    buffer_size = 0;
+    // data is the start of the unprocessed bytes, the last CHECKSUM::HASH_SIZE bytes
+    // seen so far might be the checksum and are held back
+    uint8_t *data = buffer;
+    uint64_t held = 0;
+    while (true) {
+        const uint64_t n = _read(buffer, bufsize, in);
+        const uint64_t available = held + n;
+        if (n < bufsize) {
+            // end of input, the last bytes form the checksum
+            if (available < CHECKSUM::HASH_SIZE) {
+                throw std::runtime_error("insufficient file size");
+            }
+            const uint64_t body = available - CHECKSUM::HASH_SIZE;
+            const uint64_t num_blocks = body / AES_BLOCK_SIZE;
+            decrypt_blocks(ctx, data, num_blocks, exp_key, iv);
+
+            decrypt_tail(ctx, data + num_blocks * AES_BLOCK_SIZE, body - num_blocks * AES_BLOCK_SIZE, exp_key, iv);
+            _write(data, body, out);
 
-    while (!feof(in)) {
-        buffer_size += _read(buffer + buffer_size, (uint32_t) (bufsize - buffer_size), in);
+            // check if checksum in file matches the checksum computed from the decrypted file
+            // if they mismatch this maight be due to the file being corrupted or an error occurred
+            uint8_t checksum[CHECKSUM::HASH_SIZE];
+            CHECKSUM::final(ctx, checksum);
+            if (memcmp(checksum, data + body, CHECKSUM::HASH_SIZE) != 0) {
+                throw std::runtime_error("checksum mismatch, file may be corrupted");
+            }
+            return;
+        }
 
-        // do not treat the last 20 bytes as normal file content as it is the SHA-1 checksum
-        const unsigned num_blocks = (unsigned) (buffer_size - SHA1::HASH_SIZE) / AES_BLOCK_SIZE;
-        aes_ctr_dec(buffer, buffer, exp_key, iv, num_blocks);
-        CHECKSUM::update(ctx, buffer, num_blocks * AES_BLOCK_SIZE);
+        // do not treat the last 20 bytes as normal file content as they may be the checksum
+        const uint64_t num_blocks = (available - CHECKSUM::HASH_SIZE) / AES_BLOCK_SIZE;
+        decrypt_blocks(ctx, data, num_blocks, exp_key, iv);
+        _write(data, num_blocks * AES_BLOCK_SIZE, out);
 
-        _write(buffer, num_blocks * AES_BLOCK_SIZE, out);
+        // the held back bytes end the buffer, they go right in front of it for the next read
+        held = available - num_blocks * AES_BLOCK_SIZE;
+        data = buffer - held;
+        memcpy(data, buffer + bufsize - held, held);
+    }
+}
 
-        // reduce buffer size and copy leftover bytes (those that did not form a complete block and possible hash bytes)
-        // to the beginning of the buffer
-        buffer_size -= num_blocks * AES_BLOCK_SIZE;
-        for (int i = 0; i < (int) buffer_size; ++i) {
-            buffer[i] = buffer[(num_blocks * AES_BLOCK_SIZE) + i];
+/***
+ * io_uring variant of encrypt_file, the input is read with O_DIRECT (if available)
+ * and the output is written behind the header
+ */
+static void encrypt_file_uring(uint8_t *iv, int in, int out, uint8_t *key, uint32_t *exp_key, uint64_t bufsize,
+                               SHA256::context *digest) {
+    struct stat st;
+    if (fstat(in, &st) < 0) {
+        throw std::runtime_error("unable to stat input file");
+    }
+    const uint64_t length = (uint64_t) st.st_size;
+
+    // write iv and threefold hash of key
+    uint8_t header[HEADER_SIZE];
+    uint8_t *key_hash = header + AES_BLOCK_SIZE;
+    memcpy(header, iv, AES_BLOCK_SIZE);
+    hash_key(key, key_hash);
+
+    CHECKSUM::context ctx;
+    CHECKSUM::init(ctx);
+    CHECKSUM::update(ctx, key_hash, SHA256::HASH_SIZE);
+
+    aes_ctr_enc(key_hash, key_hash, exp_key, iv, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+    pwrite_full(header, HEADER_SIZE, 0, out);
+
+    UringPipeline pipeline(in, 0, out, HEADER_SIZE, length, bufsize);
+    uint64_t consumed = 0;
+    uint8_t *data;
+    size_t n;
+    while ((n = pipeline.next(data)) > 0) {
+        consumed += n;
+        const uint64_t num_blocks = n / AES_BLOCK_SIZE;
+        encrypt_blocks(ctx, data, num_blocks, exp_key, iv, digest);
+        if (consumed == length) {
+            // the last chunk carries the checksum, there is enough slack behind it
+            encrypt_tail(ctx, data + num_blocks * AES_BLOCK_SIZE, n - num_blocks * AES_BLOCK_SIZE, exp_key, iv, digest);
+            pipeline.commit(n + CHECKSUM::HASH_SIZE);
+        } else {
+            pipeline.commit(n);
         }
     }
+    pipeline.finish();
 
-    aes_ctr_dec(buffer, buffer, exp_key, iv, (buffer_size + 15) / AES_BLOCK_SIZE);
-    _write(buffer, (uint32_t) (buffer_size - SHA1::HASH_SIZE), out);
+    if (length == 0) {
+        uint8_t checksum[2 * AES_BLOCK_SIZE];
+        encrypt_tail(ctx, checksum, 0, exp_key, iv);
+        pwrite_full(checksum, CHECKSUM::HASH_SIZE, HEADER_SIZE, out);
+    }
+}
 
-    // the last 20 bytes / 160 bit form the checksum
-    uint8_t checksum[SHA1::HASH_SIZE];
-    CHECKSUM::update(ctx, buffer, buffer_size - SHA1::HASH_SIZE);
-    CHECKSUM::final(ctx, checksum);
+/***
+ * io_uring variant of decrypt_file, the output is written with O_DIRECT (if available),
+ * the iv must already have been read from the input
+ */
+static void decrypt_file_uring(uint8_t *iv, int in, int out, uint8_t *key, uint32_t *exp_key, uint64_t bufsize) {
+    struct stat st;
+    if (fstat(in, &st) < 0) {
+        throw std::runtime_error("unable to stat input file");
+    }
+    if ((uint64_t) st.st_size < HEADER_SIZE + CHECKSUM::HASH_SIZE) {
+        throw std::runtime_error("insufficient file size");
+    }
+    const uint64_t length = (uint64_t) st.st_size - HEADER_SIZE - CHECKSUM::HASH_SIZE;
+
+    // check if the key hashes match
+    uint8_t key_hash[SHA256::HASH_SIZE];
+    uint8_t hash_of_key[SHA256::HASH_SIZE];
+    hash_key(key, hash_of_key);
+    pread_full(key_hash, SHA256::HASH_SIZE, AES_BLOCK_SIZE, in);
+    aes_ctr_dec(key_hash, key_hash, exp_key, iv, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+    if (memcmp(key_hash, hash_of_key, SHA256::HASH_SIZE) != 0) {
+        throw std::runtime_error("invalid password or compromised iv");
+    }
+
+    CHECKSUM::context ctx;
+    CHECKSUM::init(ctx);
+    CHECKSUM::update(ctx, hash_of_key, SHA256::HASH_SIZE);
+
+    // the stored checksum is decrypted together with the last chunk
+    uint8_t stored[2 * AES_BLOCK_SIZE];
+    pread_full(stored, CHECKSUM::HASH_SIZE, HEADER_SIZE + length, in);
+
+    UringPipeline pipeline(in, HEADER_SIZE, out, 0, length, bufsize);
+    uint64_t consumed = 0;
+    uint8_t *data;
+    size_t n;
+    while ((n = pipeline.next(data)) > 0) {
+        consumed += n;
+        const uint64_t num_blocks = n / AES_BLOCK_SIZE;
+        decrypt_blocks(ctx, data, num_blocks, exp_key, iv);
+        if (consumed == length) {
+            memcpy(data + n, stored, CHECKSUM::HASH_SIZE);
+            decrypt_tail(ctx, data + num_blocks * AES_BLOCK_SIZE, n - num_blocks * AES_BLOCK_SIZE, exp_key, iv);
+            memcpy(stored, data + n, CHECKSUM::HASH_SIZE);
+        }
+        pipeline.commit(n);
+    }
+    pipeline.finish();
 
-    // check if checksum in file matches the checksum computed from the decrypted file
-    // if they mismatch this maight be due to the file being corrupted or an error occurred
-    if (memcmp(checksum, buffer + (buffer_size - SHA1::HASH_SIZE), SHA1::HASH_SIZE) != 0) {
+    if (length == 0) {
+        decrypt_tail(ctx, stored, 0, exp_key, iv);
+    }
+
+    uint8_t checksum[CHECKSUM::HASH_SIZE];
+    CHECKSUM::final(ctx, checksum);
+    if (memcmp(checksum, stored, CHECKSUM::HASH_SIZE) != 0) {
         throw std::runtime_error("checksum mismatch, file may be corrupted");
     }
 }
 
+/***
+ * pipe variant of encrypt_file, reads with read(2) straight into the buffers
+ * the output is written from
+ */
+static void encrypt_file_pipe(uint8_t *iv, int in, int out, uint8_t *key, uint32_t *exp_key, uint64_t bufsize,
+                              SHA256::context *digest) {
+    pipe_grow(in);
+    PipeWriter writer(out, bufsize);
+    const size_t capacity = writer.buffer_size();
+
+    // the first buffer starts with iv and threefold hash of key
+    uint8_t *buffer = writer.acquire();
+    uint8_t *key_hash = buffer + AES_BLOCK_SIZE;
+    memcpy(buffer, iv, AES_BLOCK_SIZE);
+    hash_key(key, key_hash);
+
+    CHECKSUM::context ctx;
+    CHECKSUM::init(ctx);
+    CHECKSUM::update(ctx, key_hash, SHA256::HASH_SIZE);
+    aes_ctr_enc(key_hash, key_hash, exp_key, iv, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+
+    size_t start = HEADER_SIZE;
+    while (true) {
+        const size_t buffer_size = start + read_full(in, buffer + start, capacity - start);
+        uint8_t *data = buffer + start;
+        const size_t n = buffer_size - start;
+        const uint64_t num_blocks = n / AES_BLOCK_SIZE;
+        encrypt_blocks(ctx, data, num_blocks, exp_key, iv, digest);
+
+        if (buffer_size < capacity) {
+            // end of input, append checksum (buffers have enough slack)
+            encrypt_tail(ctx, data + num_blocks * AES_BLOCK_SIZE, n - num_blocks * AES_BLOCK_SIZE, exp_key, iv, digest);
+            writer.write(buffer, buffer_size + CHECKSUM::HASH_SIZE);
+            break;
+        }
+
+        // capacity and header size are multiples of the block size, there is no tail
+        writer.write(buffer, buffer_size);
+        buffer = writer.acquire();
+        start = 0;
+    }
+}
+
+/***
+ * pipe variant of decrypt_file, the iv must already have been read from the input
+ */
+static void decrypt_file_pipe(uint8_t *iv, int in, int out, uint8_t *key, uint32_t *exp_key, uint64_t bufsize) {
+    pipe_grow(in);
+    PipeWriter writer(out, bufsize);
+    const size_t capacity = writer.buffer_size();
+
+    uint8_t key_hash[SHA256::HASH_SIZE];
+    if (read_full(in, key_hash, SHA256::HASH_SIZE) < SHA256::HASH_SIZE) {
+        throw std::runtime_error("insufficient file size");
+    }
+
+    // check if the key hashes match
+    uint8_t hash_of_key[SHA256::HASH_SIZE];
+    hash_key(key, hash_of_key);
+    aes_ctr_dec(key_hash, key_hash, exp_key, iv, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+    if (memcmp(key_hash, hash_of_key, SHA256::HASH_SIZE) != 0) {
+        throw std::runtime_error("invalid password or compromised iv");
+    }
+
+    CHECKSUM::context ctx;
+    CHECKSUM::init(ctx);
+    CHECKSUM::update(ctx, hash_of_key, SHA256::HASH_SIZE);
+
+    uint8_t *buffer = writer.acquire();
+    size_t buffer_size = 0;
+    while (true) {
+        buffer_size += read_full(in, buffer + buffer_size, capacity - buffer_size);
+
+        if (buffer_size < capacity) {
+            // end of input, the last bytes form the checksum
+            if (buffer_size < CHECKSUM::HASH_SIZE) {
+                throw std::runtime_error("insufficient file size");
+            }
+            const size_t n = buffer_size - CHECKSUM::HASH_SIZE;
+            const uint64_t num_blocks = n / AES_BLOCK_SIZE;
+            decrypt_blocks(ctx, buffer, num_blocks, exp_key, iv);
+            decrypt_tail(ctx, buffer + num_blocks * AES_BLOCK_SIZE, n - num_blocks * AES_BLOCK_SIZE, exp_key, iv);
+            writer.write(buffer, n);
+
+            uint8_t checksum[CHECKSUM::HASH_SIZE];
+            CHECKSUM::final(ctx, checksum);
+            if (memcmp(checksum, buffer + n, CHECKSUM::HASH_SIZE) != 0) {
+                throw std::runtime_error("checksum mismatch, file may be corrupted");
+            }
+            break;
+        }
+
+        // hold back what may be the checksum and the bytes of an incomplete block
+        const size_t n = ((buffer_size - CHECKSUM::HASH_SIZE) / AES_BLOCK_SIZE) * AES_BLOCK_SIZE;
+        decrypt_blocks(ctx, buffer, n / AES_BLOCK_SIZE, exp_key, iv);
+
+        // carry the held back bytes over to the next buffer before the pages go to the pipe
+        uint8_t *next = writer.acquire();
+        buffer_size -= n;
+        memcpy(next, buffer + n, buffer_size);
+        writer.write(buffer, n);
+        buffer = next;
+    }
+}
+
+/***
+ * encrypt or decrypt a small regular file with encrypt_small / decrypt_small
+ * @param mode ENCRYPTION or DECRYPTION
+ * @param input_filename
+ * @param output_filename
+ * @param password
+ * @param size size of the input
+ * @param digest_filename where the SHA-256 of the plain text goes, empty for none
+ * @return exit code
+ */
+static int small_file(int mode, const std::string &input_filename, const std::string &output_filename,
+                      const std::string &password, uint64_t size, const std::string &digest_filename) {
+    SHA256::context digest;
+    SHA256::init(digest);
+    int in_fd = -1;
+    int out_fd = -1;
+    try {
+        in_fd = open(input_filename.c_str(), O_RDONLY);
+        if (in_fd < 0) {
+            throw std::runtime_error("unable to open input file");
+        }
+        out_fd = open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out_fd < 0) {
+            throw std::runtime_error("unable to open output file");
+        }
+        if (mode == ENCRYPTION) {
+            encrypt_small(in_fd, out_fd, size, password, digest_filename.empty() ? nullptr : &digest);
+        } else {
+            decrypt_small(in_fd, out_fd, size, password);
+        }
+        close(in_fd);
+        close(out_fd);
+        if (!digest_filename.empty()) {
+            write_digest(digest_filename, input_filename, digest);
+        }
+    } catch (std::exception &err) {
+        std::cerr << err.what() << std::endl;
+        if (in_fd >= 0) {
+            close(in_fd);
+        }
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/***
+ * encrypt or decrypt a stream with a socket in place of the input, the output or both,
+ * ciphertext is sent from and received into the buffers of the pipe variants
+ * @param mode ENCRYPTION or DECRYPTION
+ * @param input_filename ignored when listening
+ * @param output_filename ignored when sending
+ * @param send_address where to connect to, empty to write to the output file
+ * @param listen_address where to wait for a connection, empty to read from the input file
+ * @param password
+ * @param bufsize
+ * @param digest_filename where the SHA-256 of the plain text goes, empty for none
+ * @return exit code
+ */
+static int socket_stream(int mode, const std::string &input_filename, const std::string &output_filename,
+                         const std::string &send_address, const std::string &listen_address, const std::string &password,
+                         uint64_t bufsize, const std::string &digest_filename) {
+    SHA256::context digest;
+    SHA256::init(digest);
+    int in_fd = -1;
+    int out_fd = -1;
+    bool done = false;
+    try {
+        if (!listen_address.empty()) {
+            in_fd = net_accept(listen_address);
+        } else {
+            in_fd = input_filename != "-" ? open(input_filename.c_str(), O_RDONLY) : STDIN_FILENO;
+            if (in_fd < 0) {
+                throw std::runtime_error("unable to open input file");
+            }
+        }
+        if (!send_address.empty()) {
+            out_fd = net_connect(send_address);
+        } else {
+            out_fd = output_filename != "-" ? open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666) : STDOUT_FILENO;
+            if (out_fd < 0) {
+                throw std::runtime_error("unable to open output file");
+            }
+        }
+
+        std::array<uint8_t, AES_BLOCK_SIZE> iv = { 0 };
+        if (mode == ENCRYPTION) {
+            aes_generate_iv(iv.data());
+        } else if (read_full(in_fd, iv.data(), iv.size()) < iv.size()) {
+            throw std::runtime_error("insufficient file size");
+        }
+        std::array<uint8_t, KEY_BUFFER_SIZE> key = { 0 };
+        derive_key(password, iv.data(), key.data());
+        alignas(16) std::array<uint8_t, AES_EXP_KEY_BUFFER_SIZE> exp_key = { 0 };
+        aes_ctr_expand_key(key.data(), (uint32_t *) exp_key.data(), crypt_provider());
+
+        if (mode == ENCRYPTION) {
+            encrypt_file_pipe(iv.data(), in_fd, out_fd, key.data(), (uint32_t *) exp_key.data(), bufsize,
+                              digest_filename.empty() ? nullptr : &digest);
+        } else {
+            decrypt_file_pipe(iv.data(), in_fd, out_fd, key.data(), (uint32_t *) exp_key.data(), bufsize);
+        }
+        done = true;
+        if (!digest_filename.empty()) {
+            write_digest(digest_filename, listen_address.empty() ? input_filename : listen_address, digest);
+        }
+    } catch (std::exception &err) {
+        std::cerr << err.what() << std::endl;
+    }
+    if (in_fd >= 0 && in_fd != STDIN_FILENO) {
+        close(in_fd);
+    }
+    if (out_fd >= 0 && out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
+    return done ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/***
+ * the provider of --provider=auto, small regular files are done before another provider
+ * makes up for its setup and the benchmark
+ * @param input_filename
+ * @return
+ */
+static const CipherProvider &auto_provider(const std::string &input_filename) {
+    struct stat st;
+    if (!input_filename.empty() && input_filename != "-" && stat(input_filename.c_str(), &st) == 0 &&
+        S_ISREG(st.st_mode) && (uint64_t) st.st_size < PROVIDER_AUTO_MIN_SIZE) {
+        return aes_builtin_provider;
+    }
+    return cipher_fastest();
+}
+
 static void print_help() {
   std::cout << "acrypt [options...] <input file> <output file>" << std::endl;
   std::cout << "options:" << std::endl;
   std::cout << "if \'-\' is given as a filename, STDIN/STOUT is used " << std::endl;
   std::cout << "--encrypt, -e                encrpytion mode" << std::endl;
   std::cout << "--decrypt, -d                decryption mode" << std::endl;
-  std::cout << "--buffersize=SIZE, -bs SIZE  set buffer size (e.g. -bs 4M)" << std::endl;
+  std::cout << "--buffersize=SIZE, -bs SIZE  set I/O buffer size (e.g. -bs 4M), default is 4 MiB" << std::endl;
+  std::cout << "--memlimit=SIZE              upper bound of the memory used for I/O buffers, default is 512M" << std::endl;
+  std::cout << "--tilesize=SIZE, -ts SIZE    set size of the tiles the buffers are processed in," << std::endl
+            << "                             default is half of the L2 cache" << std::endl;
   std::cout << "--password=PASS, -p PASS     set password, if no password is specified then" << std::endl
             << "                             a prompt opens and it can be entered safely" << std::endl;
   std::cout << "--file=FILE, -f FILE         read plain text password from file" << std::endl;
+  std::cout << "--io=BACKEND                 set the I/O backend { auto, uring, pipe, stdio }, default is --io=auto" << std::endl
+            << "                             auto uses io_uring if both files are regular files and" << std::endl
+            << "                             read(2)/write(2) with large pipe buffers if STDIN or STDOUT is a pipe" << std::endl;
+  std::cout << "--provider=NAME              AES-256 CTR implementation { auto, builtin, afalg, openssl }, default is" << std::endl
+            << "                             --provider=auto which benchmarks the available ones at startup and takes" << std::endl
+            << "                             the fastest (builtin for files below 64M), --provider=list prints the results" << std::endl;
+  std::cout << "--verify                     check encrypted files without writing any plain text, only the tags" << std::endl
+            << "                             are checked for the v2 format, with -r or --manifest files are" << std::endl
+            << "                             checked in parallel, prints \"<file>: OK\" for every good file" << std::endl;
+  std::cout << "--repo=DIR                   deduplicating backup repository (created by the first -e): -e <input> <name>" << std::endl
+            << "                             stores only the content defined chunks DIR does not have yet and an" << std::endl
+            << "                             encrypted recipe, -d <name> <output> restores the backup" << std::endl;
+  std::cout << "--stripe=DIR[,DIR...]        encrypt into one volume file per directory, written in parallel, the" << std::endl
+            << "                             output file becomes a manifest that -d and --verify read the volumes from" << std::endl;
+  std::cout << "--stripesize=SIZE            bytes of cipher text per stripe of --stripe, default is 64M" << std::endl;
+  std::cout << "--send=ADDRESS               send the output to ADDRESS (HOST:PORT, or the path of a UNIX socket)" << std::endl
+            << "                             instead of writing a file, TCP is written with MSG_ZEROCOPY" << std::endl;
+  std::cout << "--listen=ADDRESS             wait for a --send to connect to ADDRESS ([HOST:]PORT or a path) and" << std::endl
+            << "                             read the input from it instead of a file" << std::endl;
+  std::cout << "--daemon[=SOCKET]            hand the file to a running acryptd instead of doing the work here," << std::endl
+            << "                             works with -e, -d and --verify of a single file" << std::endl;
+  std::cout << "--in-place                   encrypt/decrypt a single file where it sits, the header is kept in" << std::endl
+            << "                             a trailer and progress is journaled in <file>.acrypt-journal," << std::endl
+            << "                             an interrupted run is resumed by running the same command again" << std::endl;
+  std::cout << "--checkpoint[=SIZE]          sync the output and write a checkpoint to <output>.acrypt-checkpoint" << std::endl
+            << "                             every SIZE bytes, default is 1G, needs files of the v1 format" << std::endl;
+  std::cout << "--resume                     continue an interrupted --checkpoint run from its last checkpoint," << std::endl
+            << "                             the output is the same as that of an uninterrupted run" << std::endl;
+  std::cout << "--recursive, -r              encrypt/decrypt all files below the input directory into the" << std::endl
+            << "                             output directory, files are processed in parallel" << std::endl;
+  std::cout << "--manifest=FILE              encrypt/decrypt the files listed in FILE in parallel," << std::endl
+            << "                             one \"<input file>\\t<output file>\" per line" << std::endl;
+  std::cout << "--archive                    pack the input file or directory into one encrypted archive (-e)," << std::endl
+            << "                             or extract all members of the archive below the output directory (-d)" << std::endl;
+  std::cout << "--member=NAME                extract only the member NAME of the archive to the output file" << std::endl;
+  std::cout << "--list                       list the members of the archive" << std::endl;
+  std::cout << "--format=FORMAT              file format of the encryption { v1, v2 }, default is --format=v1," << std::endl
+            << "                             v2 consists of authenticated chunks that can be read at random," << std::endl
+            << "                             holes of sparse files are kept, decryption detects the format" << std::endl;
+  std::cout << "--chunksize=SIZE             plain bytes per chunk of the v2 format, default is 1 MiB" << std::endl;
+  std::cout << "--compress                   compress the chunks before encryption, implies --format=v2," << std::endl
+            << "                             chunks that look random or do not shrink are stored as they are" << std::endl;
+  std::cout << "--digest=FILE                also compute the SHA-256 of the plain text while encrypting (v1 only)," << std::endl
+            << "                             append it to FILE as sha256sum does, or print it as JSON to STDERR (-)," << std::endl
+            << "                             with -r or --manifest one line per file" << std::endl;
+  std::cout << "--wrap                       encrypt with a random key that is wrapped with the password, implies" << std::endl
+            << "                             --format=v2, up to 8 passwords can open the file" << std::endl;
+  std::cout << "--add-key                    let another password (--new-password=PASS, --new-file=FILE or a prompt)" << std::endl
+            << "                             open a --wrap file, only its key slots are rewritten" << std::endl;
+  std::cout << "--change-key                 replace the password of a --wrap file by the new one" << std::endl;
+  std::cout << "--remove-key                 remove the password from a --wrap file" << std::endl;
+  std::cout << "--update                     re-encrypt the v2 output file in place to the new input file," << std::endl
+            << "                             only the chunks that changed are encrypted and written again" << std::endl;
+  std::cout << "--append                     append the input to an encrypted log file (created if missing) as" << std::endl
+            << "                             segments of at most --buffersize bytes, earlier bytes are not touched" << std::endl;
+  std::cout << "--follow                     when decrypting a log file, wait for segments to be appended (like tail -f)" << std::endl;
+  std::cout << "--range=OFFSET:LENGTH        decrypt only LENGTH bytes from OFFSET on of a v2 file," << std::endl
+            << "                             only the chunks covering them are read and checked" << std::endl;
+  std::cout << "--threads=N, -j N            number of worker threads of the batch modes and of v2 encryption," << std::endl
+            << "                             default is one per CPU" << std::endl;
   std::cout << "--hash=HASH, -h HASH         set the type of hash to be used for computing the checksum { none, sha1, sha256 }"<< std::endl
             << "                             default is --hash=sha1" << std::endl;
 }
 
 int main(int argc, const char *argv[]) {
     const std::vector<std::string> args(argv, argv + argc);
+
+    // in-place mode takes a single file, a manifest lists the files itself
+    const bool in_place = std::find(args.begin(), args.end(), "--in-place") != args.end();
+    const bool manifest = std::find_if(args.begin(), args.end(), [](const std::string &arg) -> bool {
+        return starts_with(arg, "--manifest=");
+    }) != args.end();
+    const bool list = std::find(args.begin(), args.end(), "--list") != args.end();
+    const bool verify = std::find(args.begin(), args.end(), "--verify") != args.end();
+    // the passwords of a file with a wrapped key are managed in place
+    const bool key_op = std::find_if(args.begin(), args.end(), [](const std::string &arg) -> bool {
+        return arg == "--add-key" || arg == "--change-key" || arg == "--remove-key";
+    }) != args.end();
+    // a socket takes the place of the output (--send) or of the input (--listen)
+    const size_t num_sockets = std::count_if(args.begin(), args.end(), [](const std::string &arg) -> bool {
+        return starts_with(arg, "--send=") || starts_with(arg, "--listen=");
+    });
+    const size_t num_files = manifest ? 0 : (in_place || list || verify || key_op ? 1 : 2 - std::min<size_t>(num_sockets, 2));
+
     if (argc >= 2 && args[1] == "--help") {
         print_help();
         return EXIT_SUCCESS;
-    } else if (args.size() < 4) {
+    } else if (std::find(args.begin(), args.end(), "--provider=list") != args.end()) {
+        for (const CipherProvider *provider : cipher_providers()) {
+            const double speed = cipher_benchmark(*provider, PROVIDER_BENCHMARK_SIZE);
+            std::cout << provider->name << '\t';
+            if (speed > 0.0) {
+                std::cout << std::fixed << std::setprecision(0) << speed / 1000000.0 << " MB/s" << std::endl;
+            } else {
+                std::cout << "failed the self-test" << std::endl;
+            }
+        }
+        std::cout << "fastest\t" << cipher_fastest().name << std::endl;
+        return EXIT_SUCCESS;
+    } else if (args.size() < 2 + num_files) {
         std::cout << "Usage: " << argv[0] << " [options...] <input file> <output file>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --in-place <file>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] -r <input directory> <output directory>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --manifest=FILE" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --archive <input> <archive>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --archive [--member=NAME] <archive> <output>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --list <archive>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --verify [-r] <file or directory>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --update <input file> <v2 file>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --append <input file> <log file>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --add-key|--change-key|--remove-key <v2 file>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --daemon[=SOCKET] <input file> [<output file>]" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --stripe=DIR,DIR... <input file> <manifest>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --repo=DIR -e <input file> <backup name>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --repo=DIR -d <backup name> <output file>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --send=HOST:PORT <input file>" << std::endl;
+        std::cout << "       " << argv[0] << " [options...] --listen=[HOST:]PORT <output file>" << std::endl;
         return EXIT_FAILURE;
     }
 
@@ -236,8 +781,39 @@ int main(int argc, const char *argv[]) {
     std::string password;
     uint64_t buffer_size = DEFAULT_BUF_SIZE;
     auto hash = Hash::SHA256;
+    bool hash_given = false;
+    int io = IO_AUTO;
+    uint64_t memory_limit = DEFAULT_POOL_CAPACITY;
+    uint64_t tile = 0;
+    bool recursive = false;
+    bool archive = false;
+    std::string member;
+    std::string manifest_filename;
+    size_t num_threads = 0;
+    bool chunked = false;
+    bool compress = false;
+    bool update = false;
+    uint64_t checkpoint_interval = 0;
+    bool resume = false;
+    bool append = false;
+    bool wrap = false;
+    std::string digest_filename;
+    std::string key_command;
+    std::string new_password;
+    bool follow = false;
+    std::string daemon_socket;
+    std::string repo_dir;
+    std::string provider_name = "auto";
+    std::vector<std::string> stripe_dirs;
+    uint64_t stripe_size = STRIPE_DEFAULT_SIZE;
+    std::string send_address;
+    std::string listen_address;
+    uint64_t chunk_size = V2_DEFAULT_CHUNK_SIZE;
+    bool range = false;
+    uint64_t range_offset = 0;
+    uint64_t range_length = 0;
 
-    for (size_t i = 1; i < args.size() - 2; ++i) {
+    for (size_t i = 1; i < args.size() - num_files; ++i) {
         const auto &arg = args[i];
         if (starts_with(arg, "--encrypt") || starts_with(arg, "-e")) {
             mode = ENCRYPTION;
@@ -265,6 +841,22 @@ int main(int argc, const char *argv[]) {
             buffer_size = get_buffersize(args[i + 1]);
             i += 1;
             continue;
+        } else if (starts_with(arg, "--memlimit=")) {
+            auto tokens = split(arg, "=");
+            if (tokens.size() == 2) {
+                memory_limit = get_buffersize(tokens[1]);
+            }
+            continue;
+        } else if (starts_with(arg, "--tilesize=")) {
+            auto tokens = split(arg, "=");
+            if (tokens.size() == 2) {
+                tile = get_buffersize(tokens[1]);
+            }
+            continue;
+        } else if (starts_with(arg, "-ts")) {
+            tile = get_buffersize(args[i + 1]);
+            i += 1;
+            continue;
         } else if (starts_with(arg, "--file=")) {
             auto tokens = split(arg, "=");
             if (tokens.size() == 2) {
@@ -275,7 +867,145 @@ int main(int argc, const char *argv[]) {
             password = read_password(args[i + 1]);
             i += 1;
             continue;
+        } else if (starts_with(arg, "--io=")) {
+            auto tokens = split(arg, "=");
+            if (tokens.size() == 2) {
+                if (tokens[1] == "auto") {
+                    io = IO_AUTO;
+                } else if (tokens[1] == "uring") {
+                    io = IO_URING;
+                } else if (tokens[1] == "pipe") {
+                    io = IO_PIPE;
+                } else if (tokens[1] == "stdio") {
+                    io = IO_STDIO;
+                } else {
+                    std::cerr << "unrecognized I/O backend '" << tokens[1] << '\'' << std::endl;
+                }
+            }
+            continue;
+        } else if (arg == "--verify") {
+            mode = VERIFICATION;
+            continue;
+        } else if (arg == "--in-place") {
+            continue;
+        } else if (arg == "--daemon" || starts_with(arg, "--daemon=")) {
+            daemon_socket = arg == "--daemon" ? daemon_socket_path() : arg.substr(arg.find('=') + 1);
+            continue;
+        } else if (starts_with(arg, "--provider=")) {
+            provider_name = arg.substr(arg.find('=') + 1);
+            continue;
+        } else if (starts_with(arg, "--repo=")) {
+            repo_dir = arg.substr(arg.find('=') + 1);
+            continue;
+        } else if (starts_with(arg, "--stripe=")) {
+            stripe_dirs = split(arg.substr(arg.find('=') + 1), ",");
+            continue;
+        } else if (starts_with(arg, "--stripesize=")) {
+            stripe_size = get_buffersize(arg.substr(arg.find('=') + 1));
+            continue;
+        } else if (starts_with(arg, "--send=")) {
+            send_address = arg.substr(arg.find('=') + 1);
+            continue;
+        } else if (starts_with(arg, "--listen=")) {
+            listen_address = arg.substr(arg.find('=') + 1);
+            continue;
+        } else if (arg == "--update") {
+            mode = ENCRYPTION;
+            update = true;
+            continue;
+        } else if (arg == "--checkpoint" || starts_with(arg, "--checkpoint=")) {
+            checkpoint_interval = arg == "--checkpoint" ? DEFAULT_CHECKPOINT_INTERVAL : get_buffersize(arg.substr(arg.find('=') + 1));
+            continue;
+        } else if (arg == "--resume") {
+            resume = true;
+            continue;
+        } else if (starts_with(arg, "--digest=")) {
+            digest_filename = arg.substr(arg.find('=') + 1);
+            continue;
+        } else if (arg == "--wrap") {
+            // the key slots are part of the chunked format
+            wrap = true;
+            chunked = true;
+            continue;
+        } else if (arg == "--add-key" || arg == "--change-key" || arg == "--remove-key") {
+            mode = ENCRYPTION;
+            key_command = arg;
+            continue;
+        } else if (starts_with(arg, "--new-password=")) {
+            new_password = arg.substr(arg.find('=') + 1);
+            continue;
+        } else if (starts_with(arg, "--new-file=")) {
+            new_password = read_password(arg.substr(arg.find('=') + 1));
+            continue;
+        } else if (arg == "--append") {
+            mode = ENCRYPTION;
+            append = true;
+            continue;
+        } else if (arg == "--follow") {
+            follow = true;
+            continue;
+        } else if (arg == "--archive") {
+            archive = true;
+            continue;
+        } else if (arg == "--list") {
+            continue;
+        } else if (starts_with(arg, "--member=")) {
+            member = arg.substr(arg.find('=') + 1);
+            continue;
+        } else if (arg == "--recursive" || arg == "-r") {
+            recursive = true;
+            continue;
+        } else if (starts_with(arg, "--manifest=")) {
+            auto tokens = split(arg, "=");
+            if (tokens.size() == 2) {
+                manifest_filename = tokens[1];
+            }
+            continue;
+        } else if (starts_with(arg, "--threads=")) {
+            auto tokens = split(arg, "=");
+            if (tokens.size() == 2) {
+                num_threads = strto<size_t>(tokens[1]);
+            }
+            continue;
+        } else if (starts_with(arg, "-j")) {
+            num_threads = strto<size_t>(args[i + 1]);
+            i += 1;
+            continue;
+        } else if (starts_with(arg, "--format=")) {
+            auto tokens = split(arg, "=");
+            if (tokens.size() == 2) {
+                if (tokens[1] == "v1") {
+                    chunked = false;
+                } else if (tokens[1] == "v2") {
+                    chunked = true;
+                } else {
+                    std::cerr << "unrecognized format '" << tokens[1] << '\'' << std::endl;
+                }
+            }
+            continue;
+        } else if (arg == "--compress") {
+            // compression is part of the chunked format
+            compress = true;
+            chunked = true;
+            continue;
+        } else if (starts_with(arg, "--chunksize=")) {
+            auto tokens = split(arg, "=");
+            if (tokens.size() == 2) {
+                chunk_size = get_buffersize(tokens[1]);
+            }
+            continue;
+        } else if (starts_with(arg, "--range=")) {
+            auto tokens = split(arg.substr(arg.find('=') + 1), ":");
+            if (tokens.size() == 2) {
+                range = true;
+                range_offset = strto<uint64_t>(tokens[0]);
+                range_length = get_buffersize(tokens[1]);
+            } else {
+                std::cerr << "invalid range '" << arg << '\'' << std::endl;
+            }
+            continue;
         } else if (starts_with(arg, "--hash=")) {
+            hash_given = true;
             auto tokens = split(arg, "=");
             if (tokens.size() == 2) {
                 if (tokens[1] == "none") {
@@ -290,6 +1020,7 @@ int main(int argc, const char *argv[]) {
             }
             continue;
         } else if (starts_with(arg, "-h")) {
+            hash_given = true;
             if (args[i + 1] == "none") {
                 hash = Hash::NONE;
             } else if (args[i + 1] == "sha1") {
@@ -306,23 +1037,70 @@ int main(int argc, const char *argv[]) {
         }
     }
 
+    if (list) {
+        mode = DECRYPTION;
+    }
+
     if (mode < 0) {
         std::cerr << "mode not specified" << std::endl;
         return EXIT_FAILURE;
     }
 
+    // the plain text is hashed on its single pass through the encryption of a v1 file
+    if (!digest_filename.empty() && (mode != ENCRYPTION || chunked || archive || in_place ||
+                                     update || append || checkpoint_interval > 0 || resume || !key_command.empty() ||
+                                     !daemon_socket.empty() || !stripe_dirs.empty())) {
+        std::cerr << "--digest works with -e of files of the v1 format, single or with -r or --manifest" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if ((!send_address.empty() || !listen_address.empty()) &&
+        (mode == VERIFICATION || chunked || recursive || manifest || archive || list || in_place || update || append ||
+         range || checkpoint_interval > 0 || resume || !key_command.empty() || !daemon_socket.empty())) {
+        std::cerr << "--send and --listen work with -e and -d of a single file of the v1 format" << std::endl;
+        return EXIT_FAILURE;
+    }
+
     if (buffer_size < 256) {
         std::cerr << "invalid buffer size \'" << buffer_size << "\', must be at least 256 Bytes" << std::endl;
         return EXIT_FAILURE;
     }
 
+    // whole pages for the I/O buffers, whole blocks for the tiles
+    buffer_size = (buffer_size + PAGE_SIZE_BYTES - 1) & ~((uint64_t) PAGE_SIZE_BYTES - 1);
+    if (memory_limit < buffer_size) {
+        std::cerr << "memory limit must be at least the buffer size" << std::endl;
+        return EXIT_FAILURE;
+    }
+    BufferPool::global().set_capacity(memory_limit);
+
+    set_tile_size(tile);
+
     // rename filenames
-    const std::string input_filename(argv[argc - 2]);
-    const std::string output_filename(argv[argc - 1]);
+    const std::string input_filename(num_files > 0 ? argv[argc - num_files] : "");
+    const std::string output_filename(num_files > 0 ? argv[argc - 1] : "");
+
+    // the main thread does the I/O, it stays on the node the input device is attached to,
+    // the workers started later are pinned on their own. Small files are done before that
+    // pays off, the topology is not even read from sysfs for them.
+    struct stat input_st;
+    if (!input_filename.empty() && input_filename != "-" &&
+        (stat(input_filename.c_str(), &input_st) != 0 || (uint64_t) input_st.st_size > HEADER_SIZE + SMALL_FILE_SIZE + CHECKSUM::HASH_SIZE) &&
+        cpu_nodes().size() > 1) {
+        cpu_bind_node(cpu_device_node(input_filename));
+    }
+
+    // the provider is fixed before the first key is expanded
+    try {
+        set_crypt_provider(provider_name == "auto" ? auto_provider(input_filename) : cipher_provider(provider_name));
+    } catch (std::runtime_error &err) {
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
 
     // get password
     if (password.empty()) {
-        if (input_filename == "-") {
+        if (input_filename == "-" && listen_address.empty()) {
             std::cerr << "cannot read password when using STDIN as input" << std::endl;
             return EXIT_FAILURE;
         }
@@ -341,71 +1119,582 @@ int main(int argc, const char *argv[]) {
         }
     }
 
-    // open input file, if filename=="-" use stdin
-    FILE *in = input_filename != "-" ? fopen(input_filename.c_str(), "rb") : stdin;
-    if (in == nullptr) {
-        std::cerr << "unable to open input file" << std::endl;
-        exit(EXIT_FAILURE);
+    if (!key_command.empty()) {
+        if (input_filename == "-") {
+            std::cerr << "the passwords of a file can only be managed in place" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (new_password.empty() && key_command != "--remove-key") {
+            const std::string passwd(getpass("enter new password: "));
+            const std::string confrm(getpass("confirm new password: "));
+            if (passwd.empty() || passwd != confrm) {
+                std::cerr << (passwd.empty() ? "empty password is not allowed" : "passwords mismatch") << std::endl;
+                return EXIT_FAILURE;
+            }
+            new_password = passwd;
+        }
+        try {
+            if (key_command == "--add-key") {
+                chunked_add_key(input_filename, password, new_password);
+            } else if (key_command == "--change-key") {
+                chunked_change_key(input_filename, password, new_password);
+            } else {
+                chunked_remove_key(input_filename, password);
+            }
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
     }
 
-    // open output file, if filename=="-" use stdout
-    FILE *out = output_filename != "-" ? fopen(output_filename.c_str(), "wb") : stdout;
-    if (out == nullptr) {
-        std::cerr << "unable to open output file" << std::endl;
-        exit(EXIT_FAILURE);
+    if (!repo_dir.empty()) {
+        // -e <input> <backup name> stores a backup, -d <backup name> <output> restores it
+        if (mode == VERIFICATION || chunked || recursive || manifest || archive || list || in_place || update ||
+            append || range || checkpoint_interval > 0 || resume || !stripe_dirs.empty() || !daemon_socket.empty()) {
+            std::cerr << "--repo works with -e and -d of a single backup" << std::endl;
+            return EXIT_FAILURE;
+        }
+        int fd = mode == ENCRYPTION ? STDIN_FILENO : STDOUT_FILENO;
+        try {
+            const std::string &fname = mode == ENCRYPTION ? input_filename : output_filename;
+            if (fname != "-") {
+                fd = mode == ENCRYPTION ? open(fname.c_str(), O_RDONLY) : open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (fd < 0) {
+                    throw std::runtime_error(mode == ENCRYPTION ? "unable to open input file" : "unable to open output file");
+                }
+            }
+            Repository repo(repo_dir, password, mode == ENCRYPTION);
+            if (mode == ENCRYPTION) {
+                ThreadPool pool(num_threads);
+                repo.backup(fd, output_filename, pool);
+            } else {
+                repo.restore(input_filename, fd);
+            }
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            if (fd != STDIN_FILENO && fd != STDOUT_FILENO && fd >= 0) {
+                close(fd);
+            }
+            return EXIT_FAILURE;
+        }
+        if (fd != STDIN_FILENO && fd != STDOUT_FILENO) {
+            close(fd);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (!send_address.empty() || !listen_address.empty()) {
+        return socket_stream(mode, listen_address.empty() ? input_filename : "", send_address.empty() ? output_filename : "",
+                             send_address, listen_address, password, buffer_size, digest_filename);
+    }
+
+    if (!daemon_socket.empty()) {
+        // the daemon gets the open files, so that relative paths and pipes work as well
+        if (recursive || manifest || archive || list || in_place || update || range) {
+            std::cerr << "--daemon works on a single file" << std::endl;
+            return EXIT_FAILURE;
+        }
+        // the daemon encrypts into the v1 format in one go, it would drop the options below
+        const std::pair<bool, const char *> unsupported[] = {
+                { compress, "--compress" },
+                { wrap, "--wrap" },
+                { chunked, "--format=v2" },
+                { hash_given, "--hash" },
+                { append, "--append" },
+                { checkpoint_interval > 0, "--checkpoint" },
+                { resume, "--resume" },
+                { !stripe_dirs.empty(), "--stripe" }
+        };
+        for (const auto &option : unsupported) {
+            if (option.first) {
+                std::cerr << "--daemon does not support " << option.second << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        std::vector<int> fds;
+        try {
+            fds.push_back(input_filename == "-" ? dup(STDIN_FILENO) : open(input_filename.c_str(), O_RDONLY));
+            if (fds.back() < 0) {
+                throw std::runtime_error("unable to open input file");
+            }
+            if (mode != VERIFICATION) {
+                fds.push_back(output_filename == "-" ? dup(STDOUT_FILENO) : open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666));
+                if (fds.back() < 0) {
+                    throw std::runtime_error("unable to open output file");
+                }
+            }
+            const std::string op = mode == ENCRYPTION ? "encrypt" : (mode == DECRYPTION ? "decrypt" : "verify");
+            const std::string reply = daemon_request(daemon_socket, "op=" + op + "\npassword=" + password, fds);
+            if (!starts_with(reply, "ok\n")) {
+                const size_t begin = starts_with(reply, "error: ") ? 7 : 0;
+                throw std::runtime_error(reply.substr(begin, reply.find_last_not_of('\n') + 1 - begin));
+            }
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            for (int fd : fds) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            return EXIT_FAILURE;
+        }
+        for (int fd : fds) {
+            close(fd);
+        }
+        if (mode == VERIFICATION) {
+            std::cout << input_filename << ": OK" << std::endl;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (mode == VERIFICATION) {
+        size_t failed;
+        try {
+            ThreadPool pool(num_threads);
+            Verifier verifier(pool, password, buffer_size);
+            if (manifest) {
+                verifier.add_manifest(manifest_filename);
+            } else if (recursive) {
+                verifier.add_directory(input_filename);
+            } else {
+                verifier.add(input_filename);
+            }
+            failed = verifier.wait();
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (failed > 0) {
+            std::cerr << failed << " file(s) failed" << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (archive || list) {
+        if (input_filename == "-" || output_filename == "-") {
+            std::cerr << "archives need files" << std::endl;
+            return EXIT_FAILURE;
+        }
+        size_t failed = 0;
+        try {
+            ThreadPool pool(num_threads);
+            if (mode == ENCRYPTION) {
+                archive_create(input_filename, output_filename, password, buffer_size, pool);
+            } else {
+                const ArchiveReader reader(input_filename, password);
+                if (list) {
+                    for (size_t i = 0; i < reader.size(); ++i) {
+                        std::cout << reader.entry(i).length << '\t' << reader.name(reader.entry(i)) << std::endl;
+                    }
+                } else if (!member.empty()) {
+                    const archive_entry *entry = reader.find(member);
+                    if (entry == nullptr) {
+                        throw std::runtime_error("no member '" + member + "' in archive");
+                    }
+                    reader.extract(*entry, output_filename, buffer_size);
+                } else {
+                    failed = reader.extract_all(output_filename, buffer_size, pool);
+                }
+            }
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (failed > 0) {
+            std::cerr << failed << " member(s) failed" << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (recursive || manifest) {
+        if (input_filename == "-" || output_filename == "-") {
+            std::cerr << "batch mode needs directories" << std::endl;
+            return EXIT_FAILURE;
+        }
+        size_t failed;
+        try {
+            ThreadPool pool(num_threads);
+            Batch::digest_t digest;
+            if (!digest_filename.empty()) {
+                digest = [&digest_filename](const std::string &input, SHA256::context &ctx) {
+                    write_digest(digest_filename, input, ctx);
+                };
+            }
+            Batch batch(pool, mode, password, buffer_size, digest);
+            if (manifest) {
+                batch.add_manifest(manifest_filename);
+            } else {
+                batch.add_directory(input_filename, output_filename);
+            }
+            failed = batch.wait();
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (failed > 0) {
+            std::cerr << failed << " file(s) failed" << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (in_place) {
+        if (input_filename == "-") {
+            std::cerr << "in-place mode needs a file" << std::endl;
+            return EXIT_FAILURE;
+        }
+        try {
+            if (mode == ENCRYPTION) {
+                encrypt_in_place(input_filename, password, buffer_size);
+            } else {
+                decrypt_in_place(input_filename, password, buffer_size);
+            }
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (checkpoint_interval > 0 || resume) {
+        if (input_filename == "-" || output_filename == "-" || chunked || mode == VERIFICATION ||
+            recursive || manifest || archive || list || !stripe_dirs.empty()) {
+            std::cerr << "checkpoints work with -e and -d of a single file of the v1 format" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (checkpoint_interval == 0) {
+            checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+        }
+        try {
+            if (mode == ENCRYPTION) {
+                encrypt_checkpointed(input_filename, output_filename, password, buffer_size, checkpoint_interval, resume);
+            } else {
+                decrypt_checkpointed(input_filename, output_filename, password, buffer_size, checkpoint_interval, resume);
+            }
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    // the manifest of a striped file is detected by its first line
+    if (!stripe_dirs.empty() || (mode == DECRYPTION && input_filename != "-" && is_striped(input_filename))) {
+        if (input_filename == "-" || output_filename == "-" || chunked || mode == VERIFICATION ||
+            recursive || manifest || archive || list || update || append) {
+            std::cerr << "stripes work with -e and -d of a single file of the v1 format" << std::endl;
+            return EXIT_FAILURE;
+        }
+        try {
+            if (mode == ENCRYPTION) {
+                if (stripe_size == 0 || stripe_size % AES_BLOCK_SIZE != 0) {
+                    throw std::runtime_error("stripe size must be a multiple of " + std::to_string(AES_BLOCK_SIZE));
+                }
+                stripe_encrypt(input_filename, output_filename, stripe_dirs, password, stripe_size, buffer_size);
+            } else {
+                stripe_decrypt(input_filename, output_filename, password, buffer_size);
+            }
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (update) {
+        int in_fd = STDIN_FILENO;
+        try {
+            if (output_filename == "-" || !is_chunked(output_filename)) {
+                throw std::runtime_error("output is not a file of the v2 format");
+            }
+            if (input_filename != "-") {
+                in_fd = open(input_filename.c_str(), O_RDONLY);
+                if (in_fd < 0) {
+                    throw std::runtime_error("unable to open input file");
+                }
+            }
+            ChunkedFile file(output_filename, password, true);
+            ThreadPool pool(num_threads);
+            file.update(in_fd, pool);
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            if (in_fd != STDIN_FILENO) {
+                close(in_fd);
+            }
+            return EXIT_FAILURE;
+        }
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (append || (mode == DECRYPTION && input_filename != "-" && is_log(input_filename))) {
+        int in_fd = STDIN_FILENO;
+        int out_fd = STDOUT_FILENO;
+        try {
+            if (output_filename == "-") {
+                if (append) {
+                    throw std::runtime_error("appending needs a log file");
+                }
+            } else if (!append) {
+                out_fd = open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (out_fd < 0) {
+                    throw std::runtime_error("unable to open output file");
+                }
+            }
+            if (input_filename != "-") {
+                in_fd = open(input_filename.c_str(), O_RDONLY);
+                if (in_fd < 0) {
+                    throw std::runtime_error("unable to open input file");
+                }
+            }
+            if (append) {
+                log_append(in_fd, output_filename, password, buffer_size);
+            } else {
+                log_decrypt(in_fd, out_fd, password, follow);
+            }
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            if (in_fd != STDIN_FILENO) {
+                close(in_fd);
+            }
+            if (out_fd != STDOUT_FILENO) {
+                close(out_fd);
+            }
+            return EXIT_FAILURE;
+        }
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            close(out_fd);
+        }
+        return EXIT_SUCCESS;
+    } else if (follow) {
+        std::cerr << "--follow needs a log file" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // the chunked format is detected by its magic, it needs a seekable input for decryption
+    if (mode == DECRYPTION && input_filename != "-" && is_chunked(input_filename)) {
+        chunked = true;
+    } else if (mode == DECRYPTION && (chunked || range)) {
+        std::cerr << "input is not a file of the v2 format" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (chunked) {
+        int in_fd = STDIN_FILENO;
+        int out_fd = STDOUT_FILENO;
+        try {
+            if (output_filename != "-") {
+                out_fd = open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (out_fd < 0) {
+                    throw std::runtime_error("unable to open output file");
+                }
+            }
+            if (mode == ENCRYPTION) {
+                if (input_filename != "-") {
+                    in_fd = open(input_filename.c_str(), O_RDONLY);
+                    if (in_fd < 0) {
+                        throw std::runtime_error("unable to open input file");
+                    }
+                }
+                ThreadPool pool(num_threads);
+                chunked_encrypt(in_fd, out_fd, password, chunk_size, compress, wrap, pool);
+            } else if (range) {
+                // the range is streamed through a buffer, chunks are only decrypted once
+                Reader reader(input_filename, password);
+                PoolBuffer pool_buffer(buffer_size);
+                uint64_t offset = range_offset;
+                const uint64_t end = range_offset + std::min(range_length, reader.size() - std::min(range_offset, reader.size()));
+                while (offset < end) {
+                    const size_t n = reader.read_at(offset, pool_buffer.data(), (size_t) std::min(buffer_size, end - offset));
+                    write_full(out_fd, pool_buffer.data(), n);
+                    offset += n;
+                }
+            } else {
+                const ChunkedFile file(input_filename, password);
+                file.decrypt(out_fd);
+            }
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            if (in_fd != STDIN_FILENO) {
+                close(in_fd);
+            }
+            if (out_fd != STDOUT_FILENO) {
+                close(out_fd);
+            }
+            return EXIT_FAILURE;
+        }
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            close(out_fd);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    struct stat in_st, out_st;
+    const bool regular = input_filename != "-" && output_filename != "-" &&
+                         stat(input_filename.c_str(), &in_st) == 0 && S_ISREG(in_st.st_mode) &&
+                         (stat(output_filename.c_str(), &out_st) != 0 || S_ISREG(out_st.st_mode));
+
+    // small regular files are done in a single read and write, setting up a pipeline or
+    // borrowing buffers would cost more than the file itself
+    if (io == IO_AUTO && regular &&
+        (uint64_t) in_st.st_size <= (mode == ENCRYPTION ? SMALL_FILE_SIZE : HEADER_SIZE + SMALL_FILE_SIZE + CHECKSUM::HASH_SIZE)) {
+        return small_file(mode, input_filename, output_filename, password, (uint64_t) in_st.st_size, digest_filename);
+    }
+
+    // io_uring needs regular files on both sides, pipes on STDIN/STDOUT are streamed with
+    // read(2) and write(2), everything else goes through stdio
+    int backend = IO_STDIO;
+    if (io == IO_AUTO || io == IO_URING) {
+        if (regular && UringPipeline::supported()) {
+            backend = IO_URING;
+        } else if (io == IO_URING) {
+            std::cerr << "io_uring is not available, falling back to stdio" << std::endl;
+        }
+    }
+    if (io == IO_PIPE || (io == IO_AUTO && backend == IO_STDIO &&
+                          ((input_filename == "-" && is_pipe(STDIN_FILENO)) ||
+                           (output_filename == "-" && is_pipe(STDOUT_FILENO))))) {
+        backend = IO_PIPE;
+    }
+
+    FILE *in = nullptr;
+    FILE *out = nullptr;
+    int in_fd = -1;
+    int out_fd = -1;
+
+    if (backend == IO_URING) {
+        // O_DIRECT is used for the side whose file offsets are aligned (plaintext starts at offset 0)
+        in_fd = mode == ENCRYPTION ? open_direct(input_filename, O_RDONLY) : open(input_filename.c_str(), O_RDONLY);
+        if (in_fd < 0) {
+            std::cerr << "unable to open input file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        out_fd = mode == DECRYPTION ? open_direct(output_filename, O_WRONLY | O_CREAT | O_TRUNC)
+                                    : open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out_fd < 0) {
+            std::cerr << "unable to open output file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    } else if (backend == IO_PIPE) {
+        in_fd = input_filename != "-" ? open(input_filename.c_str(), O_RDONLY) : STDIN_FILENO;
+        if (in_fd < 0) {
+            std::cerr << "unable to open input file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        out_fd = output_filename != "-" ? open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666) : STDOUT_FILENO;
+        if (out_fd < 0) {
+            std::cerr << "unable to open output file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        // open input file, if filename=="-" use stdin
+        in = input_filename != "-" ? fopen(input_filename.c_str(), "rb") : stdin;
+        if (in == nullptr) {
+            std::cerr << "unable to open input file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        // open output file, if filename=="-" use stdout
+        out = output_filename != "-" ? fopen(output_filename.c_str(), "wb") : stdout;
+        if (out == nullptr) {
+            std::cerr << "unable to open output file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
     }
 
     // generate 16 Byte IV that is also used as a password salt
     std::array<uint8_t, AES_BLOCK_SIZE> iv = { 0 };
     if (mode == ENCRYPTION) {
         aes_generate_iv(iv.data());
-        _write(iv.data(), iv.size(), out);
+        // the io_uring and pipe backends write the whole header themselves
+        if (backend == IO_STDIO) {
+            _write(iv.data(), iv.size(), out);
+        }
     } else {
-        if (_read(iv.data(), iv.size(), in) < iv.size()) {
+        size_t n;
+        if (backend == IO_URING) {
+            n = pread_full(iv.data(), iv.size(), 0, in_fd);
+        } else if (backend == IO_PIPE) {
+            n = read_full(in_fd, iv.data(), iv.size());
+        } else {
+            n = _read(iv.data(), iv.size(), in);
+        }
+        if (n < iv.size()) {
             std::cerr << "insufficient file size" << std::endl;
             exit(EXIT_FAILURE);
         }
-    }
-
-    // salted password aka password + salt must be at least 32 Bytes
-    // if shorted, '#' is appended until 32 Bytes are reached
-    std::vector<uint8_t> salted_password(std::max(password.size() + iv.size(), SHA256::HASH_SIZE));
-    for (int i = 0; i < iv.size(); ++i) {
-        salted_password[i] = iv[i];
-    }
-    for (int i = 0; i < password.size(); ++i) {
-        salted_password[iv.size() + i] = UINT8_C(password[i]);
-    }
-    for (int i = password.size() + iv.size(); i < SHA256::HASH_SIZE; ++i) {
-        salted_password[i] = UINT8_C('#');
+        // files of the v2 format are only detected by name above, the chunks need a seekable input
+        if (input_filename == "-" && memcmp(iv.data(), V2_MAGIC, V2_MAGIC_SIZE) == 0) {
+            std::cerr << "v2 files cannot be read from stdin" << std::endl;
+            exit(EXIT_FAILURE);
+        }
     }
 
     // compute key from password
-    std::array<uint8_t, AES_BLOCK_SIZE> key = { 0 };
-    SHA256::hash(salted_password.data(), salted_password.size(), key.data());
-
-    for (int i = 1; i < 8192; ++i) {
-        SHA256::hash(key.data(), key.size(), key.data());
-    }
+    std::array<uint8_t, KEY_BUFFER_SIZE> key = { 0 };
+    derive_key(password, iv.data(), key.data());
 
     // expand key
-    std::array<uint8_t, AES_EXP_KEY_SIZE> exp_key = { 0 };
-    aes_ctr_expand_key(key.data(), (uint32_t*) exp_key.data());
+    alignas(16) std::array<uint8_t, AES_EXP_KEY_BUFFER_SIZE> exp_key = { 0 };
+    aes_ctr_expand_key(key.data(), (uint32_t*) exp_key.data(), crypt_provider());
+
+    // SHA-256 of the plain text, if asked for
+    SHA256::context digest;
+    SHA256::init(digest);
+    SHA256::context *digest_ptr = digest_filename.empty() ? nullptr : &digest;
 
     // do operation, catch exception
+    bool done = false;
     try {
-        if (mode == ENCRYPTION) {
-            encrypt_file(iv.data(), in, out, key.data(), (uint32_t *) exp_key.data(), buffer_size);
+        if (backend == IO_URING) {
+            if (mode == ENCRYPTION) {
+                encrypt_file_uring(iv.data(), in_fd, out_fd, key.data(), (uint32_t *) exp_key.data(), buffer_size, digest_ptr);
+            } else {
+                decrypt_file_uring(iv.data(), in_fd, out_fd, key.data(), (uint32_t *) exp_key.data(), buffer_size);
+            }
+        } else if (backend == IO_PIPE) {
+            if (mode == ENCRYPTION) {
+                encrypt_file_pipe(iv.data(), in_fd, out_fd, key.data(), (uint32_t *) exp_key.data(), buffer_size, digest_ptr);
+            } else {
+                decrypt_file_pipe(iv.data(), in_fd, out_fd, key.data(), (uint32_t *) exp_key.data(), buffer_size);
+            }
+        } else if (mode == ENCRYPTION) {
+            encrypt_file(iv.data(), in, out, key.data(), (uint32_t *) exp_key.data(), buffer_size, digest_ptr);
         } else {
             decrypt_file(iv.data(), in, out, key.data(), (uint32_t *) exp_key.data(), buffer_size);
         }
-    } catch (std::runtime_error &err) {
+        done = true;
+    } catch (std::exception &err) {
         std::cerr << err.what() << std::endl;
     }
 
     // close files
-    fclose(in);
-    fclose(out);
+    if (backend != IO_STDIO) {
+        close(in_fd);
+        close(out_fd);
+    } else {
+        fclose(in);
+        fclose(out);
+    }
 
-    return EXIT_SUCCESS;
+    if (done && digest_ptr != nullptr) {
+        try {
+            write_digest(digest_filename, input_filename, digest);
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    return done ? EXIT_SUCCESS : EXIT_FAILURE;
 }
\ No newline at end of file
@@ -0,0 +1,180 @@
+#include <net.hpp>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+bool is_socket(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+static bool is_unix(const std::string &address) {
+    return address.find('/') != std::string::npos;
+}
+
+static sockaddr_un unix_address(const std::string &path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("socket path too long");
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return addr;
+}
+
+/***
+ * resolve HOST:PORT or PORT, brackets around IPv6 addresses are removed
+ * @param address
+ * @param passive for bind()
+ * @return to be released with freeaddrinfo()
+ */
+static addrinfo *resolve(const std::string &address, bool passive) {
+    std::string host;
+    std::string port = address;
+    const size_t colon = address.rfind(':');
+    if (colon != std::string::npos) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+    }
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo *result = nullptr;
+    const int err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+    if (err != 0) {
+        throw std::runtime_error("unable to resolve '" + address + "': " + gai_strerror(err));
+    }
+    return result;
+}
+
+// large socket buffers keep the stream going while the other side is busy with a buffer
+static void tune(int fd, bool tcp) {
+    const int size = NET_SOCKET_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (tcp) {
+        // whole buffers are written at once, the end of the stream must not wait for an ack
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+}
+
+int net_connect(const std::string &address) {
+    if (is_unix(address)) {
+        const sockaddr_un addr = unix_address(address);
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("unable to create socket");
+        }
+        tune(fd, false);
+        if (connect(fd, (const sockaddr *) &addr, sizeof(addr)) < 0) {
+            close(fd);
+            throw std::runtime_error("unable to connect to '" + address + "': " + strerror(errno));
+        }
+        return fd;
+    }
+
+    addrinfo *result = resolve(address, false);
+    int fd = -1;
+    int err = 0;
+    for (addrinfo *ai = result; ai != nullptr && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        tune(fd, true);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            err = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        throw std::runtime_error("unable to connect to '" + address + "': " + strerror(err));
+    }
+    return fd;
+}
+
+/***
+ * accept one connection and close the listening socket
+ * @param fd listening socket
+ * @return
+ */
+static int accept_one(int fd) {
+    int conn;
+    do {
+        conn = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+    } while (conn < 0 && errno == EINTR);
+    const int err = errno;
+    close(fd);
+    if (conn < 0) {
+        throw std::runtime_error(std::string("unable to accept a connection: ") + strerror(err));
+    }
+    return conn;
+}
+
+int net_accept(const std::string &address) {
+    if (is_unix(address)) {
+        const sockaddr_un addr = unix_address(address);
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("unable to create socket");
+        }
+        tune(fd, false);
+        if (bind(fd, (const sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+            const int err = errno;
+            close(fd);
+            throw std::runtime_error("unable to listen on '" + address + "': " + strerror(err));
+        }
+        // the path is only needed until the sender is connected
+        try {
+            const int conn = accept_one(fd);
+            unlink(address.c_str());
+            return conn;
+        } catch (...) {
+            unlink(address.c_str());
+            throw;
+        }
+    }
+
+    // the socket buffers of an accepted socket are inherited from the listening one
+    addrinfo *result = resolve(address, true);
+    int fd = -1;
+    int err = 0;
+    for (addrinfo *ai = result; ai != nullptr && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        const int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        tune(fd, true);
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, 1) < 0) {
+            err = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        throw std::runtime_error("unable to listen on '" + address + "': " + strerror(err));
+    }
+    return accept_one(fd);
+}
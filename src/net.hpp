@@ -0,0 +1,31 @@
+#ifndef __NET_HPP
+#define __NET_HPP
+
+#include <string>
+
+// socket buffers asked for on both ends of a stream, the kernel may grant less
+#define NET_SOCKET_BUFFER_SIZE  (4 * 1024 * 1024)
+
+/***
+ * check if the file descriptor refers to a socket
+ * @param fd
+ * @return
+ */
+extern bool is_socket(int fd);
+
+/***
+ * connect a stream socket
+ * @param address HOST:PORT for TCP, a path (containing a '/') for a UNIX socket
+ * @return the connected socket
+ */
+extern int net_connect(const std::string &address);
+
+/***
+ * listen on a stream socket and wait for the one connection to be made, the
+ * listening socket is closed right after
+ * @param address PORT or HOST:PORT for TCP, a path (containing a '/') for a UNIX socket
+ * @return the accepted socket
+ */
+extern int net_accept(const std::string &address);
+
+#endif // __NET_HPP
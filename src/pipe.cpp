@@ -0,0 +1,200 @@
+#include <pipe.hpp>
+#include <net.hpp>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#define PAGE_SIZE_BYTES     (4096)
+
+bool is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+size_t pipe_grow(int fd) {
+    if (!is_pipe(fd)) {
+        return 0;
+    }
+
+    size_t max_size = 1 << 20;
+    std::ifstream in("/proc/sys/fs/pipe-max-size");
+    if (in) {
+        in >> max_size;
+    }
+
+    // the limit may be lower for unprivileged users who own many pipes already
+    for (size_t size = max_size; size > PAGE_SIZE_BYTES; size /= 2) {
+        if (fcntl(fd, F_SETPIPE_SZ, (int) size) >= 0) {
+            break;
+        }
+    }
+
+    const int size = fcntl(fd, F_GETPIPE_SZ);
+    return size > 0 ? (size_t) size : 0;
+}
+
+size_t read_full(int fd, uint8_t *ptr, size_t num_bytes) {
+    size_t b = 0;
+    while (num_bytes) {
+        const ssize_t bytes_read = read(fd, ptr, num_bytes);
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("unable to read from file: ") + strerror(errno));
+        } else if (bytes_read == 0) {
+            break;
+        }
+        num_bytes -= bytes_read;
+        ptr += bytes_read;
+        b += bytes_read;
+    }
+    return b;
+}
+
+void write_full(int fd, const uint8_t *ptr, size_t num_bytes) {
+    while (num_bytes) {
+        const ssize_t bytes_written = write(fd, ptr, num_bytes);
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("unable to write to file: ") + strerror(errno));
+        }
+        num_bytes -= bytes_written;
+        ptr += bytes_written;
+    }
+}
+
+PipeWriter::PipeWriter(int fd, size_t buffer_size) :
+        _fd(fd), _buffer_size((buffer_size + PAGE_SIZE_BYTES - 1) & ~((size_t) PAGE_SIZE_BYTES - 1)) {
+    // pipes are written with write(2): pages handed over with vmsplice() stay referenced for
+    // as long as the reader likes (tee, splice to a file), the ring could overwrite them
+    const bool pipe = pipe_grow(fd) > 0;
+
+    // UNIX sockets do not take the option and are written as usual, on loopback the kernel
+    // copies nonetheless
+    if (!pipe && is_socket(fd)) {
+        const int one = 1;
+        _zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+
+    // with zero copy a few buffers are enough to keep the socket busy while waiting for completions
+    const size_t count = _zerocopy ? 4 : 2;
+    _pending.assign(count, 0);
+
+    // not taken from the BufferPool: pages sent with zero copy may still be referenced by the
+    // socket after the writer is gone, so they must not be handed out again
+    const size_t stride = _buffer_size + PAGE_SIZE_BYTES;
+    _memory_size = count * stride;
+    void *mem = mmap(nullptr, _memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("unable to allocate pipe buffers");
+    }
+    _memory = (uint8_t *) mem;
+    for (size_t i = 0; i < count; ++i) {
+        _buffers.push_back(_memory + i * stride);
+    }
+}
+
+PipeWriter::~PipeWriter() {
+    // pages still referenced by the socket stay valid after unmapping
+    if (_memory != nullptr) {
+        munmap(_memory, _memory_size);
+    }
+}
+
+uint8_t *PipeWriter::acquire() {
+    // the kernel may still be sending from the pages of the buffer
+    while (_zerocopy && (int32_t) (_completed - _pending[_next]) < 0) {
+        reap(true);
+    }
+    uint8_t *buffer = _buffers[_next];
+    _current = _next;
+    _next = (_next + 1) % _buffers.size();
+    return buffer;
+}
+
+void PipeWriter::reap(bool wait) {
+    if (wait) {
+        // the error queue is signaled as POLLERR, which needs not be asked for
+        pollfd pfd = { _fd, 0, 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            throw std::runtime_error(std::string("unable to poll socket: ") + strerror(errno));
+        }
+        if ((pfd.revents & POLLHUP) && !(pfd.revents & POLLERR)) {
+            throw std::runtime_error("connection closed by peer");
+        }
+    }
+    while (true) {
+        char control[CMSG_SPACE(sizeof(sock_extended_err)) + 64];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(_fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            } else if (errno != EINTR) {
+                throw std::runtime_error(std::string("unable to read completions: ") + strerror(errno));
+            }
+            continue;
+        }
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                throw std::runtime_error(std::string("unable to write to socket: ") + strerror(err.ee_errno));
+            }
+            // sends ee_info up to ee_data have completed, TCP completes them in order
+            if ((int32_t) (err.ee_data + 1 - _completed) > 0) {
+                _completed = err.ee_data + 1;
+            }
+        }
+    }
+}
+
+void PipeWriter::write(const uint8_t *ptr, size_t num_bytes) {
+    while (num_bytes) {
+        ssize_t ret;
+        if (_zerocopy) {
+            ret = send(_fd, ptr, num_bytes, MSG_ZEROCOPY | MSG_NOSIGNAL);
+            if (ret >= 0) {
+                _pending[_current] = ++_sent;
+            } else if (errno == ENOBUFS && _completed != _sent) {
+                // too many pages pinned, wait for some to be released
+                reap(true);
+                continue;
+            } else if (errno == ENOBUFS) {
+                ret = send(_fd, ptr, num_bytes, MSG_NOSIGNAL);
+            }
+            if (ret < 0 && errno != EINTR) {
+                throw std::runtime_error(std::string("unable to write to socket: ") + strerror(errno));
+            }
+            reap(false);
+        } else {
+            ret = ::write(_fd, ptr, num_bytes);
+            if (ret < 0 && errno != EINTR) {
+                throw std::runtime_error(std::string("unable to write to file: ") + strerror(errno));
+            }
+        }
+        if (ret > 0) {
+            num_bytes -= ret;
+            ptr += ret;
+        }
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef __PIPE_HPP
+#define __PIPE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// spare bytes behind every buffer, enough to append a checksum
+#define PIPE_SLACK      (64)
+
+/***
+ * check if the file descriptor refers to a pipe or FIFO
+ * @param fd
+ * @return
+ */
+extern bool is_pipe(int fd);
+
+/***
+ * enlarge the pipe buffer as far as allowed (see /proc/sys/fs/pipe-max-size)
+ * @param fd
+ * @return the resulting pipe buffer size in bytes, 0 if fd is no pipe
+ */
+extern size_t pipe_grow(int fd);
+
+/***
+ * read until num_bytes have been read or end of file is reached
+ * @param fd
+ * @param ptr
+ * @param num_bytes
+ * @return number of bytes read
+ */
+extern size_t read_full(int fd, uint8_t *ptr, size_t num_bytes);
+
+/***
+ * write all num_bytes
+ * @param fd
+ * @param ptr
+ * @param num_bytes
+ */
+extern void write_full(int fd, const uint8_t *ptr, size_t num_bytes);
+
+/***
+ * Writes to a file descriptor from a ring of page aligned buffers. If the descriptor
+ * is a pipe, its buffer is enlarged and the pages are copied with write(2).
+ * If the descriptor is a TCP socket, the buffers are sent with MSG_ZEROCOPY and a buffer
+ * is only handed out again once the kernel reported that it is done with its pages.
+ */
+class PipeWriter {
+public:
+
+    PipeWriter(int fd, size_t buffer_size);
+
+    ~PipeWriter();
+
+    PipeWriter(const PipeWriter &) = delete;
+
+    PipeWriter &operator=(const PipeWriter &) = delete;
+
+    /***
+     * get the next buffer of the ring, it has PIPE_SLACK spare bytes behind buffer_size()
+     * @return
+     */
+    uint8_t *acquire();
+
+    /***
+     * write bytes from the buffer returned by the last acquire(), they must not be modified afterwards
+     * @param ptr
+     * @param num_bytes
+     */
+    void write(const uint8_t *ptr, size_t num_bytes);
+
+    size_t buffer_size() const {
+        return _buffer_size;
+    }
+
+    bool zerocopy() const {
+        return _zerocopy;
+    }
+
+private:
+
+    /***
+     * collect the completions of zero copy sends from the error queue of the socket
+     * @param wait block until there is at least one
+     */
+    void reap(bool wait);
+
+    const int _fd;
+    const size_t _buffer_size;
+    uint8_t *_memory = nullptr;
+    size_t _memory_size = 0;
+    std::vector<uint8_t *> _buffers;
+    size_t _next = 0;
+    size_t _current = 0;
+
+    // zero copy sends are numbered by the kernel, a buffer is free again once all sends
+    // up to the one in _pending have completed
+    bool _zerocopy = false;
+    uint32_t _sent = 0;
+    uint32_t _completed = 0;
+    std::vector<uint32_t> _pending;
+
+};
+
+#endif // __PIPE_HPP
@@ -0,0 +1,374 @@
+#include <provider.hpp>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#ifdef ACRYPT_OPENSSL
+#include <dlfcn.h>
+#include <openssl/evp.h>
+#endif
+
+#ifndef SOL_ALG
+#define SOL_ALG     (279)
+#endif
+
+// blocks one EVP_EncryptUpdate is given at most, its length is an int
+#define PROVIDER_OPENSSL_PIECE_BLOCKS   (UINT64_C(1) << 26)
+
+/***
+ * Blocks until the lower 64 bits of the counter wrap. The built-in routines do not carry
+ * into the upper 64 bits, the kernel and OpenSSL do, so their calls must not cross a wrap.
+ * @param iv
+ * @param n blocks wanted
+ * @return n or less
+ */
+static uint64_t blocks_to_wrap(const uint8_t *iv, uint64_t n) {
+    uint64_t low = 0;
+    for (int i = AES_BLOCK_SIZE / 2; i < AES_BLOCK_SIZE; ++i) {
+        low = (low << 8) | iv[i];
+    }
+    const uint64_t left = (uint64_t) 0 - low;
+    return left == 0 ? n : std::min(n, left);
+}
+
+// both other providers keep the plain key as their expanded key
+static void expand_key_plain(const uint8_t *key, uint32_t *exp_key) {
+    memcpy(exp_key, key, AES_KEY_SIZE);
+}
+
+// whatever the other providers fail to do is done by the built-in routines
+static void encdec_builtin(const uint8_t *input, uint8_t *output, const uint32_t *exp_key, uint8_t *iv, uint64_t n) {
+    alignas(16) uint8_t builtin_key[AES_EXP_KEY_BUFFER_SIZE];
+    aes_builtin_provider.expand_key((const uint8_t *) exp_key, (uint32_t *) builtin_key);
+    aes_builtin_provider.encdec(input, output, (const uint32_t *) builtin_key, iv, n);
+}
+
+static int alg_socket() {
+    const int fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_alg address;
+    memset(&address, 0, sizeof(address));
+    address.salg_family = AF_ALG;
+    strcpy((char *) address.salg_type, "skcipher");
+    strcpy((char *) address.salg_name, "ctr(aes)");
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/***
+ * The transform and the operation socket of a thread, the operation socket is kept as long
+ * as the key stays the same.
+ */
+struct AlgSocket {
+    int tfm = -1;
+    int op = -1;
+    uint8_t key[AES_KEY_SIZE];
+
+    ~AlgSocket() {
+        if (op >= 0) {
+            close(op);
+        }
+        if (tfm >= 0) {
+            close(tfm);
+        }
+    }
+
+    bool open(const uint8_t *k) {
+        if (op >= 0 && memcmp(key, k, AES_KEY_SIZE) == 0) {
+            return true;
+        }
+        if (tfm < 0 && (tfm = alg_socket()) < 0) {
+            return false;
+        }
+        if (op >= 0) {
+            close(op);
+            op = -1;
+        }
+        if (setsockopt(tfm, SOL_ALG, ALG_SET_KEY, k, AES_KEY_SIZE) < 0 ||
+            (op = accept4(tfm, nullptr, nullptr, SOCK_CLOEXEC)) < 0) {
+            return false;
+        }
+        memcpy(key, k, AES_KEY_SIZE);
+        return true;
+    }
+
+    // encrypt len bytes with the counter iv, the iv is not advanced
+    bool run(const uint8_t *input, uint8_t *output, const uint8_t *iv, size_t len) {
+        char control[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct af_alg_iv) + AES_BLOCK_SIZE)];
+        memset(control, 0, sizeof(control));
+        struct iovec iov = { (void *) input, len };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_ALG;
+        cmsg->cmsg_type = ALG_SET_OP;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+        const uint32_t operation = ALG_OP_ENCRYPT;
+        memcpy(CMSG_DATA(cmsg), &operation, sizeof(uint32_t));
+
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+        cmsg->cmsg_level = SOL_ALG;
+        cmsg->cmsg_type = ALG_SET_IV;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + AES_BLOCK_SIZE);
+        struct af_alg_iv *alg_iv = (struct af_alg_iv *) CMSG_DATA(cmsg);
+        alg_iv->ivlen = AES_BLOCK_SIZE;
+        memcpy(alg_iv->iv, iv, AES_BLOCK_SIZE);
+
+        if (sendmsg(op, &msg, 0) != (ssize_t) len) {
+            return false;
+        }
+        for (size_t done = 0; done < len;) {
+            const ssize_t n = read(op, output + done, len - done);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            done += (size_t) n;
+        }
+        return true;
+    }
+};
+
+static thread_local AlgSocket alg;
+
+static void encdec_afalg(const uint8_t *input, uint8_t *output, const uint32_t *exp_key, uint8_t *iv, uint64_t n) {
+    if (n > 0 && alg.open((const uint8_t *) exp_key)) {
+        while (n > 0) {
+            const uint64_t blocks = blocks_to_wrap(iv, std::min<uint64_t>(n, PROVIDER_AFALG_PIECE_SIZE / AES_BLOCK_SIZE));
+            if (!alg.run(input, output, iv, blocks * AES_BLOCK_SIZE)) {
+                // the socket is of no use any more, the next call starts over
+                close(alg.op);
+                alg.op = -1;
+                break;
+            }
+            aes_ctr_advance(iv, blocks);
+            input += blocks * AES_BLOCK_SIZE;
+            output += blocks * AES_BLOCK_SIZE;
+            n -= blocks;
+        }
+    }
+    if (n > 0) {
+        encdec_builtin(input, output, exp_key, iv, n);
+    }
+}
+
+static bool afalg_available() {
+    static const bool available = []() -> bool {
+        const int fd = alg_socket();
+        if (fd < 0) {
+            return false;
+        }
+        close(fd);
+        return true;
+    }();
+    return available;
+}
+
+static const CipherProvider afalg_provider = { "afalg", expand_key_plain, encdec_afalg };
+
+#ifdef ACRYPT_OPENSSL
+/***
+ * The EVP routines of libcrypto, the library is only loaded once the provider is asked
+ * for, a process that does not use it neither links nor loads it.
+ */
+struct LibCrypto {
+    decltype(&EVP_CIPHER_CTX_new) ctx_new;
+    decltype(&EVP_CIPHER_CTX_free) ctx_free;
+    decltype(&EVP_aes_256_ctr) aes_256_ctr;
+    decltype(&EVP_EncryptInit_ex) init;
+    decltype(&EVP_EncryptUpdate) update;
+};
+
+// nullptr if libcrypto cannot be loaded
+static const LibCrypto *libcrypto() {
+    static const LibCrypto *lib = []() -> const LibCrypto * {
+        void *handle = dlopen(ACRYPT_LIBCRYPTO, RTLD_NOW | RTLD_LOCAL);
+        if (handle == nullptr) {
+            return nullptr;
+        }
+        static LibCrypto routines;
+        routines.ctx_new = (decltype(routines.ctx_new)) dlsym(handle, "EVP_CIPHER_CTX_new");
+        routines.ctx_free = (decltype(routines.ctx_free)) dlsym(handle, "EVP_CIPHER_CTX_free");
+        routines.aes_256_ctr = (decltype(routines.aes_256_ctr)) dlsym(handle, "EVP_aes_256_ctr");
+        routines.init = (decltype(routines.init)) dlsym(handle, "EVP_EncryptInit_ex");
+        routines.update = (decltype(routines.update)) dlsym(handle, "EVP_EncryptUpdate");
+        if (routines.ctx_new == nullptr || routines.ctx_free == nullptr || routines.aes_256_ctr == nullptr ||
+            routines.init == nullptr || routines.update == nullptr) {
+            dlclose(handle);
+            return nullptr;
+        }
+        return &routines;
+    }();
+    return lib;
+}
+
+/***
+ * cipher context of a thread, initialized again only when the key changes
+ */
+struct EvpContext {
+    EVP_CIPHER_CTX *ctx = nullptr;
+    bool keyed = false;
+    uint8_t key[AES_KEY_SIZE];
+
+    ~EvpContext() {
+        if (ctx != nullptr) {
+            libcrypto()->ctx_free(ctx);
+        }
+    }
+};
+
+static thread_local EvpContext evp;
+
+static void encdec_openssl(const uint8_t *input, uint8_t *output, const uint32_t *exp_key, uint8_t *iv, uint64_t n) {
+    const uint8_t *key = (const uint8_t *) exp_key;
+    const LibCrypto *lib = libcrypto();
+    if (lib != nullptr && evp.ctx == nullptr) {
+        evp.ctx = lib->ctx_new();
+    }
+    bool ok = evp.ctx != nullptr;
+    if (ok && (!evp.keyed || memcmp(evp.key, key, AES_KEY_SIZE) != 0)) {
+        ok = evp.keyed = lib->init(evp.ctx, lib->aes_256_ctr(), nullptr, key, nullptr) == 1;
+        memcpy(evp.key, key, AES_KEY_SIZE);
+    }
+    while (ok && n > 0) {
+        const uint64_t blocks = blocks_to_wrap(iv, std::min<uint64_t>(n, PROVIDER_OPENSSL_PIECE_BLOCKS));
+        int len = 0;
+        ok = lib->init(evp.ctx, nullptr, nullptr, nullptr, iv) == 1 &&
+             lib->update(evp.ctx, output, &len, input, (int) (blocks * AES_BLOCK_SIZE)) == 1 &&
+             (uint64_t) len == blocks * AES_BLOCK_SIZE;
+        if (ok) {
+            aes_ctr_advance(iv, blocks);
+            input += blocks * AES_BLOCK_SIZE;
+            output += blocks * AES_BLOCK_SIZE;
+            n -= blocks;
+        }
+    }
+    if (n > 0) {
+        encdec_builtin(input, output, exp_key, iv, n);
+    }
+}
+
+static const CipherProvider openssl_provider = { "openssl", expand_key_plain, encdec_openssl };
+#endif
+
+std::vector<const CipherProvider *> cipher_providers() {
+    std::vector<const CipherProvider *> providers = { &aes_builtin_provider };
+    if (afalg_available()) {
+        providers.push_back(&afalg_provider);
+    }
+    #ifdef ACRYPT_OPENSSL
+    if (libcrypto() != nullptr) {
+        providers.push_back(&openssl_provider);
+    }
+    #endif
+    return providers;
+}
+
+const CipherProvider &cipher_provider(const std::string &name) {
+    // without probing the others
+    if (name == aes_builtin_provider.name) {
+        return aes_builtin_provider;
+    }
+    for (const CipherProvider *provider : cipher_providers()) {
+        if (name == provider->name) {
+            return *provider;
+        }
+    }
+    throw std::runtime_error("cipher provider '" + name + "' is not available");
+}
+
+static bool cipher_check(const CipherProvider &provider) {
+    // F.5.5 of NIST SP 800-38A, first block
+    static const uint8_t key[AES_KEY_SIZE] = {
+            0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+            0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4
+    };
+    static const uint8_t counter[AES_BLOCK_SIZE] = {
+            0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+    };
+    static const uint8_t plaintext[AES_BLOCK_SIZE] = {
+            0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a
+    };
+    static const uint8_t ciphertext[AES_BLOCK_SIZE] = {
+            0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5, 0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28
+    };
+
+    alignas(16) uint8_t exp_key[AES_EXP_KEY_BUFFER_SIZE] = { 0 };
+    uint8_t iv[AES_BLOCK_SIZE];
+    uint8_t block[AES_BLOCK_SIZE];
+    provider.expand_key(key, (uint32_t *) exp_key);
+    memcpy(iv, counter, AES_BLOCK_SIZE);
+    provider.encdec(plaintext, block, (const uint32_t *) exp_key, iv, 1);
+    if (memcmp(block, ciphertext, AES_BLOCK_SIZE) != 0) {
+        return false;
+    }
+
+    // the lower half of the counter wraps after the third block
+    uint8_t input[8 * AES_BLOCK_SIZE];
+    uint8_t output[8 * AES_BLOCK_SIZE];
+    uint8_t expected[8 * AES_BLOCK_SIZE];
+    uint8_t expected_iv[AES_BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(input); ++i) {
+        input[i] = (uint8_t) i;
+    }
+    memset(iv + AES_BLOCK_SIZE / 2, 0xff, AES_BLOCK_SIZE / 2);
+    iv[AES_BLOCK_SIZE - 1] = 0xfd;
+    memcpy(expected_iv, iv, AES_BLOCK_SIZE);
+    provider.encdec(input, output, (const uint32_t *) exp_key, iv, 8);
+    alignas(16) uint8_t builtin_key[AES_EXP_KEY_BUFFER_SIZE] = { 0 };
+    aes_builtin_provider.expand_key(key, (uint32_t *) builtin_key);
+    aes_builtin_provider.encdec(input, expected, (const uint32_t *) builtin_key, expected_iv, 8);
+    return memcmp(output, expected, sizeof(output)) == 0 && memcmp(iv, expected_iv, AES_BLOCK_SIZE) == 0;
+}
+
+double cipher_benchmark(const CipherProvider &provider, uint64_t size) {
+    if (!cipher_check(provider)) {
+        return 0.0;
+    }
+    alignas(16) uint8_t exp_key[AES_EXP_KEY_BUFFER_SIZE] = { 0 };
+    uint8_t key[AES_KEY_SIZE] = { 0 };
+    uint8_t iv[AES_BLOCK_SIZE] = { 0 };
+    std::vector<uint8_t> buffer(size);
+    provider.expand_key(key, (uint32_t *) exp_key);
+
+    // the first run also warms up the sockets and contexts of the provider
+    double best = 0.0;
+    for (int i = 0; i < 4; ++i) {
+        const auto begin = std::chrono::steady_clock::now();
+        provider.encdec(buffer.data(), buffer.data(), (const uint32_t *) exp_key, iv, size / AES_BLOCK_SIZE);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        if (i > 0 && elapsed.count() > 0.0) {
+            best = std::max(best, (double) size / elapsed.count());
+        }
+    }
+    return best;
+}
+
+const CipherProvider &cipher_fastest() {
+    const CipherProvider *fastest = &aes_builtin_provider;
+    double best = 0.0;
+    for (const CipherProvider *provider : cipher_providers()) {
+        const double speed = cipher_benchmark(*provider, PROVIDER_BENCHMARK_SIZE);
+        if (speed > best) {
+            fastest = provider;
+            best = speed;
+        }
+    }
+    return *fastest;
+}
@@ -0,0 +1,53 @@
+#ifndef __PROVIDER_HPP
+#define __PROVIDER_HPP
+
+#include <aes.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// plain bytes every provider encrypts when the fastest one is looked for at startup
+#define PROVIDER_BENCHMARK_SIZE     (256 * 1024)
+
+// --provider=auto keeps the built-in routines for regular files smaller than this, the
+// others do not make up for their setup (library, sockets) and the benchmark
+#define PROVIDER_AUTO_MIN_SIZE      (UINT64_C(64) * 1024 * 1024)
+
+// bytes handed to the kernel per sendmsg(2) by the AF_ALG provider
+#define PROVIDER_AFALG_PIECE_SIZE   (64 * 1024)
+
+/***
+ * Providers of the AES-256 CTR routines that work on this host: the built-in ones,
+ * "afalg" (the kernel crypto API through an AF_ALG socket) if the kernel offers ctr(aes)
+ * and "openssl" (EVP) if acrypt was built with OpenSSL and libcrypto can be loaded. All
+ * of them produce the same key stream, the counter only runs through the lower 64 bits of
+ * the iv as the built-in routines do. A provider is used for the keys it is passed to
+ * aes_ctr_expand_key with, nothing changes the default.
+ * @return
+ */
+extern std::vector<const CipherProvider *> cipher_providers();
+
+/***
+ * look up an available provider by name
+ * @param name
+ * @return
+ */
+extern const CipherProvider &cipher_provider(const std::string &name);
+
+/***
+ * Check a provider against the known answer of AES-256 CTR (NIST SP 800-38A) and against
+ * the built-in routines across the wrap of the counter, then time it.
+ * @param provider
+ * @param size plain bytes per run, multiple of AES_BLOCK_SIZE
+ * @return bytes per second of the best of three runs, 0 if the provider computes a wrong
+ * key stream or fails
+ */
+extern double cipher_benchmark(const CipherProvider &provider, uint64_t size);
+
+/***
+ * benchmark all available providers with PROVIDER_BENCHMARK_SIZE bytes
+ * @return the fastest one
+ */
+extern const CipherProvider &cipher_fastest();
+
+#endif // __PROVIDER_HPP
@@ -0,0 +1,62 @@
+#include <reader.hpp>
+#include <algorithm>
+#include <cstring>
+
+Reader::Reader(const std::string &fname, const std::string &password, size_t cache_chunks) :
+        _file(fname, password), _capacity(cache_chunks), _hits(0), _misses(0) {}
+
+Reader::chunk_t Reader::chunk(uint64_t i) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _cache.find(i);
+        if (it != _cache.end()) {
+            _lru.splice(_lru.begin(), _lru, it->second.lru);
+            ++_hits;
+            return it->second.chunk;
+        }
+        ++_misses;
+    }
+
+    std::shared_ptr<std::vector<uint8_t>> data = std::make_shared<std::vector<uint8_t>>(_file.chunk_size() + AES_BLOCK_SIZE);
+    data->resize(_file.read_chunk(i, data->data()));
+    chunk_t chunk(data);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_capacity == 0) {
+        return chunk;
+    }
+    // another thread may have decrypted the same chunk meanwhile
+    auto it = _cache.find(i);
+    if (it != _cache.end()) {
+        return it->second.chunk;
+    }
+    if (_cache.size() >= _capacity) {
+        _cache.erase(_lru.back());
+        _lru.pop_back();
+    }
+    _lru.push_front(i);
+    CacheEntry entry;
+    entry.chunk = chunk;
+    entry.lru = _lru.begin();
+    _cache.emplace(i, entry);
+    return chunk;
+}
+
+size_t Reader::read_at(uint64_t offset, uint8_t *data, size_t len) {
+    if (offset >= size()) {
+        return 0;
+    }
+    len = (size_t) std::min<uint64_t>(len, size() - offset);
+
+    size_t b = 0;
+    while (b < len) {
+        const uint64_t i = offset / _file.chunk_size();
+        const size_t pos = (size_t) (offset % _file.chunk_size());
+        const chunk_t c = chunk(i);
+        const size_t n = std::min(len - b, c->size() - pos);
+        memcpy(data + b, c->data() + pos, n);
+        b += n;
+        offset += n;
+    }
+    return b;
+}
@@ -0,0 +1,85 @@
+#ifndef __READER_HPP
+#define __READER_HPP
+
+#include <chunked.hpp>
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// number of decrypted chunks kept by default
+#define READER_DEFAULT_CACHE_CHUNKS     (64)
+
+/***
+ * Random access to a file of the chunked format. A read only authenticates and
+ * decrypts the chunks it touches, the most recently used chunks are kept decrypted.
+ * read_at() may be called from several threads at once, chunks are decrypted
+ * outside of the lock.
+ */
+class Reader {
+public:
+
+    /***
+     * @param fname
+     * @param password
+     * @param cache_chunks maximum number of decrypted chunks kept, 0 disables the cache
+     */
+    Reader(const std::string &fname, const std::string &password, size_t cache_chunks=READER_DEFAULT_CACHE_CHUNKS);
+
+    Reader(const Reader &) = delete;
+
+    Reader &operator=(const Reader &) = delete;
+
+    /***
+     * @return size of the plain text
+     */
+    uint64_t size() const {
+        return _file.size();
+    }
+
+    /***
+     * read plain text
+     * @param offset
+     * @param data
+     * @param len
+     * @return number of bytes read, less than len only at the end of the file
+     */
+    size_t read_at(uint64_t offset, uint8_t *data, size_t len);
+
+    uint64_t hits() const {
+        return _hits;
+    }
+
+    uint64_t misses() const {
+        return _misses;
+    }
+
+private:
+
+    typedef std::shared_ptr<const std::vector<uint8_t>> chunk_t;
+
+    struct CacheEntry {
+        chunk_t chunk;
+        std::list<uint64_t>::iterator lru;
+    };
+
+    chunk_t chunk(uint64_t i);
+
+    ChunkedFile _file;
+    const size_t _capacity;
+
+    std::mutex _mutex;
+    // most recently used chunk first
+    std::list<uint64_t> _lru;
+    std::unordered_map<uint64_t, CacheEntry> _cache;
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+
+};
+
+#endif // __READER_HPP
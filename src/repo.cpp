@@ -0,0 +1,345 @@
+#include <repo.hpp>
+#include <buffer_pool.hpp>
+#include <pipe.hpp>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+static std::string to_hex(const uint8_t *data, size_t size) {
+    static const char hex[] = "0123456789abcdef";
+    std::string str;
+    for (size_t i = 0; i < size; ++i) {
+        str += hex[data[i] >> 4];
+        str += hex[data[i] & 15];
+    }
+    return str;
+}
+
+static bool from_hex(const std::string &str, uint8_t *data, size_t size) {
+    if (str.size() != 2 * size) {
+        return false;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        char *end;
+        const std::string byte = str.substr(2 * i, 2);
+        data[i] = (uint8_t) strtoul(byte.c_str(), &end, 16);
+        if (*end != '\0') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// keys of their own for the ids, the chunks, the recipes and the gear table
+static void sub_key(const uint8_t *key, const char *label, uint8_t *sub) {
+    SHA256::context ctx;
+    SHA256::init(ctx);
+    SHA256::update(ctx, key, KEY_BUFFER_SIZE);
+    SHA256::update(ctx, label, strlen(label));
+    SHA256::final(ctx, sub);
+}
+
+static void make_dir(const std::string &dir) {
+    if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST) {
+        throw std::runtime_error("unable to create directory '" + dir + "'");
+    }
+}
+
+/***
+ * write a file under a temporary name and rename it, so that it either exists as a
+ * whole or not at all
+ * @param fname
+ * @param data
+ * @param size
+ */
+static void write_file(const std::string &fname, const uint8_t *data, size_t size) {
+    std::string tmp = fname + ".XXXXXX";
+    const int fd = mkstemp(&tmp[0]);
+    if (fd < 0) {
+        throw std::runtime_error("unable to create '" + fname + "'");
+    }
+    try {
+        pwrite_full(data, size, 0, fd);
+    } catch (...) {
+        close(fd);
+        unlink(tmp.c_str());
+        throw;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), fname.c_str()) < 0) {
+        unlink(tmp.c_str());
+        throw std::runtime_error("unable to create '" + fname + "'");
+    }
+}
+
+static std::vector<uint8_t> read_file(const std::string &fname) {
+    const FileDescriptor fd(fname, O_RDONLY);
+    std::vector<uint8_t> data(fd.size());
+    if (pread_full(data.data(), data.size(), 0, fd) < data.size()) {
+        throw std::runtime_error("unable to read '" + fname + "'");
+    }
+    return data;
+}
+
+Repository::Repository(const std::string &dir, const std::string &password, bool create) : _dir(dir) {
+    const std::string config = dir + "/config";
+    uint8_t salt[AES_BLOCK_SIZE];
+    uint8_t check[HMAC_SHA256::HASH_SIZE];
+    uint8_t expected[HMAC_SHA256::HASH_SIZE];
+    std::ifstream in(config);
+    const bool exists = (bool) in;
+    if (!exists) {
+        if (!create) {
+            throw std::runtime_error("no repository at '" + dir + "'");
+        }
+        make_dir(dir);
+        make_dir(dir + "/chunks");
+        make_dir(dir + "/backups");
+        aes_generate_iv(salt);
+    } else {
+        std::string line;
+        bool valid = std::getline(in, line) && line == REPO_MAGIC;
+        bool has_salt = false;
+        bool has_check = false;
+        while (valid && std::getline(in, line)) {
+            if (line.compare(0, 5, "salt=") == 0) {
+                has_salt = from_hex(line.substr(5), salt, AES_BLOCK_SIZE);
+            } else if (line.compare(0, 6, "check=") == 0) {
+                has_check = from_hex(line.substr(6), expected, HMAC_SHA256::HASH_SIZE);
+            }
+        }
+        if (!valid || !has_salt || !has_check) {
+            throw std::runtime_error("invalid repository config '" + config + "'");
+        }
+    }
+
+    derive_key(password, salt, _key);
+    uint8_t sub[SHA256::HASH_SIZE];
+    sub_key(_key, "acrypt repo check", sub);
+    HMAC_SHA256::hash(sub, SHA256::HASH_SIZE, REPO_MAGIC, sizeof(REPO_MAGIC) - 1, check);
+    if (exists) {
+        if (memcmp(check, expected, HMAC_SHA256::HASH_SIZE) != 0) {
+            throw std::runtime_error("invalid password");
+        }
+    } else {
+        const std::string str = std::string(REPO_MAGIC) + "\nsalt=" + to_hex(salt, AES_BLOCK_SIZE) +
+                                "\ncheck=" + to_hex(check, HMAC_SHA256::HASH_SIZE) + "\n";
+        write_file(config, (const uint8_t *) str.data(), str.size());
+    }
+
+    sub_key(_key, "acrypt repo chunk id", sub);
+    HMAC_SHA256::init(_id_mac, sub, SHA256::HASH_SIZE);
+    sub_key(_key, "acrypt repo chunk key", sub);
+    memset(_exp_key, 0, sizeof(_exp_key));
+    aes_ctr_expand_key(sub, (uint32_t *) _exp_key, crypt_provider());
+
+    // the gear table is keyed, otherwise the cut positions would tell about the content
+    sub_key(_key, "acrypt repo gear", sub);
+    for (int i = 0; i < 256; ++i) {
+        uint8_t digest[SHA256::HASH_SIZE];
+        const uint8_t index = (uint8_t) i;
+        HMAC_SHA256::hash(sub, SHA256::HASH_SIZE, &index, 1, digest);
+        memcpy(&_gear[i], digest, sizeof(uint64_t));
+    }
+}
+
+size_t Repository::cut(const uint8_t *data, size_t size, bool eof) const {
+    // the gear hash is shifted left, its top bits depend on the last 64 bytes
+    const uint64_t mask_small = ~UINT64_C(0) << (64 - REPO_MASK_BITS_SMALL);
+    const uint64_t mask_large = ~UINT64_C(0) << (64 - REPO_MASK_BITS_LARGE);
+    const size_t end = std::min<size_t>(size, REPO_MAX_CHUNK);
+    const size_t normal = std::min<size_t>(end, REPO_AVG_CHUNK);
+    if (size <= REPO_MIN_CHUNK) {
+        return eof ? size : 0;
+    }
+
+    // the bytes in front of the minimum are skipped, they cannot hold a cut
+    uint64_t hash = 0;
+    size_t i = REPO_MIN_CHUNK;
+    for (; i < normal; ++i) {
+        hash = (hash << 1) + _gear[data[i]];
+        if (!(hash & mask_small)) {
+            return i + 1;
+        }
+    }
+    for (; i < end; ++i) {
+        hash = (hash << 1) + _gear[data[i]];
+        if (!(hash & mask_large)) {
+            return i + 1;
+        }
+    }
+    return end == REPO_MAX_CHUNK || eof ? end : 0;
+}
+
+std::string Repository::chunk_path(const uint8_t *id) const {
+    const std::string hex = to_hex(id, SHA256::HASH_SIZE);
+    return _dir + "/chunks/" + hex.substr(0, 2) + "/" + hex;
+}
+
+void Repository::store(const uint8_t *data, size_t size, uint8_t *id) {
+    HMAC_SHA256::context ctx = _id_mac;
+    HMAC_SHA256::update(ctx, data, size);
+    HMAC_SHA256::final(ctx, id);
+    const std::string path = chunk_path(id);
+    if (access(path.c_str(), F_OK) == 0) {
+        return;
+    }
+
+    // the id is a keyed hash of the content, a counter starting there is never used twice
+    PoolBuffer pool_buffer(REPO_MAX_CHUNK + AES_BLOCK_SIZE);
+    uint8_t *buffer = pool_buffer.data();
+    uint8_t iv[AES_BLOCK_SIZE];
+    memcpy(buffer, data, size);
+    memcpy(iv, id, AES_BLOCK_SIZE);
+    aes_ctr_enc(buffer, buffer, (const uint32_t *) _exp_key, iv, (size + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+    make_dir(path.substr(0, path.rfind('/')));
+    write_file(path, buffer, size);
+}
+
+std::string Repository::recipe_path(const std::string &name) const {
+    if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos) {
+        throw std::runtime_error("invalid backup name '" + name + "'");
+    }
+    return _dir + "/backups/" + name;
+}
+
+void Repository::recipe_keys(uint8_t *key, HMAC_SHA256::context &mac) const {
+    uint8_t sub[SHA256::HASH_SIZE];
+    sub_key(_key, "acrypt repo recipe key", sub);
+    aes_ctr_expand_key(sub, (uint32_t *) key, crypt_provider());
+    sub_key(_key, "acrypt repo recipe tag", sub);
+    HMAC_SHA256::init(mac, sub, SHA256::HASH_SIZE);
+}
+
+void Repository::backup(int in, const std::string &name, ThreadPool &pool) {
+    const std::string recipe = recipe_path(name);
+    std::vector<uint8_t> buffer(REPO_BUFFER_SIZE);
+    std::vector<repo_entry> entries;
+    size_t size = 0;
+    bool eof = false;
+    while (!eof || size > 0) {
+        if (!eof) {
+            const size_t n = read_full(in, buffer.data() + size, buffer.size() - size);
+            size += n;
+            eof = size < buffer.size();
+        }
+
+        // the cuts are found in order, the chunks between them are hashed and stored in parallel
+        std::vector<std::pair<size_t, size_t>> chunks;
+        size_t pos = 0;
+        while (pos < size) {
+            const size_t n = cut(buffer.data() + pos, size - pos, eof);
+            if (n == 0) {
+                break;
+            }
+            chunks.emplace_back(pos, n);
+            pos += n;
+        }
+
+        const size_t first = entries.size();
+        entries.resize(first + chunks.size());
+        std::mutex mutex;
+        std::string error;
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            repo_entry &entry = entries[first + i];
+            entry.length = chunks[i].second;
+            const uint8_t *data = buffer.data() + chunks[i].first;
+            pool.submit([this, &entry, data, &mutex, &error]() {
+                try {
+                    store(data, (size_t) entry.length, entry.id);
+                } catch (std::exception &err) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    error = err.what();
+                }
+            });
+        }
+        pool.wait();
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+
+        // the rest is cut once more bytes are there
+        memmove(buffer.data(), buffer.data() + pos, size - pos);
+        size -= pos;
+    }
+
+    // magic | iv | E(entries) | tag over all of it
+    const size_t length = entries.size() * sizeof(repo_entry);
+    std::vector<uint8_t> data(REPO_RECIPE_MAGIC_SIZE + AES_BLOCK_SIZE + length + AES_BLOCK_SIZE + HMAC_SHA256::HASH_SIZE);
+    uint8_t *iv = data.data() + REPO_RECIPE_MAGIC_SIZE;
+    uint8_t *body = iv + AES_BLOCK_SIZE;
+    memcpy(data.data(), REPO_RECIPE_MAGIC, REPO_RECIPE_MAGIC_SIZE);
+    aes_generate_iv(iv);
+    if (length > 0) {
+        memcpy(body, entries.data(), length);
+    }
+
+    alignas(16) uint8_t key[AES_EXP_KEY_BUFFER_SIZE] = { 0 };
+    HMAC_SHA256::context mac;
+    recipe_keys(key, mac);
+    uint8_t counter[AES_BLOCK_SIZE];
+    memcpy(counter, iv, AES_BLOCK_SIZE);
+    aes_ctr_enc(body, body, (const uint32_t *) key, counter, (length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+    HMAC_SHA256::update(mac, data.data(), REPO_RECIPE_MAGIC_SIZE + AES_BLOCK_SIZE + length);
+    HMAC_SHA256::final(mac, body + length);
+    write_file(recipe, data.data(), REPO_RECIPE_MAGIC_SIZE + AES_BLOCK_SIZE + length + HMAC_SHA256::HASH_SIZE);
+}
+
+void Repository::restore(const std::string &name, int out) const {
+    std::vector<uint8_t> data = read_file(recipe_path(name));
+    const size_t overhead = REPO_RECIPE_MAGIC_SIZE + AES_BLOCK_SIZE + HMAC_SHA256::HASH_SIZE;
+    if (data.size() < overhead || (data.size() - overhead) % sizeof(repo_entry) != 0 ||
+        memcmp(data.data(), REPO_RECIPE_MAGIC, REPO_RECIPE_MAGIC_SIZE) != 0) {
+        throw std::runtime_error("invalid backup '" + name + "'");
+    }
+    const size_t length = data.size() - overhead;
+    uint8_t *iv = data.data() + REPO_RECIPE_MAGIC_SIZE;
+    uint8_t *body = iv + AES_BLOCK_SIZE;
+
+    alignas(16) uint8_t key[AES_EXP_KEY_BUFFER_SIZE] = { 0 };
+    HMAC_SHA256::context mac;
+    recipe_keys(key, mac);
+    uint8_t tag[HMAC_SHA256::HASH_SIZE];
+    HMAC_SHA256::update(mac, data.data(), REPO_RECIPE_MAGIC_SIZE + AES_BLOCK_SIZE + length);
+    HMAC_SHA256::final(mac, tag);
+    if (memcmp(tag, body + length, HMAC_SHA256::HASH_SIZE) != 0) {
+        throw std::runtime_error("backup '" + name + "' is corrupted");
+    }
+
+    // the tag behind the entries is room enough for the last block
+    uint8_t counter[AES_BLOCK_SIZE];
+    memcpy(counter, iv, AES_BLOCK_SIZE);
+    aes_ctr_dec(body, body, (const uint32_t *) key, counter, (length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+    std::vector<repo_entry> entries(length / sizeof(repo_entry));
+    if (length > 0) {
+        memcpy(entries.data(), body, length);
+    }
+
+    PoolBuffer pool_buffer(REPO_MAX_CHUNK + AES_BLOCK_SIZE);
+    uint8_t *buffer = pool_buffer.data();
+    for (const auto &entry : entries) {
+        const std::string path = chunk_path(entry.id);
+        const FileDescriptor fd(path, O_RDONLY);
+        if (entry.length > REPO_MAX_CHUNK || fd.size() != entry.length ||
+            pread_full(buffer, (size_t) entry.length, 0, fd) < entry.length) {
+            throw std::runtime_error("chunk '" + path + "' is corrupted");
+        }
+        memcpy(counter, entry.id, AES_BLOCK_SIZE);
+        aes_ctr_dec(buffer, buffer, (const uint32_t *) _exp_key, counter, (entry.length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+
+        // the id is the tag of the chunk
+        uint8_t id[SHA256::HASH_SIZE];
+        HMAC_SHA256::context ctx = _id_mac;
+        HMAC_SHA256::update(ctx, buffer, (size_t) entry.length);
+        HMAC_SHA256::final(ctx, id);
+        if (memcmp(id, entry.id, SHA256::HASH_SIZE) != 0) {
+            throw std::runtime_error("chunk '" + path + "' is corrupted");
+        }
+        write_full(out, buffer, (size_t) entry.length);
+    }
+}
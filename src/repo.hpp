@@ -0,0 +1,106 @@
+#ifndef __REPO_HPP
+#define __REPO_HPP
+
+#include <thread_pool.hpp>
+#include <crypt.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// layout of a repository:
+// DIR/config                   REPO_MAGIC, the salt of the key and a check value of the password
+// DIR/chunks/xx/<id>           E(chunk), id is the hex of the keyed hash of the plain chunk
+// DIR/backups/<name>           recipe: REPO_RECIPE_MAGIC | iv | E(entries) | tag
+#define REPO_MAGIC              "acrypt repository 1"
+#define REPO_RECIPE_MAGIC       "ACRYPTR"       // including the terminating zero
+#define REPO_RECIPE_MAGIC_SIZE  (8)
+
+// content defined chunking: no cut before the minimum, the normal size is aimed at
+// with a stricter mask before it and a looser one behind it (FastCDC)
+#define REPO_MIN_CHUNK          (16 * 1024)
+#define REPO_AVG_CHUNK          (64 * 1024)
+#define REPO_MAX_CHUNK          (256 * 1024)
+
+// bits of the gear hash that have to be zero for a cut before and behind REPO_AVG_CHUNK
+#define REPO_MASK_BITS_SMALL    (18)
+#define REPO_MASK_BITS_LARGE    (14)
+
+// input read and chunked at once, the chunks of it are hashed and stored in parallel
+#define REPO_BUFFER_SIZE        (16 * 1024 * 1024)
+
+/***
+ * entry of a recipe, the chunks of a backup in order
+ */
+struct repo_entry {
+    uint8_t id[SHA256::HASH_SIZE];          // HMAC-SHA256 of the plain chunk
+    uint64_t length;                        // plain bytes
+};
+
+/***
+ * Deduplicating store of encrypted backups. The input is cut into chunks at positions
+ * that depend on the content only, so an unchanged region gives the same chunks in
+ * every backup. A chunk is named by a keyed hash of its plain text and only encrypted
+ * and written if the repository does not have it yet. Every backup is a recipe of
+ * chunk ids, encrypted and authenticated. The keys of the ids, of the chunks and of the
+ * recipes are derived from a key that is derived from the password and the salt of
+ * the repository, the gear table of the chunker as well, so that the cut positions
+ * reveal nothing about the content.
+ */
+class Repository {
+public:
+
+    /***
+     * open a repository, check the password
+     * @param dir
+     * @param password
+     * @param create create the repository if there is none
+     */
+    Repository(const std::string &dir, const std::string &password, bool create);
+
+    Repository(const Repository &) = delete;
+
+    Repository &operator=(const Repository &) = delete;
+
+    /***
+     * store everything read from in as backup name, an existing backup of that name is replaced
+     * @param in
+     * @param name
+     * @param pool hashes, encrypts and writes the chunks
+     */
+    void backup(int in, const std::string &name, ThreadPool &pool);
+
+    /***
+     * write the plain text of a backup, every chunk is authenticated by its id
+     * @param name
+     * @param out
+     */
+    void restore(const std::string &name, int out) const;
+
+    /***
+     * length of the next chunk
+     * @param data
+     * @param size bytes available
+     * @param eof no more bytes follow
+     * @return 0 if more bytes are needed to find the cut
+     */
+    size_t cut(const uint8_t *data, size_t size, bool eof) const;
+
+private:
+
+    std::string chunk_path(const uint8_t *id) const;
+
+    void store(const uint8_t *data, size_t size, uint8_t *id);
+
+    std::string recipe_path(const std::string &name) const;
+
+    void recipe_keys(uint8_t *key, HMAC_SHA256::context &mac) const;
+
+    const std::string _dir;
+    uint8_t _key[KEY_BUFFER_SIZE];
+    HMAC_SHA256::context _id_mac;
+    alignas(16) uint8_t _exp_key[AES_EXP_KEY_BUFFER_SIZE];
+    uint64_t _gear[256];
+
+};
+
+#endif // __REPO_HPP
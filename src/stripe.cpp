@@ -0,0 +1,488 @@
+#include <stripe.hpp>
+#include <crypt.hpp>
+#include <buffer_pool.hpp>
+#include <thread_pool.hpp>
+#include <utils.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+
+/***
+ * The volume files of a striped file, offsets are those of the whole cipher text.
+ */
+class Volumes {
+public:
+
+    Volumes(const StripeManifest &manifest, int flags) : _stripe_size(manifest.stripe_size) {
+        for (const auto &volume : manifest.volumes) {
+            const int fd = open(volume.c_str(), flags, 0666);
+            if (fd < 0) {
+                close_all();
+                throw std::runtime_error("unable to open volume '" + volume + "'");
+            }
+            _fds.push_back(fd);
+        }
+    }
+
+    ~Volumes() {
+        close_all();
+    }
+
+    Volumes(const Volumes &) = delete;
+
+    Volumes &operator=(const Volumes &) = delete;
+
+    size_t count() const {
+        return _fds.size();
+    }
+
+    int fd(size_t volume) const {
+        return _fds[volume];
+    }
+
+    /***
+     * volume that holds a byte of the cipher text
+     * @param offset
+     * @param local receives the offset within the volume
+     * @return file descriptor of the volume
+     */
+    int locate(uint64_t offset, uint64_t &local) const {
+        const uint64_t stripe = offset / _stripe_size;
+        local = (stripe / _fds.size()) * _stripe_size + offset % _stripe_size;
+        return _fds[stripe % _fds.size()];
+    }
+
+    void read(uint64_t offset, uint8_t *data, uint64_t num_bytes) const {
+        while (num_bytes) {
+            uint64_t local;
+            const int fd = locate(offset, local);
+            const uint64_t n = std::min(num_bytes, _stripe_size - offset % _stripe_size);
+            if (pread_full(data, n, local, fd) < n) {
+                throw std::runtime_error("insufficient volume size");
+            }
+            offset += n;
+            data += n;
+            num_bytes -= n;
+        }
+    }
+
+    void write(uint64_t offset, const uint8_t *data, uint64_t num_bytes) const {
+        while (num_bytes) {
+            uint64_t local;
+            const int fd = locate(offset, local);
+            const uint64_t n = std::min(num_bytes, _stripe_size - offset % _stripe_size);
+            pwrite_full(data, n, local, fd);
+            offset += n;
+            data += n;
+            num_bytes -= n;
+        }
+    }
+
+private:
+
+    void close_all() {
+        for (int fd : _fds) {
+            close(fd);
+        }
+        _fds.clear();
+    }
+
+    const uint64_t _stripe_size;
+    std::vector<int> _fds;
+
+};
+
+/***
+ * Runs the tasks of a striped file on a pool, the first error is kept and thrown
+ * once all tasks are done.
+ */
+class StripeTasks {
+public:
+
+    explicit StripeTasks(size_t num_tasks) : _pool(num_tasks) {}
+
+    void submit(const std::function<void()> &task) {
+        _pool.submit([this, task]() {
+            try {
+                task();
+            } catch (std::exception &err) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_error.empty()) {
+                    _error = err.what();
+                }
+            }
+        });
+    }
+
+    void wait() {
+        _pool.wait();
+        if (!_error.empty()) {
+            throw std::runtime_error(_error);
+        }
+    }
+
+private:
+
+    ThreadPool _pool;
+    std::mutex _mutex;
+    std::string _error;
+
+};
+
+/***
+ * run the cipher over the stripes of one volume, the part of each stripe that belongs to
+ * the whole blocks of the plain text
+ * @param volumes
+ * @param volume index of the volume
+ * @param stripe_size
+ * @param plain file descriptor of the plain text, read when encrypting, written when decrypting
+ * @param encrypt
+ * @param iv
+ * @param exp_key
+ * @param body_end plain bytes in whole blocks
+ * @param bufsize
+ */
+static void crypt_volume(const Volumes &volumes, size_t volume, uint64_t stripe_size, int plain, bool encrypt,
+                         const uint8_t *iv, const uint32_t *exp_key, uint64_t body_end, uint64_t bufsize) {
+    PoolBuffer pool_buffer(bufsize);
+    uint8_t *buffer = pool_buffer.data();
+    for (uint64_t stripe = volume; stripe * stripe_size < HEADER_SIZE + body_end; stripe += volumes.count()) {
+        const uint64_t begin = std::max<uint64_t>(stripe * stripe_size, HEADER_SIZE);
+        const uint64_t end = std::min<uint64_t>((stripe + 1) * stripe_size, HEADER_SIZE + body_end);
+        uint8_t counter[AES_BLOCK_SIZE];
+        if (begin < end) {
+            counter_at(iv, begin - HEADER_SIZE, counter);
+        }
+        for (uint64_t offset = begin; offset < end; offset += bufsize) {
+            const uint64_t n = std::min(bufsize, end - offset);
+            uint64_t local;
+            const int fd = volumes.locate(offset, local);
+            if (pread_full(buffer, n, encrypt ? offset - HEADER_SIZE : local, encrypt ? plain : fd) < n) {
+                throw std::runtime_error(encrypt ? "insufficient file size" : "insufficient volume size");
+            }
+            aes_ctr_encdec(buffer, buffer, exp_key, counter, n / AES_BLOCK_SIZE);
+            pwrite_full(buffer, n, encrypt ? local : offset - HEADER_SIZE, encrypt ? fd : plain);
+        }
+    }
+}
+
+/***
+ * directory of a file as given, "." if the name has none
+ * @param fname
+ * @return
+ */
+static std::string directory_of(const std::string &fname) {
+    const size_t slash = fname.rfind('/');
+    if (slash == std::string::npos) {
+        return ".";
+    }
+    return slash == 0 ? "/" : fname.substr(0, slash);
+}
+
+/***
+ * path of a file relative to a directory, both absolute and without symbolic links
+ * @param dir
+ * @param path
+ * @return
+ */
+static std::string relative_path(const std::string &dir, const std::string &path) {
+    std::vector<std::string> from;
+    std::vector<std::string> to;
+    for (const auto &part : split(dir, "/")) {
+        if (!part.empty()) {
+            from.push_back(part);
+        }
+    }
+    for (const auto &part : split(path, "/")) {
+        if (!part.empty()) {
+            to.push_back(part);
+        }
+    }
+    size_t common = 0;
+    while (common < from.size() && common + 1 < to.size() && from[common] == to[common]) {
+        ++common;
+    }
+    std::string relative;
+    for (size_t i = common; i < from.size(); ++i) {
+        relative += "../";
+    }
+    for (size_t i = common; i < to.size(); ++i) {
+        relative += to[i] + (i + 1 < to.size() ? "/" : "");
+    }
+    return relative;
+}
+
+static StripeManifest read_manifest(const std::string &fname) {
+    std::ifstream in(fname);
+    std::string line;
+    if (!std::getline(in, line) || line != STRIPE_MAGIC) {
+        throw std::runtime_error("'" + fname + "' is not the manifest of a striped file");
+    }
+    StripeManifest manifest;
+    while (std::getline(in, line)) {
+        const size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        const std::string key = line.substr(0, eq);
+        const std::string value = line.substr(eq + 1);
+        if (key == "stripe_size") {
+            manifest.stripe_size = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "size") {
+            manifest.size = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "volume" && !value.empty()) {
+            manifest.volumes.push_back(value[0] == '/' ? value : directory_of(fname) + "/" + value);
+        }
+    }
+    if (manifest.stripe_size == 0 || manifest.stripe_size % AES_BLOCK_SIZE != 0 || manifest.volumes.empty() ||
+        manifest.size < HEADER_SIZE + CHECKSUM::HASH_SIZE) {
+        throw std::runtime_error("invalid manifest '" + fname + "'");
+    }
+    return manifest;
+}
+
+/***
+ * check that every volume holds its stripes up to the end of the cipher text
+ * @param manifest
+ * @param volumes
+ */
+static void check_volumes(const StripeManifest &manifest, const Volumes &volumes) {
+    for (size_t v = 0; v < volumes.count(); ++v) {
+        // the last stripe of a volume ends its file
+        uint64_t expected = 0;
+        for (uint64_t stripe = v; stripe * manifest.stripe_size < manifest.size; stripe += volumes.count()) {
+            expected = (stripe / volumes.count()) * manifest.stripe_size +
+                       std::min(manifest.stripe_size, manifest.size - stripe * manifest.stripe_size);
+        }
+        struct stat st;
+        if (fstat(volumes.fd(v), &st) < 0 || (uint64_t) st.st_size != expected) {
+            throw std::runtime_error("volume '" + manifest.volumes[v] + "' has " + std::to_string(st.st_size) +
+                                     " bytes instead of " + std::to_string(expected));
+        }
+    }
+}
+
+/***
+ * read the header of a striped file and check the password
+ * @param volumes
+ * @param password
+ * @param header receives the header, the hash of the key decrypted
+ * @param exp_key receives the expanded key
+ * @param ctx initialized with the hash of the key
+ */
+static void open_stripes(const Volumes &volumes, const std::string &password, uint8_t *header, uint32_t *exp_key,
+                         CHECKSUM::context &ctx) {
+    volumes.read(0, header, HEADER_SIZE);
+    std::array<uint8_t, KEY_BUFFER_SIZE> key = { 0 };
+    derive_key(password, header, key.data());
+    aes_ctr_expand_key(key.data(), exp_key, crypt_provider());
+
+    // check if the key hashes match
+    uint8_t iv[AES_BLOCK_SIZE];
+    uint8_t hash_of_key[SHA256::HASH_SIZE];
+    memcpy(iv, header, AES_BLOCK_SIZE);
+    hash_key(key.data(), hash_of_key);
+    aes_ctr_dec(header + AES_BLOCK_SIZE, header + AES_BLOCK_SIZE, exp_key, iv, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+    if (memcmp(header + AES_BLOCK_SIZE, hash_of_key, SHA256::HASH_SIZE) != 0) {
+        throw std::runtime_error("invalid password or compromised iv");
+    }
+    CHECKSUM::init(ctx);
+    CHECKSUM::update(ctx, hash_of_key, SHA256::HASH_SIZE);
+}
+
+bool is_striped(const std::string &fname) {
+    // only the first line is read, any other file can be large without a line break
+    const std::string magic = STRIPE_MAGIC "\n";
+    std::ifstream in(fname);
+    std::string line(magic.size(), '\0');
+    return in.read(&line[0], line.size()) && line == magic;
+}
+
+std::vector<std::string> stripe_volumes(const std::string &manifest_filename) {
+    return read_manifest(manifest_filename).volumes;
+}
+
+void stripe_encrypt(const std::string &input_filename, const std::string &manifest_filename,
+                    const std::vector<std::string> &dirs, const std::string &password,
+                    uint64_t stripe_size, uint64_t bufsize) {
+    if (dirs.empty() || stripe_size == 0 || stripe_size % AES_BLOCK_SIZE != 0) {
+        throw std::runtime_error("invalid stripes");
+    }
+    const FileDescriptor in(input_filename, O_RDONLY);
+    const uint64_t length = in.size();
+    const uint64_t body_end = length & ~((uint64_t) AES_BLOCK_SIZE - 1);
+
+    // the volumes are named after the manifest, the manifest keeps their paths relative to itself
+    StripeManifest manifest;
+    manifest.stripe_size = stripe_size;
+    manifest.size = HEADER_SIZE + length + CHECKSUM::HASH_SIZE;
+    const std::string name = manifest_filename.substr(manifest_filename.rfind('/') + 1);
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        char *path = realpath(dirs[i].c_str(), nullptr);
+        if (path == nullptr) {
+            throw std::runtime_error("unable to find directory '" + dirs[i] + "'");
+        }
+        manifest.volumes.push_back(std::string(path) + "/" + name + "." + std::to_string(i));
+        free(path);
+    }
+    char *base = realpath(directory_of(manifest_filename).c_str(), nullptr);
+    if (base == nullptr) {
+        throw std::runtime_error("unable to find directory of '" + manifest_filename + "'");
+    }
+    const std::string manifest_dir(base);
+    free(base);
+    const Volumes volumes(manifest, O_WRONLY | O_CREAT | O_TRUNC);
+
+    std::array<uint8_t, HEADER_SIZE> header;
+    std::array<uint8_t, KEY_BUFFER_SIZE> key = { 0 };
+    alignas(16) std::array<uint8_t, AES_EXP_KEY_BUFFER_SIZE> exp_key = { 0 };
+    aes_generate_iv(header.data());
+    derive_key(password, header.data(), key.data());
+    aes_ctr_expand_key(key.data(), (uint32_t *) exp_key.data(), crypt_provider());
+    const uint32_t *expanded = (const uint32_t *) exp_key.data();
+
+    uint8_t iv[AES_BLOCK_SIZE];
+    memcpy(iv, header.data(), AES_BLOCK_SIZE);
+    hash_key(key.data(), header.data() + AES_BLOCK_SIZE);
+    CHECKSUM::context ctx;
+    CHECKSUM::init(ctx);
+    CHECKSUM::update(ctx, header.data() + AES_BLOCK_SIZE, SHA256::HASH_SIZE);
+    aes_ctr_enc(header.data() + AES_BLOCK_SIZE, header.data() + AES_BLOCK_SIZE, expanded, iv,
+                SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+
+    // one writer per volume and one more task for the checksum over the plain text
+    StripeTasks tasks(volumes.count() + 1);
+    for (size_t v = 0; v < volumes.count(); ++v) {
+        tasks.submit([&, v]() {
+            crypt_volume(volumes, v, stripe_size, in, true, header.data(), expanded, body_end, bufsize);
+        });
+    }
+    tasks.submit([&]() {
+        PoolBuffer pool_buffer(bufsize);
+        uint8_t *buffer = pool_buffer.data();
+        for (uint64_t offset = 0; offset < body_end; offset += bufsize) {
+            const uint64_t n = std::min(bufsize, body_end - offset);
+            if (pread_full(buffer, n, offset, in) < n) {
+                throw std::runtime_error("insufficient file size");
+            }
+            CHECKSUM::update(ctx, buffer, n);
+        }
+    });
+    tasks.wait();
+
+    // the last incomplete block and the checksum end the cipher text
+    const uint64_t tail_size = length - body_end;
+    uint8_t tail[2 * AES_BLOCK_SIZE + CHECKSUM::HASH_SIZE];
+    if (pread_full(tail, tail_size, body_end, in) < tail_size) {
+        throw std::runtime_error("insufficient file size");
+    }
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_at(header.data(), body_end, counter);
+    encrypt_tail(ctx, tail, tail_size, expanded, counter);
+    volumes.write(HEADER_SIZE + body_end, tail, tail_size + CHECKSUM::HASH_SIZE);
+    volumes.write(0, header.data(), HEADER_SIZE);
+
+    // the manifest comes last, a striped file without one is incomplete
+    std::ofstream out(manifest_filename, std::ios::trunc);
+    out << STRIPE_MAGIC << '\n' << "stripe_size=" << manifest.stripe_size << '\n' << "size=" << manifest.size << '\n';
+    for (const auto &volume : manifest.volumes) {
+        out << "volume=" << relative_path(manifest_dir, volume) << '\n';
+    }
+    out.close();
+    if (!out) {
+        throw std::runtime_error("unable to write manifest '" + manifest_filename + "'");
+    }
+}
+
+void stripe_decrypt(const std::string &manifest_filename, const std::string &output_filename,
+                    const std::string &password, uint64_t bufsize) {
+    const StripeManifest manifest = read_manifest(manifest_filename);
+    const Volumes volumes(manifest, O_RDONLY);
+    check_volumes(manifest, volumes);
+    const uint64_t length = manifest.size - HEADER_SIZE - CHECKSUM::HASH_SIZE;
+    const uint64_t body_end = length & ~((uint64_t) AES_BLOCK_SIZE - 1);
+
+    std::array<uint8_t, HEADER_SIZE> header;
+    alignas(16) std::array<uint8_t, AES_EXP_KEY_BUFFER_SIZE> exp_key = { 0 };
+    CHECKSUM::context ctx;
+    open_stripes(volumes, password, header.data(), (uint32_t *) exp_key.data(), ctx);
+    const uint32_t *expanded = (const uint32_t *) exp_key.data();
+
+    const FileDescriptor out(output_filename, O_WRONLY | O_CREAT | O_TRUNC);
+
+    // the checksum task decrypts the cipher text a second time instead of waiting for the volumes
+    StripeTasks tasks(volumes.count() + 1);
+    for (size_t v = 0; v < volumes.count(); ++v) {
+        tasks.submit([&, v]() {
+            crypt_volume(volumes, v, manifest.stripe_size, out, false, header.data(), expanded, body_end, bufsize);
+        });
+    }
+    tasks.submit([&]() {
+        PoolBuffer pool_buffer(bufsize);
+        uint8_t *buffer = pool_buffer.data();
+        uint8_t counter[AES_BLOCK_SIZE];
+        counter_at(header.data(), 0, counter);
+        for (uint64_t offset = 0; offset < body_end; offset += bufsize) {
+            const uint64_t n = std::min(bufsize, body_end - offset);
+            volumes.read(HEADER_SIZE + offset, buffer, n);
+            decrypt_blocks(ctx, buffer, n / AES_BLOCK_SIZE, expanded, counter);
+        }
+    });
+    tasks.wait();
+
+    const uint64_t tail_size = length - body_end;
+    uint8_t tail[2 * AES_BLOCK_SIZE + CHECKSUM::HASH_SIZE];
+    volumes.read(HEADER_SIZE + body_end, tail, tail_size + CHECKSUM::HASH_SIZE);
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_at(header.data(), body_end, counter);
+    decrypt_tail(ctx, tail, tail_size, expanded, counter);
+    pwrite_full(tail, tail_size, body_end, out);
+
+    // check if checksum in file matches the checksum computed from the decrypted file
+    uint8_t checksum[CHECKSUM::HASH_SIZE];
+    CHECKSUM::final(ctx, checksum);
+    if (memcmp(checksum, tail + tail_size, CHECKSUM::HASH_SIZE) != 0) {
+        throw std::runtime_error("checksum mismatch, file may be corrupted");
+    }
+}
+
+void stripe_verify(const std::string &manifest_filename, const std::string &password, uint64_t bufsize) {
+    const StripeManifest manifest = read_manifest(manifest_filename);
+    const Volumes volumes(manifest, O_RDONLY);
+    check_volumes(manifest, volumes);
+    const uint64_t length = manifest.size - HEADER_SIZE - CHECKSUM::HASH_SIZE;
+    const uint64_t body_end = length & ~((uint64_t) AES_BLOCK_SIZE - 1);
+
+    std::array<uint8_t, HEADER_SIZE> header;
+    alignas(16) std::array<uint8_t, AES_EXP_KEY_BUFFER_SIZE> exp_key = { 0 };
+    CHECKSUM::context ctx;
+    open_stripes(volumes, password, header.data(), (uint32_t *) exp_key.data(), ctx);
+    const uint32_t *expanded = (const uint32_t *) exp_key.data();
+
+    // the plain text is decrypted into the read buffer and dropped
+    PoolBuffer pool_buffer(bufsize);
+    uint8_t *buffer = pool_buffer.data();
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_at(header.data(), 0, counter);
+    for (uint64_t offset = 0; offset < body_end; offset += bufsize) {
+        const uint64_t n = std::min(bufsize, body_end - offset);
+        volumes.read(HEADER_SIZE + offset, buffer, n);
+        decrypt_blocks(ctx, buffer, n / AES_BLOCK_SIZE, expanded, counter);
+    }
+
+    const uint64_t tail_size = length - body_end;
+    uint8_t tail[2 * AES_BLOCK_SIZE + CHECKSUM::HASH_SIZE];
+    volumes.read(HEADER_SIZE + body_end, tail, tail_size + CHECKSUM::HASH_SIZE);
+    decrypt_tail(ctx, tail, tail_size, expanded, counter);
+
+    uint8_t checksum[CHECKSUM::HASH_SIZE];
+    CHECKSUM::final(ctx, checksum);
+    if (memcmp(checksum, tail + tail_size, CHECKSUM::HASH_SIZE) != 0) {
+        throw std::runtime_error("checksum mismatch, file may be corrupted");
+    }
+}
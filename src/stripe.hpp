@@ -0,0 +1,82 @@
+#ifndef __STRIPE_HPP
+#define __STRIPE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// first line of the manifest of a striped file
+#define STRIPE_MAGIC            "acrypt stripes 1"
+
+// bytes of the cipher text per stripe by default
+#define STRIPE_DEFAULT_SIZE     (UINT64_C(64) * 1024 * 1024)
+
+/***
+ * The cipher text of the regular format, header and checksum included, cut into
+ * stripes of stripe_size bytes that go round robin to the volumes: stripe k is
+ * stored in volume k % N at offset (k / N) * stripe_size. The manifest is a text file:
+ * STRIPE_MAGIC
+ * stripe_size=<bytes>
+ * size=<bytes of the whole cipher text>
+ * volume=<path>     (one line per volume, in order, relative to the directory of the manifest)
+ * so the manifest and its volumes can be moved together. Absolute paths are accepted too.
+ */
+struct StripeManifest {
+    uint64_t stripe_size = 0;
+    uint64_t size = 0;
+    std::vector<std::string> volumes;
+};
+
+/***
+ * check if a file is the manifest of a striped file
+ * @param fname
+ * @return
+ */
+extern bool is_striped(const std::string &fname);
+
+/***
+ * the volume files a manifest refers to
+ * @param manifest_filename
+ * @return paths, resolved against the directory of the manifest
+ */
+extern std::vector<std::string> stripe_volumes(const std::string &manifest_filename);
+
+/***
+ * Encrypt a regular file into the regular format striped over several directories.
+ * Every directory gets one volume file named after the manifest and a writer of its
+ * own, the stripes are encrypted independently at their offset of the key stream
+ * while one more thread computes the checksum over the plain text.
+ * @param input_filename
+ * @param manifest_filename
+ * @param dirs one per volume
+ * @param password
+ * @param stripe_size multiple of AES_BLOCK_SIZE
+ * @param bufsize multiple of AES_BLOCK_SIZE
+ */
+extern void stripe_encrypt(const std::string &input_filename, const std::string &manifest_filename,
+                           const std::vector<std::string> &dirs, const std::string &password,
+                           uint64_t stripe_size, uint64_t bufsize);
+
+/***
+ * Decrypt a striped file, the volumes are read in parallel and the plain text is
+ * written at its offsets, so the output must be a regular file. The checksum is
+ * checked at the end as usual.
+ * @param manifest_filename
+ * @param output_filename
+ * @param password
+ * @param bufsize multiple of AES_BLOCK_SIZE
+ */
+extern void stripe_decrypt(const std::string &manifest_filename, const std::string &output_filename,
+                           const std::string &password, uint64_t bufsize);
+
+/***
+ * Check a striped file without writing any plain text: every volume must have the size
+ * the manifest asks for, then the cipher text is decrypted once across all volumes and
+ * its checksum compared.
+ * @param manifest_filename
+ * @param password
+ * @param bufsize multiple of AES_BLOCK_SIZE
+ */
+extern void stripe_verify(const std::string &manifest_filename, const std::string &password, uint64_t bufsize);
+
+#endif // __STRIPE_HPP
@@ -0,0 +1,107 @@
+#include <thread_pool.hpp>
+#include <cpu.hpp>
+#include <algorithm>
+
+// pool and queue of the calling thread, if it is a worker
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local size_t current_index = 0;
+
+ThreadPool::ThreadPool(size_t num_threads) : _queued(0), _pending(0), _next(0) {
+    if (num_threads == 0) {
+        num_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    for (size_t i = 0; i < num_threads; ++i) {
+        _queues.emplace_back(new Queue);
+    }
+    for (size_t i = 0; i < num_threads; ++i) {
+        _threads.emplace_back(&ThreadPool::run, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _work.notify_all();
+    for (auto &thread : _threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    const size_t index = current_pool == this ? current_index : _next++ % _queues.size();
+    ++_pending;
+    {
+        // counted first so that it never drops below zero, and under the lock so that
+        // a worker which just found nothing to do does not miss it
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_queued;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_queues[index]->mutex);
+        _queues[index]->tasks.push_back(std::move(task));
+    }
+    _work.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this]() { return _pending == 0; });
+}
+
+bool ThreadPool::pop(size_t index, std::function<void()> &task) {
+    // own queue first, oldest task first
+    {
+        Queue &queue = *_queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            --_queued;
+            return true;
+        }
+    }
+
+    // steal the newest task of another worker, it is the one its owner gets to last
+    for (size_t i = 1; i < _queues.size(); ++i) {
+        Queue &queue = *_queues[(index + i) % _queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            --_queued;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(size_t index) {
+    current_pool = this;
+    current_index = index;
+
+    // on NUMA machines the workers stay on their core, so the buffers they touch first
+    // come from their node and are not pulled across the interconnect afterwards
+    cpu_pin(cpu_worker_cpu(index));
+
+    std::function<void()> task;
+    while (true) {
+        if (pop(index, task)) {
+            task();
+            task = nullptr;
+            if (--_pending == 0) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _idle.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _work.wait(lock, [this]() { return _queued > 0 || _stop; });
+        if (_stop && _queued == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef __THREAD_POOL_HPP
+#define __THREAD_POOL_HPP
+
+#include <cstddef>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+/***
+ * Work stealing thread pool. Every worker owns a task queue, tasks submitted by a
+ * worker go to its own queue and are taken from the front, idle workers steal from
+ * the back of the other queues. Tasks submitted from outside the pool are spread
+ * round robin. On NUMA machines every worker is pinned to a core, the workers are
+ * spread over the nodes.
+ */
+class ThreadPool {
+public:
+
+    /***
+     * @param num_threads number of workers, 0 for one per hardware thread
+     */
+    explicit ThreadPool(size_t num_threads=0);
+
+    /***
+     * waits for all tasks to finish
+     */
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /***
+     * queue a task, tasks must not throw
+     * @param task
+     */
+    void submit(std::function<void()> task);
+
+    /***
+     * block until all submitted tasks (and the tasks they submitted) are done
+     */
+    void wait();
+
+    size_t size() const {
+        return _threads.size();
+    }
+
+private:
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void run(size_t index);
+
+    bool pop(size_t index, std::function<void()> &task);
+
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _threads;
+
+    std::mutex _mutex;
+    std::condition_variable _work;
+    std::condition_variable _idle;
+    std::atomic<size_t> _queued;    // in a queue
+    std::atomic<size_t> _pending;   // submitted and not finished
+    std::atomic<size_t> _next;
+    bool _stop = false;
+
+};
+
+#endif // __THREAD_POOL_HPP
@@ -0,0 +1,384 @@
+#include <uring.hpp>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+
+static inline int io_uring_setup(unsigned entries, io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static inline int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline uint64_t round_up(uint64_t x, uint64_t align) {
+    return (x + align - 1) & ~(align - 1);
+}
+
+static std::runtime_error io_error(const char *what, int err) {
+    return std::runtime_error(std::string(what) + ": " + strerror(err));
+}
+
+bool UringPipeline::supported() {
+    static const bool available = []() -> bool {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        const int fd = io_uring_setup(1, &p);
+        if (fd < 0) {
+            return false;
+        }
+        close(fd);
+        return true;
+    }();
+    return available;
+}
+
+UringPipeline::UringPipeline(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t length,
+                             size_t chunk_size, unsigned depth, BufferPool &pool) :
+        _in_fd(in_fd), _out_fd(out_fd), _in_offset(in_offset), _out_offset(out_offset), _length(length),
+        _chunk_size(round_up(std::max<size_t>(chunk_size, URING_ALIGNMENT), URING_ALIGNMENT)),
+        _num_chunks((length + _chunk_size - 1) / _chunk_size), _pool(pool) {
+    depth = std::max(1u, depth);
+
+    // O_DIRECT is only usable if the file offsets line up with the alignment,
+    // otherwise fall back to the page cache for that descriptor
+    const int in_flags = fcntl(in_fd, F_GETFL);
+    const int out_flags = fcntl(out_fd, F_GETFL);
+    _in_direct = in_flags >= 0 && (in_flags & O_DIRECT);
+    _out_direct = out_flags >= 0 && (out_flags & O_DIRECT);
+    if (_in_direct && in_offset % URING_ALIGNMENT != 0) {
+        fcntl(in_fd, F_SETFL, in_flags & ~O_DIRECT);
+        _in_direct = false;
+    }
+    if (_out_direct && out_offset % URING_ALIGNMENT != 0) {
+        fcntl(out_fd, F_SETFL, out_flags & ~O_DIRECT);
+        _out_direct = false;
+    }
+
+    // set up the rings
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    _ring_fd = io_uring_setup(2 * depth, &p);
+    if (_ring_fd < 0) {
+        throw io_error("unable to set up io_uring", errno);
+    }
+    _entries = p.sq_entries;
+
+    _sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+    }
+
+    _sq_ptr = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+    if (_sq_ptr == MAP_FAILED) {
+        _sq_ptr = nullptr;
+        close(_ring_fd);
+        throw io_error("unable to map io_uring", errno);
+    }
+    if (single_mmap) {
+        _cq_ptr = _sq_ptr;
+    } else {
+        _cq_ptr = mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+        if (_cq_ptr == MAP_FAILED) {
+            _cq_ptr = nullptr;
+            release();
+            throw io_error("unable to map io_uring", errno);
+        }
+    }
+    _sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    _sqes = (io_uring_sqe *) mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+    if (_sqes == MAP_FAILED) {
+        _sqes = nullptr;
+        release();
+        throw io_error("unable to map io_uring", errno);
+    }
+
+    auto *sq = (uint8_t *) _sq_ptr;
+    auto *cq = (uint8_t *) _cq_ptr;
+    _sq_head = (unsigned *) (sq + p.sq_off.head);
+    _sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    _sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    _sq_array = (unsigned *) (sq + p.sq_off.array);
+    _cq_head = (unsigned *) (cq + p.cq_off.head);
+    _cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    _cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    _cqes = cq + p.cq_off.cqes;
+
+    // chunk buffers, page aligned as required by O_DIRECT
+    const size_t slot_size = _chunk_size + URING_SLACK;
+    try {
+        _memory = _pool.acquire(depth * slot_size);
+    } catch (std::bad_alloc &) {
+        release();
+        throw std::runtime_error("unable to allocate buffers");
+    }
+
+    std::vector<iovec> iovecs(depth);
+    _slots.resize(depth);
+    for (unsigned i = 0; i < depth; ++i) {
+        _slots[i] = { _memory + i * slot_size, IDLE, 0, 0, 0 };
+        iovecs[i].iov_base = _slots[i].buffer;
+        iovecs[i].iov_len = slot_size;
+    }
+
+    // registration may be refused (e.g. by RLIMIT_MEMLOCK), plain operations work anyway
+    _fixed_buffers = io_uring_register(_ring_fd, IORING_REGISTER_BUFFERS, iovecs.data(), depth) == 0;
+    const int fds[2] = { in_fd, out_fd };
+    _fixed_files = io_uring_register(_ring_fd, IORING_REGISTER_FILES, fds, 2) == 0;
+
+    // fill the queue with reads
+    for (unsigned i = 0; i < depth && i < _num_chunks; ++i) {
+        _slots[i].chunk = i;
+        submit_read(i);
+    }
+}
+
+UringPipeline::~UringPipeline() {
+    release();
+}
+
+void UringPipeline::release() {
+    // the kernel may still access the buffers, wait for everything in flight
+    while (_ring_fd >= 0 && _in_flight > 0) {
+        const int ret = io_uring_enter(_ring_fd, _to_submit, 1, IORING_ENTER_GETEVENTS);
+        _to_submit = 0;
+        if (ret < 0 && errno != EINTR) {
+            break;
+        }
+        unsigned head = *_cq_head;
+        const unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        _in_flight -= std::min(_in_flight, tail - head);
+        __atomic_store_n(_cq_head, tail, __ATOMIC_RELEASE);
+    }
+
+    if (_sqes != nullptr) {
+        munmap(_sqes, _sqes_size);
+    }
+    if (_cq_ptr != nullptr && _cq_ptr != _sq_ptr) {
+        munmap(_cq_ptr, _cq_size);
+    }
+    if (_sq_ptr != nullptr) {
+        munmap(_sq_ptr, _sq_size);
+    }
+    if (_ring_fd >= 0) {
+        close(_ring_fd);
+        _ring_fd = -1;
+    }
+    if (_memory != nullptr) {
+        _pool.release(_memory);
+        _memory = nullptr;
+    }
+}
+
+size_t UringPipeline::chunk_length(uint64_t chunk) const {
+    return (size_t) std::min<uint64_t>(_chunk_size, _length - chunk * _chunk_size);
+}
+
+io_uring_sqe *UringPipeline::get_sqe() {
+    unsigned tail = *_sq_tail;
+    if (tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _entries) {
+        // submission queue is full, hand everything to the kernel first
+        wait(0);
+        tail = *_sq_tail;
+    }
+    const unsigned index = tail & *_sq_mask;
+    io_uring_sqe *sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    _sq_array[index] = index;
+    // the kernel only looks at the entry during io_uring_enter(), so it can be published right away
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    _to_submit += 1;
+    _in_flight += 1;
+    return sqe;
+}
+
+void UringPipeline::submit_read(unsigned slot) {
+    slot_t &s = _slots[slot];
+    if (s.state != READING) {
+        s.state = READING;
+        s.length = chunk_length(s.chunk);
+        s.done = 0;
+    }
+
+    // O_DIRECT needs an aligned length, reading past the end of file is harmless
+    const size_t request = (_in_direct ? round_up(s.length, URING_ALIGNMENT) : s.length) - s.done;
+
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = _fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = _fixed_files ? 0 : _in_fd;
+    sqe->flags = _fixed_files ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (uint64_t) (uintptr_t) (s.buffer + s.done);
+    sqe->len = (uint32_t) request;
+    sqe->off = _in_offset + s.chunk * _chunk_size + s.done;
+    sqe->buf_index = (uint16_t) slot;
+    sqe->user_data = slot;
+}
+
+void UringPipeline::submit_write(unsigned slot) {
+    slot_t &s = _slots[slot];
+    s.state = WRITING;
+
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = _fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = _fixed_files ? 1 : _out_fd;
+    sqe->flags = _fixed_files ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (uint64_t) (uintptr_t) (s.buffer + s.done);
+    sqe->len = (uint32_t) (s.length - s.done);
+    sqe->off = _out_offset + s.chunk * _chunk_size + s.done;
+    sqe->buf_index = (uint16_t) slot;
+    sqe->user_data = slot;
+}
+
+void UringPipeline::wait(unsigned min_complete) {
+    while (true) {
+        const int ret = io_uring_enter(_ring_fd, _to_submit, min_complete, IORING_ENTER_GETEVENTS);
+        if (ret >= 0) {
+            _to_submit -= std::min<unsigned>(_to_submit, (unsigned) ret);
+            break;
+        } else if (errno != EINTR) {
+            throw io_error("io_uring_enter failed", errno);
+        }
+    }
+    reap();
+}
+
+void UringPipeline::reap() {
+    unsigned head = *_cq_head;
+    const unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        const io_uring_cqe *cqe = &((const io_uring_cqe *) _cqes)[head & *_cq_mask];
+        const unsigned slot = (unsigned) cqe->user_data;
+        const int res = cqe->res;
+        head += 1;
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        _in_flight -= 1;
+
+        slot_t &s = _slots[slot];
+        if (s.state == READING) {
+            if (res < 0) {
+                throw io_error("unable to read from file", -res);
+            } else if (res == 0) {
+                throw std::runtime_error("unexpected end of file");
+            }
+            s.done += res;
+            if (s.done < s.length) {
+                submit_read(slot);
+            } else {
+                s.state = READY;
+            }
+        } else if (s.state == WRITING) {
+            if (res < 0) {
+                throw io_error("unable to write to file", -res);
+            }
+            s.done += res;
+            if (s.done < s.length) {
+                submit_write(slot);
+            } else {
+                // recycle the slot for the chunk 'depth' positions ahead
+                s.state = IDLE;
+                s.chunk += _slots.size();
+                if (s.chunk < _num_chunks) {
+                    submit_read(slot);
+                }
+            }
+        }
+    }
+}
+
+void UringPipeline::write_unaligned(unsigned slot) {
+    // let all direct writes finish, then drop O_DIRECT and write through the page cache
+    for (const slot_t &s : _slots) {
+        while (s.state == WRITING) {
+            wait(1);
+        }
+    }
+    const int flags = fcntl(_out_fd, F_GETFL);
+    if (flags < 0 || fcntl(_out_fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+        throw io_error("unable to disable O_DIRECT", errno);
+    }
+    _out_direct = false;
+
+    slot_t &s = _slots[slot];
+    const uint64_t offset = _out_offset + s.chunk * _chunk_size;
+    while (s.done < s.length) {
+        const ssize_t ret = pwrite(_out_fd, s.buffer + s.done, s.length - s.done, offset + s.done);
+        if (ret < 0 && errno != EINTR) {
+            throw io_error("unable to write to file", errno);
+        }
+        s.done += std::max<ssize_t>(ret, 0);
+    }
+
+    s.state = IDLE;
+    s.chunk += _slots.size();
+    if (s.chunk < _num_chunks) {
+        submit_read(slot);
+    }
+}
+
+size_t UringPipeline::next(uint8_t *&data) {
+    if (_current >= 0) {
+        throw std::logic_error("previous chunk has not been committed");
+    }
+    if (_next_chunk >= _num_chunks) {
+        return 0;
+    }
+
+    const unsigned slot = (unsigned) (_next_chunk % _slots.size());
+    while (_slots[slot].state != READY) {
+        wait(1);
+    }
+
+    _current = (int) slot;
+    data = _slots[slot].buffer;
+    return _slots[slot].length;
+}
+
+void UringPipeline::commit(size_t len) {
+    if (_current < 0) {
+        throw std::logic_error("no chunk to commit");
+    } else if (len > _chunk_size + URING_SLACK) {
+        throw std::length_error("commit exceeds chunk buffer");
+    }
+
+    const unsigned slot = (unsigned) _current;
+    _current = -1;
+    _next_chunk += 1;
+
+    slot_t &s = _slots[slot];
+    s.length = len;
+    s.done = 0;
+    if (len == 0) {
+        s.state = IDLE;
+        s.chunk += _slots.size();
+        if (s.chunk < _num_chunks) {
+            submit_read(slot);
+        }
+    } else if (_out_direct && len % URING_ALIGNMENT != 0) {
+        write_unaligned(slot);
+    } else {
+        submit_write(slot);
+    }
+
+    // hand the new requests to the kernel and collect what is done already
+    wait(0);
+}
+
+void UringPipeline::finish() {
+    while (_in_flight > 0 || _to_submit > 0) {
+        wait(1);
+    }
+}
@@ -0,0 +1,142 @@
+#ifndef __URING_HPP
+#define __URING_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <buffer_pool.hpp>
+
+#define URING_DEFAULT_DEPTH     (8)
+
+// alignment required for O_DIRECT transfers (buffer address, length and file offset)
+#define URING_ALIGNMENT         (4096)
+
+// spare bytes behind every chunk buffer, enough to append a checksum to the last chunk
+#define URING_SLACK             (URING_ALIGNMENT)
+
+struct io_uring_sqe;
+
+/***
+ * Moves a byte range of one file to another file through io_uring while keeping
+ * up to 'depth' reads and writes in flight. The chunk buffers are registered with
+ * the kernel (fixed buffers) and so are both file descriptors (fixed files).
+ * Chunks are handed out in file order by next(), may be transformed in place and
+ * are queued for writing by commit(). Chunk k is read from in_offset + k * chunk_size
+ * and written to out_offset + k * chunk_size.
+ * Descriptors opened with O_DIRECT are supported, an unaligned last chunk is
+ * written through the page cache. The chunk buffers are borrowed from a BufferPool.
+ */
+class UringPipeline {
+public:
+
+    UringPipeline(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t length,
+                  size_t chunk_size, unsigned depth=URING_DEFAULT_DEPTH, BufferPool &pool=BufferPool::global());
+
+    ~UringPipeline();
+
+    UringPipeline(const UringPipeline &) = delete;
+
+    UringPipeline &operator=(const UringPipeline &) = delete;
+
+    /***
+     * check if the running kernel allows to set up an io_uring instance
+     * @return
+     */
+    static bool supported();
+
+    /***
+     * wait for the next chunk to be read
+     * @param data set to the chunk buffer, it has URING_SLACK spare bytes behind the chunk
+     * @return number of bytes in the chunk, 0 if the whole range has been delivered
+     */
+    size_t next(uint8_t *&data);
+
+    /***
+     * queue the chunk returned by the last call to next() for writing
+     * @param len number of bytes to write, may exceed the chunk length by up to URING_SLACK
+     */
+    void commit(size_t len);
+
+    /***
+     * wait for all outstanding writes
+     */
+    void finish();
+
+    size_t chunk_size() const {
+        return _chunk_size;
+    }
+
+private:
+
+    enum slot_state_t {
+        IDLE,
+        READING,
+        READY,
+        WRITING
+    };
+
+    struct slot_t {
+        uint8_t *buffer;
+        slot_state_t state;
+        uint64_t chunk;     // index of the chunk held by this slot
+        size_t length;      // bytes expected (reading) or to be written (writing)
+        size_t done;        // bytes transferred so far
+    };
+
+    io_uring_sqe *get_sqe();
+
+    void submit_read(unsigned slot);
+
+    void submit_write(unsigned slot);
+
+    void wait(unsigned min_complete);
+
+    void reap();
+
+    void write_unaligned(unsigned slot);
+
+    size_t chunk_length(uint64_t chunk) const;
+
+    void release();
+
+    int _ring_fd = -1;
+    void *_sq_ptr = nullptr;
+    void *_cq_ptr = nullptr;
+    size_t _sq_size = 0;
+    size_t _cq_size = 0;
+    io_uring_sqe *_sqes = nullptr;
+    size_t _sqes_size = 0;
+
+    unsigned *_sq_head = nullptr;
+    unsigned *_sq_tail = nullptr;
+    unsigned *_sq_mask = nullptr;
+    unsigned *_sq_array = nullptr;
+    unsigned *_cq_head = nullptr;
+    unsigned *_cq_tail = nullptr;
+    unsigned *_cq_mask = nullptr;
+    void *_cqes = nullptr;
+    unsigned _entries = 0;
+    unsigned _to_submit = 0;
+    unsigned _in_flight = 0;
+
+    const int _in_fd;
+    const int _out_fd;
+    const uint64_t _in_offset;
+    const uint64_t _out_offset;
+    const uint64_t _length;
+    const size_t _chunk_size;
+    const uint64_t _num_chunks;
+    bool _in_direct = false;
+    bool _out_direct = false;
+    bool _fixed_buffers = false;
+    bool _fixed_files = false;
+
+    BufferPool &_pool;
+    uint8_t *_memory = nullptr;
+    std::vector<slot_t> _slots;
+    uint64_t _next_chunk = 0;   // next chunk handed out by next()
+    int _current = -1;          // slot handed out by next() and not yet committed
+
+};
+
+#endif // __URING_HPP
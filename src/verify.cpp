@@ -0,0 +1,259 @@
+#include <verify.hpp>
+#include <crypt.hpp>
+#include <chunked.hpp>
+#include <archive.hpp>
+#include <stripe.hpp>
+#include <buffer_pool.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+
+// room behind a buffer for the checksum
+#define SLACK_SIZE      (64)
+
+struct Verifier::File {
+    std::string fname;
+    // the opened file, shared by the tasks checking parts of it
+    std::shared_ptr<ChunkedFile> chunked;
+    std::shared_ptr<ArchiveReader> archive;
+    std::atomic<size_t> remaining;              // tasks of this file still running
+    std::mutex mutex;
+    std::string error;
+
+    explicit File(const std::string &fname) : fname(fname), remaining(1) {}
+
+    void fail(const std::string &what) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error.empty()) {
+            error = what;
+        }
+    }
+};
+
+Verifier::Verifier(ThreadPool &pool, const std::string &password, uint64_t bufsize) :
+        _pool(pool), _password(password), _bufsize(bufsize), _failed(0) {}
+
+void Verifier::add(const std::string &fname) {
+    std::shared_ptr<File> file(new File(fname));
+    _pool.submit([this, file]() {
+        start(file);
+    });
+}
+
+/***
+ * path of a file without symbolic links, the path itself if it cannot be resolved
+ * @param path
+ * @return
+ */
+static std::string canonical(const std::string &path) {
+    char *resolved = realpath(path.c_str(), nullptr);
+    if (resolved == nullptr) {
+        return path;
+    }
+    const std::string result(resolved);
+    free(resolved);
+    return result;
+}
+
+void Verifier::add_directory(const std::string &dir) {
+    std::vector<std::string> files;
+    collect(dir, files);
+
+    // the volumes of a striped file are checked with its manifest
+    std::set<std::string> volumes;
+    for (const auto &fname : files) {
+        if (is_striped(fname)) {
+            try {
+                for (const auto &volume : stripe_volumes(fname)) {
+                    volumes.insert(canonical(volume));
+                }
+            } catch (std::exception &) {
+                // reported when the manifest itself is checked
+            }
+        }
+    }
+    for (const auto &fname : files) {
+        if (volumes.count(canonical(fname)) == 0) {
+            add(fname);
+        }
+    }
+}
+
+void Verifier::collect(const std::string &dir, std::vector<std::string> &files) {
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) {
+        report(dir, "unable to open directory");
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != nullptr) {
+        const std::string name(entry->d_name);
+        if (name == "." || name == "..") {
+            continue;
+        }
+        const std::string path = dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0) {
+            continue;
+        } else if (S_ISDIR(st.st_mode)) {
+            collect(path, files);
+        } else if (S_ISREG(st.st_mode)) {
+            files.push_back(path);
+        }
+    }
+    closedir(d);
+}
+
+void Verifier::add_manifest(const std::string &fname) {
+    std::ifstream in(fname);
+    if (!in) {
+        throw std::runtime_error("unable to read manifest '" + fname + "'");
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        add(line.substr(0, line.find('\t')));
+    }
+}
+
+size_t Verifier::wait() {
+    _pool.wait();
+    return _failed;
+}
+
+void Verifier::report(const std::string &fname, const std::string &error) {
+    std::lock_guard<std::mutex> lock(_report_mutex);
+    if (error.empty()) {
+        std::cout << fname << ": OK" << std::endl;
+    } else {
+        std::cerr << fname << ": " << error << std::endl;
+        ++_failed;
+    }
+}
+
+void Verifier::done(const std::shared_ptr<File> &file) {
+    if (--file->remaining == 0) {
+        report(file->fname, file->error);
+    }
+}
+
+void Verifier::start(const std::shared_ptr<File> &file) {
+    try {
+        uint8_t magic[V2_MAGIC_SIZE] = { 0 };
+        {
+            FileDescriptor fd(file->fname, O_RDONLY);
+            pread_full(magic, V2_MAGIC_SIZE, 0, fd);
+        }
+
+        if (memcmp(magic, V2_MAGIC, V2_MAGIC_SIZE) == 0) {
+            // the index is authenticated when opening, the chunks are checked in groups
+            file->chunked.reset(new ChunkedFile(file->fname, _password));
+            const uint64_t group = std::max<uint64_t>(VERIFY_RANGE_SIZE / file->chunked->chunk_size(), 1);
+            for (uint64_t begin = 0; begin < file->chunked->num_chunks(); begin += group) {
+                const uint64_t end = std::min(begin + group, file->chunked->num_chunks());
+                ++file->remaining;
+                _pool.submit([this, file, begin, end]() {
+                    try {
+                        PoolBuffer buffer(file->chunked->chunk_size());
+                        for (uint64_t i = begin; i < end; ++i) {
+                            file->chunked->verify_chunk(i, buffer.data());
+                        }
+                    } catch (std::exception &err) {
+                        file->fail(err.what());
+                    }
+                    done(file);
+                });
+            }
+        } else if (memcmp(magic, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE) == 0) {
+            // the members carry checksums over their plain text
+            file->archive.reset(new ArchiveReader(file->fname, _password));
+            for (size_t i = 0; i < file->archive->size(); ++i) {
+                ++file->remaining;
+                _pool.submit([this, file, i]() {
+                    try {
+                        file->archive->verify(file->archive->entry(i), _bufsize);
+                    } catch (std::exception &err) {
+                        file->fail(file->archive->name(file->archive->entry(i)) + ": " + err.what());
+                    }
+                    done(file);
+                });
+            }
+        } else if (is_striped(file->fname)) {
+            // the volumes are read one after the other, striped files are rare in a batch
+            stripe_verify(file->fname, _password, _bufsize);
+        } else {
+            verify_stream(*file);
+        }
+    } catch (std::exception &err) {
+        file->fail(err.what());
+    }
+    done(file);
+}
+
+void Verifier::verify_stream(File &file) {
+    FileDescriptor fd(file.fname, O_RDONLY);
+    const uint64_t file_size = fd.size();
+    if (file_size < HEADER_SIZE + CHECKSUM::HASH_SIZE) {
+        throw std::runtime_error("insufficient file size");
+    }
+    // every byte is read once, keep the read-ahead large
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // check if the key hashes match
+    uint8_t header[HEADER_SIZE];
+    uint8_t key[KEY_BUFFER_SIZE];
+    uint8_t key_hash[SHA256::HASH_SIZE];
+    uint8_t counter[AES_BLOCK_SIZE];
+    alignas(16) uint8_t exp_key[AES_EXP_KEY_BUFFER_SIZE];
+    pread_full(header, HEADER_SIZE, 0, fd);
+    derive_key(_password, header, key);
+    aes_ctr_expand_key(key, (uint32_t *) exp_key, crypt_provider());
+    hash_key(key, key_hash);
+    memcpy(counter, header, AES_BLOCK_SIZE);
+    aes_ctr_dec(header + AES_BLOCK_SIZE, header + AES_BLOCK_SIZE, (const uint32_t *) exp_key, counter, SHA256::HASH_SIZE / AES_BLOCK_SIZE);
+    if (memcmp(header + AES_BLOCK_SIZE, key_hash, SHA256::HASH_SIZE) != 0) {
+        throw std::runtime_error("invalid password or compromised iv");
+    }
+    CHECKSUM::context ctx;
+    CHECKSUM::init(ctx);
+    CHECKSUM::update(ctx, key_hash, SHA256::HASH_SIZE);
+
+    // the plain text is decrypted into the read buffer and dropped, the last read
+    // takes the checksum along
+    PoolBuffer pool_buffer(_bufsize + SLACK_SIZE);
+    uint8_t *buffer = pool_buffer.data();
+    const uint64_t length = file_size - HEADER_SIZE - CHECKSUM::HASH_SIZE;
+    uint64_t offset = 0;
+    while (true) {
+        const uint64_t n = std::min(_bufsize, length - offset);
+        const bool last = offset + n == length;
+        const uint64_t num_bytes = n + (last ? CHECKSUM::HASH_SIZE : 0);
+        if (pread_full(buffer, num_bytes, HEADER_SIZE + offset, fd) < num_bytes) {
+            throw std::runtime_error("insufficient file size");
+        }
+        const uint64_t num_blocks = n / AES_BLOCK_SIZE;
+        decrypt_blocks(ctx, buffer, num_blocks, (const uint32_t *) exp_key, counter);
+        if (last) {
+            decrypt_tail(ctx, buffer + num_blocks * AES_BLOCK_SIZE, n - num_blocks * AES_BLOCK_SIZE, (const uint32_t *) exp_key, counter);
+            break;
+        }
+        offset += n;
+    }
+    // the pages are not needed again
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    uint8_t checksum[CHECKSUM::HASH_SIZE];
+    CHECKSUM::final(ctx, checksum);
+    if (memcmp(checksum, buffer + (length - offset), CHECKSUM::HASH_SIZE) != 0) {
+        throw std::runtime_error("checksum mismatch, file may be corrupted");
+    }
+}
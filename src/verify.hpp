@@ -0,0 +1,80 @@
+#ifndef __VERIFY_HPP
+#define __VERIFY_HPP
+
+#include <thread_pool.hpp>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// chunks of the v2 format are checked in groups of about this size, one task per group
+#define VERIFY_RANGE_SIZE   (UINT64_C(64) * 1024 * 1024)
+
+/***
+ * Checks encrypted files on a thread pool without writing any plain text. Files of
+ * the chunked format only have their tags checked over the cipher text, spread over
+ * several workers, archive members are decrypted and hashed in parallel, and files
+ * of the regular format and striped files are decrypted and hashed in one pass each.
+ * Every file is reported with "<file>: OK" on stdout or "<file>: <error>" on stderr.
+ */
+class Verifier {
+public:
+
+    Verifier(ThreadPool &pool, const std::string &password, uint64_t bufsize);
+
+    Verifier(const Verifier &) = delete;
+
+    Verifier &operator=(const Verifier &) = delete;
+
+    /***
+     * queue a single file
+     * @param fname
+     */
+    void add(const std::string &fname);
+
+    /***
+     * queue all regular files below a directory, the volumes of striped files found
+     * there are checked with their manifest only
+     * @param dir
+     */
+    void add_directory(const std::string &dir);
+
+    /***
+     * queue the files listed in a manifest, the first column of the lines that
+     * Batch::add_manifest() accepts
+     * @param fname
+     */
+    void add_manifest(const std::string &fname);
+
+    /***
+     * wait until all queued files are checked
+     * @return number of files that failed
+     */
+    size_t wait();
+
+private:
+
+    struct File;
+
+    void collect(const std::string &dir, std::vector<std::string> &files);
+
+    void start(const std::shared_ptr<File> &file);
+
+    void verify_stream(File &file);
+
+    void done(const std::shared_ptr<File> &file);
+
+    void report(const std::string &fname, const std::string &error);
+
+    ThreadPool &_pool;
+    const std::string _password;
+    const uint64_t _bufsize;
+
+    std::atomic<size_t> _failed;
+    std::mutex _report_mutex;
+
+};
+
+#endif // __VERIFY_HPP